@@ -0,0 +1,96 @@
+#include <cstring>
+
+#include "annexb_reader.h"
+
+const uint8_t ACCESS_UNIT_DELIMITER[6] = { 0, 0, 0, 1, NAL_UNIT_AUD, 0xF0 };
+
+size_t AnnexBReader::findStartCode(size_t from, size_t* startCodeLen) const {
+  for (size_t i = from; i + 2 < pending.size(); i++) {
+    if (pending[i + 2] > 1) {
+      // Fast skip, none of the three bytes can be the start of a start code.
+      i += 2;
+      continue;
+    }
+
+    if (pending[i] == 0 && pending[i + 1] == 0 && pending[i + 2] == 1) {
+      // A leading zero belongs to a four byte start code.
+      if (i > from && pending[i - 1] == 0) {
+        *startCodeLen = 4;
+        return i - 1;
+      }
+
+      *startCodeLen = 3;
+      return i;
+    }
+  }
+
+  return pending.size();
+}
+
+void AnnexBReader::push(const uint8_t* data, size_t len, NalSink* sink) {
+  pending.insert(pending.end(), data, data + len);
+
+  while (true) {
+    // Skip the start code the current unit begins with.
+    size_t from = scanOffset < 3 ? 3 : scanOffset;
+    size_t startCodeLen = 0;
+    size_t next = findStartCode(from, &startCodeLen);
+
+    if (next == pending.size()) {
+      // Remember where to continue, a start code might be split across chunks.
+      scanOffset = pending.size() > from + 2 ? pending.size() - 2 : from;
+      return;
+    }
+
+    if (sink) {
+      sink->onNalUnit(pending.data(), next);
+    }
+
+    pending.erase(pending.begin(), pending.begin() + next);
+    scanOffset = 0;
+  }
+}
+
+void AnnexBReader::flush(NalSink* sink) {
+  if (!pending.empty() && sink) {
+    sink->onNalUnit(pending.data(), pending.size());
+  }
+
+  reset();
+}
+
+void AnnexBReader::reset() {
+  pending.clear();
+  scanOffset = 0;
+}
+
+int nalUnitType(const uint8_t* data, size_t len) {
+  size_t offset = 0;
+  while (offset < len && data[offset] == 0) {
+    offset++;
+  }
+
+  // Expect the 0x01 of the start code followed by the nal header.
+  if (offset + 1 >= len || data[offset] != 1) {
+    return -1;
+  }
+
+  return data[offset + 1] & 0x1f;
+}
+
+bool containsNalUnit(const uint8_t* data, size_t len, int type) {
+  for (size_t i = 0; i + 3 < len; i++) {
+    if (data[i] == 0 && data[i + 1] == 0 && data[i + 2] == 1 && (data[i + 3] & 0x1f) == type) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+bool endsWithAccessUnitDelimiter(const uint8_t* data, size_t len) {
+  // The three byte start code form is enough, a leading zero does not matter.
+  const uint8_t* delimiter = ACCESS_UNIT_DELIMITER + 1;
+  size_t delimiterLen = sizeof(ACCESS_UNIT_DELIMITER) - 1;
+  return len >= delimiterLen && memcmp(data + len - delimiterLen, delimiter, delimiterLen) == 0;
+}
@@ -0,0 +1,62 @@
+#ifndef _ANNEXB_READER_H_
+#define _ANNEXB_READER_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+/// Receiver for complete NAL units (start code included), e.g. a decoder.
+class NalSink {
+  public:
+    virtual ~NalSink() {}
+
+    virtual void onNalUnit(const uint8_t* data, size_t len) = 0;
+};
+
+/// Splits an Annex-B byte stream, delivered in arbitrary chunks, into NAL units.
+///
+/// A NAL unit is handed out as soon as the start code of the following one arrived,
+/// so a decoder can start working on a slice while the rest of the frame is still
+/// on its way. The server sends an access unit delimiter after the last slice of a
+/// frame, that slice does not wait for the next frame either.
+class AnnexBReader {
+  private:
+    /// Bytes of the NAL unit currently being received.
+    std::vector<uint8_t> pending;
+    /// Offset up to which `pending` has already been searched for start codes.
+    size_t scanOffset = 0;
+
+  public:
+    /// Appends received bytes and emits every NAL unit completed by them.
+    void push(const uint8_t* data, size_t len, NalSink* sink);
+    /// Emits whatever is left, used once the stream finished.
+    void flush(NalSink* sink);
+    void reset();
+    /// Preallocates room for a NAL unit of `bytes`, the buffer never shrinks afterwards.
+    void reserve(size_t bytes) { pending.reserve(bytes); }
+
+  private:
+    /// Returns the position of the start code at or after `from` or `pending.size()`.
+    size_t findStartCode(size_t from, size_t* startCodeLen) const;
+};
+
+/// Returns the nal_unit_type of a NAL unit that begins with a start code.
+int nalUnitType(const uint8_t* data, size_t len);
+
+/// Whether any NAL unit of the given type starts within `data`.
+bool containsNalUnit(const uint8_t* data, size_t len, int type);
+
+/// Whether `data` ends with an access unit delimiter.
+bool endsWithAccessUnitDelimiter(const uint8_t* data, size_t len);
+
+/// nal_unit_type of a non-IDR and an IDR slice.
+#define NAL_UNIT_SLICE 1
+#define NAL_UNIT_IDR 5
+/// nal_unit_type of an access unit delimiter.
+#define NAL_UNIT_AUD 9
+
+/// Access unit delimiter (any slice type may follow) that marks the end of a frame
+/// on the wire.
+extern const uint8_t ACCESS_UNIT_DELIMITER[6];
+
+#endif
@@ -0,0 +1,474 @@
+#include <cstdio>
+#include <cstring>
+#include <chrono>
+
+#include <pthread.h>
+#include <sched.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+
+#include "client_pipeline.h"
+
+/// Process private futex, both sides of a ring are threads of this client.
+static void futex_wake(std::atomic<uint32_t>* word) {
+  syscall(SYS_futex, (uint32_t*)word, FUTEX_WAKE_PRIVATE, INT32_MAX, nullptr, nullptr, 0);
+}
+
+static void futex_wait(std::atomic<uint32_t>* word, uint32_t value, uint32_t timeoutMs) {
+  struct timespec timeout;
+  timeout.tv_sec = timeoutMs / 1000;
+  timeout.tv_nsec = (long)(timeoutMs % 1000) * 1000000;
+  syscall(SYS_futex, (uint32_t*)word, FUTEX_WAIT_PRIVATE, value, &timeout, nullptr, 0);
+}
+
+/// Names, pins and prioritizes the calling thread. Without CAP_SYS_NICE (or root) the
+/// kernel refuses SCHED_FIFO, the thread keeps running normally then.
+static void apply_thread_config(const char* name, const ThreadConfig& config) {
+  pthread_setname_np(pthread_self(), name);
+
+  if (config.cpu >= 0) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(config.cpu, &cpus);
+    int error = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    if (error != 0) {
+      printf("[Pipeline] Failed to pin %s to cpu %d (%s)\n", name, config.cpu, strerror(error));
+    }
+  }
+
+  if (config.priority > 0) {
+    struct sched_param param = {};
+    param.sched_priority = config.priority;
+    int error = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+    if (error != 0) {
+      printf("[Pipeline] %s keeps the normal scheduler, SCHED_FIFO %d was refused (%s)\n",
+             name, config.priority, strerror(error));
+    }
+  }
+}
+
+bool parsePipelineConfig(const char* spec, PipelineConfig& config) {
+  ThreadConfig threads[3];
+  if (sscanf(spec, "%d:%d,%d:%d,%d:%d", &threads[0].cpu, &threads[0].priority, &threads[1].cpu,
+             &threads[1].priority, &threads[2].cpu, &threads[2].priority) != 6) {
+    return false;
+  }
+
+  for (auto& thread : threads) {
+    if (thread.cpu < -1 || thread.priority < 0 || thread.priority > 99) {
+      return false;
+    }
+  }
+
+  config.receive = threads[0];
+  config.reassembly = threads[1];
+  config.decode = threads[2];
+  return true;
+}
+
+WakeupHistogram::WakeupHistogram() {
+  for (auto& bucket : buckets) {
+    bucket = 0;
+  }
+}
+
+void WakeupHistogram::record(uint64_t latencyUs) {
+  size_t bucket = 0;
+  while (bucket < WAKEUP_BUCKETS - 1 && latencyUs >= (1ull << bucket)) {
+    bucket++;
+  }
+
+  buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+  count.fetch_add(1, std::memory_order_relaxed);
+  totalUs.fetch_add(latencyUs, std::memory_order_relaxed);
+
+  uint64_t max = maxUs.load(std::memory_order_relaxed);
+  while (latencyUs > max && !maxUs.compare_exchange_weak(max, latencyUs, std::memory_order_relaxed)) {}
+
+  metric.observe(latencyUs);
+}
+
+void WakeupHistogram::print(const char* name) {
+  uint64_t wakeups = count.exchange(0, std::memory_order_relaxed);
+  uint64_t total = totalUs.exchange(0, std::memory_order_relaxed);
+  uint64_t max = maxUs.exchange(0, std::memory_order_relaxed);
+
+  printf("  %s: %llu wakeups (avg %lluus, max %lluus)\n", name, (unsigned long long)wakeups,
+         (unsigned long long)(wakeups == 0 ? 0 : total / wakeups), (unsigned long long)max);
+  for (size_t i = 0; i < WAKEUP_BUCKETS; i++) {
+    uint64_t n = buckets[i].exchange(0, std::memory_order_relaxed);
+    if (n == 0) {
+      continue;
+    }
+
+    if (i == WAKEUP_BUCKETS - 1) {
+      printf("    >= %6lluus: %llu\n", 1ull << (i - 1), (unsigned long long)n);
+    } else {
+      printf("    <  %6lluus: %llu\n", 1ull << i, (unsigned long long)n);
+    }
+  }
+}
+
+void PipelineRing::initialize(size_t slotCount, size_t slotBytes) {
+  size_t count = 1;
+  while (count < slotCount) {
+    count <<= 1;
+  }
+
+  // Zero filled, every page is touched before memory gets locked.
+  slots.clear();
+  slots.resize(count);
+  for (auto& slot : slots) {
+    slot.data.resize(slotBytes);
+  }
+  mask = count - 1;
+  head = 0;
+  tail = 0;
+  closed = false;
+}
+
+PipelineBuffer* PipelineRing::beginPush(size_t length) {
+  uint64_t position = head.load(std::memory_order_relaxed);
+
+  bool stalled = false;
+  while (position - tail.load(std::memory_order_acquire) > mask) {
+    if (closed) {
+      return nullptr;
+    }
+    if (!stalled) {
+      statsStalls++;
+      stalled = true;
+    }
+
+    // Sleep until the consumer popped something, see pop().
+    uint32_t seen = pops.load();
+    producerSleeping = true;
+    if (position - tail.load() > mask && !closed) {
+      futex_wait(&pops, seen, 100);
+    }
+    producerSleeping = false;
+  }
+
+  if (closed) {
+    return nullptr;
+  }
+
+  PipelineBuffer& buffer = slots[position & mask];
+  if (buffer.data.size() < length) {
+    statsGrown++;
+    buffer.data.resize(length);
+  }
+  buffer.length = 0;
+  buffer.discontinuity = false;
+  return &buffer;
+}
+
+void PipelineRing::commitPush() {
+  uint64_t position = head.load(std::memory_order_relaxed);
+  slots[position & mask].pushedUs = nowMicros();
+  head.store(position + 1);
+
+  // The consumer flags itself before it checks `head` a last time, one of both sees the other.
+  pushes.fetch_add(1);
+  if (consumerSleeping) {
+    futex_wake(&pushes);
+  }
+}
+
+PipelineBuffer* PipelineRing::front(uint32_t timeoutMs, WakeupHistogram* wakeups) {
+  uint64_t position = tail.load(std::memory_order_relaxed);
+  if (head.load(std::memory_order_acquire) != position) {
+    return &slots[position & mask];
+  }
+
+  if (closed || timeoutMs == 0) {
+    return nullptr;
+  }
+
+  uint32_t seen = pushes.load();
+  consumerSleeping = true;
+  bool slept = false;
+  if (head.load() == position && !closed) {
+    futex_wait(&pushes, seen, timeoutMs);
+    slept = true;
+  }
+  consumerSleeping = false;
+
+  if (head.load(std::memory_order_acquire) == position) {
+    return nullptr;
+  }
+
+  PipelineBuffer& buffer = slots[position & mask];
+  if (slept && wakeups) {
+    wakeups->record(nowMicros() - buffer.pushedUs);
+  }
+  return &buffer;
+}
+
+void PipelineRing::pop() {
+  tail.store(tail.load(std::memory_order_relaxed) + 1);
+
+  pops.fetch_add(1);
+  if (producerSleeping) {
+    futex_wake(&pops);
+  }
+}
+
+void PipelineRing::close() {
+  closed = true;
+  pushes.fetch_add(1);
+  pops.fetch_add(1);
+  futex_wake(&pushes);
+  futex_wake(&pops);
+}
+
+void PipelineRing::reopen() {
+  closed = false;
+}
+
+bool ClientPipeline::initialize(QUICClient* client, NalSink* decoder, const PipelineConfig& config) {
+  pClient = client;
+  pDecoder = decoder;
+  this->config = config;
+
+  // Everything the steady state needs is allocated here.
+  received.initialize(PIPELINE_RECEIVE_SLOTS, BUFFER_LEN);
+  units.initialize(PIPELINE_NAL_SLOTS, PIPELINE_NAL_SLOT_BYTES);
+  reader.reserve(PIPELINE_NAL_SLOT_BYTES + BUFFER_LEN);
+  pClient->setDataSink(this);
+
+  if (config.lockMemory && mlockall(MCL_CURRENT | MCL_FUTURE) != 0) {
+    perror("[Pipeline] Failed to lock memory (raise RLIMIT_MEMLOCK or run as root)");
+  }
+
+  printf("[Pipeline] Receive on cpu %d (prio %d), reassembly on cpu %d (prio %d), decode on cpu %d (prio %d)\n",
+         config.receive.cpu, config.receive.priority, config.reassembly.cpu, config.reassembly.priority,
+         config.decode.cpu, config.decode.priority);
+  return true;
+}
+
+bool ClientPipeline::start() {
+  if (!pClient || running) {
+    return false;
+  }
+
+  received.reopen();
+  units.reopen();
+  receivedConnection = 0;
+  reassembledConnection = 0;
+  join = JoinTracker();
+  joinConnection = 0;
+  joinReported = 0;
+  running = true;
+  decodeThread = std::thread([this]() { this->decodeLoop(); });
+  reassemblyThread = std::thread([this]() { this->reassemblyLoop(); });
+  receiveThread = std::thread([this]() { this->receiveLoop(); });
+  return true;
+}
+
+void ClientPipeline::stop() {
+  running = false;
+  received.close();
+  units.close();
+
+  if (receiveThread.joinable()) {
+    receiveThread.join();
+  }
+  if (reassemblyThread.joinable()) {
+    reassemblyThread.join();
+  }
+  if (decodeThread.joinable()) {
+    decodeThread.join();
+  }
+}
+
+void ClientPipeline::cleanup() {
+  stop();
+
+  if (pClient) {
+    pClient->setDataSink(nullptr);
+    pClient = nullptr;
+  }
+  reader.reset();
+}
+
+void ClientPipeline::receiveLoop() {
+  apply_thread_config("brocky-receive", config.receive);
+
+  while (running) {
+    // A wait that ran into its timeout shows how late the thread got the cpu back.
+    uint64_t start = nowMicros();
+    pClient->wait(PIPELINE_RECEIVE_WAIT_MS);
+    uint64_t elapsed = nowMicros() - start;
+    if (elapsed >= PIPELINE_RECEIVE_WAIT_MS * 1000) {
+      receiveWakeups.record(elapsed - PIPELINE_RECEIVE_WAIT_MS * 1000);
+    }
+
+    pClient->tick();
+    reportJoin();
+
+    if (nowMicros() - lastMetricsUs >= PIPELINE_METRICS_INTERVAL_US) {
+      updateConnectionMetrics();
+    }
+
+    // Reboots of the server or a roaming Pi end up here, connect again right away.
+    if (pClient->isClosed() && running) {
+      printf("[Pipeline] Connection closed, reconnecting..\n");
+      statsReconnects++;
+      metricReconnects.add();
+
+      PipelineBuffer* marker = received.beginPush(0);
+      if (marker) {
+        marker->discontinuity = true;
+        received.commitPush();
+        receivedConnection++;
+      }
+
+      if (!pClient->reconnect()) {
+        for (int i = 0; i < 10 && running; i++) {
+          std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        }
+      }
+    }
+  }
+}
+
+void ClientPipeline::onStreamData(const uint8_t* data, size_t len) {
+  PipelineBuffer* buffer = received.beginPush(len);
+  if (!buffer) {
+    return;
+  }
+
+  memcpy(buffer->data.data(), data, len);
+  buffer->length = len;
+  received.commitPush();
+
+  statsChunks++;
+  statsBytes += len;
+  metricChunks.add();
+  metricBytes.add(len);
+}
+
+void ClientPipeline::reassemblyLoop() {
+  apply_thread_config("brocky-reasm", config.reassembly);
+
+  while (running) {
+    PipelineBuffer* buffer = received.front(100, &reassemblyWakeups);
+    if (!buffer) {
+      continue;
+    }
+
+    // Half a NAL unit of the old connection must not be glued to the new stream.
+    if (buffer->discontinuity) {
+      reader.reset();
+      join = JoinTracker();
+      reassembledConnection++;
+    } else {
+      reader.push(buffer->data.data(), buffer->length, this);
+    }
+    received.pop();
+  }
+}
+
+void ClientPipeline::onNalUnit(const uint8_t* data, size_t len) {
+  // The client never sees the units, its join stats are completed by the receive thread.
+  if (join.onNalUnit(data, len)) {
+    joinKeyFrameUs.store(join.firstKeyFrameUs, std::memory_order_relaxed);
+    joinDecodableUs.store(join.firstDecodableUs, std::memory_order_relaxed);
+    joinConnection.store(reassembledConnection + 1, std::memory_order_release);
+  }
+
+  PipelineBuffer* buffer = units.beginPush(len);
+  if (!buffer) {
+    return;
+  }
+
+  memcpy(buffer->data.data(), data, len);
+  buffer->length = len;
+  units.commitPush();
+}
+
+void ClientPipeline::decodeLoop() {
+  apply_thread_config("brocky-decode", config.decode);
+
+  while (running) {
+    PipelineBuffer* buffer = units.front(100, &decodeWakeups);
+    if (!buffer) {
+      continue;
+    }
+
+    if (pDecoder) {
+      uint64_t start = nowMicros();
+      pDecoder->onNalUnit(buffer->data.data(), buffer->length);
+      metricDecodeTime.observe(nowMicros() - start);
+    }
+    units.pop();
+    statsUnits++;
+    metricUnits.add();
+  }
+}
+
+void ClientPipeline::debugSession() {
+  printf("\n\n---------------------------------------------\n");
+  printf("Client pipeline stats:\n");
+  printf("  Received: %lld chunks (%lld KB)\n", statsChunks.exchange(0), statsBytes.exchange(0) / 1024);
+  printf("  Decoded: %lld NAL units\n", statsUnits.exchange(0));
+  printf("  Reconnects: %lld\n", statsReconnects.exchange(0));
+  printf("  Receive stalls, total (reassembly behind): %lld\n", received.getStalls());
+  printf("  Reassembly stalls, total (decode behind): %lld\n", units.getStalls());
+  printf("  Slots grown, total: %lld\n", received.getGrown() + units.getGrown());
+  receiveWakeups.print("Receive timer");
+  reassemblyWakeups.print("Reassembly");
+  decodeWakeups.print("Decode");
+  printf("---------------------------------------------\n");
+}
+
+void ClientPipeline::reportJoin() {
+  // Only the join of the connection the client has now, a late one of a closed
+  // connection is ignored.
+  uint32_t connection = receivedConnection + 1;
+  if (joinReported == connection || joinConnection.load(std::memory_order_acquire) != connection) {
+    return;
+  }
+
+  joinReported = connection;
+  pClient->completeJoin(joinKeyFrameUs.load(std::memory_order_relaxed), joinDecodableUs.load(std::memory_order_relaxed));
+}
+
+void ClientPipeline::updateConnectionMetrics() {
+  lastMetricsUs = nowMicros();
+
+  quiche_stats stats;
+  if (!pClient->getStats(&stats)) {
+    return;
+  }
+
+  metricRttNs.set((int64_t)stats.rtt);
+  metricCwnd.set((int64_t)stats.cwnd);
+  metricDeliveryRate.set((int64_t)stats.delivery_rate);
+  metricPacketsLost.set((int64_t)stats.lost);
+}
+
+void ClientPipeline::registerMetrics(MetricsRegistry& registry) {
+  registry.addCounter("brocky_client_chunks_total", "Stream reads handed to reassembly.", "", &metricChunks);
+  registry.addCounter("brocky_client_bytes_total", "Stream bytes received.", "", &metricBytes);
+  registry.addCounter("brocky_client_nal_units_total", "NAL units handed to the decoder.", "", &metricUnits);
+  registry.addCounter("brocky_client_reconnects_total", "Connections opened again after they were closed.", "", &metricReconnects);
+  registry.addHistogram("brocky_client_decode_seconds", "Time the decoder took per NAL unit.", "", &metricDecodeTime);
+  registry.addHistogram("brocky_client_wakeup_seconds", "Time from being signalled to running again.", "thread=\"receive\"", receiveWakeups.getMetric());
+  registry.addHistogram("brocky_client_wakeup_seconds", "Time from being signalled to running again.", "thread=\"reassembly\"", reassemblyWakeups.getMetric());
+  registry.addHistogram("brocky_client_wakeup_seconds", "Time from being signalled to running again.", "thread=\"decode\"", decodeWakeups.getMetric());
+  registry.addCollector(this);
+}
+
+void ClientPipeline::collectMetrics(MetricsWriter& writer) {
+  writer.counter("brocky_client_ring_stalls_total", "Times the producer of a ring waited because it was full.", "ring=\"received\"", received.getStalls());
+  writer.counter("brocky_client_ring_stalls_total", "Times the producer of a ring waited because it was full.", "ring=\"units\"", units.getStalls());
+  writer.counter("brocky_client_ring_grown_total", "Slots that had to grow for a larger buffer.", "", received.getGrown() + units.getGrown());
+  writer.gauge("brocky_client_rtt_seconds", "Smoothed rtt of the connection.", "", metricRttNs.get() / 1000000000.0);
+  writer.gauge("brocky_client_cwnd_bytes", "Congestion window of the connection.", "", (double)metricCwnd.get());
+  writer.gauge("brocky_client_delivery_rate_bytes", "Estimated delivery rate of the connection per second.", "", (double)metricDeliveryRate.get());
+  writer.counter("brocky_client_packets_lost_total", "Packets quiche declared lost on the current connection.", "", (uint64_t)metricPacketsLost.get());
+}
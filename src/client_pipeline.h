@@ -0,0 +1,212 @@
+#ifndef _CLIENT_PIPELINE_H_
+#define _CLIENT_PIPELINE_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "metrics.h"
+#include "quic_client.h"
+
+/// Received chunks between the receive and the reassembly thread, one per stream read.
+#define PIPELINE_RECEIVE_SLOTS 32
+/// NAL units between the reassembly and the decode thread.
+#define PIPELINE_NAL_SLOTS 16
+/// Preallocated size of a NAL unit slot, larger units grow the slot once (counted).
+#define PIPELINE_NAL_SLOT_BYTES (512 * 1024)
+/// Longest the receive thread sleeps in poll without a quiche timer due.
+#define PIPELINE_RECEIVE_WAIT_MS 5
+/// Histogram buckets, bucket i counts wakeups below 2^i microseconds, the last one the rest.
+#define WAKEUP_BUCKETS 16
+/// How often the receive thread copies the quiche stats into the metrics.
+#define PIPELINE_METRICS_INTERVAL_US 1000000
+
+/// Where and how a pipeline thread runs.
+struct ThreadConfig {
+  /// Core the thread is pinned to, -1 lets the scheduler decide.
+  int cpu = -1;
+  /// SCHED_FIFO priority (1-99), 0 keeps the normal scheduler.
+  int priority = 0;
+};
+
+/// Threads of the client pipeline. The defaults are for a 4 core Pi: core 0 stays with
+/// the OS and interrupts, every stage gets a core of its own. Receiving runs at the
+/// highest priority so the socket never overflows while a frame is decoded.
+struct PipelineConfig {
+  ThreadConfig receive = { 1, 50 };
+  ThreadConfig reassembly = { 2, 45 };
+  ThreadConfig decode = { 3, 40 };
+  /// Locks all memory (mlockall) after the buffers were allocated, no page faults later.
+  bool lockMemory = true;
+};
+
+/// Parses `cpu:priority,cpu:priority,cpu:priority` (receive, reassembly, decode).
+bool parsePipelineConfig(const char* spec, PipelineConfig& config);
+
+/// Time from being signalled to running again, in power of two buckets. Recorded by
+/// one thread and printed by another, so all counters are relaxed atomics.
+class WakeupHistogram {
+  private:
+    std::atomic<uint64_t> buckets[WAKEUP_BUCKETS];
+    std::atomic<uint64_t> count{ 0 };
+    std::atomic<uint64_t> totalUs{ 0 };
+    std::atomic<uint64_t> maxUs{ 0 };
+    /// Same wakeups, never reset.
+    MetricHistogram metric;
+
+  public:
+    WakeupHistogram();
+
+    void record(uint64_t latencyUs);
+    /// Prints the buckets seen since the last call and resets them.
+    void print(const char* name);
+
+    const MetricHistogram* getMetric() const { return &metric; }
+};
+
+/// A preallocated buffer travelling through the pipeline.
+struct PipelineBuffer {
+  std::vector<uint8_t> data;
+  size_t length = 0;
+  /// Time the producer committed it, the consumer's wakeup latency is measured from here.
+  uint64_t pushedUs = 0;
+  /// The stream starts over (reconnect), whatever was partially received is invalid.
+  bool discontinuity = false;
+};
+
+/// Single producer, single consumer ring of preallocated buffers.
+///
+/// Neither side takes a lock. A side that has to wait sleeps on a futex and is only
+/// woken up (syscall) if it actually sleeps. A full ring stalls the producer instead of
+/// dropping data, the stream would be broken otherwise.
+class PipelineRing {
+  private:
+    std::vector<PipelineBuffer> slots;
+    size_t mask = 0;
+    /// Next slot to fill, only written by the producer.
+    std::atomic<uint64_t> head{ 0 };
+    uint8_t headPadding[64];
+    /// Next slot to empty, only written by the consumer.
+    std::atomic<uint64_t> tail{ 0 };
+    uint8_t tailPadding[64];
+    /// Futex words bumped with every push and pop, plus who sleeps on them.
+    std::atomic<uint32_t> pushes{ 0 };
+    std::atomic<uint32_t> pops{ 0 };
+    std::atomic<bool> consumerSleeping{ false };
+    std::atomic<bool> producerSleeping{ false };
+    std::atomic<bool> closed{ false };
+    /// Debug stats.
+    std::atomic<long long> statsStalls{ 0 };
+    std::atomic<long long> statsGrown{ 0 };
+
+  public:
+    /// Allocates and touches all slots, `slotCount` is rounded up to a power of two.
+    void initialize(size_t slotCount, size_t slotBytes);
+
+    /// Free slot with room for `length` bytes, waits while the ring is full. Returns
+    /// nullptr once the ring was closed.
+    PipelineBuffer* beginPush(size_t length);
+    void commitPush();
+
+    /// Oldest buffer, waits up to `timeoutMs` for one. A wait that ended with a buffer
+    /// is recorded in `wakeups`. Returns nullptr on timeout or once closed.
+    PipelineBuffer* front(uint32_t timeoutMs, WakeupHistogram* wakeups);
+    void pop();
+
+    /// Wakes up both sides for good.
+    void close();
+    void reopen();
+
+    long long getStalls() const { return statsStalls; }
+    long long getGrown() const { return statsGrown; }
+};
+
+/// Runs the client on three threads so that decoding never delays reading the socket:
+///
+///   receive     QUICClient::wait()/tick(), copies stream data into `received`
+///   reassembly  splits it into NAL units (AnnexBReader) and copies them into `units`
+///   decode      hands every NAL unit to the decoder (and presents)
+///
+/// Every thread can be pinned and run with SCHED_FIFO. All buffers are allocated up front,
+/// in the steady state nothing on the pipeline's side allocates.
+class ClientPipeline : public StreamDataSink, public NalSink, public MetricsCollector {
+  private:
+    QUICClient* pClient = nullptr;
+    NalSink* pDecoder = nullptr;
+    PipelineConfig config;
+    PipelineRing received;
+    PipelineRing units;
+    AnnexBReader reader;
+    std::thread receiveThread;
+    std::thread reassemblyThread;
+    std::thread decodeThread;
+    std::atomic<bool> running{ false };
+    /// Connections seen by the receive and the reassembly thread, counted by the
+    /// discontinuity markers so both agree on which connection a join belongs to.
+    uint32_t receivedConnection = 0;
+    uint32_t reassembledConnection = 0;
+    /// First decodable frame, found by the reassembly thread and reported to the client
+    /// by the receive thread. `joinConnection` is the connection + 1, 0 before any.
+    JoinTracker join;
+    std::atomic<uint64_t> joinKeyFrameUs{ 0 };
+    std::atomic<uint64_t> joinDecodableUs{ 0 };
+    std::atomic<uint32_t> joinConnection{ 0 };
+    uint32_t joinReported = 0;
+    /// Jitter per thread: poll timer overshoot for receiving, hand over latency otherwise.
+    WakeupHistogram receiveWakeups;
+    WakeupHistogram reassemblyWakeups;
+    WakeupHistogram decodeWakeups;
+    /// Debug stats.
+    std::atomic<long long> statsChunks{ 0 };
+    std::atomic<long long> statsUnits{ 0 };
+    std::atomic<long long> statsBytes{ 0 };
+    std::atomic<long long> statsReconnects{ 0 };
+    /// Live metrics.
+    MetricCounter metricChunks;
+    MetricCounter metricBytes;
+    MetricCounter metricUnits;
+    MetricCounter metricReconnects;
+    MetricHistogram metricDecodeTime;
+    /// quiche_conn_stats() of the connection, refreshed by the receive thread.
+    MetricGauge metricRttNs;
+    MetricGauge metricCwnd;
+    MetricGauge metricDeliveryRate;
+    MetricGauge metricPacketsLost;
+    uint64_t lastMetricsUs = 0;
+
+  public:
+    ~ClientPipeline() { this->cleanup(); }
+
+    /// Takes over `client` (it must not be ticked elsewhere anymore), `decoder` runs on the
+    /// decode thread and may be null.
+    bool initialize(QUICClient* client, NalSink* decoder, const PipelineConfig& config);
+    bool start();
+    void stop();
+    void cleanup();
+
+    /// Receive thread, stream data of the client.
+    void onStreamData(const uint8_t* data, size_t len) override;
+    /// Reassembly thread, complete NAL units.
+    void onNalUnit(const uint8_t* data, size_t len) override;
+
+    void debugSession();
+
+    /// Adds receiving, reassembly, decoding and the connection to `registry`.
+    void registerMetrics(MetricsRegistry& registry);
+    /// Ring stalls and the connection, runs on the scrape thread.
+    void collectMetrics(MetricsWriter& writer) override;
+
+  private:
+    void receiveLoop();
+    /// Hands the join of the current connection to the client once it is complete,
+    /// receive thread only.
+    void reportJoin();
+    /// Copies the quiche stats of the client, receive thread only.
+    void updateConnectionMetrics();
+    void reassemblyLoop();
+    void decodeLoop();
+};
+
+#endif
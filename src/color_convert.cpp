@@ -0,0 +1,375 @@
+#include <cstdio>
+#include <cstring>
+#include <chrono>
+#include <random>
+#include <utility>
+
+#include "color_convert.h"
+#include "color_kernels.h"
+
+// BT.601 limited range coefficients in 8 bit fixed point.
+static inline uint8_t rgb_to_y(int r, int g, int b) {
+  return (uint8_t)(((66 * r + 129 * g + 25 * b + 128) >> 8) + 16);
+}
+
+static inline uint8_t rgb_to_u(int r, int g, int b) {
+  return (uint8_t)(((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128);
+}
+
+static inline uint8_t rgb_to_v(int r, int g, int b) {
+  return (uint8_t)(((112 * r - 94 * g - 18 * b + 128) >> 8) + 128);
+}
+
+// Shared by I420 and NV12, `chromaStep` is the distance between two chroma samples.
+static void convert_bgra_to_yuv(
+  const uint8_t* bgra, int bgraStride,
+  int width, int height,
+  uint8_t* y, int yStride,
+  uint8_t* u, int uStride,
+  uint8_t* v, int vStride,
+  int chromaStep
+) {
+  for (int row = 0; row < height; row += 2) {
+    const uint8_t* src0 = bgra + row * bgraStride;
+    const uint8_t* src1 = src0 + bgraStride;
+    uint8_t* y0 = y + row * yStride;
+    uint8_t* y1 = y0 + yStride;
+    uint8_t* uRow = u + (row / 2) * uStride;
+    uint8_t* vRow = v + (row / 2) * vStride;
+
+    for (int col = 0; col < width; col += 2) {
+      const uint8_t* p00 = src0 + col * 4;
+      const uint8_t* p01 = p00 + 4;
+      const uint8_t* p10 = src1 + col * 4;
+      const uint8_t* p11 = p10 + 4;
+
+      y0[col] = rgb_to_y(p00[2], p00[1], p00[0]);
+      y0[col + 1] = rgb_to_y(p01[2], p01[1], p01[0]);
+      y1[col] = rgb_to_y(p10[2], p10[1], p10[0]);
+      y1[col + 1] = rgb_to_y(p11[2], p11[1], p11[0]);
+
+      // Chroma of the averaged 2x2 block.
+      int b = (p00[0] + p01[0] + p10[0] + p11[0] + 2) >> 2;
+      int g = (p00[1] + p01[1] + p10[1] + p11[1] + 2) >> 2;
+      int r = (p00[2] + p01[2] + p10[2] + p11[2] + 2) >> 2;
+      uRow[(col / 2) * chromaStep] = rgb_to_u(r, g, b);
+      vRow[(col / 2) * chromaStep] = rgb_to_v(r, g, b);
+    }
+  }
+}
+
+void convertBgraToI420Scalar(
+  const uint8_t* bgra, int bgraStride, int width, int height,
+  uint8_t* y, int yStride, uint8_t* u, int uStride, uint8_t* v, int vStride
+) {
+  convert_bgra_to_yuv(bgra, bgraStride, width, height, y, yStride, u, uStride, v, vStride, 1);
+}
+
+void convertBgraToNV12Scalar(
+  const uint8_t* bgra, int bgraStride, int width, int height,
+  uint8_t* y, int yStride, uint8_t* uv, int uvStride
+) {
+  convert_bgra_to_yuv(bgra, bgraStride, width, height, y, yStride, uv, uvStride, uv + 1, uvStride, 2);
+}
+
+void downscaleBgra2xScalar(const uint8_t* src, int srcStride, int dstWidth, int dstHeight, uint8_t* dst, int dstStride) {
+  for (int row = 0; row < dstHeight; row++) {
+    const uint8_t* src0 = src + (row * 2) * srcStride;
+    const uint8_t* src1 = src0 + srcStride;
+    uint8_t* out = dst + row * dstStride;
+
+    for (int col = 0; col < dstWidth * 4; col++) {
+      // Same byte of the two pixels next to each other.
+      int x = (col / 4) * 8 + (col % 4);
+      out[col] = (uint8_t)((src0[x] + src0[x + 4] + src1[x] + src1[x + 4] + 2) >> 2);
+    }
+  }
+}
+
+void blendRowsScalar(const uint8_t* a, const uint8_t* b, uint8_t* dst, int count, int weight) {
+  for (int i = 0; i < count; i++) {
+    dst[i] = (uint8_t)((a[i] * (128 - weight) + b[i] * weight + 64) >> 7);
+  }
+}
+
+const ColorKernels& getScalarColorKernels() {
+  static const ColorKernels kernels = {
+    "scalar",
+    &convertBgraToI420Scalar,
+    &convertBgraToNV12Scalar,
+    &downscaleBgra2xScalar,
+    &blendRowsScalar,
+  };
+  return kernels;
+}
+
+const ColorKernels& getColorKernels() {
+  static const ColorKernels* best = []() -> const ColorKernels* {
+    if (const ColorKernels* avx2 = getAvx2ColorKernels()) {
+      return avx2;
+    }
+    if (const ColorKernels* neon = getNeonColorKernels()) {
+      return neon;
+    }
+    return &getScalarColorKernels();
+  }();
+  return *best;
+}
+
+void convertBgraToI420(
+  const uint8_t* bgra, int bgraStride,
+  int width, int height,
+  uint8_t* y, int yStride,
+  uint8_t* u, int uStride,
+  uint8_t* v, int vStride
+) {
+  getColorKernels().bgraToI420(bgra, bgraStride, width, height, y, yStride, u, uStride, v, vStride);
+}
+
+void convertBgraToNV12(
+  const uint8_t* bgra, int bgraStride,
+  int width, int height,
+  uint8_t* y, int yStride,
+  uint8_t* uv, int uvStride
+) {
+  getColorKernels().bgraToNV12(bgra, bgraStride, width, height, y, yStride, uv, uvStride);
+}
+
+void downscaleBgra2x(const uint8_t* src, int srcStride, int dstWidth, int dstHeight, uint8_t* dst, int dstStride) {
+  getColorKernels().downscaleBgra2x(src, srcStride, dstWidth, dstHeight, dst, dstStride);
+}
+
+const char* getColorKernelName() {
+  return getColorKernels().name;
+}
+
+// Source position of every destination pixel center with a 7 bit fraction.
+template <typename Tap>
+static void compute_taps(int srcSize, int dstSize, std::vector<Tap>& taps) {
+  taps.resize(dstSize);
+  for (int i = 0; i < dstSize; i++) {
+    long long position = ((2LL * i + 1) * srcSize * 128) / (2LL * dstSize) - 64;
+    if (position < 0) {
+      position = 0;
+    }
+
+    taps[i].index = (int)(position >> 7);
+    taps[i].weight = (int)(position & 127);
+    if (taps[i].index >= srcSize - 1) {
+      taps[i].index = srcSize - 1;
+      taps[i].weight = 0;
+    }
+  }
+}
+
+bool BgraScaler::initialize(int srcWidth, int srcHeight, int dstWidth, int dstHeight, const ColorKernels* kernels) {
+  if (srcWidth <= 0 || srcHeight <= 0 || dstWidth <= 0 || dstHeight <= 0) {
+    return false;
+  }
+
+  this->kernels = kernels ? kernels : &getColorKernels();
+  this->srcWidth = srcWidth;
+  this->srcHeight = srcHeight;
+  this->dstWidth = dstWidth;
+  this->dstHeight = dstHeight;
+
+  compute_taps(srcWidth, dstWidth, columns);
+  compute_taps(srcHeight, dstHeight, rows);
+  rowBuffer[0].resize(dstWidth * 4);
+  rowBuffer[1].resize(dstWidth * 4);
+  return true;
+}
+
+void BgraScaler::scale(const uint8_t* src, int srcStride, uint8_t* dst, int dstStride) {
+  if (srcWidth == dstWidth * 2 && srcHeight == dstHeight * 2) {
+    kernels->downscaleBgra2x(src, srcStride, dstWidth, dstHeight, dst, dstStride);
+    return;
+  }
+
+  // Rows of the previous frame are stale.
+  bufferedRow[0] = -1;
+  bufferedRow[1] = -1;
+
+  for (int row = 0; row < dstHeight; row++) {
+    const Tap& tap = rows[row];
+    uint8_t* out = dst + row * dstStride;
+
+    const uint8_t* top = scaledRow(src, srcStride, tap.index, 0);
+    if (tap.weight == 0) {
+      memcpy(out, top, dstWidth * 4);
+      continue;
+    }
+    const uint8_t* bottom = scaledRow(src, srcStride, tap.index + 1, 1);
+    kernels->blendRows(top, bottom, out, dstWidth * 4, tap.weight);
+  }
+}
+
+const uint8_t* BgraScaler::scaledRow(const uint8_t* src, int srcStride, int srcRow, int slot) {
+  if (bufferedRow[slot] == srcRow) {
+    return rowBuffer[slot].data();
+  }
+
+  // The bottom row of the last output row is usually the top row of this one.
+  int other = 1 - slot;
+  if (bufferedRow[other] == srcRow) {
+    std::swap(rowBuffer[0], rowBuffer[1]);
+    std::swap(bufferedRow[0], bufferedRow[1]);
+    return rowBuffer[slot].data();
+  }
+
+  const uint8_t* in = src + srcRow * srcStride;
+  uint8_t* out = rowBuffer[slot].data();
+  for (int col = 0; col < dstWidth; col++) {
+    const Tap& tap = columns[col];
+    uint32_t p0, p1;
+    memcpy(&p0, in + tap.index * 4, 4);
+    memcpy(&p1, in + (tap.index + (tap.weight ? 1 : 0)) * 4, 4);
+
+    // Two channels per multiply, 255 * 128 + 64 fits into each 16 bit half.
+    uint32_t weight0 = 128 - tap.weight;
+    uint32_t weight1 = tap.weight;
+    uint32_t blueRed = (p0 & 0x00ff00ff) * weight0 + (p1 & 0x00ff00ff) * weight1 + 0x00400040;
+    uint32_t greenAlpha = ((p0 >> 8) & 0x00ff00ff) * weight0 + ((p1 >> 8) & 0x00ff00ff) * weight1 + 0x00400040;
+    uint32_t pixel = ((blueRed >> 7) & 0x00ff00ff) | (((greenAlpha >> 7) & 0x00ff00ff) << 8);
+    memcpy(out + col * 4, &pixel, 4);
+  }
+  bufferedRow[slot] = srcRow;
+  return out;
+}
+
+/// Random image with some padding at the end of every row.
+static std::vector<uint8_t> random_image(int width, int height, int stride) {
+  std::mt19937 random(width * 31 + height);
+  std::vector<uint8_t> image(stride * height);
+  for (auto& value : image) {
+    value = (uint8_t)random();
+  }
+  return image;
+}
+
+static bool compare_output(const char* kernel, const char* what, const std::vector<uint8_t>& expected, const std::vector<uint8_t>& actual) {
+  if (expected == actual) {
+    return true;
+  }
+
+  size_t offset = 0;
+  while (offset < expected.size() && expected[offset] == actual[offset]) {
+    offset++;
+  }
+  printf("[Color] %s %s differs from scalar at byte %zd (%d != %d)\n", kernel, what, offset, actual[offset], expected[offset]);
+  return false;
+}
+
+// Runs every kernel of `kernels` on the same input, the outputs are appended to `outputs`.
+static void run_kernels(const ColorKernels& kernels, const std::vector<uint8_t>& image, int width, int height, int stride, std::vector<std::vector<uint8_t>>& outputs) {
+  int chromaSize = (width / 2) * (height / 2);
+
+  std::vector<uint8_t> i420(width * height + chromaSize * 2);
+  kernels.bgraToI420(
+    image.data(), stride, width, height,
+    i420.data(), width, i420.data() + width * height, width / 2, i420.data() + width * height + chromaSize, width / 2
+  );
+  outputs.push_back(std::move(i420));
+
+  std::vector<uint8_t> nv12(width * height + chromaSize * 2);
+  kernels.bgraToNV12(image.data(), stride, width, height, nv12.data(), width, nv12.data() + width * height, width);
+  outputs.push_back(std::move(nv12));
+
+  std::vector<uint8_t> half((width / 2) * (height / 2) * 4);
+  kernels.downscaleBgra2x(image.data(), stride, width / 2, height / 2, half.data(), (width / 2) * 4);
+  outputs.push_back(std::move(half));
+
+  BgraScaler scaler;
+  scaler.initialize(width, height, width * 2 / 3, height * 3 / 4, &kernels);
+  std::vector<uint8_t> scaled(scaler.getWidth() * scaler.getHeight() * 4);
+  scaler.scale(image.data(), stride, scaled.data(), scaler.getWidth() * 4);
+  outputs.push_back(std::move(scaled));
+}
+
+bool verifyColorKernels(int width, int height) {
+  static const char* names[] = { "i420", "nv12", "downscale 2x", "scale" };
+  const ColorKernels* candidates[] = { getAvx2ColorKernels(), getNeonColorKernels() };
+  bool matches = true;
+
+  // The second size leaves columns for the scalar tail of the SIMD kernels.
+  int sizes[2][2] = { { width, height }, { width - 14, height - 2 } };
+  for (auto& size : sizes) {
+    int stride = size[0] * 4 + 64;
+    std::vector<uint8_t> image = random_image(size[0], size[1], stride);
+
+    std::vector<std::vector<uint8_t>> expected;
+    run_kernels(getScalarColorKernels(), image, size[0], size[1], stride, expected);
+
+    for (const ColorKernels* kernels : candidates) {
+      if (!kernels) {
+        continue;
+      }
+
+      std::vector<std::vector<uint8_t>> actual;
+      run_kernels(*kernels, image, size[0], size[1], stride, actual);
+      for (size_t i = 0; i < expected.size(); i++) {
+        matches = compare_output(kernels->name, names[i], expected[i], actual[i]) && matches;
+      }
+    }
+  }
+
+  printf("[Color] Kernels (%s) %s the scalar reference\n", getColorKernelName(), matches ? "match" : "DO NOT match");
+  return matches;
+}
+
+// Average time of `iterations` runs of `work` in microseconds.
+template <typename Work>
+static double time_kernel(int iterations, Work work) {
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < iterations; i++) {
+    work();
+  }
+  auto duration = std::chrono::steady_clock::now() - start;
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count() / 1000.0 / iterations;
+}
+
+void benchmarkColorKernels(int width, int height, int iterations) {
+  int stride = width * 4;
+  std::vector<uint8_t> image = random_image(width, height, stride);
+  std::vector<uint8_t> yuv(width * height * 3 / 2);
+  std::vector<uint8_t> bgra(width * height * 4);
+  uint8_t* y = yuv.data();
+  uint8_t* u = y + width * height;
+  uint8_t* v = u + (width / 2) * (height / 2);
+  double megapixels = width * height / 1000000.0;
+
+  const ColorKernels* candidates[] = { &getScalarColorKernels(), getAvx2ColorKernels(), getNeonColorKernels() };
+
+  printf("\n\n---------------------------------------------\n");
+  printf("Color kernel stats (%dx%d, %d iterations, single core):\n", width, height, iterations);
+  for (const ColorKernels* kernels : candidates) {
+    if (!kernels) {
+      continue;
+    }
+
+    BgraScaler scaler;
+    scaler.initialize(width, height, width * 2 / 3, height * 2 / 3, kernels);
+
+    double i420 = time_kernel(iterations, [&]() {
+      kernels->bgraToI420(image.data(), stride, width, height, y, width, u, width / 2, v, width / 2);
+    });
+    double nv12 = time_kernel(iterations, [&]() {
+      kernels->bgraToNV12(image.data(), stride, width, height, y, width, u, width);
+    });
+    double half = time_kernel(iterations, [&]() {
+      kernels->downscaleBgra2x(image.data(), stride, width / 2, height / 2, bgra.data(), (width / 2) * 4);
+    });
+    double scaled = time_kernel(iterations, [&]() {
+      scaler.scale(image.data(), stride, bgra.data(), scaler.getWidth() * 4);
+    });
+
+    // Throughput is given in source megapixels.
+    printf("  %s:\n", kernels->name);
+    printf("    BGRA -> I420: %.3fms (%.0f MP/s)\n", i420 / 1000, megapixels / i420 * 1000000);
+    printf("    BGRA -> NV12: %.3fms (%.0f MP/s)\n", nv12 / 1000, megapixels / nv12 * 1000000);
+    printf("    Downscale 2x: %.3fms (%.0f MP/s)\n", half / 1000, megapixels / half * 1000000);
+    printf("    Scale 2/3: %.3fms (%.0f MP/s)\n", scaled / 1000, megapixels / scaled * 1000000);
+  }
+  printf("  Budget for 60fps: 2ms per conversion\n");
+  printf("---------------------------------------------\n");
+}
@@ -0,0 +1,77 @@
+#ifndef _COLOR_CONVERT_H_
+#define _COLOR_CONVERT_H_
+
+#include <stdint.h>
+#include <vector>
+
+struct ColorKernels;
+
+/// Converts a BGRA (BGRX) image into planar I420 (BT.601, limited range).
+///
+/// Chroma is taken from the average of every 2x2 block, width and height have to be even.
+/// Runs the fastest kernel of the CPU (AVX2, NEON or scalar), all of them are bit-exact.
+void convertBgraToI420(
+  const uint8_t* bgra, int bgraStride,
+  int width, int height,
+  uint8_t* y, int yStride,
+  uint8_t* u, int uStride,
+  uint8_t* v, int vStride
+);
+
+/// Same as convertBgraToI420() but with interleaved chroma (NV12).
+void convertBgraToNV12(
+  const uint8_t* bgra, int bgraStride,
+  int width, int height,
+  uint8_t* y, int yStride,
+  uint8_t* uv, int uvStride
+);
+
+/// Halves a BGRA image in both directions by averaging every 2x2 block.
+void downscaleBgra2x(const uint8_t* src, int srcStride, int dstWidth, int dstHeight, uint8_t* dst, int dstStride);
+
+/// Name of the kernels convertBgraToI420() and friends run with.
+const char* getColorKernelName();
+
+/// Scales BGRA images to a fixed size.
+///
+/// Exact halving uses downscaleBgra2x(), everything else is bilinear with 7 bit weights.
+/// The horizontal pass is a lookup table, the vertical pass runs on the SIMD kernels.
+class BgraScaler {
+  private:
+    struct Tap {
+      int index;
+      int weight;
+    };
+
+    const ColorKernels* kernels = nullptr;
+    int srcWidth = 0;
+    int srcHeight = 0;
+    int dstWidth = 0;
+    int dstHeight = 0;
+    std::vector<Tap> columns;
+    std::vector<Tap> rows;
+    /// Horizontally scaled source rows, cached while consecutive output rows share them.
+    std::vector<uint8_t> rowBuffer[2];
+    int bufferedRow[2] = { -1, -1 };
+
+  public:
+    /// `kernels` null picks the fastest kernels of this CPU.
+    bool initialize(int srcWidth, int srcHeight, int dstWidth, int dstHeight, const ColorKernels* kernels = nullptr);
+
+    void scale(const uint8_t* src, int srcStride, uint8_t* dst, int dstStride);
+
+    int getWidth() const { return dstWidth; }
+    int getHeight() const { return dstHeight; }
+
+  private:
+    const uint8_t* scaledRow(const uint8_t* src, int srcStride, int srcRow, int slot);
+};
+
+/// Runs every compiled in kernel against the scalar reference on random images.
+/// Returns false if any output differs.
+bool verifyColorKernels(int width, int height);
+
+/// Prints the throughput (megapixels/s) of every kernel on a single core.
+void benchmarkColorKernels(int width, int height, int iterations);
+
+#endif
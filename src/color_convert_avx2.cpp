@@ -0,0 +1,237 @@
+#include "color_kernels.h"
+
+#ifdef COLOR_KERNELS_AVX2
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+// Lets GCC/Clang emit AVX2 for these functions only, the rest of the binary stays baseline x86.
+#if defined(__GNUC__) || defined(__clang__)
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define TARGET_AVX2
+#endif
+
+// Every pixel is a 32 bit lane, masking with 0x00ff00ff splits it into 16 bit [b, r]
+// and [g, a] pairs. pmaddwd on those pairs computes exactly the scalar formulas.
+
+TARGET_AVX2 static inline __m256i pair_coefficients(int16_t low, int16_t high) {
+  return _mm256_set1_epi32((int)((uint32_t)(uint16_t)low | ((uint32_t)(uint16_t)high << 16)));
+}
+
+TARGET_AVX2 static inline __m256i blue_red(__m256i pixels) {
+  return _mm256_and_si256(pixels, _mm256_set1_epi32(0x00ff00ff));
+}
+
+TARGET_AVX2 static inline __m256i green_alpha(__m256i pixels) {
+  return _mm256_and_si256(_mm256_srli_epi32(pixels, 8), _mm256_set1_epi32(0x00ff00ff));
+}
+
+// Y of 8 pixels as 32 bit values.
+TARGET_AVX2 static inline __m256i luma(__m256i pixels) {
+  __m256i y = _mm256_add_epi32(
+    _mm256_madd_epi16(blue_red(pixels), pair_coefficients(25, 66)),
+    _mm256_madd_epi16(green_alpha(pixels), pair_coefficients(129, 0))
+  );
+  y = _mm256_srli_epi32(_mm256_add_epi32(y, _mm256_set1_epi32(128)), 8);
+  return _mm256_add_epi32(y, _mm256_set1_epi32(16));
+}
+
+// Sums the pairs of two rows x 16 pixels (a: pixels 0-7, b: pixels 8-15) and rounds
+// them to the 2x2 average, the result is in pixel order.
+TARGET_AVX2 static inline __m256i average_pairs(__m256i a, __m256i b) {
+  // Sums never exceed 1020, so adding whole 32 bit lanes keeps both 16 bit halves apart.
+  __m256i sum = _mm256_permute4x64_epi64(_mm256_hadd_epi32(a, b), 0xD8);
+  return _mm256_srli_epi16(_mm256_add_epi16(sum, _mm256_set1_epi16(2)), 2);
+}
+
+TARGET_AVX2 static inline __m256i chroma(__m256i blueRed, __m256i greenAlpha, __m256i brCoefficients, __m256i gaCoefficients) {
+  __m256i c = _mm256_add_epi32(
+    _mm256_madd_epi16(blueRed, brCoefficients),
+    _mm256_madd_epi16(greenAlpha, gaCoefficients)
+  );
+  c = _mm256_srai_epi32(_mm256_add_epi32(c, _mm256_set1_epi32(128)), 8);
+  return _mm256_add_epi32(c, _mm256_set1_epi32(128));
+}
+
+// Packs 8 32 bit values (0-255) into the low 8 bytes.
+TARGET_AVX2 static inline __m128i pack_bytes(__m256i values) {
+  __m256i words = _mm256_packs_epi32(values, values);
+  __m256i bytes = _mm256_packus_epi16(words, words);
+  return _mm256_castsi256_si128(_mm256_permutevar8x32_epi32(bytes, _mm256_setr_epi32(0, 4, 0, 0, 0, 0, 0, 0)));
+}
+
+// Converts 16 columns of two rows, chroma is written as 8 u and 8 v values.
+TARGET_AVX2 static inline void convert_block(const uint8_t* src0, const uint8_t* src1, uint8_t* y0, uint8_t* y1, __m128i& u, __m128i& v) {
+  __m256i p0a = _mm256_loadu_si256((const __m256i*)src0);
+  __m256i p0b = _mm256_loadu_si256((const __m256i*)(src0 + 32));
+  __m256i p1a = _mm256_loadu_si256((const __m256i*)src1);
+  __m256i p1b = _mm256_loadu_si256((const __m256i*)(src1 + 32));
+
+  _mm_storel_epi64((__m128i*)y0, pack_bytes(luma(p0a)));
+  _mm_storel_epi64((__m128i*)(y0 + 8), pack_bytes(luma(p0b)));
+  _mm_storel_epi64((__m128i*)y1, pack_bytes(luma(p1a)));
+  _mm_storel_epi64((__m128i*)(y1 + 8), pack_bytes(luma(p1b)));
+
+  __m256i blueRed = average_pairs(
+    _mm256_add_epi16(blue_red(p0a), blue_red(p1a)),
+    _mm256_add_epi16(blue_red(p0b), blue_red(p1b))
+  );
+  __m256i greenAlpha = average_pairs(
+    _mm256_add_epi16(green_alpha(p0a), green_alpha(p1a)),
+    _mm256_add_epi16(green_alpha(p0b), green_alpha(p1b))
+  );
+
+  u = pack_bytes(chroma(blueRed, greenAlpha, pair_coefficients(112, -38), pair_coefficients(-74, 0)));
+  v = pack_bytes(chroma(blueRed, greenAlpha, pair_coefficients(-18, 112), pair_coefficients(-94, 0)));
+}
+
+TARGET_AVX2 static void bgra_to_i420_avx2(
+  const uint8_t* bgra, int bgraStride, int width, int height,
+  uint8_t* y, int yStride, uint8_t* u, int uStride, uint8_t* v, int vStride
+) {
+  int simdWidth = width & ~15;
+
+  for (int row = 0; row < height; row += 2) {
+    const uint8_t* src0 = bgra + row * bgraStride;
+    const uint8_t* src1 = src0 + bgraStride;
+    uint8_t* y0 = y + row * yStride;
+    uint8_t* uRow = u + (row / 2) * uStride;
+    uint8_t* vRow = v + (row / 2) * vStride;
+
+    for (int col = 0; col < simdWidth; col += 16) {
+      __m128i uBlock, vBlock;
+      convert_block(src0 + col * 4, src1 + col * 4, y0 + col, y0 + yStride + col, uBlock, vBlock);
+      _mm_storel_epi64((__m128i*)(uRow + col / 2), uBlock);
+      _mm_storel_epi64((__m128i*)(vRow + col / 2), vBlock);
+    }
+
+    if (simdWidth < width) {
+      convertBgraToI420Scalar(
+        src0 + simdWidth * 4, bgraStride, width - simdWidth, 2,
+        y0 + simdWidth, yStride, uRow + simdWidth / 2, uStride, vRow + simdWidth / 2, vStride
+      );
+    }
+  }
+}
+
+TARGET_AVX2 static void bgra_to_nv12_avx2(
+  const uint8_t* bgra, int bgraStride, int width, int height,
+  uint8_t* y, int yStride, uint8_t* uv, int uvStride
+) {
+  int simdWidth = width & ~15;
+
+  for (int row = 0; row < height; row += 2) {
+    const uint8_t* src0 = bgra + row * bgraStride;
+    const uint8_t* src1 = src0 + bgraStride;
+    uint8_t* y0 = y + row * yStride;
+    uint8_t* uvRow = uv + (row / 2) * uvStride;
+
+    for (int col = 0; col < simdWidth; col += 16) {
+      __m128i uBlock, vBlock;
+      convert_block(src0 + col * 4, src1 + col * 4, y0 + col, y0 + yStride + col, uBlock, vBlock);
+      _mm_storeu_si128((__m128i*)(uvRow + col), _mm_unpacklo_epi8(uBlock, vBlock));
+    }
+
+    if (simdWidth < width) {
+      convertBgraToNV12Scalar(
+        src0 + simdWidth * 4, bgraStride, width - simdWidth, 2,
+        y0 + simdWidth, yStride, uvRow + simdWidth, uvStride
+      );
+    }
+  }
+}
+
+TARGET_AVX2 static void downscale_bgra_2x_avx2(const uint8_t* src, int srcStride, int dstWidth, int dstHeight, uint8_t* dst, int dstStride) {
+  int simdWidth = dstWidth & ~7;
+
+  for (int row = 0; row < dstHeight; row++) {
+    const uint8_t* src0 = src + (row * 2) * srcStride;
+    const uint8_t* src1 = src0 + srcStride;
+    uint8_t* out = dst + row * dstStride;
+
+    // 16 source pixels of both rows give 8 output pixels.
+    for (int col = 0; col < simdWidth; col += 8) {
+      __m256i p0a = _mm256_loadu_si256((const __m256i*)(src0 + col * 8));
+      __m256i p0b = _mm256_loadu_si256((const __m256i*)(src0 + col * 8 + 32));
+      __m256i p1a = _mm256_loadu_si256((const __m256i*)(src1 + col * 8));
+      __m256i p1b = _mm256_loadu_si256((const __m256i*)(src1 + col * 8 + 32));
+
+      __m256i blueRed = average_pairs(
+        _mm256_add_epi16(blue_red(p0a), blue_red(p1a)),
+        _mm256_add_epi16(blue_red(p0b), blue_red(p1b))
+      );
+      __m256i greenAlpha = average_pairs(
+        _mm256_add_epi16(green_alpha(p0a), green_alpha(p1a)),
+        _mm256_add_epi16(green_alpha(p0b), green_alpha(p1b))
+      );
+      __m256i pixels = _mm256_or_si256(blueRed, _mm256_slli_epi32(greenAlpha, 8));
+      _mm256_storeu_si256((__m256i*)(out + col * 4), pixels);
+    }
+
+    if (simdWidth < dstWidth) {
+      downscaleBgra2xScalar(src0 + simdWidth * 8, srcStride, dstWidth - simdWidth, 1, out + simdWidth * 4, dstStride);
+    }
+  }
+}
+
+TARGET_AVX2 static void blend_rows_avx2(const uint8_t* a, const uint8_t* b, uint8_t* dst, int count, int weight) {
+  __m256i weightA = _mm256_set1_epi16((int16_t)(128 - weight));
+  __m256i weightB = _mm256_set1_epi16((int16_t)weight);
+  __m256i rounding = _mm256_set1_epi16(64);
+  int simdCount = count & ~31;
+
+  for (int i = 0; i < simdCount; i += 32) {
+    __m256i va = _mm256_loadu_si256((const __m256i*)(a + i));
+    __m256i vb = _mm256_loadu_si256((const __m256i*)(b + i));
+
+    // 255 * 128 + 64 still fits into 16 bit.
+    __m256i low = _mm256_add_epi16(
+      _mm256_mullo_epi16(_mm256_cvtepu8_epi16(_mm256_castsi256_si128(va)), weightA),
+      _mm256_mullo_epi16(_mm256_cvtepu8_epi16(_mm256_castsi256_si128(vb)), weightB)
+    );
+    __m256i high = _mm256_add_epi16(
+      _mm256_mullo_epi16(_mm256_cvtepu8_epi16(_mm256_extracti128_si256(va, 1)), weightA),
+      _mm256_mullo_epi16(_mm256_cvtepu8_epi16(_mm256_extracti128_si256(vb, 1)), weightB)
+    );
+    low = _mm256_srli_epi16(_mm256_add_epi16(low, rounding), 7);
+    high = _mm256_srli_epi16(_mm256_add_epi16(high, rounding), 7);
+
+    __m256i out = _mm256_permute4x64_epi64(_mm256_packus_epi16(low, high), 0xD8);
+    _mm256_storeu_si256((__m256i*)(dst + i), out);
+  }
+
+  if (simdCount < count) {
+    blendRowsScalar(a + simdCount, b + simdCount, dst + simdCount, count - simdCount, weight);
+  }
+}
+
+static bool cpu_has_avx2() {
+#ifdef _MSC_VER
+  int info[4];
+  __cpuid(info, 1);
+  bool osSavesYmm = (info[2] & (1 << 27)) && (_xgetbv(0) & 6) == 6;
+  __cpuidex(info, 7, 0);
+  return osSavesYmm && (info[1] & (1 << 5));
+#else
+  return __builtin_cpu_supports("avx2");
+#endif
+}
+
+const ColorKernels* getAvx2ColorKernels() {
+  static const ColorKernels kernels = {
+    "avx2",
+    &bgra_to_i420_avx2,
+    &bgra_to_nv12_avx2,
+    &downscale_bgra_2x_avx2,
+    &blend_rows_avx2,
+  };
+  static const bool supported = cpu_has_avx2();
+  return supported ? &kernels : nullptr;
+}
+#else
+const ColorKernels* getAvx2ColorKernels() {
+  return nullptr;
+}
+#endif
@@ -0,0 +1,170 @@
+#include "color_kernels.h"
+
+#ifdef COLOR_KERNELS_NEON
+#include <arm_neon.h>
+
+// vld4 splits 16 BGRA pixels into one register per channel, so every formula maps
+// directly onto widening multiplies. All sums fit into 16 bit lanes.
+
+// Y of 16 pixels.
+static inline uint8x16_t luma(const uint8x16x4_t& pixels) {
+  uint16x8_t low = vmull_u8(vget_low_u8(pixels.val[2]), vdup_n_u8(66));
+  low = vmlal_u8(low, vget_low_u8(pixels.val[1]), vdup_n_u8(129));
+  low = vmlal_u8(low, vget_low_u8(pixels.val[0]), vdup_n_u8(25));
+
+  uint16x8_t high = vmull_u8(vget_high_u8(pixels.val[2]), vdup_n_u8(66));
+  high = vmlal_u8(high, vget_high_u8(pixels.val[1]), vdup_n_u8(129));
+  high = vmlal_u8(high, vget_high_u8(pixels.val[0]), vdup_n_u8(25));
+
+  uint16x8_t rounding = vdupq_n_u16(128);
+  uint8x16_t y = vcombine_u8(vshrn_n_u16(vaddq_u16(low, rounding), 8), vshrn_n_u16(vaddq_u16(high, rounding), 8));
+  return vaddq_u8(y, vdupq_n_u8(16));
+}
+
+// Rounded average of every 2x2 block of one channel.
+static inline int16x8_t average_block(uint8x16_t row0, uint8x16_t row1) {
+  uint16x8_t sum = vpadalq_u8(vpaddlq_u8(row0), row1);
+  return vreinterpretq_s16_u16(vrshrq_n_u16(sum, 2));
+}
+
+// (c0 * a + c1 * b + c2 * c + 128) >> 8 + 128 for chroma, stays within int16.
+static inline uint8x8_t chroma(int16x8_t a, int16_t c0, int16x8_t b, int16_t c1, int16x8_t c, int16_t c2) {
+  int16x8_t sum = vmulq_n_s16(a, c0);
+  sum = vmlaq_n_s16(sum, b, c1);
+  sum = vmlaq_n_s16(sum, c, c2);
+  sum = vshrq_n_s16(vaddq_s16(sum, vdupq_n_s16(128)), 8);
+  return vqmovun_s16(vaddq_s16(sum, vdupq_n_s16(128)));
+}
+
+// Converts 16 columns of two rows, chroma is written as 8 u and 8 v values.
+static inline void convert_block(const uint8_t* src0, const uint8_t* src1, uint8_t* y0, uint8_t* y1, uint8x8_t& u, uint8x8_t& v) {
+  uint8x16x4_t p0 = vld4q_u8(src0);
+  uint8x16x4_t p1 = vld4q_u8(src1);
+
+  vst1q_u8(y0, luma(p0));
+  vst1q_u8(y1, luma(p1));
+
+  int16x8_t b = average_block(p0.val[0], p1.val[0]);
+  int16x8_t g = average_block(p0.val[1], p1.val[1]);
+  int16x8_t r = average_block(p0.val[2], p1.val[2]);
+
+  u = chroma(r, -38, g, -74, b, 112);
+  v = chroma(r, 112, g, -94, b, -18);
+}
+
+static void bgra_to_i420_neon(
+  const uint8_t* bgra, int bgraStride, int width, int height,
+  uint8_t* y, int yStride, uint8_t* u, int uStride, uint8_t* v, int vStride
+) {
+  int simdWidth = width & ~15;
+
+  for (int row = 0; row < height; row += 2) {
+    const uint8_t* src0 = bgra + row * bgraStride;
+    const uint8_t* src1 = src0 + bgraStride;
+    uint8_t* y0 = y + row * yStride;
+    uint8_t* uRow = u + (row / 2) * uStride;
+    uint8_t* vRow = v + (row / 2) * vStride;
+
+    for (int col = 0; col < simdWidth; col += 16) {
+      uint8x8_t uBlock, vBlock;
+      convert_block(src0 + col * 4, src1 + col * 4, y0 + col, y0 + yStride + col, uBlock, vBlock);
+      vst1_u8(uRow + col / 2, uBlock);
+      vst1_u8(vRow + col / 2, vBlock);
+    }
+
+    if (simdWidth < width) {
+      convertBgraToI420Scalar(
+        src0 + simdWidth * 4, bgraStride, width - simdWidth, 2,
+        y0 + simdWidth, yStride, uRow + simdWidth / 2, uStride, vRow + simdWidth / 2, vStride
+      );
+    }
+  }
+}
+
+static void bgra_to_nv12_neon(
+  const uint8_t* bgra, int bgraStride, int width, int height,
+  uint8_t* y, int yStride, uint8_t* uv, int uvStride
+) {
+  int simdWidth = width & ~15;
+
+  for (int row = 0; row < height; row += 2) {
+    const uint8_t* src0 = bgra + row * bgraStride;
+    const uint8_t* src1 = src0 + bgraStride;
+    uint8_t* y0 = y + row * yStride;
+    uint8_t* uvRow = uv + (row / 2) * uvStride;
+
+    for (int col = 0; col < simdWidth; col += 16) {
+      uint8x8x2_t block;
+      convert_block(src0 + col * 4, src1 + col * 4, y0 + col, y0 + yStride + col, block.val[0], block.val[1]);
+      vst2_u8(uvRow + col, block);
+    }
+
+    if (simdWidth < width) {
+      convertBgraToNV12Scalar(
+        src0 + simdWidth * 4, bgraStride, width - simdWidth, 2,
+        y0 + simdWidth, yStride, uvRow + simdWidth, uvStride
+      );
+    }
+  }
+}
+
+static void downscale_bgra_2x_neon(const uint8_t* src, int srcStride, int dstWidth, int dstHeight, uint8_t* dst, int dstStride) {
+  int simdWidth = dstWidth & ~7;
+
+  for (int row = 0; row < dstHeight; row++) {
+    const uint8_t* src0 = src + (row * 2) * srcStride;
+    const uint8_t* src1 = src0 + srcStride;
+    uint8_t* out = dst + row * dstStride;
+
+    // 16 source pixels of both rows give 8 output pixels.
+    for (int col = 0; col < simdWidth; col += 8) {
+      uint8x16x4_t p0 = vld4q_u8(src0 + col * 8);
+      uint8x16x4_t p1 = vld4q_u8(src1 + col * 8);
+
+      uint8x8x4_t pixels;
+      for (int c = 0; c < 4; c++) {
+        pixels.val[c] = vrshrn_n_u16(vpadalq_u8(vpaddlq_u8(p0.val[c]), p1.val[c]), 2);
+      }
+      vst4_u8(out + col * 4, pixels);
+    }
+
+    if (simdWidth < dstWidth) {
+      downscaleBgra2xScalar(src0 + simdWidth * 8, srcStride, dstWidth - simdWidth, 1, out + simdWidth * 4, dstStride);
+    }
+  }
+}
+
+static void blend_rows_neon(const uint8_t* a, const uint8_t* b, uint8_t* dst, int count, int weight) {
+  uint8x8_t weightA = vdup_n_u8((uint8_t)(128 - weight));
+  uint8x8_t weightB = vdup_n_u8((uint8_t)weight);
+  int simdCount = count & ~15;
+
+  for (int i = 0; i < simdCount; i += 16) {
+    uint8x16_t va = vld1q_u8(a + i);
+    uint8x16_t vb = vld1q_u8(b + i);
+
+    uint16x8_t low = vmlal_u8(vmull_u8(vget_low_u8(va), weightA), vget_low_u8(vb), weightB);
+    uint16x8_t high = vmlal_u8(vmull_u8(vget_high_u8(va), weightA), vget_high_u8(vb), weightB);
+    vst1q_u8(dst + i, vcombine_u8(vrshrn_n_u16(low, 7), vrshrn_n_u16(high, 7)));
+  }
+
+  if (simdCount < count) {
+    blendRowsScalar(a + simdCount, b + simdCount, dst + simdCount, count - simdCount, weight);
+  }
+}
+
+const ColorKernels* getNeonColorKernels() {
+  static const ColorKernels kernels = {
+    "neon",
+    &bgra_to_i420_neon,
+    &bgra_to_nv12_neon,
+    &downscale_bgra_2x_neon,
+    &blend_rows_neon,
+  };
+  return &kernels;
+}
+#else
+const ColorKernels* getNeonColorKernels() {
+  return nullptr;
+}
+#endif
@@ -0,0 +1,55 @@
+#ifndef _COLOR_KERNELS_H_
+#define _COLOR_KERNELS_H_
+
+#include <stdint.h>
+
+// Instruction sets the kernels are compiled for. AVX2 is picked at runtime, NEON
+// is used whenever the compiler targets it.
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define COLOR_KERNELS_AVX2 1
+#endif
+#if defined(__ARM_NEON) || defined(__ARM_NEON__) || defined(_M_ARM64)
+#define COLOR_KERNELS_NEON 1
+#endif
+
+/// One implementation of every color/scale kernel. All implementations produce
+/// bit-exact the same output as the scalar reference.
+struct ColorKernels {
+  const char* name;
+  /// BGRA to planar I420, width and height have to be even.
+  void (*bgraToI420)(
+    const uint8_t* bgra, int bgraStride, int width, int height,
+    uint8_t* y, int yStride, uint8_t* u, int uStride, uint8_t* v, int vStride
+  );
+  /// BGRA to NV12 (interleaved chroma), width and height have to be even.
+  void (*bgraToNV12)(
+    const uint8_t* bgra, int bgraStride, int width, int height,
+    uint8_t* y, int yStride, uint8_t* uv, int uvStride
+  );
+  /// Averages every 2x2 block of a BGRA image of twice the destination size.
+  void (*downscaleBgra2x)(const uint8_t* src, int srcStride, int dstWidth, int dstHeight, uint8_t* dst, int dstStride);
+  /// dst = (a * (128 - weight) + b * weight + 64) >> 7 for `count` bytes, weight in [0, 128].
+  void (*blendRows)(const uint8_t* a, const uint8_t* b, uint8_t* dst, int count, int weight);
+};
+
+/// Kernels with the best instruction set supported by this CPU.
+const ColorKernels& getColorKernels();
+/// Plain C++ kernels, these define the expected output.
+const ColorKernels& getScalarColorKernels();
+/// Kernels for a given instruction set, null if they are not compiled in or the CPU lacks support.
+const ColorKernels* getAvx2ColorKernels();
+const ColorKernels* getNeonColorKernels();
+
+// Scalar kernels, also used by the SIMD kernels for the remaining columns of a row.
+void convertBgraToI420Scalar(
+  const uint8_t* bgra, int bgraStride, int width, int height,
+  uint8_t* y, int yStride, uint8_t* u, int uStride, uint8_t* v, int vStride
+);
+void convertBgraToNV12Scalar(
+  const uint8_t* bgra, int bgraStride, int width, int height,
+  uint8_t* y, int yStride, uint8_t* uv, int uvStride
+);
+void downscaleBgra2xScalar(const uint8_t* src, int srcStride, int dstWidth, int dstHeight, uint8_t* dst, int dstStride);
+void blendRowsScalar(const uint8_t* a, const uint8_t* b, uint8_t* dst, int count, int weight);
+
+#endif
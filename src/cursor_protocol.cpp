@@ -0,0 +1,390 @@
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <random>
+
+#include "cursor_protocol.h"
+
+static void write_u16(std::vector<uint8_t>& out, uint32_t value) {
+  out.push_back((uint8_t)(value >> 8));
+  out.push_back((uint8_t)value);
+}
+
+static void write_u32(std::vector<uint8_t>& out, uint32_t value) {
+  out.push_back((uint8_t)(value >> 24));
+  out.push_back((uint8_t)(value >> 16));
+  out.push_back((uint8_t)(value >> 8));
+  out.push_back((uint8_t)value);
+}
+
+static uint32_t read_u16(const uint8_t* data) {
+  return ((uint32_t)data[0] << 8) | data[1];
+}
+
+static uint32_t read_u32(const uint8_t* data) {
+  return ((uint32_t)data[0] << 24) | ((uint32_t)data[1] << 16) | ((uint32_t)data[2] << 8) | data[3];
+}
+
+static void write_header(std::vector<uint8_t>& out, CursorMessage type, uint32_t len) {
+  out.push_back((uint8_t)type);
+  write_u32(out, len);
+}
+
+void encodeCursorPosition(const CursorPosition& position, std::vector<uint8_t>& out) {
+  write_header(out, CursorMessage::Position, CURSOR_POSITION_LEN);
+  write_u32(out, (uint32_t)position.x);
+  write_u32(out, (uint32_t)position.y);
+  out.push_back(position.visible ? 1 : 0);
+  write_u32(out, (uint32_t)(position.timeUs >> 32));
+  write_u32(out, (uint32_t)position.timeUs);
+}
+
+bool encodeCursorShape(const CursorShape& shape, std::vector<uint8_t>& out) {
+  size_t len = CURSOR_SHAPE_HEADER_LEN + shape.pixels.size();
+  if (len > CURSOR_MAX_SHAPE_LEN || shape.width > 0xFFFF || shape.height > 0xFFFF || shape.pitch > 0xFFFF ||
+      shape.pixels.size() < (size_t)shape.pitch * shape.height) {
+    return false;
+  }
+
+  write_header(out, CursorMessage::Shape, (uint32_t)len);
+  out.push_back((uint8_t)shape.type);
+  write_u16(out, shape.width);
+  write_u16(out, shape.height);
+  write_u16(out, shape.pitch);
+  write_u16(out, (uint16_t)(int16_t)shape.hotX);
+  write_u16(out, (uint16_t)(int16_t)shape.hotY);
+  out.insert(out.end(), shape.pixels.begin(), shape.pixels.end());
+  return true;
+}
+
+void CursorChannel::publishPosition(const CursorPosition& position) {
+  std::lock_guard<std::mutex> guard(lock);
+  this->position = position;
+  positionVersion++;
+}
+
+void CursorChannel::publishShape(const CursorShape& shape) {
+  // Encoded outside the lock, the capture thread does not hold up the server.
+  auto encoded = std::make_shared<std::vector<uint8_t>>();
+  if (!encodeCursorShape(shape, *encoded)) {
+    printf("[Cursor] Dropping %ux%u shape, it does not fit a message\n", shape.width, shape.height);
+    return;
+  }
+
+  std::lock_guard<std::mutex> guard(lock);
+  this->shape = encoded;
+  shapeVersion++;
+}
+
+bool CursorChannel::collect(uint32_t* positionVersion, uint32_t* shapeVersion, std::vector<uint8_t>& out) {
+  std::lock_guard<std::mutex> guard(lock);
+  bool changed = false;
+
+  if (*shapeVersion != this->shapeVersion && shape) {
+    out.insert(out.end(), shape->begin(), shape->end());
+    *shapeVersion = this->shapeVersion;
+    changed = true;
+  }
+
+  if (*positionVersion != this->positionVersion) {
+    encodeCursorPosition(position, out);
+    *positionVersion = this->positionVersion;
+    changed = true;
+  }
+
+  return changed;
+}
+
+void CursorState::push(const uint8_t* data, size_t len) {
+  statsBytes += len;
+  if (broken) {
+    return;
+  }
+  buffer.insert(buffer.end(), data, data + len);
+
+  size_t offset = 0;
+  while (buffer.size() - offset >= CURSOR_HEADER_LEN) {
+    CursorMessage type = (CursorMessage)buffer[offset];
+    size_t payloadLen = read_u32(&buffer[offset + 1]);
+    if (payloadLen > CURSOR_MAX_SHAPE_LEN) {
+      // The stream cannot be resynced after a bad length, wait for a new connection.
+      printf("[Cursor] Message of %zd bytes, dropping the cursor stream\n", payloadLen);
+      statsErrors++;
+      buffer.clear();
+      hasShape = false;
+      broken = true;
+      return;
+    }
+
+    if (buffer.size() - offset - CURSOR_HEADER_LEN < payloadLen) {
+      break;
+    }
+
+    if (!apply(type, &buffer[offset + CURSOR_HEADER_LEN], payloadLen)) {
+      statsErrors++;
+    }
+    offset += CURSOR_HEADER_LEN + payloadLen;
+  }
+
+  buffer.erase(buffer.begin(), buffer.begin() + offset);
+}
+
+void CursorState::reset() {
+  buffer.clear();
+  position = CursorPosition();
+  shape = CursorShape();
+  hasShape = false;
+  broken = false;
+}
+
+bool CursorState::apply(CursorMessage type, const uint8_t* payload, size_t len) {
+  switch (type) {
+    case CursorMessage::Position:
+      if (len < CURSOR_POSITION_LEN) {
+        return false;
+      }
+      position.x = (int32_t)read_u32(payload);
+      position.y = (int32_t)read_u32(payload + 4);
+      position.visible = payload[8] != 0;
+      position.timeUs = ((uint64_t)read_u32(payload + 9) << 32) | read_u32(payload + 13);
+      statsPositions++;
+      return true;
+
+    case CursorMessage::Shape: {
+      if (len < CURSOR_SHAPE_HEADER_LEN) {
+        return false;
+      }
+      CursorShape next;
+      next.type = (CursorShapeType)payload[0];
+      next.width = read_u16(payload + 1);
+      next.height = read_u16(payload + 3);
+      next.pitch = read_u16(payload + 5);
+      next.hotX = (int16_t)read_u16(payload + 7);
+      next.hotY = (int16_t)read_u16(payload + 9);
+
+      size_t bytesPerPixel = next.type == CursorShapeType::Monochrome ? 0 : 4;
+      bool known = next.type == CursorShapeType::Monochrome || next.type == CursorShapeType::Color ||
+                   next.type == CursorShapeType::MaskedColor;
+      bool fits = next.pitch >= (bytesPerPixel ? next.width * bytesPerPixel : (next.width + 7) / 8) &&
+                  len - CURSOR_SHAPE_HEADER_LEN >= (size_t)next.pitch * next.height;
+      if (!known || !fits) {
+        // An unusable shape must not leave the old one on screen.
+        hasShape = false;
+        return false;
+      }
+
+      next.pixels.assign(payload + CURSOR_SHAPE_HEADER_LEN, payload + CURSOR_SHAPE_HEADER_LEN + (size_t)next.pitch * next.height);
+      shape = std::move(next);
+      hasShape = true;
+      statsShapes++;
+      return true;
+    }
+  }
+
+  // Unknown messages are skipped, newer servers may send more.
+  return true;
+}
+
+void CursorState::composite(uint8_t* bgra, size_t stride, int width, int height) const {
+  if (!isVisible()) {
+    return;
+  }
+
+  bool monochrome = shape.type == CursorShapeType::Monochrome;
+  int rows = monochrome ? (int)shape.height / 2 : (int)shape.height;
+  int left = position.x - shape.hotX;
+  int top = position.y - shape.hotY;
+
+  for (int row = 0; row < rows; row++) {
+    int y = top + row;
+    if (y < 0 || y >= height) {
+      continue;
+    }
+    const uint8_t* src = &shape.pixels[(size_t)row * shape.pitch];
+    uint8_t* dst = bgra + (size_t)y * stride;
+
+    for (int col = 0; col < (int)shape.width; col++) {
+      int x = left + col;
+      if (x < 0 || x >= width) {
+        continue;
+      }
+      uint8_t* pixel = dst + (size_t)x * 4;
+
+      if (monochrome) {
+        // AND mask in the upper half, XOR mask in the lower half, most significant bit first.
+        uint8_t bit = 0x80 >> (col % 8);
+        bool andBit = (src[col / 8] & bit) != 0;
+        bool xorBit = (src[(size_t)rows * shape.pitch + col / 8] & bit) != 0;
+        for (int c = 0; c < 3; c++) {
+          pixel[c] = (uint8_t)((andBit ? pixel[c] : 0) ^ (xorBit ? 0xFF : 0));
+        }
+      } else if (shape.type == CursorShapeType::MaskedColor) {
+        const uint8_t* value = src + col * 4;
+        for (int c = 0; c < 3; c++) {
+          pixel[c] = value[3] ? (uint8_t)(pixel[c] ^ value[c]) : value[c];
+        }
+      } else {
+        const uint8_t* value = src + col * 4;
+        uint32_t alpha = value[3];
+        for (int c = 0; c < 3; c++) {
+          pixel[c] = (uint8_t)((value[c] * alpha + pixel[c] * (255 - alpha) + 127) / 255);
+        }
+      }
+    }
+  }
+}
+
+/// Feeds `bytes` to `state` in random pieces, like a QUIC stream hands them out.
+static void push_in_pieces(CursorState& state, const std::vector<uint8_t>& bytes, std::mt19937& random) {
+  size_t offset = 0;
+  while (offset < bytes.size()) {
+    size_t piece = std::min<size_t>(bytes.size() - offset, 1 + random() % 40);
+    state.push(bytes.data() + offset, piece);
+    offset += piece;
+  }
+}
+
+bool verifyCursorProtocol() {
+  bool ok = true;
+  std::mt19937 random(1234);
+
+  // 16x16 arrow-ish color shape with a half transparent edge.
+  CursorShape arrow;
+  arrow.type = CursorShapeType::Color;
+  arrow.width = 16;
+  arrow.height = 16;
+  arrow.pitch = 16 * 4;
+  arrow.hotX = 1;
+  arrow.hotY = 2;
+  arrow.pixels.resize(arrow.pitch * arrow.height);
+  for (uint32_t y = 0; y < arrow.height; y++) {
+    for (uint32_t x = 0; x < arrow.width; x++) {
+      uint8_t* p = &arrow.pixels[y * arrow.pitch + x * 4];
+      p[0] = p[1] = p[2] = 0xFF;
+      p[3] = x < y ? 0xFF : (x == y ? 0x80 : 0);
+    }
+  }
+
+  CursorChannel channel;
+  CursorState state;
+  uint32_t positionVersion = 0;
+  uint32_t shapeVersion = 0;
+  std::vector<uint8_t> wire;
+
+  // Moves before the first shape are kept, but nothing is drawn yet.
+  CursorPosition position;
+  position.x = 100;
+  position.y = 50;
+  position.visible = true;
+  position.timeUs = 1;
+  channel.publishPosition(position);
+  channel.collect(&positionVersion, &shapeVersion, wire);
+  push_in_pieces(state, wire, random);
+  if (state.isVisible() || state.getPosition().x != 100) {
+    printf("[Cursor] Cursor without shape is drawn or position lost\n");
+    ok = false;
+  }
+
+  // Shape and a burst of moves while the client could not take anything: only the newest
+  // position goes out, after the shape.
+  channel.publishShape(arrow);
+  for (int i = 0; i < 50; i++) {
+    position.x = 100 + i;
+    position.y = 50 + i / 2;
+    position.timeUs = 2 + i;
+    channel.publishPosition(position);
+  }
+  wire.clear();
+  channel.collect(&positionVersion, &shapeVersion, wire);
+  size_t expected = CURSOR_HEADER_LEN + CURSOR_SHAPE_HEADER_LEN + arrow.pixels.size() + CURSOR_HEADER_LEN + CURSOR_POSITION_LEN;
+  if (wire.size() != expected) {
+    printf("[Cursor] Burst of moves took %zd bytes, expected %zd\n", wire.size(), expected);
+    ok = false;
+  }
+  push_in_pieces(state, wire, random);
+  if (!state.isVisible() || state.getPosition().x != 149 || state.getPosition().y != 74 ||
+      state.getShape().hotY != 2 || state.getShapes() != 1) {
+    printf("[Cursor] Shape or newest position did not arrive\n");
+    ok = false;
+  }
+
+  // Nothing changed, nothing to send.
+  wire.clear();
+  if (channel.collect(&positionVersion, &shapeVersion, wire) || !wire.empty()) {
+    printf("[Cursor] Unchanged cursor produced %zd bytes\n", wire.size());
+    ok = false;
+  }
+
+  // A pure move is a single small message.
+  position.x = 10;
+  position.y = 20;
+  channel.publishPosition(position);
+  channel.collect(&positionVersion, &shapeVersion, wire);
+  size_t moveBytes = wire.size();
+  push_in_pieces(state, wire, random);
+  if (moveBytes != CURSOR_HEADER_LEN + CURSOR_POSITION_LEN || state.getPosition().x != 10) {
+    printf("[Cursor] Move took %zd bytes\n", moveBytes);
+    ok = false;
+  }
+
+  // Composite onto a gray frame: fully opaque, blended and untouched pixels.
+  const int width = 64;
+  const int height = 64;
+  std::vector<uint8_t> frame(width * height * 4, 0x40);
+  state.composite(frame.data(), width * 4, width, height);
+  auto pixel = [&](int x, int y) { return frame[(y * width + x) * 4]; };
+  int left = 10 - arrow.hotX;
+  int top = 20 - arrow.hotY;
+  if (pixel(left, top + 5) != 0xFF || pixel(left + 5, top + 5) != 0xA0 || pixel(left + 6, top + 5) != 0x40) {
+    printf("[Cursor] Composited pixels are %02x %02x %02x\n", pixel(left, top + 5), pixel(left + 5, top + 5), pixel(left + 6, top + 5));
+    ok = false;
+  }
+
+  // Hidden cursor is not drawn, the shape stays for when it comes back.
+  position.visible = false;
+  channel.publishPosition(position);
+  wire.clear();
+  channel.collect(&positionVersion, &shapeVersion, wire);
+  push_in_pieces(state, wire, random);
+  std::vector<uint8_t> untouched(width * height * 4, 0x40);
+  std::vector<uint8_t> hidden = untouched;
+  state.composite(hidden.data(), width * 4, width, height);
+  if (state.isVisible() || hidden != untouched) {
+    printf("[Cursor] Hidden cursor is drawn\n");
+    ok = false;
+  }
+
+  // Monochrome: transparent, black, white and inverted pixels on an 8x1 cursor.
+  CursorShape mono;
+  mono.type = CursorShapeType::Monochrome;
+  mono.width = 8;
+  mono.height = 2;
+  mono.pitch = 1;
+  mono.pixels = { 0xA0, 0x60 };
+  wire.clear();
+  encodeCursorShape(mono, wire);
+  position.x = 0;
+  position.y = 0;
+  position.visible = true;
+  encodeCursorPosition(position, wire);
+  push_in_pieces(state, wire, random);
+  std::vector<uint8_t> row(8 * 4, 0x40);
+  state.composite(row.data(), row.size(), 8, 1);
+  if (row[0] != 0x40 || row[4] != 0xFF || row[8] != 0xBF || row[12] != 0x00) {
+    printf("[Cursor] Monochrome pixels are %02x %02x %02x %02x\n", row[0], row[4], row[8], row[12]);
+    ok = false;
+  }
+
+  // Garbage length drops the cursor instead of drawing something random.
+  uint8_t garbage[CURSOR_HEADER_LEN] = { 2, 0xFF, 0xFF, 0xFF, 0xFF };
+  state.push(garbage, sizeof(garbage));
+  if (state.isVisible() || state.getErrors() != 1) {
+    printf("[Cursor] Broken message was not rejected\n");
+    ok = false;
+  }
+
+  printf("[Cursor] Shape message %zd bytes, cursor move %zd bytes\n",
+         CURSOR_HEADER_LEN + CURSOR_SHAPE_HEADER_LEN + arrow.pixels.size(), moveBytes);
+  printf("[Cursor] Protocol checks %s\n", ok ? "passed" : "FAILED");
+  return ok;
+}
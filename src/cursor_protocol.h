@@ -0,0 +1,134 @@
+#ifndef _CURSOR_PROTOCOL_H_
+#define _CURSOR_PROTOCOL_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+/// Every cursor message starts with its type (1 byte) and the payload length (4 bytes).
+#define CURSOR_HEADER_LEN 5
+/// x, y, visible and the capture timestamp.
+#define CURSOR_POSITION_LEN 17
+/// Shape type, size, pitch and hotspot in front of the pixels.
+#define CURSOR_SHAPE_HEADER_LEN 11
+/// Largest shape payload a client accepts, DDA shapes are at most 256x256 BGRA.
+#define CURSOR_MAX_SHAPE_LEN (CURSOR_SHAPE_HEADER_LEN + 256 * 256 * 4)
+
+enum class CursorMessage : uint8_t {
+  Position = 1,
+  Shape = 2,
+};
+
+/// Pixel formats of a cursor shape, same values as DXGI_OUTDUPL_POINTER_SHAPE_TYPE.
+enum class CursorShapeType : uint8_t {
+  /// 1bpp AND mask followed by a 1bpp XOR mask, `height` covers both masks.
+  Monochrome = 1,
+  /// 32bpp BGRA with alpha.
+  Color = 2,
+  /// 32bpp BGR, the alpha byte decides between replacing (0) and XOR-ing (0xFF) the pixel.
+  MaskedColor = 4,
+};
+
+/// Where the cursor is, in pixels of the captured region (the hotspot sits there).
+struct CursorPosition {
+  int32_t x = 0;
+  int32_t y = 0;
+  bool visible = false;
+  /// Capture clock of the update.
+  uint64_t timeUs = 0;
+};
+
+struct CursorShape {
+  CursorShapeType type = CursorShapeType::Color;
+  uint32_t width = 0;
+  /// Rows of the shape, twice the cursor height for monochrome shapes.
+  uint32_t height = 0;
+  /// Bytes per row.
+  uint32_t pitch = 0;
+  int32_t hotX = 0;
+  int32_t hotY = 0;
+  std::vector<uint8_t> pixels;
+};
+
+/// Appends a position message to `out`.
+void encodeCursorPosition(const CursorPosition& position, std::vector<uint8_t>& out);
+/// Appends a shape message to `out`, returns false if the shape does not fit a message.
+bool encodeCursorShape(const CursorShape& shape, std::vector<uint8_t>& out);
+
+/// Latest cursor state of a capture source, written by the capture thread and read by
+/// the server.
+///
+/// Only the newest position and shape are kept. A client that fell behind gets the
+/// current state instead of every intermediate move, so motion never queues up.
+class CursorChannel {
+  private:
+    std::mutex lock;
+    CursorPosition position;
+    /// Encoded once and shared by all clients.
+    std::shared_ptr<const std::vector<uint8_t>> shape;
+    uint32_t positionVersion = 0;
+    uint32_t shapeVersion = 0;
+
+  public:
+    void publishPosition(const CursorPosition& position);
+    void publishShape(const CursorShape& shape);
+
+    /// Appends what changed since `*positionVersion` and `*shapeVersion` to `out` (shape
+    /// first, so a new shape never shows at an old position) and updates both versions.
+    /// Returns false if nothing changed.
+    bool collect(uint32_t* positionVersion, uint32_t* shapeVersion, std::vector<uint8_t>& out);
+};
+
+/// Client side of the cursor channel: parses the cursor stream and keeps what has to be
+/// drawn on top of the video.
+///
+/// Nothing is drawn until the first shape arrived. Afterwards the cursor is shown or
+/// hidden by the position updates, a new shape replaces the old one in place. A broken
+/// shape drops the cursor until the next shape, a broken message length drops the rest
+/// of the stream since there is no way to find the next message.
+class CursorState {
+  private:
+    /// Bytes of an incomplete message.
+    std::vector<uint8_t> buffer;
+    CursorPosition position;
+    CursorShape shape;
+    bool hasShape = false;
+    /// Set after a broken message length, everything up to reset() is ignored.
+    bool broken = false;
+    /// Debug stats.
+    uint64_t statsPositions = 0;
+    uint64_t statsShapes = 0;
+    uint64_t statsBytes = 0;
+    uint64_t statsErrors = 0;
+
+  public:
+    /// Feeds received bytes of the cursor stream, messages may be cut anywhere.
+    void push(const uint8_t* data, size_t len);
+    void reset();
+
+    /// Whether there is a cursor to draw.
+    bool isVisible() const { return hasShape && position.visible; }
+    const CursorPosition& getPosition() const { return position; }
+    const CursorShape& getShape() const { return shape; }
+
+    /// Draws the cursor into a BGRA frame of `width` x `height` pixels.
+    void composite(uint8_t* bgra, size_t stride, int width, int height) const;
+
+    uint64_t getPositions() const { return statsPositions; }
+    uint64_t getShapes() const { return statsShapes; }
+    uint64_t getBytes() const { return statsBytes; }
+    uint64_t getErrors() const { return statsErrors; }
+
+  private:
+    /// Applies one complete message, returns false if it is malformed.
+    bool apply(CursorMessage type, const uint8_t* payload, size_t len);
+};
+
+/// Runs cursor updates through the channel and the client state machine (random cuts,
+/// stale positions, hidden cursor, compositing) and prints the bytes a pure cursor move
+/// costs. Returns false if a check failed.
+bool verifyCursorProtocol();
+
+#endif
@@ -0,0 +1,341 @@
+#include <cstdio>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+#include "encode_ring.h"
+
+bool EncodeRing::initialize(size_t slotCount, EncodeBackend* backend) {
+  if (slotCount == 0 || !backend) {
+    printf("Invalid encode ring settings\n");
+    return false;
+  }
+
+  std::lock_guard<std::mutex> guard(lock);
+  slots.assign(slotCount, Slot());
+  pBackend = backend;
+  head = 0;
+  tail = 0;
+  nextFence = 1;
+  completedFence = 0;
+  stopped = false;
+  statsDropped = 0;
+  return true;
+}
+
+void EncodeRing::stop() {
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    stopped = true;
+  }
+  submitted.notify_all();
+}
+
+int EncodeRing::acquireSlot() {
+  std::lock_guard<std::mutex> guard(lock);
+
+  // Slots are used strictly round robin, so the next one has to be free.
+  Slot& slot = slots[head];
+  if (slot.state != SlotState::Free) {
+    statsDropped++;
+    return -1;
+  }
+
+  slot.state = SlotState::Capturing;
+  int index = (int)head;
+  head = (head + 1) % slots.size();
+  return index;
+}
+
+void EncodeRing::cancelSlot(int slot) {
+  std::lock_guard<std::mutex> guard(lock);
+  if (slots[slot].state == SlotState::Capturing) {
+    cancelSlotLocked(slot);
+  }
+}
+
+bool EncodeRing::submit(int slot, const EncodeJob& job) {
+  EncodeJob queued = job;
+
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    if (slots[slot].state != SlotState::Capturing) {
+      return false;
+    }
+    queued.fence = nextFence++;
+    slots[slot].job = queued;
+  }
+
+  // The backend call happens outside the lock, the drain side may be busy meanwhile.
+  if (!pBackend->submitEncode(slot, queued)) {
+    std::lock_guard<std::mutex> guard(lock);
+    cancelSlotLocked(slot);
+    return false;
+  }
+
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    slots[slot].state = SlotState::Encoding;
+  }
+  submitted.notify_one();
+  return true;
+}
+
+void EncodeRing::cancelSlotLocked(int slot) {
+  size_t last = (head + slots.size() - 1) % slots.size();
+  if ((size_t)slot == last) {
+    slots[slot].state = SlotState::Free;
+    head = last;
+  } else {
+    // Something was acquired after us, pass the slot on as an empty encode.
+    slots[slot].job.fence = 0;
+    slots[slot].state = SlotState::Encoding;
+  }
+}
+
+bool EncodeRing::drain(SliceSink* sink, uint32_t timeoutMs, size_t* bytes) {
+  int slot = 0;
+  EncodeJob job;
+
+  {
+    std::unique_lock<std::mutex> guard(lock);
+    bool ready = submitted.wait_for(guard, std::chrono::milliseconds(timeoutMs), [this]() {
+      return stopped || slots[tail].state == SlotState::Encoding;
+    });
+    if (!ready || slots[tail].state != SlotState::Encoding) {
+      return false;
+    }
+
+    slot = (int)tail;
+    job = slots[tail].job;
+  }
+
+  // Failed submits are passed along with fence 0 and have no output.
+  size_t written = job.fence == 0 ? 0 : pBackend->collectEncode(slot, job, sink);
+  if (bytes) {
+    *bytes = written;
+  }
+
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    slots[slot].state = SlotState::Free;
+    tail = (tail + 1) % slots.size();
+    if (job.fence != 0) {
+      completedFence = job.fence;
+    }
+  }
+  return job.fence != 0;
+}
+
+size_t EncodeRing::inFlight() {
+  std::lock_guard<std::mutex> guard(lock);
+
+  size_t count = 0;
+  for (auto& slot : slots) {
+    if (slot.state != SlotState::Free) {
+      count++;
+    }
+  }
+  return count;
+}
+
+uint64_t EncodeRing::getCompletedFence() {
+  std::lock_guard<std::mutex> guard(lock);
+  return completedFence;
+}
+
+uint64_t EncodeRing::getDropped() {
+  std::lock_guard<std::mutex> guard(lock);
+  return statsDropped;
+}
+
+MockEncodeBackend::MockEncodeBackend(size_t slotCount, uint32_t latencyUs)
+  : latencyUs(slotCount, latencyUs), readyUs(slotCount, 0) {}
+
+void MockEncodeBackend::setLatency(int slot, uint32_t latencyUs) {
+  std::lock_guard<std::mutex> guard(lock);
+  this->latencyUs[slot] = latencyUs;
+}
+
+void MockEncodeBackend::failNextSubmit() {
+  std::lock_guard<std::mutex> guard(lock);
+  failNext = true;
+}
+
+std::vector<int> MockEncodeBackend::getFinishOrder() {
+  std::lock_guard<std::mutex> guard(lock);
+
+  // The "hardware" finishes every slot on its own, no matter which one is collected first.
+  std::vector<std::pair<uint64_t, int>> sorted = submits;
+  std::stable_sort(sorted.begin(), sorted.end());
+
+  std::vector<int> order;
+  for (auto& submit : sorted) {
+    order.push_back(submit.second);
+  }
+  return order;
+}
+
+bool MockEncodeBackend::submitEncode(int slot, const EncodeJob&) {
+  std::lock_guard<std::mutex> guard(lock);
+  if (failNext) {
+    failNext = false;
+    return false;
+  }
+
+  readyUs[slot] = nowMicros() + latencyUs[slot];
+  submits.push_back(std::make_pair(readyUs[slot], slot));
+  return true;
+}
+
+size_t MockEncodeBackend::collectEncode(int slot, const EncodeJob& job, SliceSink* sink) {
+  uint64_t ready = 0;
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    ready = readyUs[slot];
+  }
+
+  uint64_t now = nowMicros();
+  if (ready > now) {
+    std::this_thread::sleep_for(std::chrono::microseconds(ready - now));
+  }
+
+  EncodedSlice slice;
+  slice.streamId = job.streamId;
+  slice.frameIndex = job.frameIndex;
+  slice.lastInFrame = true;
+  slice.captureTimeUs = job.captureTimeUs;
+  slice.payload = std::make_shared<std::vector<uint8_t>>(1000, (uint8_t)job.frameIndex);
+  if (sink) {
+    sink->onSlice(slice);
+  }
+  return slice.payload->size();
+}
+
+/// Remembers the frames the ring hands out.
+class CollectedFrames : public SliceSink {
+  public:
+    std::vector<uint32_t> frames;
+
+    void onSlice(const EncodedSlice& slice) override { frames.push_back(slice.frameIndex); }
+};
+
+static bool submit_frame(EncodeRing& ring, uint32_t frameIndex) {
+  int slot = ring.acquireSlot();
+  if (slot < 0) {
+    return false;
+  }
+
+  EncodeJob job;
+  job.frameIndex = frameIndex;
+  job.captureTimeUs = nowMicros();
+  return ring.submit(slot, job);
+}
+
+bool verifyEncodeRing() {
+  bool ok = true;
+  const size_t slotCount = 3;
+
+  // Exhaustion: a full ring drops instead of waiting, and counts every drop.
+  {
+    MockEncodeBackend backend(slotCount, 1000);
+    EncodeRing ring;
+    CollectedFrames sink;
+    ring.initialize(slotCount, &backend);
+
+    uint32_t submitted = 0;
+    for (uint32_t i = 0; i < slotCount; i++) {
+      submitted += submit_frame(ring, i) ? 1 : 0;
+    }
+    bool dropped = !submit_frame(ring, 3) && !submit_frame(ring, 4);
+    if (submitted != slotCount || !dropped || ring.getDropped() != 2 || ring.inFlight() != slotCount) {
+      printf("[EncodeRing] Full ring accepted a frame or miscounted (dropped %llu, in flight %zd)\n",
+             (unsigned long long)ring.getDropped(), ring.inFlight());
+      ok = false;
+    }
+
+    // One collected frame makes room for exactly one more.
+    ring.drain(&sink, 100);
+    if (!submit_frame(ring, 5) || submit_frame(ring, 6) || ring.getDropped() != 3) {
+      printf("[EncodeRing] Slot was not reusable after a drain\n");
+      ok = false;
+    }
+    while (ring.drain(&sink, 0)) {}
+  }
+
+  // Out of order: the first slot finishes last, frames still come out in submit order.
+  {
+    MockEncodeBackend backend(slotCount, 1000);
+    backend.setLatency(0, 30000);
+    EncodeRing ring;
+    CollectedFrames sink;
+    ring.initialize(slotCount, &backend);
+
+    for (uint32_t i = 0; i < slotCount; i++) {
+      submit_frame(ring, i);
+    }
+    std::vector<uint64_t> fences;
+    while (ring.drain(&sink, 100)) {
+      fences.push_back(ring.getCompletedFence());
+    }
+
+    std::vector<int> finished = backend.getFinishOrder();
+    bool reordered = !finished.empty() && finished.front() != 0;
+    if (!reordered || sink.frames != std::vector<uint32_t>({ 0, 1, 2 }) || fences != std::vector<uint64_t>({ 1, 2, 3 })) {
+      printf("[EncodeRing] Frames finished out of order were not collected in submit order\n");
+      ok = false;
+    }
+  }
+
+  // Fences: slots are reused many times, a cancelled slot and a failed submit pass through
+  // as empty encodes, and the completed fence only ever grows.
+  {
+    MockEncodeBackend backend(slotCount, 200);
+    EncodeRing ring;
+    CollectedFrames sink;
+    ring.initialize(slotCount, &backend);
+
+    uint64_t lastFence = 0;
+    bool monotonic = true;
+    uint32_t expected = 0;
+    for (uint32_t i = 0; i < 20; i++) {
+      if (i == 7) {
+        // Cancelled behind a later slot, the drain side has to skip it.
+        int cancelled = ring.acquireSlot();
+        submit_frame(ring, i);
+        ring.cancelSlot(cancelled);
+        expected++;
+      } else if (i == 13) {
+        backend.failNextSubmit();
+        submit_frame(ring, i);
+      } else {
+        submit_frame(ring, i);
+        expected++;
+      }
+
+      while (ring.inFlight() > 1) {
+        ring.drain(&sink, 100);
+        uint64_t fence = ring.getCompletedFence();
+        monotonic = monotonic && fence >= lastFence;
+        lastFence = fence;
+      }
+    }
+    while (ring.inFlight() > 0) {
+      ring.drain(&sink, 100);
+      monotonic = monotonic && ring.getCompletedFence() >= lastFence;
+      lastFence = ring.getCompletedFence();
+    }
+
+    bool ordered = std::is_sorted(sink.frames.begin(), sink.frames.end()) &&
+                   std::adjacent_find(sink.frames.begin(), sink.frames.end()) == sink.frames.end();
+    bool skipped = std::find(sink.frames.begin(), sink.frames.end(), 13) == sink.frames.end();
+    if (!monotonic || !ordered || !skipped || sink.frames.size() != expected || ring.getDropped() != 0) {
+      printf("[EncodeRing] Fences or frames wrong across slot reuse (%zd of %u frames, last fence %llu)\n",
+             sink.frames.size(), expected, (unsigned long long)lastFence);
+      ok = false;
+    }
+  }
+
+  printf("[EncodeRing] Ring checks %s\n", ok ? "passed" : "FAILED");
+  return ok;
+}
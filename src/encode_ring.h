@@ -0,0 +1,117 @@
+#ifndef _ENCODE_RING_H_
+#define _ENCODE_RING_H_
+
+#include <stdint.h>
+#include <condition_variable>
+#include <mutex>
+#include <vector>
+
+#include "encoded_slice.h"
+
+/// Everything the drain side needs to know about a submitted frame.
+struct EncodeJob {
+  uint32_t streamId = 0;
+  uint32_t frameIndex = 0;
+  uint64_t captureTimeUs = 0;
+  /// Increases by one with every submitted frame, assigned by the ring.
+  uint64_t fence = 0;
+};
+
+/// The actual encoder behind the ring. `slot` identifies the input surface (and
+/// the matching output buffer) of the encoder.
+class EncodeBackend {
+  public:
+    virtual ~EncodeBackend() {}
+
+    /// Starts encoding the input surface of `slot`, must not wait for the result.
+    virtual bool submitEncode(int slot, const EncodeJob& job) = 0;
+    /// Waits for `slot` to finish and hands its slices to `sink`. Returns the amount of bytes.
+    virtual size_t collectEncode(int slot, const EncodeJob& job, SliceSink* sink) = 0;
+};
+
+/// Ring of encoder input surfaces shared between a capture thread and a drain thread.
+///
+/// The capture thread acquires a free slot, copies the frame into it and submits it,
+/// while the drain thread collects the slots in submission order. Frame n+1 can
+/// therefore be captured while frame n is still being encoded. If all slots are busy
+/// the capture side drops the frame instead of waiting.
+class EncodeRing {
+  private:
+    enum class SlotState { Free, Capturing, Encoding };
+
+    struct Slot {
+      SlotState state = SlotState::Free;
+      EncodeJob job;
+    };
+
+    std::vector<Slot> slots;
+    EncodeBackend* pBackend = nullptr;
+
+    /// Next slot handed to the capture side.
+    size_t head = 0;
+    /// Oldest slot that is still encoding.
+    size_t tail = 0;
+    uint64_t nextFence = 1;
+    uint64_t completedFence = 0;
+    bool stopped = false;
+
+    std::mutex lock;
+    std::condition_variable submitted;
+
+    /// Stats.
+    uint64_t statsDropped = 0;
+
+  public:
+    bool initialize(size_t slotCount, EncodeBackend* backend);
+    /// Wakes up a waiting drain call, used on shutdown.
+    void stop();
+
+    /// Returns the slot the next frame should be copied into or -1 if all slots are busy.
+    int acquireSlot();
+    /// Gives back a slot that was acquired but not submitted.
+    void cancelSlot(int slot);
+    /// Submits the frame copied into `slot` to the backend.
+    bool submit(int slot, const EncodeJob& job);
+
+    /// Collects the oldest submitted frame, waiting up to `timeoutMs` for one to be submitted.
+    /// Returns false if there was nothing to collect.
+    bool drain(SliceSink* sink, uint32_t timeoutMs, size_t* bytes = nullptr);
+
+    size_t inFlight();
+    uint64_t getCompletedFence();
+    uint64_t getDropped();
+
+  private:
+    /// Frees `slot`, or passes it on as an empty encode if later slots are already in use.
+    void cancelSlotLocked(int slot);
+};
+
+/// Stand-in for the hardware encoder. A submitted slot completes `latencyUs` after its
+/// submit (per slot, so later slots can finish first) and yields one slice per frame.
+class MockEncodeBackend : public EncodeBackend {
+  private:
+    std::mutex lock;
+    std::vector<uint32_t> latencyUs;
+    std::vector<uint64_t> readyUs;
+    /// Fails the next submit once.
+    bool failNext = false;
+    /// Every submit as (ready time, slot).
+    std::vector<std::pair<uint64_t, int>> submits;
+
+  public:
+    MockEncodeBackend(size_t slotCount, uint32_t latencyUs);
+
+    void setLatency(int slot, uint32_t latencyUs);
+    void failNextSubmit();
+    /// Slots in the order the mock finishes them.
+    std::vector<int> getFinishOrder();
+
+    bool submitEncode(int slot, const EncodeJob& job) override;
+    size_t collectEncode(int slot, const EncodeJob& job, SliceSink* sink) override;
+};
+
+/// Runs the ring against the mock encoder: slot exhaustion and drop counting, completion
+/// out of order, fences across slot reuse and cancelled slots. Returns false if a check failed.
+bool verifyEncodeRing();
+
+#endif
@@ -0,0 +1,46 @@
+#ifndef _ENCODED_SLICE_H_
+#define _ENCODED_SLICE_H_
+
+#include <stdint.h>
+#include <chrono>
+#include <memory>
+#include <vector>
+
+/// Immutable bytes of an encoded slice. Shared so that every consumer can keep the
+/// slice around without copying it.
+typedef std::shared_ptr<const std::vector<uint8_t>> SlicePayload;
+
+/// A single slice of an encoded frame, handed out as soon as the encoder wrote it.
+struct EncodedSlice {
+  /// Stream (capture source) the slice belongs to.
+  uint32_t streamId = 0;
+  /// Frame counter of the source that produced the slice.
+  uint32_t frameIndex = 0;
+  /// Position of the slice within its frame.
+  uint32_t sliceIndex = 0;
+  /// Set on the last slice of a frame.
+  bool lastInFrame = false;
+  /// Set on every slice of an IDR frame, decoding can start at its first slice.
+  bool keyFrame = false;
+  /// Time the frame was captured (steady clock, microseconds).
+  uint64_t captureTimeUs = 0;
+  /// Annex-B bytes of the slice (start codes included).
+  SlicePayload payload;
+};
+
+/// Anything that wants encoded slices the moment they leave the encoder.
+class SliceSink {
+  public:
+    virtual ~SliceSink() {}
+
+    virtual void onSlice(const EncodedSlice& slice) = 0;
+};
+
+/// Current steady clock time in microseconds.
+inline uint64_t nowMicros() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()
+  ).count();
+}
+
+#endif
@@ -0,0 +1,187 @@
+#include <cstdio>
+#include <algorithm>
+
+#include "frame_damage.h"
+
+const int8_t DamageTracker::DIRTY_QP_DELTA;
+const int8_t DamageTracker::MOVED_QP_DELTA;
+const int8_t DamageTracker::KEEP_ALIVE_QP_DELTA;
+
+void DamageTracker::initialize(const DamageRect& region, uint32_t refineFrames, uint32_t keepAliveInterval) {
+  this->region = region;
+  this->refineFrames = refineFrames;
+  this->keepAliveInterval = keepAliveInterval;
+
+  mbWidth = (uint32_t)(region.right - region.left + 15) / 16;
+  mbHeight = (uint32_t)(region.bottom - region.top + 15) / 16;
+  qpDeltaMap.assign(mbWidth * mbHeight, 0);
+
+  // The very first frame always has to be encoded.
+  framesSinceChange = 0;
+  staticFrames = 0;
+  damageLost = false;
+}
+
+uint32_t DamageTracker::markRect(const DamageRect& rect, int8_t delta) {
+  // Clip to the captured region and translate into region coordinates.
+  int32_t left = std::max(rect.left, region.left) - region.left;
+  int32_t top = std::max(rect.top, region.top) - region.top;
+  int32_t right = std::min(rect.right, region.right) - region.left;
+  int32_t bottom = std::min(rect.bottom, region.bottom) - region.top;
+  if (right <= left || bottom <= top) {
+    return 0;
+  }
+
+  uint32_t marked = 0;
+  for (uint32_t y = top / 16; y < (uint32_t)(bottom + 15) / 16; y++) {
+    for (uint32_t x = left / 16; x < (uint32_t)(right + 15) / 16; x++) {
+      // Dirty wins over moved if both touch the same macroblock.
+      int8_t& value = qpDeltaMap[y * mbWidth + x];
+      value = std::min(value, delta);
+      marked++;
+    }
+  }
+
+  return marked;
+}
+
+EncodeDecision DamageTracker::evaluate(const FrameDamage& damage) {
+  std::fill(qpDeltaMap.begin(), qpDeltaMap.end(), 0);
+  dirtyMacroblocks = 0;
+
+  if (damage.full || damageLost) {
+    damageLost = false;
+    std::fill(qpDeltaMap.begin(), qpDeltaMap.end(), DIRTY_QP_DELTA);
+    dirtyMacroblocks = getMacroblockCount();
+  } else {
+    for (auto& move : damage.moves) {
+      dirtyMacroblocks += markRect(move.destination, MOVED_QP_DELTA);
+    }
+    for (auto& rect : damage.dirty) {
+      dirtyMacroblocks += markRect(rect, DIRTY_QP_DELTA);
+    }
+    dirtyMacroblocks = std::min(dirtyMacroblocks, getMacroblockCount());
+  }
+
+  if (dirtyMacroblocks > 0) {
+    framesSinceChange = 0;
+    staticFrames = 0;
+    return EncodeDecision::Encode;
+  }
+
+  // Give the encoder a few frames to bring the last change up to full quality.
+  if (framesSinceChange < refineFrames) {
+    framesSinceChange++;
+    return EncodeDecision::Encode;
+  }
+
+  staticFrames++;
+  if (keepAliveInterval > 0 && staticFrames % keepAliveInterval == 0) {
+    std::fill(qpDeltaMap.begin(), qpDeltaMap.end(), KEEP_ALIVE_QP_DELTA);
+    return EncodeDecision::KeepAlive;
+  }
+
+  return EncodeDecision::Skip;
+}
+
+static FrameDamage dirty_damage(const DamageRect& rect) {
+  FrameDamage damage;
+  damage.dirty.push_back(rect);
+  return damage;
+}
+
+static int8_t qp_at(const DamageTracker& tracker, uint32_t mbWidth, uint32_t x, uint32_t y) {
+  return tracker.getQpDeltaMap()[y * mbWidth + x];
+}
+
+bool verifyFrameDamage() {
+  bool ok = true;
+  FrameDamage none;
+
+  // A 256x128 crop at 1000,500 of a larger output: 16x8 macroblocks.
+  DamageRect region = { 1000, 500, 1256, 628 };
+  const uint32_t mbWidth = 16;
+  DamageTracker tracker;
+  tracker.initialize(region, 2, 0);
+
+  // Damage outside the crop is ignored, damage across its edge is clipped to it.
+  DamageRect outside = { 0, 0, 900, 400 };
+  DamageRect acrossCorner = { 990, 490, 1020, 516 };
+  tracker.evaluate(dirty_damage(outside));
+  uint32_t outsideMarked = tracker.getDirtyMacroblocks();
+  tracker.evaluate(dirty_damage(acrossCorner));
+  if (outsideMarked != 0 || tracker.getDirtyMacroblocks() != 2 ||
+      qp_at(tracker, mbWidth, 0, 0) != DamageTracker::DIRTY_QP_DELTA ||
+      qp_at(tracker, mbWidth, 1, 0) != DamageTracker::DIRTY_QP_DELTA ||
+      qp_at(tracker, mbWidth, 2, 0) != 0 || qp_at(tracker, mbWidth, 0, 1) != 0) {
+    printf("[Damage] Rects were not clipped to the region (outside %u, corner %u)\n",
+           outsideMarked, tracker.getDirtyMacroblocks());
+    ok = false;
+  }
+
+  // Dirty wins over moved where both touch a macroblock.
+  FrameDamage mixed;
+  MoveRect move = { 1000, 500, { 1000, 500, 1064, 516 } };
+  mixed.moves.push_back(move);
+  mixed.dirty.push_back({ 1032, 500, 1048, 516 });
+  tracker.evaluate(mixed);
+  if (qp_at(tracker, mbWidth, 0, 0) != DamageTracker::MOVED_QP_DELTA ||
+      qp_at(tracker, mbWidth, 2, 0) != DamageTracker::DIRTY_QP_DELTA ||
+      qp_at(tracker, mbWidth, 3, 0) != DamageTracker::MOVED_QP_DELTA) {
+    printf("[Damage] Moved macroblock overrode a dirty one\n");
+    ok = false;
+  }
+
+  // After a change exactly `refineFrames` static frames are encoded, then nothing.
+  tracker.initialize(region, 2, 0);
+  tracker.evaluate(dirty_damage({ 1000, 500, 1016, 516 }));
+  EncodeDecision refine1 = tracker.evaluate(none);
+  EncodeDecision refine2 = tracker.evaluate(none);
+  bool skipped = true;
+  for (int i = 0; i < 100; i++) {
+    skipped = skipped && tracker.evaluate(none) == EncodeDecision::Skip;
+  }
+  if (refine1 != EncodeDecision::Encode || refine2 != EncodeDecision::Encode || !skipped) {
+    printf("[Damage] Static frames after a change were not refined twice and then skipped\n");
+    ok = false;
+  }
+
+  // A keep alive frame every 10th static frame after the refine frames, with the coarse map.
+  tracker.initialize(region, 1, 10);
+  tracker.evaluate(dirty_damage({ 1000, 500, 1016, 516 }));
+  tracker.evaluate(none);
+  std::vector<int> keepAlives;
+  bool coarse = true;
+  for (int i = 1; i <= 35; i++) {
+    if (tracker.evaluate(none) == EncodeDecision::KeepAlive) {
+      keepAlives.push_back(i);
+      coarse = coarse && qp_at(tracker, mbWidth, 5, 5) == DamageTracker::KEEP_ALIVE_QP_DELTA;
+    }
+  }
+  if (keepAlives != std::vector<int>({ 10, 20, 30 }) || !coarse) {
+    printf("[Damage] Keep alive frames at the wrong interval (%zd of 3)\n", keepAlives.size());
+    ok = false;
+  }
+
+  // New damage restarts refining and the keep alive count.
+  tracker.evaluate(dirty_damage({ 1100, 550, 1120, 560 }));
+  EncodeDecision afterChange = tracker.evaluate(none);
+  EncodeDecision firstStatic = tracker.evaluate(none);
+  if (afterChange != EncodeDecision::Encode || firstStatic != EncodeDecision::Skip) {
+    printf("[Damage] A change did not restart refining\n");
+    ok = false;
+  }
+
+  // A dropped frame takes its damage with it, the next frame has to be encoded in full.
+  tracker.evaluate(dirty_damage({ 1000, 500, 1016, 516 }));
+  tracker.dropFrame();
+  EncodeDecision afterDrop = tracker.evaluate(none);
+  if (afterDrop != EncodeDecision::Encode || tracker.getDirtyMacroblocks() != tracker.getMacroblockCount()) {
+    printf("[Damage] A dropped frame did not force a full encode (%u of %u dirty)\n",
+      tracker.getDirtyMacroblocks(), tracker.getMacroblockCount());
+    ok = false;
+  }
+
+  printf("[Damage] Damage checks %s\n", ok ? "passed" : "FAILED");
+  return ok;
+}
@@ -0,0 +1,95 @@
+#ifndef _FRAME_DAMAGE_H_
+#define _FRAME_DAMAGE_H_
+
+#include <stdint.h>
+#include <vector>
+
+/// Rectangle in output coordinates, right and bottom are exclusive.
+struct DamageRect {
+  int32_t left;
+  int32_t top;
+  int32_t right;
+  int32_t bottom;
+};
+
+/// Content that was moved (scrolling, window drag) from `sourceX`/`sourceY` to `destination`.
+struct MoveRect {
+  int32_t sourceX;
+  int32_t sourceY;
+  DamageRect destination;
+};
+
+/// What changed on the output since the previous frame.
+struct FrameDamage {
+  std::vector<DamageRect> dirty;
+  std::vector<MoveRect> moves;
+  /// Set when the capture API could not tell what changed.
+  bool full = false;
+
+  void clear() { dirty.clear(); moves.clear(); full = false; }
+};
+
+enum class EncodeDecision {
+  /// Nothing changed, do not send anything.
+  Skip,
+  /// Nothing changed but clients should get a (tiny) frame to stay in sync.
+  KeepAlive,
+  /// Encode the frame, the QP delta map tells the encoder where to spend bits.
+  Encode,
+};
+
+/// Turns the damage of a frame into an encode decision and a per macroblock QP
+/// delta map for the captured region.
+class DamageTracker {
+  private:
+    /// Captured region in output coordinates.
+    DamageRect region = { 0, 0, 0, 0 };
+    uint32_t mbWidth = 0;
+    uint32_t mbHeight = 0;
+
+    /// Frames still encoded after the last change so the encoder can refine the image.
+    uint32_t refineFrames = 2;
+    /// Static frames between two keep alive frames, 0 disables keep alive frames.
+    uint32_t keepAliveInterval = 0;
+
+    uint32_t framesSinceChange = 0;
+    uint32_t staticFrames = 0;
+    uint32_t dirtyMacroblocks = 0;
+    /// The last evaluated frame was never encoded, its damage is lost.
+    bool damageLost = false;
+
+    /// One QP delta per macroblock, row major.
+    std::vector<int8_t> qpDeltaMap;
+
+  public:
+    /// QP delta for macroblocks that changed, negative means better quality.
+    static const int8_t DIRTY_QP_DELTA = -3;
+    /// QP delta for macroblocks that were only moved around.
+    static const int8_t MOVED_QP_DELTA = 0;
+    /// QP delta for all macroblocks of a keep alive frame. Only coarsens quantization so
+    /// whatever residual the encoder still codes is cheap, it does not force skip blocks.
+    static const int8_t KEEP_ALIVE_QP_DELTA = 51;
+
+    void initialize(const DamageRect& region, uint32_t refineFrames, uint32_t keepAliveInterval);
+
+    EncodeDecision evaluate(const FrameDamage& damage);
+    /// Tells the tracker the last evaluated frame was not encoded (no free slot, failed
+    /// submit). The next frame is encoded in full since its damage only covers the changes
+    /// after the dropped one.
+    void dropFrame() { damageLost = true; }
+
+    const std::vector<int8_t>& getQpDeltaMap() const { return qpDeltaMap; }
+    uint32_t getDirtyMacroblocks() const { return dirtyMacroblocks; }
+    uint32_t getMacroblockCount() const { return mbWidth * mbHeight; }
+
+  private:
+    /// Marks all macroblocks touched by `rect` with `delta`, returns the amount touched.
+    uint32_t markRect(const DamageRect& rect, int8_t delta);
+};
+
+/// Feeds synthetic rect lists through a DamageTracker: clipping to a cropped region, dirty
+/// over moved QP, refine frames, keep alive interval and skipping static frames. Returns
+/// false if a check failed.
+bool verifyFrameDamage();
+
+#endif
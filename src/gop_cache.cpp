@@ -0,0 +1,42 @@
+#include "gop_cache.h"
+
+void GopCache::push(const EncodedSlice& slice) {
+  if (slice.keyFrame && slice.sliceIndex == 0) {
+    clear();
+    valid = true;
+  }
+
+  if (!valid) {
+    return;
+  }
+
+  bytes += slice.payload->size();
+  if (bytes > maxBytes) {
+    // Replaying half a GOP would be useless, wait for the next IDR.
+    clear();
+    return;
+  }
+
+  slices.push_back(slice);
+  if (slice.sliceIndex == 0) {
+    frames++;
+  }
+}
+
+bool GopCache::replay(SliceSink* sink) const {
+  if (!valid || slices.empty()) {
+    return false;
+  }
+
+  for (auto& slice : slices) {
+    sink->onSlice(slice);
+  }
+  return true;
+}
+
+void GopCache::clear() {
+  slices.clear();
+  bytes = 0;
+  frames = 0;
+  valid = false;
+}
@@ -0,0 +1,40 @@
+#ifndef _GOP_CACHE_H_
+#define _GOP_CACHE_H_
+
+#include <vector>
+
+#include "encoded_slice.h"
+
+/// Keeps the slices of the current GOP (last IDR with its parameter sets and every
+/// frame after it) so that a new subscriber can start decoding right away instead
+/// of waiting for the next IDR.
+///
+/// Slices share their payload with everyone else, the cache only holds references.
+class GopCache {
+  private:
+    std::vector<EncodedSlice> slices;
+    size_t bytes = 0;
+    size_t frames = 0;
+    /// Upper bound of cached bytes, a GOP growing past it is dropped until the next IDR.
+    size_t maxBytes;
+    /// Set while `slices` starts at an IDR and is complete.
+    bool valid = false;
+
+  public:
+    explicit GopCache(size_t maxBytes = 16 * 1024 * 1024) : maxBytes(maxBytes) {}
+
+    /// Adds the next slice of the stream, an IDR starts a new GOP.
+    void push(const EncodedSlice& slice);
+    /// Hands all cached slices to `sink` in order. Returns false if there was no GOP to replay.
+    bool replay(SliceSink* sink) const;
+    void clear();
+
+    bool isValid() const { return valid; }
+    size_t getSliceCount() const { return slices.size(); }
+    size_t getFrameCount() const { return frames; }
+    /// Whether the last cached slice ends a frame.
+    bool isFrameComplete() const { return !slices.empty() && slices.back().lastInFrame; }
+    size_t getBytes() const { return bytes; }
+};
+
+#endif
@@ -0,0 +1,344 @@
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <random>
+
+#include "input_protocol.h"
+
+static void write_u16(std::vector<uint8_t>& out, uint32_t value) {
+  out.push_back((uint8_t)(value >> 8));
+  out.push_back((uint8_t)value);
+}
+
+static void write_u32(std::vector<uint8_t>& out, uint32_t value) {
+  out.push_back((uint8_t)(value >> 24));
+  out.push_back((uint8_t)(value >> 16));
+  out.push_back((uint8_t)(value >> 8));
+  out.push_back((uint8_t)value);
+}
+
+static void write_u64(std::vector<uint8_t>& out, uint64_t value) {
+  write_u32(out, (uint32_t)(value >> 32));
+  write_u32(out, (uint32_t)value);
+}
+
+static uint32_t read_u16(const uint8_t* data) {
+  return ((uint32_t)data[0] << 8) | data[1];
+}
+
+static uint32_t read_u32(const uint8_t* data) {
+  return ((uint32_t)data[0] << 24) | ((uint32_t)data[1] << 16) | ((uint32_t)data[2] << 8) | data[3];
+}
+
+static uint64_t read_u64(const uint8_t* data) {
+  return ((uint64_t)read_u32(data) << 32) | read_u32(data + 4);
+}
+
+void InputBatcher::push(const InputEvent& event) {
+  statsEvents++;
+
+  // Only the newest position matters, the age of the oldest move is kept for the latency.
+  if (!events.empty() && events.back().type == event.type) {
+    InputEvent& last = events.back();
+    if (event.type == InputEventType::MouseMove) {
+      last.x = event.x;
+      last.y = event.y;
+      statsCoalesced++;
+      return;
+    }
+    if (event.type == InputEventType::MouseWheel) {
+      last.x += event.x;
+      last.y += event.y;
+      statsCoalesced++;
+      return;
+    }
+  }
+
+  events.push_back(event);
+}
+
+uint32_t InputBatcher::flush(uint64_t nowUs, std::vector<uint8_t>& out) {
+  if (events.empty()) {
+    return 0;
+  }
+
+  size_t count = std::min<size_t>(events.size(), INPUT_MAX_BATCH_EVENTS);
+  uint32_t sequence = nextSequence++;
+
+  out.push_back((uint8_t)InputMessage::Batch);
+  write_u32(out, (uint32_t)(INPUT_BATCH_HEADER_LEN + count * INPUT_EVENT_LEN));
+  write_u32(out, sequence);
+  write_u64(out, nowUs);
+  write_u16(out, (uint32_t)count);
+
+  for (size_t i = 0; i < count; i++) {
+    const InputEvent& event = events[i];
+    uint64_t age = nowUs > event.timeUs ? nowUs - event.timeUs : 0;
+    out.push_back((uint8_t)event.type);
+    out.push_back(event.pressed ? 1 : 0);
+    write_u32(out, (uint32_t)event.x);
+    write_u32(out, (uint32_t)event.y);
+    write_u32(out, event.code);
+    write_u32(out, (uint32_t)std::min<uint64_t>(age, UINT32_MAX));
+  }
+
+  events.erase(events.begin(), events.begin() + count);
+  statsBatches++;
+  return sequence;
+}
+
+void encodeInputAck(const InputAck& ack, std::vector<uint8_t>& out) {
+  out.push_back((uint8_t)InputMessage::Ack);
+  write_u32(out, INPUT_ACK_LEN);
+  write_u32(out, ack.sequence);
+  write_u64(out, ack.sendTimeUs);
+  write_u32(out, ack.queuedUs);
+  write_u32(out, ack.injectUs);
+  write_u32(out, ack.captureUs);
+  write_u32(out, ack.sendUs);
+}
+
+void InputReader::push(const uint8_t* data, size_t len) {
+  if (broken) {
+    return;
+  }
+
+  // Drop what was already read before growing the buffer.
+  if (offset > 0) {
+    buffer.erase(buffer.begin(), buffer.begin() + offset);
+    offset = 0;
+  }
+  buffer.insert(buffer.end(), data, data + len);
+}
+
+bool InputReader::next(InputMessage* type, InputBatch* batch, InputAck* ack) {
+  while (!broken && buffer.size() - offset >= INPUT_HEADER_LEN) {
+    const uint8_t* header = &buffer[offset];
+    size_t len = read_u32(header + 1);
+    if (len > INPUT_BATCH_HEADER_LEN + INPUT_MAX_BATCH_EVENTS * INPUT_EVENT_LEN) {
+      // No way to find the next message after a bad length.
+      printf("[Input] Message of %zd bytes, dropping the input stream\n", len);
+      statsErrors++;
+      broken = true;
+      buffer.clear();
+      offset = 0;
+      return false;
+    }
+
+    if (buffer.size() - offset - INPUT_HEADER_LEN < len) {
+      return false;
+    }
+
+    const uint8_t* payload = header + INPUT_HEADER_LEN;
+    offset += INPUT_HEADER_LEN + len;
+    *type = (InputMessage)header[0];
+
+    if (*type == InputMessage::Batch && len >= INPUT_BATCH_HEADER_LEN) {
+      size_t count = read_u16(payload + 12);
+      if (len < INPUT_BATCH_HEADER_LEN + count * INPUT_EVENT_LEN) {
+        statsErrors++;
+        continue;
+      }
+
+      batch->sequence = read_u32(payload);
+      batch->sendTimeUs = read_u64(payload + 4);
+      batch->events.resize(count);
+      const uint8_t* data = payload + INPUT_BATCH_HEADER_LEN;
+      for (size_t i = 0; i < count; i++, data += INPUT_EVENT_LEN) {
+        InputEvent& event = batch->events[i];
+        event.type = (InputEventType)data[0];
+        event.pressed = data[1] != 0;
+        event.x = (int32_t)read_u32(data + 2);
+        event.y = (int32_t)read_u32(data + 6);
+        event.code = read_u32(data + 10);
+        event.timeUs = batch->sendTimeUs - read_u32(data + 14);
+      }
+      return true;
+    }
+
+    if (*type == InputMessage::Ack && len >= INPUT_ACK_LEN) {
+      ack->sequence = read_u32(payload);
+      ack->sendTimeUs = read_u64(payload + 4);
+      ack->queuedUs = read_u32(payload + 12);
+      ack->injectUs = read_u32(payload + 16);
+      ack->captureUs = read_u32(payload + 20);
+      ack->sendUs = read_u32(payload + 24);
+      return true;
+    }
+
+    // Too short or unknown, newer clients may send more.
+    if (*type == InputMessage::Batch || *type == InputMessage::Ack) {
+      statsErrors++;
+    }
+  }
+
+  return false;
+}
+
+void InputReader::reset() {
+  buffer.clear();
+  offset = 0;
+  broken = false;
+}
+
+static void print_event(const InputEvent& event) {
+  switch (event.type) {
+    case InputEventType::MouseMove:
+      printf("[Input] Mouse move to %d,%d\n", event.x, event.y);
+      break;
+    case InputEventType::MouseButton:
+      printf("[Input] Mouse button %u %s\n", event.code, event.pressed ? "down" : "up");
+      break;
+    case InputEventType::MouseWheel:
+      printf("[Input] Mouse wheel %d,%d\n", event.x, event.y);
+      break;
+    case InputEventType::Key:
+      printf("[Input] Key %u %s\n", event.code, event.pressed ? "down" : "up");
+      break;
+  }
+}
+
+void InputRecorder::onInputEvent(const InputEvent& event) {
+  events.push_back(event);
+
+  if (verbose) {
+    print_event(event);
+  }
+}
+
+void InputCounter::onInputEvent(const InputEvent& event) {
+  statsEvents++;
+  if (event.type == InputEventType::MouseMove) {
+    statsMoves++;
+  }
+
+  if (verbose) {
+    print_event(event);
+  }
+}
+
+void InputCounter::debugSession() {
+  printf("\n\n---------------------------------------------\n");
+  printf("Input stats:\n");
+  printf("  Received: %lld events (%lld mouse moves)\n", statsEvents, statsMoves);
+  printf("---------------------------------------------\n");
+
+  statsEvents = 0;
+  statsMoves = 0;
+}
+
+static InputEvent make_event(InputEventType type, int32_t x, int32_t y, uint32_t code, bool pressed, uint64_t timeUs) {
+  InputEvent event;
+  event.type = type;
+  event.x = x;
+  event.y = y;
+  event.code = code;
+  event.pressed = pressed;
+  event.timeUs = timeUs;
+  return event;
+}
+
+bool verifyInputProtocol() {
+  bool ok = true;
+  std::mt19937 random(4321);
+
+  InputBatcher batcher;
+  InputReader reader;
+  InputRecorder recorder;
+  uint64_t now = 1000000;
+
+  // Drag: moves around a press and a release, only the last move before each survives.
+  for (int i = 0; i < 30; i++) {
+    batcher.push(make_event(InputEventType::MouseMove, 10 + i, 20 + i, 0, false, now + i * 100));
+  }
+  batcher.push(make_event(InputEventType::MouseButton, 0, 0, 0, true, now + 3000));
+  for (int i = 0; i < 30; i++) {
+    batcher.push(make_event(InputEventType::MouseMove, 100 + i, 200, 0, false, now + 3100 + i * 100));
+  }
+  batcher.push(make_event(InputEventType::MouseButton, 0, 0, 0, false, now + 6100));
+  batcher.push(make_event(InputEventType::MouseWheel, 0, 120, 0, false, now + 6200));
+  batcher.push(make_event(InputEventType::MouseWheel, 0, 120, 0, false, now + 6300));
+  batcher.push(make_event(InputEventType::Key, 0, 0, 30, true, now + 6400));
+  batcher.push(make_event(InputEventType::Key, 0, 0, 30, false, now + 6500));
+
+  std::vector<uint8_t> wire;
+  uint32_t first = batcher.flush(now + 7000, wire);
+
+  // Second batch, the sequence number has to go up by one.
+  batcher.push(make_event(InputEventType::MouseMove, 5, 6, 0, false, now + 8000));
+  uint32_t second = batcher.flush(now + 8500, wire);
+  if (batcher.flush(now + 9000, wire) != 0 || second != first + 1) {
+    printf("[Input] Sequence numbers %u, %u or an empty batch was sent\n", first, second);
+    ok = false;
+  }
+
+  size_t offset = 0;
+  uint32_t lastSequence = 0;
+  uint32_t batches = 0;
+  while (offset < wire.size()) {
+    size_t piece = std::min<size_t>(wire.size() - offset, 1 + random() % 30);
+    reader.push(wire.data() + offset, piece);
+    offset += piece;
+
+    InputMessage type;
+    InputBatch batch;
+    InputAck ack;
+    while (reader.next(&type, &batch, &ack)) {
+      if (type != InputMessage::Batch || (lastSequence != 0 && batch.sequence != lastSequence + 1)) {
+        printf("[Input] Unexpected message or sequence %u after %u\n", batch.sequence, lastSequence);
+        ok = false;
+      }
+      lastSequence = batch.sequence;
+      batches++;
+      for (auto& event : batch.events) {
+        recorder.onInputEvent(event);
+      }
+    }
+  }
+
+  const std::vector<InputEvent>& events = recorder.getEvents();
+  const InputEventType expected[] = {
+    InputEventType::MouseMove, InputEventType::MouseButton, InputEventType::MouseMove,
+    InputEventType::MouseButton, InputEventType::MouseWheel, InputEventType::Key,
+    InputEventType::Key, InputEventType::MouseMove
+  };
+  bool sameOrder = events.size() == sizeof(expected) / sizeof(expected[0]);
+  for (size_t i = 0; sameOrder && i < events.size(); i++) {
+    sameOrder = events[i].type == expected[i];
+  }
+  if (batches != 2 || !sameOrder) {
+    printf("[Input] Got %u batches with %zd events, expected 2 with 8\n", batches, events.size());
+    ok = false;
+  } else if (events[0].x != 39 || events[0].timeUs != now || events[2].x != 129 || events[3].pressed ||
+             events[4].y != 240 || events[5].code != 30 || events[7].timeUs != now + 8000) {
+    printf("[Input] Coalesced events have the wrong position, time or code\n");
+    ok = false;
+  }
+
+  // Latency split: the client clock only sees its own timestamps, the server reports durations.
+  InputAck ack;
+  ack.sequence = second;
+  ack.sendTimeUs = now + 8500;
+  ack.queuedUs = 500;
+  ack.injectUs = 200;
+  ack.captureUs = 9000;
+  ack.sendUs = 4000;
+  std::vector<uint8_t> ackWire;
+  encodeInputAck(ack, ackWire);
+  InputReader ackReader;
+  ackReader.push(ackWire.data(), ackWire.size());
+  InputMessage type;
+  InputBatch unused;
+  InputAck received;
+  if (!ackReader.next(&type, &unused, &received) || type != InputMessage::Ack ||
+      received.sequence != second || received.sendTimeUs != now + 8500 || received.captureUs != 9000) {
+    printf("[Input] Ack did not survive the round trip\n");
+    ok = false;
+  }
+
+  printf("[Input] %llu events in %llu batches (%llu coalesced), %zd bytes\n",
+         (unsigned long long)batcher.getEvents(), (unsigned long long)batcher.getBatches(),
+         (unsigned long long)batcher.getCoalesced(), wire.size());
+  printf("[Input] Protocol checks %s\n", ok ? "passed" : "FAILED");
+  return ok;
+}
@@ -0,0 +1,170 @@
+#ifndef _INPUT_PROTOCOL_H_
+#define _INPUT_PROTOCOL_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+/// Every input message starts with its type (1 byte) and the payload length (4 bytes).
+#define INPUT_HEADER_LEN 5
+/// Sequence number, send time and event count in front of the events.
+#define INPUT_BATCH_HEADER_LEN 14
+/// Type, pressed flag, x, y, code and the age of the event at send time.
+#define INPUT_EVENT_LEN 18
+/// Sequence number, echoed send time, client queue time and the three server hops.
+#define INPUT_ACK_LEN 28
+/// Events a batch carries at most, the rest goes with the next one.
+#define INPUT_MAX_BATCH_EVENTS 256
+
+enum class InputMessage : uint8_t {
+  /// Events of the client, client to server.
+  Batch = 1,
+  /// Timing of the first frame captured after a batch was injected, server to client.
+  Ack = 2,
+};
+
+enum class InputEventType : uint8_t {
+  /// Absolute position in pixels of the stream.
+  MouseMove = 1,
+  /// Button `code` (0 left, 1 right, 2 middle) pressed or released.
+  MouseButton = 2,
+  /// Wheel turned by x/y in 1/120 of a notch.
+  MouseWheel = 3,
+  /// Key `code` (Linux evdev key code) pressed or released.
+  Key = 4,
+};
+
+struct InputEvent {
+  InputEventType type = InputEventType::MouseMove;
+  int32_t x = 0;
+  int32_t y = 0;
+  uint32_t code = 0;
+  bool pressed = false;
+  /// Client clock when the event happened.
+  uint64_t timeUs = 0;
+};
+
+struct InputBatch {
+  uint32_t sequence = 0;
+  /// Client clock when the batch was sent.
+  uint64_t sendTimeUs = 0;
+  std::vector<InputEvent> events;
+};
+
+/// Timestamps of one batch along the way, the server parts are durations so the client
+/// can put them next to its own clock.
+struct InputAck {
+  uint32_t sequence = 0;
+  /// Echoed from the batch.
+  uint64_t sendTimeUs = 0;
+  /// Oldest event of the batch until it was sent.
+  uint32_t queuedUs = 0;
+  /// Arrival at the server until the events were injected.
+  uint32_t injectUs = 0;
+  /// Injection until the next frame was captured.
+  uint32_t captureUs = 0;
+  /// Capture until the first slice of that frame was with quiche.
+  uint32_t sendUs = 0;
+};
+
+/// Client side: collects events between two sends.
+///
+/// A mouse move right after another mouse move replaces it, the same goes for wheel
+/// turns which add up. Anything else keeps its place, so a click always happens at the
+/// position it was made at.
+class InputBatcher {
+  private:
+    std::vector<InputEvent> events;
+    uint32_t nextSequence = 1;
+    /// Debug stats.
+    uint64_t statsEvents = 0;
+    uint64_t statsCoalesced = 0;
+    uint64_t statsBatches = 0;
+
+  public:
+    void push(const InputEvent& event);
+    bool empty() const { return events.empty(); }
+
+    /// Appends the queued events as one batch message to `out` (at most
+    /// INPUT_MAX_BATCH_EVENTS, the rest stays queued). Returns the sequence number of the
+    /// batch, 0 if nothing was queued.
+    uint32_t flush(uint64_t nowUs, std::vector<uint8_t>& out);
+
+    uint64_t getEvents() const { return statsEvents; }
+    uint64_t getCoalesced() const { return statsCoalesced; }
+    uint64_t getBatches() const { return statsBatches; }
+};
+
+/// Appends an ack message to `out`.
+void encodeInputAck(const InputAck& ack, std::vector<uint8_t>& out);
+
+/// Splits the input stream into messages, both ends use it.
+class InputReader {
+  private:
+    /// Bytes of an incomplete message.
+    std::vector<uint8_t> buffer;
+    size_t offset = 0;
+    /// Set after a broken message length, nothing is read until reset().
+    bool broken = false;
+    uint64_t statsErrors = 0;
+
+  public:
+    /// Feeds received bytes, messages may be cut anywhere.
+    void push(const uint8_t* data, size_t len);
+    /// Takes the next complete message, returns false if there is none yet. Only the
+    /// output matching `*type` is filled, unknown messages are skipped.
+    bool next(InputMessage* type, InputBatch* batch, InputAck* ack);
+    void reset();
+
+    uint64_t getErrors() const { return statsErrors; }
+};
+
+/// Receives the events of a client on the server, e.g. to inject them into the desktop.
+class InputSink {
+  public:
+    virtual ~InputSink() {}
+
+    virtual void onInputEvent(const InputEvent& event) = 0;
+};
+
+/// Keeps the received events instead of injecting them, for platforms without an injector
+/// and for checking the channel.
+class InputRecorder : public InputSink {
+  private:
+    std::vector<InputEvent> events;
+    /// Prints every event as it arrives.
+    bool verbose = false;
+
+  public:
+    InputRecorder(bool verbose = false) : verbose(verbose) {}
+
+    void onInputEvent(const InputEvent& event) override;
+
+    const std::vector<InputEvent>& getEvents() const { return events; }
+    void clear() { events.clear(); }
+};
+
+/// Counts the received events without keeping them, for servers without an injector.
+/// Runs on the network thread, events are only printed if asked for.
+class InputCounter : public InputSink {
+  private:
+    /// Prints every event as it arrives.
+    bool verbose = false;
+    /// Debug stats.
+    long long statsEvents = 0;
+    long long statsMoves = 0;
+
+  public:
+    InputCounter(bool verbose = false) : verbose(verbose) {}
+
+    void onInputEvent(const InputEvent& event) override;
+
+    void debugSession();
+};
+
+/// Sends events through the batcher, random cuts and the reader into a recorder and
+/// checks coalescing, order, sequence numbers and the latency split of an ack.
+/// Returns false if a check failed.
+bool verifyInputProtocol();
+
+#endif
@@ -0,0 +1,46 @@
+#include <algorithm>
+
+#include "layer_selector.h"
+
+const double LayerSelector::HEADROOM = 0.8;
+
+bool LayerSelector::initialize(const std::vector<StreamLayer>& layers, uint64_t upgradeHoldUs) {
+  if (layers.empty()) {
+    return false;
+  }
+
+  this->layers = layers;
+  std::sort(this->layers.begin(), this->layers.end(),
+            [](const StreamLayer& a, const StreamLayer& b) { return a.bitrateKbps < b.bitrateKbps; });
+  this->upgradeHoldUs = upgradeHoldUs;
+  current = 0;
+  upgradePending = false;
+  return true;
+}
+
+size_t LayerSelector::update(double throughputKbps, uint64_t nowUs) {
+  // Highest layer that fits, the lowest one is always streamed.
+  size_t fitting = 0;
+  for (size_t i = 1; i < layers.size(); i++) {
+    if (layers[i].bitrateKbps <= throughputKbps * HEADROOM) {
+      fitting = i;
+    }
+  }
+
+  if (fitting < current) {
+    current = fitting;
+    upgradePending = false;
+  } else if (fitting > current) {
+    if (!upgradePending) {
+      upgradePending = true;
+      upgradeSinceUs = nowUs;
+    } else if (nowUs - upgradeSinceUs >= upgradeHoldUs) {
+      current++;
+      upgradePending = false;
+    }
+  } else {
+    upgradePending = false;
+  }
+
+  return current;
+}
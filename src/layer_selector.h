@@ -0,0 +1,44 @@
+#ifndef _LAYER_SELECTOR_H_
+#define _LAYER_SELECTOR_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+/// One encoded version (resolution/bitrate) of a simulcast stream.
+struct StreamLayer {
+  uint32_t streamId = 0;
+  uint32_t bitrateKbps = 0;
+};
+
+/// Picks the simulcast layer of a single client from its measured throughput.
+///
+/// Going down happens as soon as the layer does not fit anymore, going up only once
+/// the next layer fitted for `upgradeHoldUs` and only a single step at a time. This
+/// keeps a client on a flaky link from bouncing between layers on every IDR.
+class LayerSelector {
+  private:
+    /// Layers sorted by bitrate, lowest first.
+    std::vector<StreamLayer> layers;
+    size_t current = 0;
+    /// Set while the next layer fits, since `upgradeSinceUs`.
+    bool upgradePending = false;
+    uint64_t upgradeSinceUs = 0;
+    uint64_t upgradeHoldUs = 2000000;
+
+  public:
+    /// Share of the measured throughput a layer may use.
+    static const double HEADROOM;
+
+    /// Starts on the lowest layer, its GOP is the quickest to send to a new client.
+    bool initialize(const std::vector<StreamLayer>& layers, uint64_t upgradeHoldUs = 2000000);
+
+    /// Feeds a new throughput measurement, returns the index of the layer to stream.
+    size_t update(double throughputKbps, uint64_t nowUs);
+
+    size_t getCurrent() const { return current; }
+    const StreamLayer& getLayer(size_t index) const { return layers[index]; }
+    size_t getLayerCount() const { return layers.size(); }
+};
+
+#endif
@@ -1,69 +1,606 @@
+#include <csignal>
 #include <cstdio>
+#include <cstring>
 
-#ifndef RPI_CLIENT
+/// Set by SIGINT/SIGTERM, the main loops finish and everything gets cleaned up.
+static volatile std::sig_atomic_t stopRequested = 0;
+
+static void request_stop(int) {
+  stopRequested = 1;
+}
+
+#if defined(BROCKY_RELAY)
+#include <cstdlib>
+#include <string>
+
+#include "relay.h"
+
+/// How often the relay prints its hop stats.
+#define RELAY_STATS_INTERVAL_US 10000000
+
+// Entry point for a relay, arguments are `upstream-host:port [listen-port] [stream]`.
+void relay_main(int argc, char** argv) {
+  RelayConfig config;
+  if (argc > 1) {
+    std::string upstream = argv[1];
+    size_t colon = upstream.rfind(':');
+    config.upstreamHost = upstream.substr(0, colon);
+    if (colon != std::string::npos) {
+      config.upstreamPort = upstream.substr(colon + 1);
+    }
+  }
+  if (argc > 2) {
+    config.listenPort = (uint16_t)atoi(argv[2]);
+  }
+  if (argc > 3) {
+    config.streamName = argv[3];
+  }
+
+  Relay* relay = new Relay();
+  if (relay->initialize(config)) {
+    uint64_t lastStats = nowMicros();
+    while (!relay->isUpstreamClosed() && !stopRequested) {
+      relay->wait(1);
+      relay->tick();
+
+      if (nowMicros() - lastStats >= RELAY_STATS_INTERVAL_US) {
+        relay->debugSession();
+        lastStats = nowMicros();
+      }
+    }
+    printf("Upstream connection closed\n");
+  }
+
+  printf("Exiting...\n");
+  relay->cleanup();
+  delete relay;
+}
+#elif !defined(RPI_CLIENT)
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "cursor_protocol.h"
+#include "encode_ring.h"
+#include "frame_damage.h"
+#include "input_protocol.h"
+#include "metrics.h"
 #include "quic_server.h"
+#include "recording.h"
+#include "simulcast_sim.h"
+#include "slice_queue.h"
+#include "stream_router.h"
+#ifdef _WIN32
 #include "windows_capture.h"
+#include "windows_input.h"
+#else
+#include "shm_transport.h"
+#include "transport_bench.h"
+#include "x11_capture.h"
+#endif
+
+/// Capture source given on the command line as `name@output[:left,top,width,height][=WxH][*layers]`.
+struct CaptureSpec {
+  std::string name;
+  /// DXGI output on windows, X screen on linux.
+  unsigned int output = 0;
+  /// Captured region, a zero width or height captures the whole output.
+  long left = 0;
+  long top = 0;
+  long width = 0;
+  long height = 0;
+  /// Size the capture is scaled to before encoding (software path only), zero keeps it.
+  int scaleWidth = 0;
+  int scaleHeight = 0;
+  /// Simulcast layers, every further layer has half the resolution of the previous one.
+  unsigned int layers = 1;
+};
+
+/// Bitrate of the base layer, every further layer gets a third of the previous one.
+#define BASE_BITRATE_KBPS 10000
+#define MAX_LAYERS 3
+
+static bool parse_capture_spec(const char* spec, CaptureSpec& out) {
+  const char* at = strchr(spec, '@');
+  if (!at || at == spec) {
+    return false;
+  }
+  out.name.assign(spec, at - spec);
+
+  const char* scale = strchr(at, '=');
+  if (scale && sscanf(scale + 1, "%dx%d", &out.scaleWidth, &out.scaleHeight) != 2) {
+    return false;
+  }
+
+  const char* layers = strchr(at, '*');
+  if (layers && (sscanf(layers + 1, "%u", &out.layers) != 1 || out.layers < 1 || out.layers > MAX_LAYERS)) {
+    return false;
+  }
+
+  int matched = sscanf(at + 1, "%u:%ld,%ld,%ld,%ld", &out.output, &out.left, &out.top, &out.width, &out.height);
+  return matched == 1 || matched == 5;
+}
+
+#ifdef _WIN32
+typedef WindowsCapturer Capturer;
+typedef WindowsInputInjector InputTarget;
+
+static CaptureConfig make_capture_config(const CaptureSpec& spec, uint32_t streamId, const std::vector<StreamLayer>&) {
+  CaptureConfig config;
+  config.outputIndex = spec.output;
+  config.streamId = streamId;
+  if (spec.width > 0 && spec.height > 0) {
+    config.region.left = spec.left;
+    config.region.top = spec.top;
+    config.region.right = spec.left + spec.width;
+    config.region.bottom = spec.top + spec.height;
+  }
+  if (spec.scaleWidth > 0) {
+    printf("Scaling is not supported by the NVENC capturer, encoding %s at its captured size\n", spec.name.c_str());
+  }
+  if (spec.layers > 1) {
+    printf("Simulcast is not supported by the NVENC capturer, encoding %s as a single layer\n", spec.name.c_str());
+  }
+  return config;
+}
+#else
+typedef X11Capturer Capturer;
+/// No injector on linux yet, received input is only counted.
+typedef InputCounter InputTarget;
 
-// Entry point for windows main server.
-void win_server_main () {
-  WindowsCapturer* capturer = new WindowsCapturer();
+static X11CaptureConfig make_capture_config(const CaptureSpec& spec, uint32_t streamId, const std::vector<StreamLayer>& layers) {
+  X11CaptureConfig config;
+  config.screen = (int)spec.output;
+  config.streamId = streamId;
+  config.left = (int)spec.left;
+  config.top = (int)spec.top;
+  config.width = (int)spec.width;
+  config.height = (int)spec.height;
+  config.scaleWidth = spec.scaleWidth;
+  config.scaleHeight = spec.scaleHeight;
+  config.bitrateKbps = BASE_BITRATE_KBPS;
+  // Sizes of the lower layers follow from the captured size.
+  for (auto& layer : layers) {
+    X11EncodeLayer encodeLayer;
+    encodeLayer.streamId = layer.streamId;
+    encodeLayer.bitrateKbps = layer.bitrateKbps;
+    config.layers.push_back(encodeLayer);
+  }
+  return config;
+}
+
+/// How often `--shm-read` prints its stats.
+#define SHM_READ_STATS_INTERVAL_US 5000000
+
+/// Counts what `--shm-read` gets out of the ring. The steady clock is shared by all
+/// processes of the host, so the capture time gives the latency through the ring.
+class ShmReadStats : public SliceSink {
+  private:
+    long long statsFrames = 0;
+    long long statsBytes = 0;
+    long long statsLatency = 0;
+
+  public:
+    void onSlice(const EncodedSlice& slice) override {
+      statsBytes += slice.payload->size();
+      if (slice.lastInFrame) {
+        statsFrames++;
+        statsLatency += nowMicros() - slice.captureTimeUs;
+      }
+    }
+
+    void debugSession() {
+      printf("\n\n---------------------------------------------\n");
+      printf("Shared memory read:\n");
+      printf("  Frames: %lld (%lld KB)\n", statsFrames, statsBytes / 1024);
+      printf("  Capture to read: %lldus\n", statsFrames == 0 ? 0 : statsLatency / statsFrames);
+      printf("---------------------------------------------\n");
+
+      statsFrames = 0;
+      statsBytes = 0;
+      statsLatency = 0;
+    }
+};
+#endif
+
+// Streams a recording of `--record` as `replay` instead of capturing, over and over.
+static void serve_recording(const char* path) {
+  StreamRouter* router = new StreamRouter();
   QUICServer* server = new QUICServer();
+  server->setRouter(router);
+  RecordingReplay* replay = new RecordingReplay();
+
+  if (router->addStream(0, "replay", BASE_BITRATE_KBPS) && replay->initialize(path) && server->initialize()) {
+    // Frames are paced on their own thread like a capturer, the server picks them up here.
+    SliceQueue queue;
+    std::thread replayThread([&]() {
+      while (!stopRequested && replay->captureFrame(&queue)) {}
+    });
+
+    while (!stopRequested) {
+      queue.drain(router, 1);
+      server->tick();
+    }
+    replayThread.join();
+  }
+
+  printf("Exiting...\n");
+  server->cleanup();
+  delete server;
+  delete router;
+  delete replay;
+}
+
+// Entry point for the main server, captures with DDA/NVENC on windows and X11/x264 on linux.
+void server_main (int argc, char** argv) {
+#ifndef _WIN32
+  // Checks the SIMD color kernels against the scalar ones and measures them.
+  if (argc > 1 && strcmp(argv[1], "--bench-color") == 0) {
+    verifyColorKernels(1920, 1080);
+    benchmarkColorKernels(1920, 1080, 200);
+    return;
+  }
+
+  // Compares the shared memory ring with QUIC over loopback.
+  if (argc > 1 && strcmp(argv[1], "--bench-transports") == 0) {
+    benchmarkLocalTransports();
+    return;
+  }
+
+  // Streams the synthetic source to a loopback client with per slice timing.
+  if (argc > 1 && strcmp(argv[1], "--bench-synthetic") == 0) {
+    benchmarkSyntheticStream();
+    return;
+  }
+
+  // Follows the shared memory ring of a stream published by another server process.
+  if (argc > 2 && strcmp(argv[1], "--shm-read") == 0) {
+    ShmSubscriber subscriber;
+    ShmReadStats counter;
+    if (subscriber.initialize(argv[2])) {
+      uint64_t lastStats = nowMicros();
+      while (!stopRequested) {
+        subscriber.read(&counter, 100);
+        if (nowMicros() - lastStats >= SHM_READ_STATS_INTERVAL_US) {
+          counter.debugSession();
+          subscriber.debugSession();
+          lastStats = nowMicros();
+        }
+      }
+    }
+    return;
+  }
+#endif
+
+  // Runs synthetic simulcast layers against clients with simulated bandwidth.
+  if (argc > 1 && strcmp(argv[1], "--simulcast-sim") == 0) {
+    runSimulcastSimulation();
+    return;
+  }
+
+  // Runs the cursor channel and the client cursor state machine without a capture device.
+  if (argc > 1 && strcmp(argv[1], "--cursor-check") == 0) {
+    verifyCursorProtocol();
+    return;
+  }
+
+  // Runs client input through batching, coalescing and the server side reader.
+  if (argc > 1 && strcmp(argv[1], "--input-check") == 0) {
+    verifyInputProtocol();
+    return;
+  }
+
+  // Runs the encoder input ring against a mock encoder with completions out of order.
+  if (argc > 1 && strcmp(argv[1], "--encode-ring-check") == 0) {
+    verifyEncodeRing();
+    return;
+  }
+
+  // Feeds synthetic damage rects through the damage tracker.
+  if (argc > 1 && strcmp(argv[1], "--damage-check") == 0) {
+    verifyFrameDamage();
+    return;
+  }
+
+  // Checks the retry token hmac and measures how many tokens per second can be handled.
+  if (argc > 1 && strcmp(argv[1], "--bench-tokens") == 0) {
+    benchmarkRetryTokens(200000);
+    return;
+  }
+
+  // Records, replays and seeks a synthetic stream in the working directory.
+  if (argc > 1 && strcmp(argv[1], "--record-check") == 0) {
+    verifyRecording(".");
+    return;
+  }
+
+  if (argc > 2 && strcmp(argv[1], "--replay") == 0) {
+    serve_recording(argv[2]);
+    return;
+  }
+
+  std::vector<Capturer*> capturers;
+  std::vector<CursorChannel*> cursors;
+  std::vector<InputTarget*> inputs;
+  std::vector<SliceRecorder*> recorders;
+#ifndef _WIN32
+  std::vector<ShmPublisher*> publishers;
+#endif
+  StreamRouter* router = new StreamRouter();
+  QUICServer* server = new QUICServer();
+  server->setRouter(router);
+
+  MetricsRegistry registry;
+  MetricsServer metrics;
+
+  // `--shm` additionally publishes every stream into shared memory for local consumers,
+  // `--record <directory>` writes every stream to `<directory>/<name>.h264`,
+  // `--metrics-port <port>` moves the metrics endpoint (0 turns it off),
+  // `--input` accepts keyboard and mouse input of clients, `--input-verbose` prints every
+  // received input event (linux).
+  bool sharedMemory = false;
+  bool acceptInput = false;
+  bool inputVerbose = false;
+  const char* recordDirectory = nullptr;
+  int metricsPort = METRICS_PORT;
+  std::vector<const char*> specs;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--shm") == 0) {
+      sharedMemory = true;
+    } else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+      recordDirectory = argv[++i];
+    } else if (strcmp(argv[i], "--metrics-port") == 0 && i + 1 < argc) {
+      metricsPort = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--input") == 0) {
+      acceptInput = true;
+    } else if (strcmp(argv[i], "--input-verbose") == 0) {
+      inputVerbose = true;
+    } else {
+      specs.push_back(argv[i]);
+    }
+  }
+
+  // Without arguments the whole main monitor is streamed as `stream`.
+  if (specs.empty()) {
+    specs.push_back("stream@0");
+  }
+
+  // Clients are not authenticated, whoever reaches the port could type on this desktop.
+  if (acceptInput) {
+    printf("Accepting input from every client that can reach the server, there is no authentication\n");
+  }
 
   printf("Initializing QUIC server\n");
   if (server->initialize()) {
-    printf("Initializing windows capturing\n");
-    if (capturer->initialize()) {
-      printf("Windows capturer initialized without errors...\n");
-
-      while (true) {
-        auto encodedFrame = capturer->captureFrame();
-        if (encodedFrame) {
-          server->tick(encodedFrame);
+    printf("Initializing capturing\n");
+
+    bool initialized = true;
+    uint32_t nextStreamId = 0;
+    for (size_t i = 0; i < specs.size() && initialized; i++) {
+      CaptureSpec spec;
+      if (!parse_capture_spec(specs[i], spec)) {
+        printf("Invalid capture spec %s (expected name@output[:left,top,width,height][=WxH][*layers])\n", specs[i]);
+        initialized = false;
+        break;
+      }
+
+      uint32_t baseId = nextStreamId++;
+      initialized = router->addStream(baseId, spec.name, BASE_BITRATE_KBPS);
+      std::vector<StreamLayer> layers;
+#ifndef _WIN32
+      for (unsigned int l = 1; l < spec.layers && initialized; l++) {
+        StreamLayer layer;
+        layer.streamId = nextStreamId++;
+        layer.bitrateKbps = (layers.empty() ? BASE_BITRATE_KBPS : layers.back().bitrateKbps) / 3;
+        layers.push_back(layer);
+        initialized = router->addLayer(layer.streamId, baseId, layer.bitrateKbps);
+      }
+#endif
+
+      Capturer* capturer = new Capturer();
+      capturers.push_back(capturer);
+#ifdef _WIN32
+      // DDA leaves the pointer out of the image, clients draw it from the cursor channel.
+      CursorChannel* cursor = new CursorChannel();
+      cursors.push_back(cursor);
+      router->setCursor(baseId, cursor);
+      CaptureConfig config = make_capture_config(spec, baseId, layers);
+      config.cursor = cursor;
+      initialized = initialized && capturer->initialize(config);
+#else
+      initialized = initialized && capturer->initialize(make_capture_config(spec, baseId, layers));
+#endif
+
+      // Without `--input` input requests are answered like unknown streams.
+      if (acceptInput) {
+#ifdef _WIN32
+        // Input lands on the region this stream shows.
+        InputTarget* input = new InputTarget();
+        input->initialize(capturer->getDesktopRect());
+#else
+        InputTarget* input = new InputTarget(inputVerbose);
+#endif
+        inputs.push_back(input);
+        router->setInput(baseId, input);
+      }
+
+      if (initialized) {
+        capturer->registerMetrics(registry, spec.name);
+      }
+
+      // The recorder subscribes like a client, it starts at the IDR the GOP cache hands out.
+      if (recordDirectory && initialized) {
+        SliceRecorder* recorder = new SliceRecorder();
+        recorders.push_back(recorder);
+        initialized = recorder->initialize(std::string(recordDirectory) + "/" + spec.name + ".h264") &&
+                      router->subscribe(baseId, recorder);
+      }
+
+#ifndef _WIN32
+      // Local consumers read the base layer from /dev/shm/brocky-<name>.
+      if (sharedMemory && initialized) {
+        ShmPublisher* publisher = new ShmPublisher();
+        publishers.push_back(publisher);
+        initialized = publisher->initialize(spec.name) && router->subscribe(baseId, publisher);
+      }
+#else
+      if (sharedMemory) {
+        printf("Shared memory is not supported on windows, %s is only sent over QUIC\n", spec.name.c_str());
+      }
+#endif
+    }
+
+    if (initialized) {
+      printf("Capturer initialized without errors...\n");
+
+      // Scrapes run on their own thread and only read what the loop below updates.
+      server->registerMetrics(registry);
+      if (metricsPort > 0) {
+        metrics.initialize(&registry, (uint16_t)metricsPort);
+      }
+
+      // Every capturer grabs and submits frames on its own thread.
+      for (auto capturer : capturers) {
+        capturer->start();
+      }
+
+      while (!stopRequested) {
+        // Slices are sent by the server while the frame is still being encoded.
+        for (auto capturer : capturers) {
+          capturer->drainEncoded(router, 1);
         }
+        server->tick();
       }
 
-      capturer->debugSession();
+      for (auto capturer : capturers) {
+        capturer->debugSession();
+      }
+      for (auto input : inputs) {
+        input->debugSession();
+      }
     }
   };
 
   printf("Exiting...\n");
-  capturer->cleanup();
+  // Nothing may be scraped once the server and the capturers are gone.
+  metrics.cleanup();
   server->cleanup();
-
-  delete capturer;
   delete server;
+  delete router;
+
+  for (auto capturer : capturers) {
+    capturer->cleanup();
+    delete capturer;
+  }
+
+  for (auto cursor : cursors) {
+    delete cursor;
+  }
+
+  for (auto input : inputs) {
+    delete input;
+  }
+
+  // Everything still queued is written before the files are closed.
+  for (auto recorder : recorders) {
+    recorder->cleanup();
+    delete recorder;
+  }
+
+#ifndef _WIN32
+  for (auto publisher : publishers) {
+    publisher->cleanup();
+    delete publisher;
+  }
+#endif
 }
 #else
 #include <chrono>
+#include <cstdlib>
 #include <thread>
 
+#include "client_pipeline.h"
+#include "metrics.h"
 #include "quic_client.h"
 
-void rpi_client_main() {
+/// How often the client prints the pipeline stats and wakeup histograms.
+#define PIPELINE_STATS_INTERVAL_S 10
+
+void rpi_client_main(int argc, char** argv) {
   printf("Connecting to QUIC server..\n");
   QUICClient* client = new QUICClient();
+  ClientPipeline* pipeline = new ClientPipeline();
+
+  // The cursor comes separately from the video, the renderer draws it on top of each frame.
+  CursorState* cursor = new CursorState();
+  client->setCursorState(cursor);
 
-  if (client->initialize()) {
+  // Optional name of the stream to watch.
+  if (argc > 1) {
+    client->setStreamName(argv[1]);
+  }
+
+  // Optional `host:port` of the server or relay.
+  if (argc > 2) {
+    std::string server = argv[2];
+    size_t colon = server.rfind(':');
+    client->setServer(server.substr(0, colon), colon == std::string::npos ? "1337" : server.substr(colon + 1));
+  }
+
+  // Optional `cpu:priority` of the receive, reassembly and decode thread.
+  PipelineConfig config;
+  bool valid = argc <= 3 || parsePipelineConfig(argv[3], config);
+  if (!valid) {
+    printf("Invalid thread spec %s (expected cpu:prio,cpu:prio,cpu:prio)\n", argv[3]);
+  }
+
+  // Optional port of the metrics endpoint, 0 turns it off.
+  int metricsPort = argc > 4 ? atoi(argv[4]) : METRICS_PORT;
+  MetricsRegistry registry;
+  MetricsServer metrics;
+
+  if (valid && client->initialize()) {
     printf("Initializing VideoCore decoder..\n");
 
+    // Receiving, reassembly and decoding run on their own threads from here on.
     printf("Start taking frames..\n");
-    while (true) {
-      std::this_thread::sleep_for(std::chrono::milliseconds(16));
-      client->tick();
+    if (pipeline->initialize(client, nullptr, config) && pipeline->start()) {
+      pipeline->registerMetrics(registry);
+      if (metricsPort > 0) {
+        metrics.initialize(&registry, (uint16_t)metricsPort);
+      }
+
+      while (!stopRequested) {
+        for (int i = 0; i < PIPELINE_STATS_INTERVAL_S && !stopRequested; i++) {
+          std::this_thread::sleep_for(std::chrono::seconds(1));
+        }
+        pipeline->debugSession();
+      }
     }
   }
 
   printf("Exiting..\n");
+  metrics.cleanup();
+  pipeline->cleanup();
   client->cleanup();
+  delete pipeline;
   delete client;
+  delete cursor;
 }
 #endif
 
-int main () {
-  #ifndef RPI_CLIENT
-  win_server_main();
+int main (int argc, char** argv) {
+  // Ctrl+C ends the main loop instead of the process, so stats and files get finished.
+  std::signal(SIGINT, request_stop);
+  std::signal(SIGTERM, request_stop);
+
+  #if defined(BROCKY_RELAY)
+  relay_main(argc, argv);
+  #elif !defined(RPI_CLIENT)
+  server_main(argc, argv);
   #else
-  rpi_client_main();
+  rpi_client_main(argc, argv);
   #endif
 
   return 0;
@@ -0,0 +1,261 @@
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+
+#ifdef _WIN32
+#include <ws2tcpip.h>
+#else
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+
+#define INVALID_SOCKET (-1)
+#define closesocket close
+#endif
+
+// A scraper that hangs up early must not kill the process with SIGPIPE.
+#ifdef MSG_NOSIGNAL
+#define SEND_FLAGS MSG_NOSIGNAL
+#else
+#define SEND_FLAGS 0
+#endif
+
+#include "metrics.h"
+
+MetricHistogram::MetricHistogram() {
+  for (auto& bucket : buckets) {
+    bucket = 0;
+  }
+}
+
+void MetricHistogram::observe(uint64_t us) {
+  size_t bucket = 0;
+  while (bucket < METRICS_HISTOGRAM_BUCKETS - 1 && us > getBound(bucket)) {
+    bucket++;
+  }
+
+  buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+  count.fetch_add(1, std::memory_order_relaxed);
+  sumUs.fetch_add(us, std::memory_order_relaxed);
+}
+
+uint64_t MetricHistogram::getBound(size_t index) {
+  return index < METRICS_HISTOGRAM_BUCKETS - 1 ? (uint64_t)METRICS_HISTOGRAM_FIRST_US << index : 0;
+}
+
+/// `name{labels}` or just `name`, `extra` is appended to the labels (used for `le`).
+static std::string series(const std::string& name, const std::string& labels, const std::string& extra = "") {
+  std::string joined = labels;
+  if (!extra.empty()) {
+    joined += joined.empty() ? extra : "," + extra;
+  }
+  return joined.empty() ? name : name + "{" + joined + "}";
+}
+
+void MetricsWriter::describe(const std::string& name, const std::string& help, const char* type) {
+  if (!described.insert(name).second) {
+    return;
+  }
+
+  out += "# HELP " + name + " " + help + "\n";
+  out += "# TYPE " + name + " " + type + "\n";
+}
+
+void MetricsWriter::counter(const std::string& name, const std::string& help, const std::string& labels, uint64_t value) {
+  describe(name, help, "counter");
+  out += series(name, labels) + " " + std::to_string(value) + "\n";
+}
+
+void MetricsWriter::gauge(const std::string& name, const std::string& help, const std::string& labels, double value) {
+  char text[32];
+  snprintf(text, sizeof(text), "%.15g", value);
+
+  describe(name, help, "gauge");
+  out += series(name, labels) + " " + text + "\n";
+}
+
+void MetricsWriter::histogram(const std::string& name, const std::string& help, const std::string& labels, const MetricHistogram& histogram) {
+  describe(name, help, "histogram");
+
+  // Buckets are cumulative, observations racing the scrape may show up in the count only.
+  uint64_t cumulative = 0;
+  for (size_t i = 0; i < METRICS_HISTOGRAM_BUCKETS; i++) {
+    cumulative += histogram.getBucket(i);
+
+    char le[32];
+    uint64_t bound = MetricHistogram::getBound(i);
+    if (bound == 0) {
+      snprintf(le, sizeof(le), "le=\"+Inf\"");
+    } else {
+      snprintf(le, sizeof(le), "le=\"%.9g\"", bound / 1000000.0);
+    }
+    out += series(name + "_bucket", labels, le) + " " + std::to_string(cumulative) + "\n";
+  }
+
+  char sum[32];
+  snprintf(sum, sizeof(sum), "%.6f", histogram.getSumUs() / 1000000.0);
+  out += series(name + "_sum", labels) + " " + sum + "\n";
+  out += series(name + "_count", labels) + " " + std::to_string(cumulative) + "\n";
+}
+
+void MetricsRegistry::addCounter(const std::string& name, const std::string& help, const std::string& labels, const MetricCounter* counter) {
+  std::lock_guard<std::mutex> guard(lock);
+  entries.push_back({ MetricType::Counter, name, help, labels, counter });
+}
+
+void MetricsRegistry::addGauge(const std::string& name, const std::string& help, const std::string& labels, const MetricGauge* gauge) {
+  std::lock_guard<std::mutex> guard(lock);
+  entries.push_back({ MetricType::Gauge, name, help, labels, gauge });
+}
+
+void MetricsRegistry::addHistogram(const std::string& name, const std::string& help, const std::string& labels, const MetricHistogram* histogram) {
+  std::lock_guard<std::mutex> guard(lock);
+  entries.push_back({ MetricType::Histogram, name, help, labels, histogram });
+}
+
+void MetricsRegistry::addCollector(MetricsCollector* collector) {
+  std::lock_guard<std::mutex> guard(lock);
+  collectors.push_back(collector);
+}
+
+std::string MetricsRegistry::render() {
+  std::lock_guard<std::mutex> guard(lock);
+
+  // Series of the same metric (e.g. one per stream) have to be next to each other.
+  std::vector<const Entry*> sorted;
+  for (auto& entry : entries) {
+    sorted.push_back(&entry);
+  }
+  std::stable_sort(sorted.begin(), sorted.end(), [](const Entry* a, const Entry* b) { return a->name < b->name; });
+
+  std::string out;
+  MetricsWriter writer(out);
+  for (auto entry : sorted) {
+    switch (entry->type) {
+      case MetricType::Counter:
+        writer.counter(entry->name, entry->help, entry->labels, ((const MetricCounter*)entry->pMetric)->get());
+        break;
+      case MetricType::Gauge:
+        writer.gauge(entry->name, entry->help, entry->labels, (double)((const MetricGauge*)entry->pMetric)->get());
+        break;
+      case MetricType::Histogram:
+        writer.histogram(entry->name, entry->help, entry->labels, *(const MetricHistogram*)entry->pMetric);
+        break;
+    }
+  }
+
+  for (auto collector : collectors) {
+    collector->collectMetrics(writer);
+  }
+  return out;
+}
+
+bool MetricsServer::initialize(MetricsRegistry* registry, uint16_t port) {
+  pRegistry = registry;
+
+#ifdef _WIN32
+  if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0) {
+    printf("[Metrics] Could not load winsock2.2 (error code: %d)\n", WSAGetLastError());
+    return false;
+  }
+#endif
+
+  listenSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  if (listenSocket == INVALID_SOCKET) {
+    printf("[Metrics] Could not create socket\n");
+    return false;
+  }
+
+  int reuse = 1;
+  setsockopt(listenSocket, SOL_SOCKET, SO_REUSEADDR, (const char*)&reuse, sizeof(reuse));
+
+  // Only reachable from this host, put a proxy in front to scrape from elsewhere.
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = htons(port);
+  if (bind(listenSocket, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(listenSocket, 4) != 0) {
+    printf("[Metrics] Could not listen on port %u\n", port);
+    closesocket(listenSocket);
+    listenSocket = INVALID_SOCKET;
+    return false;
+  }
+
+  registry->addCounter("brocky_metrics_scrapes_total", "Metrics requests served.", "", &scrapes);
+
+  running = true;
+  serveThread = std::thread([this]() { this->serveLoop(); });
+
+  printf("[Metrics] Serving http://127.0.0.1:%u/metrics\n", port);
+  return true;
+}
+
+void MetricsServer::cleanup() {
+  running = false;
+  if (serveThread.joinable()) {
+    serveThread.join();
+  }
+
+  if (listenSocket != INVALID_SOCKET) {
+    closesocket(listenSocket);
+    listenSocket = INVALID_SOCKET;
+#ifdef _WIN32
+    WSACleanup();
+#endif
+  }
+}
+
+void MetricsServer::serveLoop() {
+  while (running) {
+    // Wake up now and then to notice cleanup().
+    fd_set readable;
+    FD_ZERO(&readable);
+    FD_SET(listenSocket, &readable);
+    struct timeval timeout = { 0, 200000 };
+    if (select((int)listenSocket + 1, &readable, nullptr, nullptr, &timeout) <= 0) {
+      continue;
+    }
+
+    auto client = accept(listenSocket, nullptr, nullptr);
+    if (client == INVALID_SOCKET) {
+      continue;
+    }
+
+#ifdef _WIN32
+    DWORD receiveTimeout = 1000;
+#else
+    struct timeval receiveTimeout = { 1, 0 };
+#endif
+    setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, (const char*)&receiveTimeout, sizeof(receiveTimeout));
+
+    // The request line is all that matters, it arrives in the first segment.
+    char request[1024];
+    int received = (int)recv(client, request, sizeof(request) - 1, 0);
+    request[received > 0 ? received : 0] = 0;
+
+    std::string response;
+    if (strncmp(request, "GET /metrics", 12) == 0) {
+      std::string body = pRegistry->render();
+      response = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " +
+                 std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+      scrapes.add();
+    } else {
+      response = "HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+    }
+
+    size_t sent = 0;
+    while (sent < response.size()) {
+      int written = (int)send(client, response.data() + sent, (int)(response.size() - sent), SEND_FLAGS);
+      if (written <= 0) {
+        break;
+      }
+      sent += written;
+    }
+    closesocket(client);
+  }
+}
@@ -0,0 +1,146 @@
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include <stdint.h>
+#include <atomic>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#endif
+
+/// Port the metrics are served on (localhost only), 9464 is the usual exporter port.
+#define METRICS_PORT 9464
+/// Histogram buckets: 16us, 32us, ... doubling up to ~1s, then +Inf.
+#define METRICS_HISTOGRAM_BUCKETS 18
+#define METRICS_HISTOGRAM_FIRST_US 16
+
+/// Monotonic counter, updated with a single relaxed atomic add.
+class MetricCounter {
+  private:
+    std::atomic<uint64_t> value{ 0 };
+
+  public:
+    void add(uint64_t n = 1) { value.fetch_add(n, std::memory_order_relaxed); }
+    uint64_t get() const { return value.load(std::memory_order_relaxed); }
+};
+
+/// Value that goes up and down.
+class MetricGauge {
+  private:
+    std::atomic<int64_t> value{ 0 };
+
+  public:
+    void set(int64_t v) { value.store(v, std::memory_order_relaxed); }
+    void add(int64_t n) { value.fetch_add(n, std::memory_order_relaxed); }
+    int64_t get() const { return value.load(std::memory_order_relaxed); }
+};
+
+/// Durations in microseconds, exported in seconds with power of two buckets.
+class MetricHistogram {
+  private:
+    std::atomic<uint64_t> buckets[METRICS_HISTOGRAM_BUCKETS];
+    std::atomic<uint64_t> count{ 0 };
+    std::atomic<uint64_t> sumUs{ 0 };
+
+  public:
+    MetricHistogram();
+
+    void observe(uint64_t us);
+
+    /// Observations of bucket `index` alone (not cumulative).
+    uint64_t getBucket(size_t index) const { return buckets[index].load(std::memory_order_relaxed); }
+    uint64_t getCount() const { return count.load(std::memory_order_relaxed); }
+    uint64_t getSumUs() const { return sumUs.load(std::memory_order_relaxed); }
+    /// Upper bound of bucket `index` in microseconds, 0 for the +Inf bucket.
+    static uint64_t getBound(size_t index);
+};
+
+/// Renders metrics in the Prometheus text format. `labels` is the inside of the braces,
+/// e.g. `stream="desk"`, or empty.
+class MetricsWriter {
+  private:
+    std::string& out;
+    /// Metrics that got their HELP and TYPE lines already.
+    std::set<std::string> described;
+
+  public:
+    explicit MetricsWriter(std::string& out) : out(out) {}
+
+    void counter(const std::string& name, const std::string& help, const std::string& labels, uint64_t value);
+    void gauge(const std::string& name, const std::string& help, const std::string& labels, double value);
+    void histogram(const std::string& name, const std::string& help, const std::string& labels, const MetricHistogram& histogram);
+
+  private:
+    void describe(const std::string& name, const std::string& help, const char* type);
+};
+
+/// Anything that writes its metrics itself when scraped, e.g. per connection values.
+/// Runs on the scrape thread.
+class MetricsCollector {
+  public:
+    virtual ~MetricsCollector() {}
+
+    virtual void collectMetrics(MetricsWriter& writer) = 0;
+};
+
+/// All metrics of the process.
+///
+/// Metrics are registered once at startup and owned by whoever updates them, the hot path
+/// never touches the registry. Scraping only reads the atomics. Registered metrics and
+/// collectors have to outlive the MetricsServer.
+class MetricsRegistry {
+  private:
+    enum class MetricType { Counter, Gauge, Histogram };
+    struct Entry {
+      MetricType type;
+      std::string name;
+      std::string help;
+      std::string labels;
+      const void* pMetric;
+    };
+    /// Only held while registering and rendering.
+    std::mutex lock;
+    std::vector<Entry> entries;
+    std::vector<MetricsCollector*> collectors;
+
+  public:
+    void addCounter(const std::string& name, const std::string& help, const std::string& labels, const MetricCounter* counter);
+    void addGauge(const std::string& name, const std::string& help, const std::string& labels, const MetricGauge* gauge);
+    void addHistogram(const std::string& name, const std::string& help, const std::string& labels, const MetricHistogram* histogram);
+    void addCollector(MetricsCollector* collector);
+
+    /// Everything in the Prometheus text format.
+    std::string render();
+};
+
+/// Serves `GET /metrics` of a registry over HTTP on localhost, on its own thread so
+/// scraping never delays capture or network.
+class MetricsServer {
+  private:
+#ifdef _WIN32
+    WSADATA wsa;
+    SOCKET listenSocket = INVALID_SOCKET;
+#else
+    int listenSocket = -1;
+#endif
+    MetricsRegistry* pRegistry = nullptr;
+    std::thread serveThread;
+    std::atomic<bool> running{ false };
+    MetricCounter scrapes;
+
+  public:
+    ~MetricsServer() { this->cleanup(); }
+
+    bool initialize(MetricsRegistry* registry, uint16_t port = METRICS_PORT);
+    void cleanup();
+
+  private:
+    void serveLoop();
+};
+
+#endif
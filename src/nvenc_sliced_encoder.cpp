@@ -0,0 +1,120 @@
+#include <thread>
+
+#include "annexb_reader.h"
+#include "nvenc_sliced_encoder.h"
+
+void NvEncoderSlicedD3D11::CreateSliceBuffers() {
+  for (int32_t i = 0; i < m_nEncoderBuffer; i++) {
+    NV_ENC_CREATE_BITSTREAM_BUFFER createBuffer = { NV_ENC_CREATE_BITSTREAM_BUFFER_VER };
+    NVENC_API_CALL(m_nvenc.nvEncCreateBitstreamBuffer(m_hEncoder, &createBuffer));
+    vSliceOutput.push_back(createBuffer.bitstreamBuffer);
+  }
+
+  // Worst case every macroblock ends up in its own slice.
+  uint32_t macroblocks = ((GetEncodeWidth() + 15) / 16) * ((GetEncodeHeight() + 15) / 16);
+  vSliceOffsets.resize(macroblocks);
+}
+
+void NvEncoderSlicedD3D11::DestroySlicedEncoder() {
+  for (auto buffer : vSliceOutput) {
+    m_nvenc.nvEncDestroyBitstreamBuffer(m_hEncoder, buffer);
+  }
+  vSliceOutput.clear();
+
+  DestroyEncoder();
+}
+
+void NvEncoderSlicedD3D11::SubmitSlot(int slot, NV_ENC_PIC_PARAMS* pPicParams) {
+  if (!IsHWEncoderInitialized()) {
+    NVENC_THROW_ERROR("Encoder device not found", NV_ENC_ERR_NO_ENCODE_DEVICE);
+  }
+
+  if (vSliceOutput.empty()) {
+    CreateSliceBuffers();
+  }
+
+  MapResources(slot);
+
+  NV_ENC_PIC_PARAMS picParams = *pPicParams;
+  picParams.version = NV_ENC_PIC_PARAMS_VER;
+  picParams.pictureStruct = NV_ENC_PIC_STRUCT_FRAME;
+  picParams.inputBuffer = m_vMappedInputBuffers[slot];
+  picParams.bufferFmt = GetPixelFormat();
+  picParams.inputWidth = GetEncodeWidth();
+  picParams.inputHeight = GetEncodeHeight();
+  picParams.outputBitstream = vSliceOutput[slot];
+  // Only set when the encoder runs in async mode.
+  picParams.completionEvent = m_vpCompletionEvent.empty() ? nullptr : m_vpCompletionEvent[slot];
+
+  NVENCSTATUS status = m_nvenc.nvEncEncodePicture(m_hEncoder, &picParams);
+  if (status != NV_ENC_SUCCESS) {
+    m_nvenc.nvEncUnmapInputResource(m_hEncoder, m_vMappedInputBuffers[slot]);
+    m_vMappedInputBuffers[slot] = nullptr;
+    NVENC_THROW_ERROR("nvEncEncodePicture API failed", status);
+  }
+}
+
+size_t NvEncoderSlicedD3D11::CollectSlot(int slot, uint32_t streamId, uint32_t frameIndex, uint64_t captureTimeUs, SliceSink* sink) {
+  // Poll the bitstream and forward every slice that has been completed in the meantime.
+  uint32_t emitted = 0;
+  size_t total = 0;
+  bool frameDone = false;
+  bool keyFrame = false;
+
+  while (!frameDone) {
+    NV_ENC_LOCK_BITSTREAM lockParams = { NV_ENC_LOCK_BITSTREAM_VER };
+    lockParams.outputBitstream = vSliceOutput[slot];
+    lockParams.doNotWait = 1;
+    lockParams.sliceOffsets = vSliceOffsets.data();
+
+    NVENCSTATUS status = m_nvenc.nvEncLockBitstream(m_hEncoder, &lockParams);
+    if (status == NV_ENC_ERR_LOCK_BUSY || status == NV_ENC_ERR_ENCODER_BUSY) {
+      std::this_thread::yield();
+      continue;
+    }
+    NVENC_API_CALL(status);
+
+    // A hwEncodeStatus of 2 means the whole picture has been written.
+    frameDone = lockParams.hwEncodeStatus == 2;
+    uint32_t available = lockParams.numSlices;
+    uint8_t* pData = (uint8_t*)lockParams.bitstreamBufferPtr;
+
+    for (; emitted < available; emitted++) {
+      // Parameter sets in front of the first slice travel together with it.
+      uint32_t begin = emitted == 0 ? 0 : vSliceOffsets[emitted];
+      uint32_t end = emitted + 1 < available ? vSliceOffsets[emitted + 1] : lockParams.bitstreamSizeInBytes;
+
+      // The first slice tells whether this is an IDR frame.
+      if (emitted == 0) {
+        keyFrame = containsNalUnit(pData + begin, end - begin, NAL_UNIT_IDR);
+      }
+
+      EncodedSlice slice;
+      slice.streamId = streamId;
+      slice.frameIndex = frameIndex;
+      slice.sliceIndex = emitted;
+      slice.lastInFrame = frameDone && emitted + 1 == available;
+      slice.keyFrame = keyFrame;
+      slice.captureTimeUs = captureTimeUs;
+      slice.payload = std::make_shared<std::vector<uint8_t>>(pData + begin, pData + end);
+      total += end - begin;
+
+      if (sink) {
+        sink->onSlice(slice);
+      }
+    }
+
+    NVENC_API_CALL(m_nvenc.nvEncUnlockBitstream(m_hEncoder, lockParams.outputBitstream));
+  }
+
+  // Consume the completion event so it can be signaled again.
+  if (!m_vpCompletionEvent.empty()) {
+    WaitForCompletionEvent(slot);
+  }
+
+  NVENC_API_CALL(m_nvenc.nvEncUnmapInputResource(m_hEncoder, m_vMappedInputBuffers[slot]));
+  m_vMappedInputBuffers[slot] = nullptr;
+
+  lastSliceCount = emitted;
+  return total;
+}
@@ -0,0 +1,52 @@
+#ifndef _NVENC_SLICED_ENCODER_H_
+#define _NVENC_SLICED_ENCODER_H_
+
+#include <vector>
+
+// Nvidia encoder api
+#include "NvEncoder/NvEncoderD3D11.h"
+
+#include "encoded_slice.h"
+
+/// NvEncoderD3D11 that reads the bitstream back slice by slice (sub-frame readback)
+/// instead of waiting for the whole frame like NvEncoder::EncodeFrame does.
+///
+/// Input surfaces are addressed by slot so encoding can be submitted from one thread
+/// and collected from another (see EncodeRing).
+///
+/// Requires `enableSubFrameWrite` and `reportSliceOffsets` to be set on the
+/// initialization parameters.
+class NvEncoderSlicedD3D11 : public NvEncoderD3D11 {
+  private:
+    /// Bitstream buffers we own, one per encoder input buffer.
+    std::vector<NV_ENC_OUTPUT_PTR> vSliceOutput;
+    /// Scratch space NVENC writes the slice offsets into.
+    std::vector<uint32_t> vSliceOffsets;
+    /// Amount of slices the last collected frame was split into.
+    uint32_t lastSliceCount = 0;
+
+  public:
+    NvEncoderSlicedD3D11(ID3D11Device* pDevice, uint32_t width, uint32_t height, NV_ENC_BUFFER_FORMAT format)
+      : NvEncoderD3D11(pDevice, width, height, format) {}
+
+    /// Amount of input surfaces, each of them is a slot.
+    int GetSlotCount() const { return m_nEncoderBuffer; }
+    /// Input surface of `slot`.
+    const NvEncInputFrame* GetSlotInputFrame(int slot) const { return &m_vInputFrames[slot]; }
+
+    /// Starts encoding the input surface of `slot` without waiting for the result.
+    void SubmitSlot(int slot, NV_ENC_PIC_PARAMS* pPicParams);
+    /// Hands every slice of `slot` to `sink` as soon as NVENC finished it and releases
+    /// the slot afterwards. Returns the amount of bytes written.
+    size_t CollectSlot(int slot, uint32_t streamId, uint32_t frameIndex, uint64_t captureTimeUs, SliceSink* sink);
+
+    uint32_t GetLastSliceCount() const { return lastSliceCount; }
+
+    /// Releases our bitstream buffers and destroys the underlying encoder.
+    void DestroySlicedEncoder();
+
+  private:
+    void CreateSliceBuffers();
+};
+
+#endif
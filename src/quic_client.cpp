@@ -1,3 +1,7 @@
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
 #include "quic_client.h"
 
 void QUICClient::cleanup() {
@@ -15,13 +19,34 @@ void QUICClient::cleanup() {
     freeaddrinfo(pPeer);
     pPeer = nullptr;
   }
+
+  if (socketRef >= 0) {
+    close(socketRef);
+    socketRef = -1;
+  }
 }
 
-static void debug_log(const char *line, void *argp) {
+static void debug_log(const char * /*line*/, void * /*argp*/) {
   //fprintf(stderr, "[QUICHE DEBUG] %s\n", line);
 }
 
 bool QUICClient::initialize() {
+  uint32_t connects = joinStats.connects;
+  joinStats = JoinStats();
+  joinStats.connectStartUs = nowMicros();
+  joinStats.connects = connects + 1;
+  joinTracker = JoinTracker();
+  requestSent = false;
+  reader.reset();
+  if (pCursor) {
+    pCursor->reset();
+  }
+  // Events of the old connection are stale by now.
+  inputBatcher = InputBatcher();
+  inputReader.reset();
+  inputOut.clear();
+  inputOutOffset = 0;
+
   // Initialize quiche config
   quiche_enable_debug_logging(debug_log, NULL);
   pConfig = quiche_config_new(QUICHE_PROTOCOL_VERSION);
@@ -42,7 +67,7 @@ bool QUICClient::initialize() {
   quiche_config_set_initial_max_stream_data_bidi_local(pConfig, 0x0FFFFFFFFFFFFFFF);
   quiche_config_set_initial_max_stream_data_bidi_remote(pConfig, 0x0FFFFFFFFFFFFFFF);
   quiche_config_set_initial_max_streams_bidi(pConfig, 0x0FFFFFFFFFFFFFFF);
-  //quiche_config_set_max_idle_timeout(pConfig, 5000);
+  quiche_config_set_max_idle_timeout(pConfig, IDLE_TIMEOUT_MS);
   /*
   quiche_config_set_max_packet_size(pConfig, MAX_DATAGRAM_SIZE);
   quiche_config_set_initial_max_data(pConfig, 10000000);
@@ -58,7 +83,7 @@ bool QUICClient::initialize() {
   hints.ai_socktype = SOCK_DGRAM;
   hints.ai_protocol = IPPROTO_UDP;
 
-  if (getaddrinfo("192.168.178.20", "1337", &hints, &pPeer) != 0) {
+  if (getaddrinfo(host.c_str(), port.c_str(), &hints, &pPeer) != 0) {
     perror("[UDP] Failed to resolve host.");
     return false;
   }
@@ -71,7 +96,7 @@ bool QUICClient::initialize() {
 
   if (fcntl(socketRef, F_SETFL, O_NONBLOCK) != 0) {
     perror("[UDP] Failed to make socket non-blocking\n");
-    return -1;
+    return false;
   }
 
   if (connect(socketRef, pPeer->ai_addr, pPeer->ai_addrlen) < 0) {
@@ -84,51 +109,30 @@ bool QUICClient::initialize() {
   int rng = open("/dev/urandom", O_RDONLY);
   if (rng < 0) {
       perror("[QUIC] Failed to open /dev/urandom\n");
-      return -1;
+      return false;
   }
 
   ssize_t rand_len = read(rng, &scid, sizeof(scid));
+  close(rng);
   if (rand_len < 0) {
       perror("[QUIC] Failed to create connection ID\n");
-      return -1;
+      return false;
   }
 
   // Connect with quiche
-  pQuicheRef = quiche_connect("192.168.178.20", (const uint8_t *) scid,
+  pQuicheRef = quiche_connect(host.c_str(), (const uint8_t *) scid,
                                       sizeof(scid), pConfig);
   if (pQuicheRef == NULL) {
     fprintf(stderr, "[QUIC] Failed to create connection\n");
-    return -1;
+    return false;
   }
   
   return true;
 }
 
 void QUICClient::tick() {
-  auto isEstablished = quiche_conn_is_established(pQuicheRef);
-  auto isEarlyStage = quiche_conn_is_in_early_data(pQuicheRef);
-  auto isClosed = quiche_conn_is_closed(pQuicheRef);
-  //printf("Client state %s %s %s\n", isEstablished ? "true" : "false", isEarlyStage ? "true" : "false", isClosed ? "true" : "false");
-
-  // Send out all QUIC packets over UDP.
-  while (true) {
-    ssize_t written = quiche_conn_send(pQuicheRef, pSendBuffer, sizeof(pSendBuffer));
-    if (written != QUICHE_ERR_DONE) {
-      if (written < 0) {
-        fprintf(stderr, "[QUIC] Failed to create packet: %zd\n", written);
-        return;
-      }
-
-      ssize_t sent = send(socketRef, pSendBuffer, written, 0);
-      if (sent != written) {
-        perror("[UDP] Failed to send packet.\n");
-        return;
-      }
-
-      //printf("[QUIC] Send QUIC packet to server (size: %zd)\n", written);
-    } else {
-      break;
-    }
+  if (!pQuicheRef) {
+    return;
   }
 
   // Handle all incoming packets to QUIC
@@ -159,16 +163,10 @@ void QUICClient::tick() {
     }
   }
 
-  static bool hasSent = false;
-  if (quiche_conn_is_established(pQuicheRef) && !hasSent) {
-    const static uint8_t r[] = "GET /raw/stream.h264\r\n";
-    auto sent = quiche_conn_stream_send(pQuicheRef, 4, r, sizeof(r), true);
-    if (sent < 0) {
-        fprintf(stderr, "Failed to send HTTP request (error: %d)\n", sent);
-        return;
-    }
-    printf("[QUIC] Send request to retrieve raw stream\n");
-    hasSent = true;
+  // A resumed session can carry the request as 0-RTT data, otherwise it goes out with
+  // the first packet after the handshake.
+  if (!requestSent && (quiche_conn_is_established(pQuicheRef) || quiche_conn_is_in_early_data(pQuicheRef))) {
+    sendRequest();
   }
 
   // Handle packets after QUIC parsed
@@ -189,18 +187,253 @@ void QUICClient::tick() {
         break;
       }
 
+      // Cursor updates come on their own stream and never wait for video data.
+      if (s == CURSOR_STREAM_ID && pCursor) {
+        pCursor->push((uint8_t*)pBuffer, recv_len);
+        continue;
+      }
+      if (s == INPUT_STREAM_ID && inputEnabled) {
+        handleInputAcks((uint8_t*)pBuffer, recv_len);
+        continue;
+      }
+
       count++;
       received += recv_len;
+      if (joinStats.firstByteUs == 0 && recv_len > 0) {
+        joinStats.firstByteUs = nowMicros();
+      }
+
+      // Hand out every slice that is complete now, no need to wait for the whole frame.
+      if (pDataSink) {
+        pDataSink->onStreamData((uint8_t*)pBuffer, recv_len);
+      } else {
+        reader.push((uint8_t*)pBuffer, recv_len, this);
+      }
 
       if (fin) {
+        reader.flush(this);
         printf("[QUIC] FIN: Received %d packets that contained a total of %d\n", count, received);
         received = 0;
         count = 0;
       } else {
-        printf("[QUIC] Received %d packets that contained a total of %d\n", 1, recv_len);
+        //printf("[QUIC] Received %d packets that contained a total of %d\n", 1, recv_len);
       };
     }
 
     quiche_stream_iter_free(readable);
   }
-}
\ No newline at end of file
+
+  // Acks, the request and input leave in the same tick they were created in.
+  flushInput();
+  flushPackets();
+}
+
+void QUICClient::sendRequest() {
+  std::string request = "GET /raw/" + streamName + ".h264\r\n";
+  auto sent = quiche_conn_stream_send(pQuicheRef, VIDEO_STREAM_ID, (const uint8_t*)request.c_str(), request.size() + 1, true);
+  if (sent < 0) {
+      fprintf(stderr, "Failed to send HTTP request (error: %zd)\n", sent);
+      return;
+  }
+
+  // The input stream stays open, the events follow the request.
+  if (inputEnabled) {
+    std::string inputRequest = "GET /input/" + streamName + ".input\r\n";
+    inputOut.insert(inputOut.begin(), inputRequest.c_str(), inputRequest.c_str() + inputRequest.size() + 1);
+  }
+
+  if (pCursor) {
+    std::string cursorRequest = "GET /cursor/" + streamName + ".cursor\r\n";
+    if (quiche_conn_stream_send(pQuicheRef, CURSOR_STREAM_ID, (const uint8_t*)cursorRequest.c_str(), cursorRequest.size() + 1, true) < 0) {
+      fprintf(stderr, "Failed to request the cursor\n");
+    }
+  }
+
+  requestSent = true;
+  joinStats.requestSentUs = nowMicros();
+  joinStats.earlyData = !quiche_conn_is_established(pQuicheRef);
+  printf("[QUIC] Send request to retrieve raw stream %s%s\n", streamName.c_str(), joinStats.earlyData ? " (0-RTT)" : "");
+}
+
+void QUICClient::sendInput(const InputEvent& event) {
+  if (inputEnabled) {
+    inputBatcher.push(event);
+  }
+}
+
+void QUICClient::flushInput() {
+  if (!inputEnabled || !requestSent) {
+    return;
+  }
+
+  // A batch cut by flow control is finished before the next one is started.
+  while (true) {
+    if (inputOutOffset == inputOut.size()) {
+      inputOut.clear();
+      inputOutOffset = 0;
+      if (inputBatcher.flush(nowMicros(), inputOut) == 0) {
+        return;
+      }
+    }
+
+    ssize_t sent = quiche_conn_stream_send(pQuicheRef, INPUT_STREAM_ID, inputOut.data() + inputOutOffset,
+                                           inputOut.size() - inputOutOffset, false);
+    if (sent > 0) {
+      inputOutOffset += sent;
+    }
+    if (inputOutOffset < inputOut.size()) {
+      return;
+    }
+  }
+}
+
+void QUICClient::handleInputAcks(const uint8_t* data, size_t len) {
+  inputReader.push(data, len);
+
+  InputMessage type;
+  InputBatch batch;
+  InputAck ack;
+  while (inputReader.next(&type, &batch, &ack)) {
+    if (type != InputMessage::Ack) {
+      continue;
+    }
+
+    uint64_t roundTrip = nowMicros() - ack.sendTimeUs;
+    uint64_t server = (uint64_t)ack.injectUs + ack.captureUs + ack.sendUs;
+    uint64_t total = ack.queuedUs + roundTrip;
+
+    inputStats.acks++;
+    inputStats.queuedUs += ack.queuedUs;
+    inputStats.networkUs += roundTrip > server ? roundTrip - server : 0;
+    inputStats.injectUs += ack.injectUs;
+    inputStats.captureUs += ack.captureUs;
+    inputStats.sendUs += ack.sendUs;
+    inputStats.totalUs += total;
+    inputStats.maxTotalUs = std::max(inputStats.maxTotalUs, total);
+  }
+}
+
+void QUICClient::debugInput() {
+  uint64_t acks = inputStats.acks == 0 ? 1 : inputStats.acks;
+
+  printf("\n\n---------------------------------------------\n");
+  printf("Input stats:\n");
+  printf("  Events: %llu in %llu batches (%llu coalesced)\n", (unsigned long long)inputBatcher.getEvents(),
+         (unsigned long long)inputBatcher.getBatches(), (unsigned long long)inputBatcher.getCoalesced());
+  printf("  Acked batches: %llu\n", (unsigned long long)inputStats.acks);
+  printf("  Queued on the client: %lluus\n", (unsigned long long)(inputStats.queuedUs / acks));
+  printf("  Network (both ways): %lluus\n", (unsigned long long)(inputStats.networkUs / acks));
+  printf("  Server receive to inject: %lluus\n", (unsigned long long)(inputStats.injectUs / acks));
+  printf("  Inject to next capture: %lluus\n", (unsigned long long)(inputStats.captureUs / acks));
+  printf("  Capture to send: %lluus\n", (unsigned long long)(inputStats.sendUs / acks));
+  printf("  Input to frame: avg %lluus, max %lluus\n", (unsigned long long)(inputStats.totalUs / acks),
+         (unsigned long long)inputStats.maxTotalUs);
+  printf("---------------------------------------------\n");
+
+  inputStats = InputStats();
+}
+
+void QUICClient::flushPackets() {
+  // Send out all QUIC packets over UDP.
+  while (true) {
+    ssize_t written = quiche_conn_send(pQuicheRef, pSendBuffer, sizeof(pSendBuffer));
+    if (written == QUICHE_ERR_DONE) {
+      break;
+    }
+
+    if (written < 0) {
+      fprintf(stderr, "[QUIC] Failed to create packet: %zd\n", written);
+      return;
+    }
+
+    ssize_t sent = send(socketRef, pSendBuffer, written, 0);
+    if (sent != written) {
+      perror("[UDP] Failed to send packet.\n");
+      return;
+    }
+
+    //printf("[QUIC] Send QUIC packet to server (size: %zd)\n", written);
+  }
+}
+
+void QUICClient::wait(int maxMs) {
+  if (!pQuicheRef) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(maxMs));
+    return;
+  }
+
+  // Wake up for the next quiche timer (loss detection, idle timeout) at the latest.
+  uint64_t timerMs = quiche_conn_timeout_as_millis(pQuicheRef);
+  int timeout = timerMs < (uint64_t)maxMs ? (int)timerMs : maxMs;
+
+  struct pollfd fd = {};
+  fd.fd = socketRef;
+  fd.events = POLLIN;
+  if (poll(&fd, 1, timeout) == 0 && timerMs <= (uint64_t)maxMs) {
+    quiche_conn_on_timeout(pQuicheRef);
+  }
+}
+
+bool QUICClient::reconnect() {
+  cleanup();
+  return initialize();
+}
+
+bool QUICClient::getStats(quiche_stats* stats) const {
+  if (!pQuicheRef) {
+    return false;
+  }
+
+  quiche_conn_stats(pQuicheRef, stats);
+  return true;
+}
+
+bool JoinTracker::onNalUnit(const uint8_t* data, size_t len) {
+  if (firstDecodableUs != 0) {
+    return false;
+  }
+
+  bool keyFrameSlice = nalUnitType(data, len) == NAL_UNIT_IDR;
+  if (keyFrameSlice && firstKeyFrameUs == 0) {
+    firstKeyFrameUs = nowMicros();
+    receivingKeyFrame = true;
+  } else if (!keyFrameSlice && receivingKeyFrame) {
+    // Whatever follows the IDR slices means the IDR frame is complete.
+    firstDecodableUs = nowMicros();
+    receivingKeyFrame = false;
+    return true;
+  }
+  return false;
+}
+
+void QUICClient::onNalUnit(const uint8_t* data, size_t len) {
+  if (joinTracker.onNalUnit(data, len)) {
+    completeJoin(joinTracker.firstKeyFrameUs, joinTracker.firstDecodableUs);
+  }
+
+  if (pNalSink) {
+    pNalSink->onNalUnit(data, len);
+  }
+}
+
+void QUICClient::completeJoin(uint64_t firstKeyFrameUs, uint64_t firstDecodableUs) {
+  joinStats.firstKeyFrameUs = firstKeyFrameUs;
+  joinStats.firstDecodableUs = firstDecodableUs;
+  debugJoin();
+}
+
+void QUICClient::debugJoin() {
+  long long start = joinStats.connectStartUs;
+  long long request = joinStats.requestSentUs;
+
+  printf("\n\n---------------------------------------------\n");
+  printf("Join stats:\n");
+  printf("  Connection: %u (%s)\n", joinStats.connects, joinStats.earlyData ? "0-RTT request" : "full handshake");
+  printf("  Handshake: %lldms\n", (request - start) / 1000);
+  printf("  Connect to first byte: %lldms\n", ((long long)joinStats.firstByteUs - start) / 1000);
+  printf("  Request to first byte: %lldms\n", ((long long)joinStats.firstByteUs - request) / 1000);
+  printf("  Request to first IDR slice: %lldms\n", ((long long)joinStats.firstKeyFrameUs - request) / 1000);
+  printf("  Request to first decodable frame: %lldms\n", ((long long)joinStats.firstDecodableUs - request) / 1000);
+  printf("  Connect to first decodable frame: %lldms\n", ((long long)joinStats.firstDecodableUs - start) / 1000);
+  printf("---------------------------------------------\n");
+}
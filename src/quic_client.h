@@ -1,6 +1,7 @@
 #ifndef _QUIC_CLIENT_H_
 #define _QUIC_CLIENT_H_
 
+#include <string>
 #include <vector>
 #include <map>
 #include <sstream>
@@ -15,6 +16,7 @@
 #include <fcntl.h>
 #include <errno.h>
 
+#include <poll.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netdb.h>
@@ -24,10 +26,73 @@
 /// Decides how big raw udp packages are
 #define MAX_DATAGRAM_SIZE 1350
 #define LOCAL_CONN_ID_LEN 16
+/// A connection that did not hear from the server for this long is closed and redone.
+#define IDLE_TIMEOUT_MS 10000
+/// Stream the video is requested on.
+#define VIDEO_STREAM_ID 4
+/// Stream the cursor is requested on, it is independent of the video stream.
+#define CURSOR_STREAM_ID 0
+/// Stream keyboard and mouse events are sent on, the server acks on it.
+#define INPUT_STREAM_ID 8
 
 #include <quiche.h>
 
-class QUICClient {
+#include "annexb_reader.h"
+#include "cursor_protocol.h"
+#include "encoded_slice.h"
+#include "input_protocol.h"
+
+/// Timestamps (steady clock, microseconds) of joining a stream, 0 until they happened.
+struct JoinStats {
+  uint64_t connectStartUs = 0;
+  uint64_t requestSentUs = 0;
+  uint64_t firstByteUs = 0;
+  /// First slice of the first IDR frame.
+  uint64_t firstKeyFrameUs = 0;
+  /// First NAL unit after the IDR frame, from here on the first frame can be decoded.
+  uint64_t firstDecodableUs = 0;
+  /// Set if the request went out as 0-RTT data of a resumed session.
+  bool earlyData = false;
+  /// Connections made so far, everything after the first one is a reconnect.
+  uint32_t connects = 0;
+};
+
+/// Watches the NAL units of a connection for the end of its first IDR frame.
+struct JoinTracker {
+  uint64_t firstKeyFrameUs = 0;
+  uint64_t firstDecodableUs = 0;
+  bool receivingKeyFrame = false;
+
+  /// Returns true once, for the first unit after the first IDR frame.
+  bool onNalUnit(const uint8_t* data, size_t len);
+};
+
+/// Input latency of the acked batches, split into the hops. Photon is approximated by the
+/// ack, which the server sends with the first slice of the first frame captured after the
+/// batch was injected.
+struct InputStats {
+  uint64_t acks = 0;
+  /// Event until the batch was sent.
+  uint64_t queuedUs = 0;
+  /// Both ways over the network, what the server did not account for.
+  uint64_t networkUs = 0;
+  uint64_t injectUs = 0;
+  uint64_t captureUs = 0;
+  uint64_t sendUs = 0;
+  /// Event until the ack arrived.
+  uint64_t totalUs = 0;
+  uint64_t maxTotalUs = 0;
+};
+
+/// Receiver for the raw bytes of the video stream, before they are split into NAL units.
+class StreamDataSink {
+  public:
+    virtual ~StreamDataSink() {}
+
+    virtual void onStreamData(const uint8_t* data, size_t len) = 0;
+};
+
+class QUICClient : public NalSink {
   private:
     /// QUICHE Config object.
     quiche_config* pConfig = nullptr;
@@ -38,15 +103,83 @@ class QUICClient {
     uint8_t pSendBuffer[MAX_DATAGRAM_SIZE];
 
     // Socket
-    int socketRef;
-    struct addrinfo *pPeer;
+    int socketRef = -1;
+    struct addrinfo *pPeer = nullptr;
+    /// Server to connect to.
+    std::string host = "192.168.178.20";
+    std::string port = "1337";
+
+    /// Splits the received stream into NAL units.
+    AnnexBReader reader;
+    /// Receives every NAL unit as soon as it is complete (decoder).
+    NalSink* pNalSink = nullptr;
+    /// Takes the stream as received instead of NAL units, e.g. to forward it.
+    StreamDataSink* pDataSink = nullptr;
+    /// Cursor drawn on top of the video, requested next to the video if set.
+    CursorState* pCursor = nullptr;
+    /// Keyboard and mouse events waiting for the next tick.
+    InputBatcher inputBatcher;
+    InputReader inputReader;
+    bool inputEnabled = false;
+    /// Batch quiche did not take completely yet.
+    std::vector<uint8_t> inputOut;
+    size_t inputOutOffset = 0;
+    InputStats inputStats;
+    /// Name of the stream requested from the server.
+    std::string streamName = "stream";
+    /// Time to first decodable frame.
+    JoinStats joinStats;
+    JoinTracker joinTracker;
+    bool requestSent = false;
 
   public:
     bool initialize();
+    /// Handles received packets, sends the request once possible and flushes everything queued.
     void tick();
+    /// Blocks until a packet arrived, a quiche timer expired or `maxMs` passed.
+    void wait(int maxMs);
+    /// Drops the connection and connects again, stream name and sinks stay.
+    bool reconnect();
     void cleanup();
 
+    /// Sets the consumer that gets every slice right after it arrived.
+    void setNalSink(NalSink* sink) { pNalSink = sink; }
+    /// Sets a consumer for the raw stream, NAL units are not split out then.
+    void setDataSink(StreamDataSink* sink) { pDataSink = sink; }
+    /// Receives the cursor of the stream, the server does not draw it into the video.
+    void setCursorState(CursorState* cursor) { pCursor = cursor; }
+    /// Opens the input stream with the next request, must be called before initialize.
+    void setInputEnabled(bool enabled) { inputEnabled = enabled; }
+    /// Queues an event, everything queued goes out as one batch with the next tick.
+    void sendInput(const InputEvent& event);
+    void setStreamName(const std::string& name) { streamName = name; }
+    /// Sets the server to connect to, must be called before initialize.
+    void setServer(const std::string& host, const std::string& port) { this->host = host; this->port = port; }
+
+    const JoinStats& getJoinStats() const { return joinStats; }
+    bool isClosed() const { return !pQuicheRef || quiche_conn_is_closed(pQuicheRef); }
+    /// Statistics of the connection to the server (rtt, loss, ...).
+    bool getStats(quiche_stats* stats) const;
+
+    /// Watches for the first decodable frame and passes the unit on to the nal sink.
+    void onNalUnit(const uint8_t* data, size_t len) override;
+    /// Fills in the NAL unit timestamps of the join stats and prints them. For consumers
+    /// that split the stream themselves (see setDataSink()), call from the ticking thread.
+    void completeJoin(uint64_t firstKeyFrameUs, uint64_t firstDecodableUs);
+
     ~QUICClient() { this->cleanup(); }
+
+  private:
+    void sendRequest();
+    void flushPackets();
+    void debugJoin();
+    /// Sends the queued events once the input stream is open.
+    void flushInput();
+    void handleInputAcks(const uint8_t* data, size_t len);
+
+  public:
+    const InputStats& getInputStats() const { return inputStats; }
+    void debugInput();
 };
 
 #endif
@@ -1,7 +1,45 @@
+#include <algorithm>
+
 #include "quic_server.h"
 
+/// Error code of the last failed socket call.
+static int socket_error() {
+#ifdef _WIN32
+  return WSAGetLastError();
+#else
+  return errno;
+#endif
+}
+
+static bool socket_would_block(int error) {
+#ifdef _WIN32
+  return error == WSAEWOULDBLOCK;
+#else
+  return error == EAGAIN || error == EWOULDBLOCK;
+#endif
+}
+
 void QUICServer::cleanup() {
+  for (auto iter = clientRefs.begin(); iter != clientRefs.end(); iter++) {
+    if (iter->second.subscriber) {
+      if (pRouter) {
+        pRouter->unsubscribe(iter->second.subscriber);
+      }
+      delete iter->second.subscriber;
+    }
+    quiche_conn_free(iter->second.quiche_ref);
+  }
+  clientRefs.clear();
+  initialConnIds.clear();
+
+  if (pServerSocket != INVALID_SOCKET) {
+    closesocket(pServerSocket);
+    pServerSocket = INVALID_SOCKET;
+  }
+
+#ifdef _WIN32
   WSACleanup();
+#endif
 
   if (pConfig) {
     quiche_config_free(pConfig);
@@ -9,20 +47,22 @@ void QUICServer::cleanup() {
   }
 }
 
-static void debug_log(const char *line, void *argp) {
+static void debug_log(const char * /*line*/, void * /*argp*/) {
   //fprintf(stderr, "[QUICHE DEBUG] %s\n", line);
 }
 
-bool QUICServer::initialize() {
+bool QUICServer::initialize(uint16_t port) {
+#ifdef _WIN32
   // Initialize winsock
 	if (WSAStartup(MAKEWORD(2,2), &pWSA) != 0) {
 		printf("Could not load winsock2.2 (error code: %d)\n", WSAGetLastError());
     return false;
 	}
+#endif
   
   // Initialize server socket. 
   if((pServerSocket = socket(AF_INET , SOCK_DGRAM , 0 )) == INVALID_SOCKET) {
-		printf("Could not create server socket (error code: %d)\n", WSAGetLastError());
+		printf("Could not create server socket (error code: %d)\n", socket_error());
     return false;
 	}
 
@@ -30,18 +70,22 @@ bool QUICServer::initialize() {
   struct sockaddr_in serverAddr;
   serverAddr.sin_family = AF_INET;
 	serverAddr.sin_addr.s_addr = INADDR_ANY;
-	serverAddr.sin_port = htons(1337);
+	serverAddr.sin_port = htons(port);
 
   // Bind to address.
 	if(bind(pServerSocket ,(struct sockaddr *)&serverAddr, sizeof(serverAddr)) == SOCKET_ERROR) {
-		printf("Failed to bind to port 1337 (error code: %d)\n", WSAGetLastError());
+		printf("Failed to bind to port %u (error code: %d)\n", port, socket_error());
     return false;
 	}
 
   // Set socket to non-blocking
+#ifdef _WIN32
   u_long mode = 1;
   if (ioctlsocket(pServerSocket, FIONBIO, &mode) != NO_ERROR) {
-		printf("Failed to set socket to non-blocking (error code: %d)\n", WSAGetLastError());
+#else
+  if (fcntl(pServerSocket, F_SETFL, O_NONBLOCK) != 0) {
+#endif
+		printf("Failed to set socket to non-blocking (error code: %d)\n", socket_error());
     return false;
   }
 
@@ -67,6 +111,14 @@ bool QUICServer::initialize() {
   quiche_config_set_initial_max_stream_data_bidi_remote(pConfig, 0x0FFFFFFFFFFFFFFF);
   quiche_config_set_initial_max_streams_bidi(pConfig, 0x0FFFFFFFFFFFFFFF);
   quiche_config_set_cc_algorithm(pConfig, QUICHE_CC_RENO);
+  quiche_config_set_max_idle_timeout(pConfig, SERVER_IDLE_TIMEOUT_MS);
+
+  // Retry tokens and connection ids of retries.
+  if (!retryTokens.initialize()) {
+    return false;
+  }
+  std::random_device random;
+  connectionIdRandom.seed(((uint64_t)random() << 32) | random());
 
   return true;
 }
@@ -81,123 +133,558 @@ std::string hexStr(char *data, int len) {
   return ss.str();
 }
 
-/// Generate a stateless retry token.
-///
-/// The token includes the static string `"quiche"` followed by the IP address
-/// of the client and by the original destination connection ID generated by the
-/// client.
-///
-/// Note that this function is only an example and doesn't do any cryptographic
-/// authenticate of the token. *It should not be used in production system*.
-static void mint_token(const uint8_t *dcid, size_t dcid_len,
-                       struct sockaddr_in *addr, int addr_len,
-                       uint8_t *token, size_t *token_len) {
-  memcpy(token, "quiche", sizeof("quiche") - 1);
-  memcpy(token + sizeof("quiche") - 1, addr, addr_len);
-  memcpy(token + sizeof("quiche") - 1 + addr_len, dcid, dcid_len);
-  *token_len = sizeof("quiche") - 1 + addr_len + dcid_len;
-}
-
-static bool validate_mint_token(const uint8_t *token, size_t token_len,
-                           struct sockaddr_in *addr, int addr_len,
-                           uint8_t *odcid, size_t *odcid_len) {
-    if ((token_len < sizeof("quiche") - 1) ||
-         memcmp(token, "quiche", sizeof("quiche") - 1)) {
-        return false;
+/// Bytes identifying the client address a retry token is bound to (ip and port).
+static void address_bytes(const struct sockaddr_in* addr, uint8_t* out) {
+  memcpy(out, &addr->sin_addr, 4);
+  memcpy(out + 4, &addr->sin_port, 2);
+}
+
+void ClientSubscriber::onSlice(const EncodedSlice& slice) {
+  pServer->sendSlice(*pClient, slice);
+}
+
+/// Bytes `queued` puts on the stream, the delimiter included.
+static size_t queued_bytes(const QueuedSlice& queued) {
+  return queued.slice.payload->size() + (queued.delimited ? sizeof(ACCESS_UNIT_DELIMITER) : 0);
+}
+
+void QUICServer::sendSlice(ClientRef& client, const EncodedSlice& slice) {
+  if (!client.streaming || quiche_conn_is_closed(client.quiche_ref)) {
+    return;
+  }
+
+  if (client.backlogBytes + slice.payload->size() > CLIENT_BACKLOG_MAX_BYTES && !client.skipToKeyFrame) {
+    dropBacklog(client);
+  }
+
+  // The decoder can only pick up again at an IDR, anything before it is useless.
+  if (client.skipToKeyFrame) {
+    if (!slice.keyFrame || slice.sliceIndex != 0) {
+      statsBacklogDrops++;
+      metricBacklogDrops.add();
+      return;
     }
+    client.skipToKeyFrame = false;
+  }
 
-    token += sizeof("quiche") - 1;
-    token_len -= sizeof("quiche") - 1;
+  // The client can only tell a NAL unit is complete once the next start code arrived.
+  // Close the last slice of a frame with a delimiter instead of holding it back until
+  // the next frame, a relayed stream already carries one.
+  bool delimited = slice.lastInFrame && !endsWithAccessUnitDelimiter(slice.payload->data(), slice.payload->size());
+
+  // Keep the byte order of the stream, nothing overtakes the backlog.
+  client.backlog.push_back({ slice, client.replaying, delimited });
+  client.backlogBytes += queued_bytes(client.backlog.back());
+  sendBacklog(client);
+  if (client.input) {
+    ackInput(client, slice);
+  }
 
-    if ((token_len < addr_len) || memcmp(token, addr, addr_len)) {
-        return false;
+  // Do not wait for the rest of the frame, get the slice on the wire now.
+  flushClient(client);
+}
+
+size_t QUICServer::getBacklogBytes() const {
+  size_t bytes = 0;
+  for (auto& entry : clientRefs) {
+    bytes += entry.second.backlogBytes;
+  }
+  return bytes;
+}
+
+void QUICServer::dropBacklog(ClientRef& client) {
+  // A partially queued slice has to be completed, the stream would be corrupt otherwise.
+  size_t kept = client.backlogOffset > 0 ? 1 : 0;
+  size_t dropped = client.backlog.size() - kept;
+  while (client.backlog.size() > kept) {
+    client.backlogBytes -= queued_bytes(client.backlog.back());
+    client.backlog.pop_back();
+  }
+
+  client.skipToKeyFrame = true;
+  statsBacklogDrops += dropped;
+  metricBacklogDrops.add(dropped);
+  printf("[QUIC] Backlog of a client exceeded %d KB, dropped %zd slices, waiting for the next IDR\n",
+         CLIENT_BACKLOG_MAX_BYTES / 1024, dropped);
+}
+
+void QUICServer::onSliceAccepted(const QueuedSlice& queued) {
+  metricSliceBytes.add(queued.slice.payload->size());
+  if (queued.replayed) {
+    statsSlicesReplayed++;
+    metricSlicesReplayed.add();
+    return;
+  }
+
+  long long latency = (long long)(nowMicros() - queued.slice.captureTimeUs);
+  metricSlicesSent.add();
+  metricSendLatency.observe(latency > 0 ? (uint64_t)latency : 0);
+  statsSlicesSent++;
+  statsSendLatency += latency;
+  if (latency > statsMaxSendLatency) {
+    statsMaxSendLatency = latency;
+  }
+}
+
+void QUICServer::debugSession() {
+  long long slices = statsSlicesSent == 0 ? 1 : statsSlicesSent;
+
+  printf("\n\n---------------------------------------------\n");
+  printf("QUIC server stats:\n");
+  printf("  Clients: %zd\n", clientRefs.size());
+  printf("  Slices sent: %lld (replayed: %lld, dropped from backlogs: %lld)\n", statsSlicesSent, statsSlicesReplayed, statsBacklogDrops);
+  printf("  Send latency: avg %lldus, max %lldus\n", statsSendLatency / slices, statsMaxSendLatency);
+  printf("  Accepted without retry: %lld\n", statsAcceptedWithoutRetry);
+  printf("  Retries: %lld (tokens minted: %lld, validated: %lld, rejected: %lld, expired: %lld)\n",
+         statsRetries, retryTokens.getMinted(), retryTokens.getValidated(),
+         retryTokens.getRejected(), retryTokens.getExpired());
+  printf("  Dropped packets: %lld\n", statsDropped);
+  printf("  Cursor updates: %lld (%lld bytes)\n", statsCursorUpdates, statsCursorBytes);
+  printf("  Input: %lld events in %lld batches (%lld sequence gaps)\n", statsInputEvents, statsInputBatches, statsInputGaps);
+  printf("---------------------------------------------\n");
+
+  statsSlicesSent = 0;
+  statsSlicesReplayed = 0;
+  statsBacklogDrops = 0;
+  statsSendLatency = 0;
+  statsMaxSendLatency = 0;
+  statsAcceptedWithoutRetry = 0;
+  statsRetries = 0;
+  statsDropped = 0;
+  statsCursorUpdates = 0;
+  statsCursorBytes = 0;
+  statsInputEvents = 0;
+  statsInputBatches = 0;
+  statsInputGaps = 0;
+}
+
+void QUICServer::registerMetrics(MetricsRegistry& registry) {
+  registry.addCounter("brocky_server_slices_sent_total", "Live slices quiche accepted.", "", &metricSlicesSent);
+  registry.addCounter("brocky_server_slices_replayed_total", "Slices of replayed GOPs quiche accepted.", "", &metricSlicesReplayed);
+  registry.addCounter("brocky_server_backlog_dropped_slices_total", "Slices dropped because a client backlog overflowed.", "", &metricBacklogDrops);
+  registry.addCounter("brocky_server_slice_bytes_total", "Slice bytes handed to quiche.", "", &metricSliceBytes);
+  registry.addCounter("brocky_server_packets_sent_total", "UDP packets sent.", "", &metricPacketsSent);
+  registry.addCounter("brocky_server_packet_bytes_total", "UDP bytes sent.", "", &metricPacketBytes);
+  registry.addCounter("brocky_server_dropped_packets_total", "Received packets dropped without a reply.", "", &metricDropped);
+  registry.addCounter("brocky_server_retries_total", "Retry packets sent to new clients.", "", &metricRetries);
+  registry.addCounter("brocky_server_connections_total", "Connections accepted.", "", &metricConnections);
+  registry.addGauge("brocky_server_clients", "Open connections.", "", &metricClients);
+  registry.addGauge("brocky_server_backlog_bytes", "Video bytes of all clients waiting for flow or congestion control.", "", &metricBacklogBytes);
+  registry.addHistogram("brocky_server_send_latency_seconds", "Capture until the slice was handed to quiche.", "", &metricSendLatency);
+  registry.addCollector(this);
+}
+
+void QUICServer::snapshotMetrics() {
+  lastMetricsSnapshotUs = nowMicros();
+
+  std::lock_guard<std::mutex> guard(metricsLock);
+  connectionMetrics.clear();
+
+  uint64_t totalBacklog = 0;
+  for (auto& entry : clientRefs) {
+    ClientRef& client = entry.second;
+    quiche_stats stats;
+    quiche_conn_stats(client.quiche_ref, &stats);
+
+    ConnectionMetrics metrics;
+    metrics.connection = entry.first;
+    metrics.streamId = -1;
+    uint32_t streamId = 0;
+    if (client.subscriber && pRouter && pRouter->getSubscribedStream(client.subscriber, &streamId)) {
+      metrics.streamId = streamId;
     }
+    metrics.rttNs = stats.rtt;
+    metrics.cwnd = stats.cwnd;
+    metrics.packetsSent = stats.sent;
+    metrics.packetsReceived = stats.recv;
+    metrics.packetsLost = stats.lost;
+    metrics.deliveryRate = stats.delivery_rate;
+    metrics.backlogBytes = client.backlogBytes;
+    totalBacklog += metrics.backlogBytes;
+    connectionMetrics.push_back(metrics);
+  }
 
-    token += addr_len;
-    token_len -= addr_len;
+  metricClients.set((int64_t)clientRefs.size());
+  metricBacklogBytes.set((int64_t)totalBacklog);
+}
 
-    if (*odcid_len < token_len) {
+void QUICServer::collectMetrics(MetricsWriter& writer) {
+  std::lock_guard<std::mutex> guard(metricsLock);
+
+  // One metric after the other, the series of a metric have to be grouped.
+  std::vector<std::string> labels;
+  for (auto& metrics : connectionMetrics) {
+    labels.push_back("connection=\"" + metrics.connection + "\",stream=\"" + std::to_string(metrics.streamId) + "\"");
+  }
+  for (size_t i = 0; i < connectionMetrics.size(); i++) {
+    writer.gauge("brocky_connection_rtt_seconds", "Smoothed rtt of the connection.", labels[i], connectionMetrics[i].rttNs / 1000000000.0);
+  }
+  for (size_t i = 0; i < connectionMetrics.size(); i++) {
+    writer.gauge("brocky_connection_cwnd_bytes", "Congestion window of the connection.", labels[i], (double)connectionMetrics[i].cwnd);
+  }
+  for (size_t i = 0; i < connectionMetrics.size(); i++) {
+    writer.gauge("brocky_connection_delivery_rate_bytes", "Estimated delivery rate of the connection per second.", labels[i], (double)connectionMetrics[i].deliveryRate);
+  }
+  for (size_t i = 0; i < connectionMetrics.size(); i++) {
+    writer.gauge("brocky_connection_backlog_bytes", "Video bytes waiting for flow or congestion control.", labels[i], (double)connectionMetrics[i].backlogBytes);
+  }
+  for (size_t i = 0; i < connectionMetrics.size(); i++) {
+    writer.counter("brocky_connection_packets_sent_total", "Packets quiche sent on the connection.", labels[i], connectionMetrics[i].packetsSent);
+  }
+  for (size_t i = 0; i < connectionMetrics.size(); i++) {
+    writer.counter("brocky_connection_packets_received_total", "Packets quiche received on the connection.", labels[i], connectionMetrics[i].packetsReceived);
+  }
+  for (size_t i = 0; i < connectionMetrics.size(); i++) {
+    writer.counter("brocky_connection_packets_lost_total", "Packets quiche declared lost on the connection.", labels[i], connectionMetrics[i].packetsLost);
+  }
+}
+
+bool QUICServer::sendBacklog(ClientRef& client) {
+  while (!client.backlog.empty()) {
+    const QueuedSlice& queued = client.backlog.front();
+    const SlicePayload& payload = queued.slice.payload;
+
+    // The offset runs over the payload and then over the delimiter.
+    while (client.backlogOffset < queued_bytes(queued)) {
+      const uint8_t* data = payload->data() + client.backlogOffset;
+      size_t remaining = payload->size() - client.backlogOffset;
+      if (client.backlogOffset >= payload->size()) {
+        data = ACCESS_UNIT_DELIMITER + (client.backlogOffset - payload->size());
+        remaining = queued_bytes(queued) - client.backlogOffset;
+      }
+
+      ssize_t sent = quiche_conn_stream_send(client.quiche_ref, client.stream_id, data, remaining, false);
+      if (sent < 0) {
+        return false;
+      }
+
+      client.backlogOffset += sent;
+      client.backlogBytes -= sent;
+      if ((size_t)sent < remaining) {
         return false;
+      }
     }
 
-    memcpy(odcid, token, token_len);
-    *odcid_len = token_len;
+    onSliceAccepted(client.backlog.front());
+    client.backlog.pop_front();
+    client.backlogOffset = 0;
+  }
 
-    return true;
+  return true;
+}
+
+void QUICServer::handleRequest(ClientRef& client, uint64_t streamId, const char* request, size_t len) {
+  uint32_t id = 0;
+  if (!pRouter || !pRouter->resolveRequest(request, len, &id)) {
+    printf("[QUIC] Client requested unknown stream: %.*s\n", (int)len, request);
+    quiche_conn_stream_send(client.quiche_ref, streamId, nullptr, 0, true);
+    return;
+  }
+
+  // Simulcast streams start on the lowest layer, it joins quickest.
+  std::vector<StreamLayer> layers = pRouter->getLayers(id);
+  if (pRouter->isBaseStream(id) && layers.size() > 1) {
+    client.adaptive = client.layerSelector.initialize(layers);
+    client.lastLayerCheckUs = nowMicros();
+    id = client.layerSelector.getLayer(0).streamId;
+  }
+
+  client.stream_id = streamId;
+  client.streaming = true;
+  client.subscriber = new ClientSubscriber(this, &client);
+  client.replaying = true;
+  pRouter->subscribe(id, client.subscriber);
+  client.replaying = false;
+  printf("[QUIC] Client subscribed to stream %u on %d%s\n", id, (int)streamId, client.adaptive ? " (simulcast)" : "");
+}
+
+bool QUICServer::handleCursorRequest(ClientRef& client, uint64_t streamId, const char* request, size_t len) {
+  CursorChannel* cursor = pRouter ? pRouter->resolveCursorRequest(request, len) : nullptr;
+  if (!cursor) {
+    return false;
+  }
+
+  client.cursor = cursor;
+  client.cursorStreamId = streamId;
+  client.cursorPositionVersion = 0;
+  client.cursorShapeVersion = 0;
+  client.cursorPending.clear();
+  client.cursorPendingOffset = 0;
+  printf("[QUIC] Client subscribed to the cursor on %d\n", (int)streamId);
+  return true;
+}
+
+void QUICServer::sendCursor(ClientRef& client) {
+  // A message cut by flow control has to be finished first, the stream stays parseable.
+  if (client.cursorPendingOffset < client.cursorPending.size()) {
+    ssize_t sent = quiche_conn_stream_send(client.quiche_ref, client.cursorStreamId,
+                                           client.cursorPending.data() + client.cursorPendingOffset,
+                                           client.cursorPending.size() - client.cursorPendingOffset, false);
+    if (sent > 0) {
+      client.cursorPendingOffset += sent;
+    }
+    if (client.cursorPendingOffset < client.cursorPending.size()) {
+      return;
+    }
+  }
+
+  // Only the newest state is queued, moves that happened in between are skipped.
+  client.cursorPending.clear();
+  client.cursorPendingOffset = 0;
+  if (!client.cursor->collect(&client.cursorPositionVersion, &client.cursorShapeVersion, client.cursorPending)) {
+    return;
+  }
+
+  ssize_t sent = quiche_conn_stream_send(client.quiche_ref, client.cursorStreamId,
+                                         client.cursorPending.data(), client.cursorPending.size(), false);
+  if (sent > 0) {
+    client.cursorPendingOffset = sent;
+  }
+  statsCursorUpdates++;
+  statsCursorBytes += client.cursorPending.size();
+}
+
+bool QUICServer::handleInputRequest(ClientRef& client, uint64_t streamId, const char* request, size_t len) {
+  InputSink* input = pRouter ? pRouter->resolveInputRequest(request, len) : nullptr;
+  if (!input) {
+    return false;
+  }
+
+  client.input = input;
+  client.inputStreamId = streamId;
+  client.inputReader.reset();
+  client.lastInputSequence = 0;
+  printf("[QUIC] Client sends input on %d\n", (int)streamId);
+
+  // Events go right behind the request, the request ends with its terminator.
+  const char* end = (const char*)memchr(request, '\0', len);
+  if (end) {
+    handleInput(client, (const uint8_t*)end + 1, len - (end + 1 - request));
+  }
+  return true;
+}
+
+void QUICServer::handleInput(ClientRef& client, const uint8_t* data, size_t len) {
+  uint64_t receivedUs = nowMicros();
+  client.inputReader.push(data, len);
+
+  InputMessage type;
+  InputBatch batch;
+  InputAck ack;
+  while (client.inputReader.next(&type, &batch, &ack)) {
+    if (type != InputMessage::Batch) {
+      continue;
+    }
+
+    // The stream is reliable, a gap means the client lost its batcher state.
+    if (client.lastInputSequence != 0 && batch.sequence != client.lastInputSequence + 1) {
+      statsInputGaps++;
+    }
+    client.lastInputSequence = batch.sequence;
+
+    uint64_t oldestUs = batch.sendTimeUs;
+    for (auto& event : batch.events) {
+      client.input->onInputEvent(event);
+      oldestUs = std::min(oldestUs, event.timeUs);
+    }
+    statsInputEvents += batch.events.size();
+    statsInputBatches++;
+
+    // Only the newest batch waits for its frame, older ones would report the same frame.
+    uint64_t injectedUs = nowMicros();
+    client.pendingInputAck.sequence = batch.sequence;
+    client.pendingInputAck.sendTimeUs = batch.sendTimeUs;
+    client.pendingInputAck.queuedUs = (uint32_t)(batch.sendTimeUs - oldestUs);
+    client.pendingInputAck.injectUs = (uint32_t)(injectedUs - receivedUs);
+    client.inputInjectedUs = injectedUs;
+  }
+}
+
+void QUICServer::ackInput(ClientRef& client, const EncodedSlice& slice) {
+  if (client.pendingInputAck.sequence == 0 || slice.sliceIndex != 0 || slice.captureTimeUs < client.inputInjectedUs) {
+    return;
+  }
+
+  InputAck& ack = client.pendingInputAck;
+  ack.captureUs = (uint32_t)(slice.captureTimeUs - client.inputInjectedUs);
+  ack.sendUs = (uint32_t)(nowMicros() - slice.captureTimeUs);
+  encodeInputAck(ack, client.inputOut);
+  ack.sequence = 0;
+  sendInputAcks(client);
 }
 
-void QUICServer::tick(std::vector<std::vector<uint8_t>>* frameData) {
-  // Send frame data to all active connections.
+void QUICServer::sendInputAcks(ClientRef& client) {
+  if (client.inputOutOffset == client.inputOut.size()) {
+    return;
+  }
+
+  ssize_t sent = quiche_conn_stream_send(client.quiche_ref, client.inputStreamId,
+                                         client.inputOut.data() + client.inputOutOffset,
+                                         client.inputOut.size() - client.inputOutOffset, false);
+  if (sent > 0) {
+    client.inputOutOffset += sent;
+  }
+  if (client.inputOutOffset == client.inputOut.size()) {
+    client.inputOut.clear();
+    client.inputOutOffset = 0;
+  }
+}
+
+void QUICServer::updateLayer(ClientRef& client) {
+  uint64_t now = nowMicros();
+  if (now - client.lastLayerCheckUs < LAYER_CHECK_INTERVAL_US) {
+    return;
+  }
+  client.lastLayerCheckUs = now;
+
+  // Congestion window per round trip (rtt in nanoseconds) is what the connection carries right now.
+  quiche_stats stats;
+  quiche_conn_stats(client.quiche_ref, &stats);
+  if (stats.rtt == 0) {
+    return;
+  }
+  double throughputKbps = (double)stats.cwnd * 8.0 * 1000000.0 / (double)stats.rtt;
+
+  size_t before = client.layerSelector.getCurrent();
+  size_t layer = client.layerSelector.update(throughputKbps, now);
+  if (layer != before) {
+    const StreamLayer& target = client.layerSelector.getLayer(layer);
+    pRouter->switchLayer(client.subscriber, target.streamId);
+    printf("[QUIC] Switching client to stream %u (%u kbit/s, measured %.0f kbit/s)\n",
+           target.streamId, target.bitrateKbps, throughputKbps);
+  }
+}
+
+void QUICServer::removeClosedClients() {
+  for (auto iter = clientRefs.begin(); iter != clientRefs.end();) {
+    ClientRef& client = iter->second;
+    if (!quiche_conn_is_closed(client.quiche_ref)) {
+      iter++;
+      continue;
+    }
+
+    if (client.subscriber) {
+      if (pRouter) {
+        pRouter->unsubscribe(client.subscriber);
+      }
+      delete client.subscriber;
+    }
+    quiche_conn_free(client.quiche_ref);
+    if (!client.initialConnId.empty()) {
+      initialConnIds.erase(client.initialConnId);
+    }
+
+    printf("[QUIC] Client %s disconnected\n", iter->first.c_str());
+    iter = clientRefs.erase(iter);
+  }
+}
+
+void QUICServer::flushClient(ClientRef& client) {
+  // Get all outstanding QUIC packets and send them over.
+  while (true) {
+    ssize_t written = quiche_conn_send(client.quiche_ref, pSendBuffer, sizeof(pSendBuffer));
+    if (written == QUICHE_ERR_DONE || written < 0) {
+      break;
+    }
+
+    int sent = (int)sendto(pServerSocket, (char*)pSendBuffer, (int)written, 0,
+                           &client.addr,
+                           sizeof(client.addr));
+    // A full socket buffer loses the packet, quiche sends its data again once it is declared lost.
+    if (sent < 0) {
+      continue;
+    }
+    metricPacketsSent.add();
+    metricPacketBytes.add(sent);
+  }
+}
+
+void QUICServer::tick() {
+  // Handle requests of all active connections.
   for (auto iter = clientRefs.begin(); iter != clientRefs.end(); iter++) {
-    // Only take clients that are ready.
+    // Loss recovery and the idle timeout (reaps half open handshakes) run on quiche timers.
     auto ref = iter->second.quiche_ref;
+    if (quiche_conn_timeout_as_millis(ref) == 0) {
+      quiche_conn_on_timeout(ref);
+    }
+
+    // Only take clients that are ready.
     auto isEstablished = quiche_conn_is_established(ref);
     auto isEarlyStage = quiche_conn_is_in_early_data(ref);
-    auto isClosed = quiche_conn_is_closed(ref);
     if (isEstablished || isEarlyStage) {
       uint64_t id = 0;
 
-      // Check for readable packets. 
+      // Check for readable streams, a cursor request or the video request.
       quiche_stream_iter *readable = quiche_conn_readable(ref);
 
       while (quiche_stream_iter_next(readable, &id)) {
         bool finish = false;
-        size_t recv_len = quiche_conn_stream_recv(ref, id, (uint8_t*)pBuffer, sizeof(pBuffer), &finish);
+        ssize_t recv_len = quiche_conn_stream_recv(ref, id, (uint8_t*)pBuffer, sizeof(pBuffer), &finish);
         //printf("[QUIC] Got reable stream (size: %zd, fin: %s)\n", recv_len, finish ? "true" : "false");
-      }
-      quiche_stream_iter_free(readable);
-
-      // Force quiche to create sliced QUIC packets.
-      quiche_stream_iter *writeable = quiche_conn_writable(ref);
 
-      while (quiche_stream_iter_next(writeable, &id)) {
-        bool finish = false;
-        size_t amount = 0;
-        for (auto chunkIter = frameData->begin(); chunkIter != frameData->end(); chunkIter++) {
-          size_t recv_len = quiche_conn_stream_send(ref, id, chunkIter->data(), chunkIter->size(), false);
-          amount += chunkIter->size();
-          //printf("[QUIC] Creating QUIC packet for frame data (size: %zd)\n", recv_len);
+        if (recv_len <= 0) {
+          continue;
+        }
+        if (iter->second.input && id == iter->second.inputStreamId) {
+          handleInput(iter->second, (const uint8_t*)pBuffer, recv_len);
+          continue;
+        }
+        if (handleInputRequest(iter->second, id, pBuffer, recv_len) ||
+            handleCursorRequest(iter->second, id, pBuffer, recv_len)) {
+          continue;
+        }
+        if (!iter->second.streaming) {
+          handleRequest(iter->second, id, pBuffer, recv_len);
         }
-        printf("[QUIC] Sent %zd frame chunks with a total of %zd bytes to client %d\n", frameData->size(), amount, id);
       }
-      quiche_stream_iter_free(writeable);
+      quiche_stream_iter_free(readable);
     }
 
-    // Get all outstanding QUIC packets and send them over.
-    while (true) {
-      size_t written = quiche_conn_send(ref, pSendBuffer, sizeof(pSendBuffer));
-      if (written == QUICHE_ERR_DONE) {
-        break;
+    // The cursor is queued ahead of the video and never waits behind its backlog.
+    if (iter->second.cursor) {
+      sendCursor(iter->second);
+    }
+    if (iter->second.input) {
+      sendInputAcks(iter->second);
+    }
+    if (iter->second.streaming) {
+      sendBacklog(iter->second);
+      if (iter->second.adaptive && pRouter) {
+        updateLayer(iter->second);
       }
-
-      // Send retry packet over udp.
-      size_t sent = sendto(pServerSocket, (char*)pSendBuffer, written, 0,
-                           &iter->second.addr,
-                            sizeof(iter->second.addr));
-      
-      //printf("[QUIC] Sending QUIC packet over UDP (size: %d; actual: %d)\n", written, sent);
     }
+    flushClient(iter->second);
+  }
+
+  removeClosedClients();
+
+  if (nowMicros() - lastMetricsSnapshotUs >= METRICS_SNAPSHOT_INTERVAL_US) {
+    snapshotMetrics();
   }
 
-  // Try to read raw udp data
-  int recvLength = 0;
-  struct sockaddr_in peer_addr;
-  int peer_addr_len = sizeof(peer_addr);
-  memset(&peer_addr, 0, peer_addr_len);
+  // Read all pending raw udp data
+  while (true) {
+    int recvLength = 0;
+    struct sockaddr_in peer_addr;
+    socklen_t peer_addr_len = sizeof(peer_addr);
+    memset(&peer_addr, 0, peer_addr_len);
 
-  if ((recvLength = recvfrom(pServerSocket, pBuffer, BUFFER_LEN, 0, (struct sockaddr *)&peer_addr, &peer_addr_len)) == SOCKET_ERROR) {
-    auto error = WSAGetLastError();
+    if ((recvLength = recvfrom(pServerSocket, pBuffer, BUFFER_LEN, 0, (struct sockaddr *)&peer_addr, &peer_addr_len)) == SOCKET_ERROR) {
+      auto error = socket_error();
 
-    // Since we do not want to block we simply ignore this tick in case that there is no data.
-    if (error == WSAEWOULDBLOCK) {
+      // Since we do not want to block we simply stop once there is no more data.
+      if (!socket_would_block(error)) {
+        printf("[UDP] Failed to read from socket (error code: %d)\n", error);
+      }
       return;
     }
 
-		printf("[UDP] Failed to read from socket (error code: %d)\n", WSAGetLastError());
+    //printf("[Socket] UDP message received (length: %d)\n", recvLength);
+    handlePacket(recvLength, &peer_addr, (int)peer_addr_len);
   }
+}
 
-  //printf("[Socket] UDP message received (length: %d)\n", recvLength);
-
+void QUICServer::handlePacket(int recvLength, struct sockaddr_in* peer_addr, int peer_addr_len) {
   // Get header from quic raw data.
   uint8_t type;
   uint32_t version;
@@ -211,79 +698,187 @@ void QUICServer::tick(std::vector<std::vector<uint8_t>>* frameData) {
   uint8_t odcid[QUICHE_MAX_CONN_ID_LEN];
   size_t odcid_len = sizeof(odcid);
 
-  uint8_t token[MAX_TOKEN_LEN];
+  uint8_t token[RETRY_TOKEN_MAX_LEN];
   size_t token_len = sizeof(token);
 
   int rc = quiche_header_info((uint8_t*)pBuffer, recvLength, LOCAL_CONN_ID_LEN, &version,
                               &type, scid, &scid_len, dcid, &dcid_len,
                               token, &token_len);
+  if (rc < 0) {
+    // Garbage or a token that is not ours, not worth a log line during a flood.
+    statsDropped++;
+    metricDropped.add();
+    return;
+  }
 
   // Check if client is already registered
   auto clientKey = hexStr((char*)dcid, dcid_len);
   auto client = clientRefs.find(clientKey);
 
-  // Client has not sent a token yet -> therefore assume its a new client.
-  if (client == clientRefs.end() && token_len == 0) {
-    this->negotiateVersion(version);
-    this->createToken(scid, scid_len, dcid, dcid_len, &peer_addr, peer_addr_len, token, &token_len);
-    printf("[QUIC] Retry packet with new token generated (token: %s)\n", hexStr((char *)token, token_len).c_str());
-    printf("[QUIC] ODCID when retry was sent: %s\n", hexStr((char *)odcid, odcid_len).c_str());
-    return;
+  // Until the client switched to our connection id its Initials carry the one it picked.
+  if (client == clientRefs.end() && version != 0) {
+    auto initial = initialConnIds.find(clientKey);
+    if (initial != initialConnIds.end()) {
+      client = clientRefs.find(initial->second);
+    }
   }
 
   // Create new client if not yet happened.
   if (client == clientRefs.end()) {
-    // Validate token.
-    if (!validate_mint_token(token, token_len, &peer_addr, peer_addr_len, odcid, &odcid_len)) {
-      printf("[QUIC] Client sent invalid token ??? whyyyy\n");
+    // Only a full sized long header packet (a client Initial) may create a connection.
+    if (version == 0 || recvLength < MIN_INITIAL_LEN) {
+      statsDropped++;
+      metricDropped.add();
+      return;
+    }
+    countConnectAttempt();
+
+    uint8_t addr[6];
+    address_bytes(peer_addr, addr);
+
+    if (token_len == 0) {
+      // Under load every new client has to prove its address first, that costs a round trip
+      // but no state. Otherwise it is accepted right away.
+      if (isUnderLoad()) {
+        this->negotiateVersion(version);
+        this->createToken(scid, scid_len, dcid, dcid_len, peer_addr, peer_addr_len);
+        return;
+      }
+      // No retry happened, so there is no original destination connection id either.
+      odcid_len = 0;
+      statsAcceptedWithoutRetry++;
+    } else if (!retryTokens.validate(token, token_len, addr, sizeof(addr), odcid, &odcid_len)) {
+      // Forged, expired or from another address, dropped without a reply.
+      statsDropped++;
+      metricDropped.add();
+      return;
+    }
+    // Short headers are parsed with LOCAL_CONN_ID_LEN, so the connection id has to be one
+    // of ours. After a retry the client already uses the one the retry handed out.
+    uint8_t localConnId[LOCAL_CONN_ID_LEN];
+    const uint8_t* connId = dcid;
+    size_t connIdLen = dcid_len;
+    if (token_len == 0) {
+      newConnectionId(localConnId);
+      connId = localConnId;
+      connIdLen = sizeof(localConnId);
+    }
+
+    auto ref = quiche_accept(connId, connIdLen, odcid_len > 0 ? odcid : nullptr, odcid_len, pConfig);
+    if (!ref) {
+      printf("[QUIC] Failed to accept connection\n");
       return;
     }
-    printf("[QUIC] ODCID after validating: %s\n", hexStr((char *)odcid, odcid_len).c_str());
-    printf("[QUIC] ODCID when accepting: %s\n", hexStr((char *)odcid, odcid_len).c_str());
-    printf("[QUIC] Token when accepting: %s\n", hexStr((char *)token, token_len).c_str());
-    auto ref = quiche_accept(dcid, dcid_len, odcid, odcid_len, pConfig);
 
     ClientRef newClient;
     newClient.quiche_ref = ref;
-    memcpy(newClient.dcid, dcid, dcid_len);
-    memcpy(&newClient.addr, (void*)&peer_addr, peer_addr_len);
+    newClient.stream_id = 0;
+    newClient.streaming = false;
+    newClient.subscriber = nullptr;
+    newClient.backlogOffset = 0;
+    newClient.backlogBytes = 0;
+    newClient.replaying = false;
+    newClient.skipToKeyFrame = false;
+    newClient.adaptive = false;
+    newClient.lastLayerCheckUs = 0;
+    newClient.cursor = nullptr;
+    newClient.cursorStreamId = 0;
+    newClient.cursorPositionVersion = 0;
+    newClient.cursorShapeVersion = 0;
+    newClient.cursorPendingOffset = 0;
+    newClient.input = nullptr;
+    newClient.inputStreamId = 0;
+    newClient.lastInputSequence = 0;
+    newClient.inputInjectedUs = 0;
+    newClient.inputOutOffset = 0;
+    memcpy(&newClient.addr, (void*)peer_addr, peer_addr_len);
+
+    std::string connKey = hexStr((char*)connId, connIdLen);
+    if (connId != dcid) {
+      newClient.initialConnId = clientKey;
+      initialConnIds[clientKey] = connKey;
+    }
 
-    clientRefs.insert(std::pair<std::string, ClientRef>(clientKey, newClient));
-    client = clientRefs.find(clientKey);
+    clientRefs.insert(std::pair<std::string, ClientRef>(connKey, newClient));
+    client = clientRefs.find(connKey);
+    metricConnections.add();
 
-    printf("[QUIC] New client registered. (token: %s)\n", hexStr((char*)token, token_len).c_str());
+    printf("[QUIC] New client registered (%s)\n", token_len > 0 ? "after retry" : "without retry");
   }
 
   // Send over all messages to quiche to handle quiche implementation.
-  size_t done = quiche_conn_recv(client->second.quiche_ref, (uint8_t*)pBuffer, recvLength);
+  quiche_conn_recv(client->second.quiche_ref, (uint8_t*)pBuffer, recvLength);
 }
 
 
+void QUICServer::newConnectionId(uint8_t* id) {
+  for (size_t i = 0; i < LOCAL_CONN_ID_LEN; i += 8) {
+    uint64_t value = connectionIdRandom();
+    memcpy(id + i, &value, 8);
+  }
+}
+
 void QUICServer::createToken(
   const uint8_t *scid, size_t scid_len,
   const uint8_t *dcid, size_t dcid_len,
-  struct sockaddr_in *addr, int addr_len,
-  uint8_t *token, size_t *token_len
+  struct sockaddr_in *addr, int addr_len
 ) {
-  // Create a new token based on address and connection id.
-  mint_token(dcid, dcid_len, addr, addr_len, token, token_len);
+  // The token carries the original dcid, sealed together with the client address.
+  uint8_t addrBytes[6];
+  address_bytes(addr, addrBytes);
+  uint8_t token[RETRY_TOKEN_MAX_LEN];
+  size_t tokenLen = retryTokens.mint(dcid, dcid_len, addrBytes, sizeof(addrBytes), token);
+  if (tokenLen == 0) {
+    return;
+  }
+
+  // The retry has to come with a new connection id, the client uses it from now on.
+  uint8_t newScid[LOCAL_CONN_ID_LEN];
+  newConnectionId(newScid);
 
   // Create quiche retry packet with new token.
-  size_t written = quiche_retry(scid, scid_len,
-                                  dcid, dcid_len,
-                                  dcid, dcid_len,
-                                  token, *token_len,
-                                  pSendBuffer, sizeof(pSendBuffer));
+  ssize_t written = quiche_retry(scid, scid_len,
+                                 dcid, dcid_len,
+                                 newScid, sizeof(newScid),
+                                 token, tokenLen,
+                                 pSendBuffer, sizeof(pSendBuffer));
+  if (written < 0) {
+    printf("[QUIC] Failed to create retry packet (error code: %zd)\n", written);
+    return;
+  }
 
   // Send retry packet over udp.
-  size_t sent = sendto(pServerSocket, (char*)pSendBuffer, written, 0,
-                        (struct sockaddr *)addr,
-                        addr_len);
+  sendto(pServerSocket, (char*)pSendBuffer, written, 0, (struct sockaddr *)addr, addr_len);
+  statsRetries++;
+  metricRetries.add();
+}
+
+void QUICServer::countConnectAttempt() {
+  uint64_t now = nowMicros();
+  if (now - connectWindowStartUs >= 1000000) {
+    // Keep the last full second, a burst at the end of a window still counts.
+    lastWindowConnects = now - connectWindowStartUs < 2000000 ? connectsInWindow : 0;
+    connectsInWindow = 0;
+    connectWindowStartUs = now;
+  }
+  connectsInWindow++;
+}
 
-  printf("[QUIC] Send retry package (size: %d, actual: %d)\n", written, sent);
+bool QUICServer::isUnderLoad() const {
+  if (connectsInWindow > RETRY_CONNECT_RATE || lastWindowConnects > RETRY_CONNECT_RATE) {
+    return true;
+  }
+
+  uint32_t handshaking = 0;
+  for (auto iter = clientRefs.begin(); iter != clientRefs.end(); iter++) {
+    if (!quiche_conn_is_established(iter->second.quiche_ref)) {
+      handshaking++;
+    }
+  }
+  return handshaking >= RETRY_HANDSHAKE_LIMIT;
 }
 
-void QUICServer::negotiateVersion(uint32_t version) {
+void QUICServer::negotiateVersion(uint32_t /*version*/) {
   // TODO
 }
 
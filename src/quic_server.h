@@ -1,12 +1,33 @@
 #ifndef _QUIC_SERVER_H_
 #define _QUIC_SERVER_H_
 
+#include <deque>
 #include <vector>
 #include <map>
+#include <mutex>
+#include <random>
 #include <sstream>
 #include <iomanip>
 
+#ifdef _WIN32
 #include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <cstdio>
+#include <cstring>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+// Winsock names for the BSD socket api, keeps the server code the same on both platforms.
+typedef int SOCKET;
+#define INVALID_SOCKET (-1)
+#define SOCKET_ERROR (-1)
+#define closesocket close
+#endif
 
 #if defined(_MSC_VER)
 #include <BaseTsd.h>
@@ -14,23 +35,135 @@ typedef SSIZE_T ssize_t;
 #endif
 #include <quiche.h>
 
+#include "annexb_reader.h"
+#include "cursor_protocol.h"
+#include "encoded_slice.h"
+#include "input_protocol.h"
+#include "layer_selector.h"
+#include "metrics.h"
+#include "retry_token.h"
+#include "stream_router.h"
+
 /// Max buffer length for sending and receiving.
 #define BUFFER_LEN 65535
 
 /// Decides how big raw udp packages are
 #define MAX_DATAGRAM_SIZE 1350
 
+/// Video bytes a client may have waiting for flow or congestion control. Past it the
+/// backlog is dropped and the client continues at the next IDR. Above the GOP cache
+/// limit so that a replayed GOP always fits.
+#define CLIENT_BACKLOG_MAX_BYTES (24 * 1024 * 1024)
+
+class QUICServer;
+struct ClientRef;
+
+/// A slice waiting in the backlog of a client.
+struct QueuedSlice {
+  EncodedSlice slice;
+  /// Part of the GOP replayed on subscribe, its capture time says nothing about sending.
+  bool replayed;
+  /// Followed by an access unit delimiter, the slice ends its frame.
+  bool delimited;
+};
+
+/// Feeds the slices of the subscribed stream into a single QUIC connection.
+class ClientSubscriber : public SliceSink {
+  private:
+    QUICServer* pServer;
+    ClientRef* pClient;
+
+  public:
+    ClientSubscriber(QUICServer* server, ClientRef* client) : pServer(server), pClient(client) {}
+
+    void onSlice(const EncodedSlice& slice) override;
+};
+
 struct ClientRef {
-  uint8_t dcid[QUICHE_MAX_CONN_ID_LEN];
+  /// Key of the connection id the client picked for its first Initial, only set when it
+  /// was accepted without retry.
+  std::string initialConnId;
   quiche_conn* quiche_ref;
   struct sockaddr addr;
+  /// Stream the client requested the video on.
+  uint64_t stream_id;
+  /// Whether the client already sent its request.
+  bool streaming;
+  /// Subscription at the router, exists once the client requested a stream.
+  ClientSubscriber* subscriber;
+  /// Slices quiche did not take yet (flow control), sent before anything new.
+  std::deque<QueuedSlice> backlog;
+  /// Bytes of the first backlog entry that are already queued.
+  size_t backlogOffset;
+  /// Bytes in `backlog` that quiche did not take yet.
+  size_t backlogBytes;
+  /// Set while the GOP cache is replayed to the client.
+  bool replaying;
+  /// Set after the backlog overflowed, slices are dropped until the next IDR.
+  bool skipToKeyFrame;
+  /// Set if the client asked for a simulcast stream, its layer follows its throughput.
+  bool adaptive;
+  LayerSelector layerSelector;
+  uint64_t lastLayerCheckUs;
+  /// Cursor the client asked for on its own stream, null without one.
+  CursorChannel* cursor;
+  uint64_t cursorStreamId;
+  /// Cursor state already queued for the client.
+  uint32_t cursorPositionVersion;
+  uint32_t cursorShapeVersion;
+  /// Cursor messages quiche did not take completely yet.
+  std::vector<uint8_t> cursorPending;
+  size_t cursorPendingOffset;
+  /// Sink the client's input goes to, null until it opened an input stream.
+  InputSink* input;
+  uint64_t inputStreamId;
+  InputReader inputReader;
+  uint32_t lastInputSequence;
+  /// Newest injected batch, acked with the first frame captured after it (sequence 0: none).
+  InputAck pendingInputAck;
+  uint64_t inputInjectedUs;
+  /// Acks quiche did not take completely yet.
+  std::vector<uint8_t> inputOut;
+  size_t inputOutOffset;
 };
 
-class QUICServer {
+/// Connect attempts per second above which new clients have to go through a retry.
+#define RETRY_CONNECT_RATE 20
+/// Unfinished handshakes at which new clients have to go through a retry.
+#define RETRY_HANDSHAKE_LIMIT 8
+/// Clients pad their Initial packets to at least this size.
+#define MIN_INITIAL_LEN 1200
+/// Half open connections are dropped after this long without a packet.
+#define SERVER_IDLE_TIMEOUT_MS 30000
+
+/// How often the layer of adaptive clients is checked.
+#define LAYER_CHECK_INTERVAL_US 500000
+/// How often the per connection metrics are copied out for scrapes.
+#define METRICS_SNAPSHOT_INTERVAL_US 1000000
+
+/// Per connection values of the last metrics snapshot.
+struct ConnectionMetrics {
+  std::string connection;
+  /// Stream the connection currently receives, -1 before its request.
+  int64_t streamId;
+  /// quiche_conn_stats().
+  uint64_t rttNs;
+  uint64_t cwnd;
+  uint64_t packetsSent;
+  uint64_t packetsReceived;
+  uint64_t packetsLost;
+  uint64_t deliveryRate;
+  /// Video bytes waiting for flow control or congestion control.
+  uint64_t backlogBytes;
+};
+
+class QUICServer : public MetricsCollector {
   private:
+#ifdef _WIN32
     /// Winsock reference
     WSADATA pWSA;
-    SOCKET pServerSocket;
+#endif
+    SOCKET pServerSocket = INVALID_SOCKET;
 
     // Buffers
     char pBuffer[BUFFER_LEN];
@@ -39,32 +172,119 @@ class QUICServer {
     /// QUICHE Config object.
     quiche_config* pConfig = nullptr;
 
-    // Client references.
+    // Client references, keyed by the connection id the server picked.
     std::map<std::string, ClientRef> clientRefs;
+    /// Connection ids clients picked for their first Initial, mapped to the key of their
+    /// connection. Retransmitted Initials still carry them.
+    std::map<std::string, std::string> initialConnIds;
+
+    /// Router the clients subscribe at.
+    StreamRouter* pRouter = nullptr;
+
+    /// Stateless retry, only used while the server is under load.
+    RetryTokens retryTokens;
+    std::mt19937_64 connectionIdRandom;
+    uint64_t connectWindowStartUs = 0;
+    uint32_t connectsInWindow = 0;
+    uint32_t lastWindowConnects = 0;
+
+    /// Debug stats, latency is from capture (or arrival at a relay) until quiche took the
+    /// slice. Replayed slices are counted on their own and left out of the latency.
+    long long statsSlicesSent = 0;
+    long long statsSlicesReplayed = 0;
+    long long statsBacklogDrops = 0;
+    long long statsSendLatency = 0;
+    long long statsMaxSendLatency = 0;
+    long long statsAcceptedWithoutRetry = 0;
+    long long statsRetries = 0;
+    long long statsDropped = 0;
+    long long statsCursorUpdates = 0;
+    long long statsCursorBytes = 0;
+    long long statsInputEvents = 0;
+    long long statsInputBatches = 0;
+    long long statsInputGaps = 0;
+    /// Live metrics, these count since startup while the debug stats are reset.
+    MetricCounter metricSlicesSent;
+    MetricCounter metricSlicesReplayed;
+    MetricCounter metricBacklogDrops;
+    MetricCounter metricSliceBytes;
+    MetricCounter metricPacketsSent;
+    MetricCounter metricPacketBytes;
+    MetricCounter metricDropped;
+    MetricCounter metricRetries;
+    MetricCounter metricConnections;
+    MetricGauge metricClients;
+    MetricGauge metricBacklogBytes;
+    MetricHistogram metricSendLatency;
+    /// Written by tick() once per METRICS_SNAPSHOT_INTERVAL_US, read by scrapes.
+    std::mutex metricsLock;
+    std::vector<ConnectionMetrics> connectionMetrics;
+    uint64_t lastMetricsSnapshotUs = 0;
 
   public:
     ~QUICServer() { this->cleanup(); }
 
-    bool initialize();
-    void tick(std::vector<std::vector<uint8_t>>* frameData);
+    bool initialize(uint16_t port = 1337);
+    /// Handles incoming packets and flushes pending QUIC packets of all clients.
+    void tick();
     void cleanup();
 
+    /// Sets the router that resolves client requests to streams.
+    void setRouter(StreamRouter* router) { pRouter = router; }
+
+    /// Queues a slice on the client's stream and gets it on the wire right away.
+    void sendSlice(ClientRef& client, const EncodedSlice& slice);
+
+    size_t getClientCount() const { return clientRefs.size(); }
+    /// Video bytes waiting for flow or congestion control, summed over all clients.
+    size_t getBacklogBytes() const;
+    long long getAverageSendLatency() const { return statsSlicesSent == 0 ? 0 : statsSendLatency / statsSlicesSent; }
+    void debugSession();
+
+    /// Adds the server totals to `registry`, per connection values come from collectMetrics().
+    void registerMetrics(MetricsRegistry& registry);
+    void collectMetrics(MetricsWriter& writer) override;
+
   private:
+    void flushClient(ClientRef& client);
+    /// Drops the backlog after it overflowed, the client continues at the next IDR.
+    void dropBacklog(ClientRef& client);
+    /// Counts a slice quiche took completely, live slices also count for the latency.
+    void onSliceAccepted(const QueuedSlice& queued);
+    /// Queues as much of the backlog as quiche accepts, returns false while some is left.
+    bool sendBacklog(ClientRef& client);
+    void handleRequest(ClientRef& client, uint64_t streamId, const char* request, size_t len);
+    /// Takes a cursor request, returns false if the request is something else.
+    bool handleCursorRequest(ClientRef& client, uint64_t streamId, const char* request, size_t len);
+    /// Queues the newest cursor state once the previous one is completely with quiche.
+    void sendCursor(ClientRef& client);
+    /// Takes an input request, the rest of the chunk already carries events.
+    bool handleInputRequest(ClientRef& client, uint64_t streamId, const char* request, size_t len);
+    /// Injects all complete batches of the client's input stream.
+    void handleInput(ClientRef& client, const uint8_t* data, size_t len);
+    /// Acks the pending batch if `slice` starts the first frame captured after it.
+    void ackInput(ClientRef& client, const EncodedSlice& slice);
+    void sendInputAcks(ClientRef& client);
+    /// Moves an adaptive client to the layer its connection can carry.
+    void updateLayer(ClientRef& client);
+    void removeClosedClients();
+    /// Copies the quiche stats of every connection for the next scrapes.
+    void snapshotMetrics();
+    void handlePacket(int recvLength, struct sockaddr_in* peer_addr, int peer_addr_len);
+    void countConnectAttempt();
+    /// Whether new clients have to prove their address with a retry first.
+    bool isUnderLoad() const;
     void negotiateVersion(uint32_t peerVersion);
+    /// Fills `id` with a random connection id of LOCAL_CONN_ID_LEN bytes.
+    void newConnectionId(uint8_t* id);
     void createToken(
       const uint8_t *scid, size_t scid_len,
       const uint8_t *dcid, size_t dcid_len,
-      struct sockaddr_in *addr, int addr_len,
-      uint8_t *token, size_t *token_len
+      struct sockaddr_in *addr, int addr_len
     );
 };
 
 #define LOCAL_CONN_ID_LEN 16
 
-#define MAX_TOKEN_LEN \
-    (sizeof("quiche") - 1 + \
-    sizeof(struct sockaddr_storage) + \
-    QUICHE_MAX_CONN_ID_LEN)
-
 
 #endif
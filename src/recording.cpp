@@ -0,0 +1,506 @@
+#include <cstring>
+#include <algorithm>
+#include <chrono>
+
+#include "recording.h"
+
+/// Recordings easily grow beyond 2 GB, `long` offsets are 32 bit on windows.
+static int seek_file(FILE* pFile, uint64_t offset, int origin) {
+#ifdef _WIN32
+  return _fseeki64(pFile, (long long)offset, origin);
+#else
+  return fseeko(pFile, (off_t)offset, origin);
+#endif
+}
+
+static uint64_t tell_file(FILE* pFile) {
+#ifdef _WIN32
+  return (uint64_t)_ftelli64(pFile);
+#else
+  return (uint64_t)ftello(pFile);
+#endif
+}
+
+bool SliceRecorder::initialize(const std::string& path, size_t maxQueuedBytes) {
+  this->path = path;
+  this->maxQueuedBytes = maxQueuedBytes;
+
+  pData = fopen(path.c_str(), "wb");
+  pIndex = fopen((path + ".idx").c_str(), "wb");
+  if (!pData || !pIndex) {
+    printf("[Record] Failed to create %s\n", path.c_str());
+    return false;
+  }
+  setvbuf(pData, nullptr, _IOFBF, RECORDER_WRITE_BUFFER);
+
+  RecordingIndexHeader header;
+  header.magic = RECORDING_INDEX_MAGIC;
+  header.version = RECORDING_INDEX_VERSION;
+  if (fwrite(&header, sizeof(header), 1, pIndex) != 1 || fflush(pIndex) != 0) {
+    printf("[Record] Failed to write the index of %s\n", path.c_str());
+    return false;
+  }
+
+  dataOffset = 0;
+  waitingForKeyFrame = true;
+  stopping = false;
+  failed = false;
+  writerThread = std::thread([this]() { this->writeLoop(); });
+
+  printf("[Record] Recording to %s\n", path.c_str());
+  return true;
+}
+
+void SliceRecorder::cleanup() {
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    stopping = true;
+  }
+  pushed.notify_one();
+  if (writerThread.joinable()) {
+    writerThread.join();
+  }
+
+  if (pData) {
+    fclose(pData);
+    pData = nullptr;
+  }
+
+  if (pIndex) {
+    fclose(pIndex);
+    pIndex = nullptr;
+  }
+}
+
+void SliceRecorder::onSlice(const EncodedSlice& slice) {
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    if (stopping || failed) {
+      statsDropped++;
+      return;
+    }
+
+    // Without the start of its IDR a slice cannot be decoded, skip until the next one.
+    if (waitingForKeyFrame) {
+      if (!slice.keyFrame || slice.sliceIndex != 0) {
+        statsSkipped++;
+        return;
+      }
+      waitingForKeyFrame = false;
+    }
+
+    // The disk fell behind, drop instead of letting capture wait or memory grow.
+    size_t length = slice.payload->size();
+    if (queuedBytes + length > maxQueuedBytes) {
+      statsDropped++;
+      waitingForKeyFrame = true;
+      return;
+    }
+
+    // Only the reference to the payload is queued, the encoder buffer is shared.
+    queue.push_back(slice);
+    queuedBytes += length;
+    statsPeakQueued = std::max(statsPeakQueued, queuedBytes);
+  }
+  pushed.notify_one();
+}
+
+void SliceRecorder::writeLoop() {
+  std::deque<EncodedSlice> batch;
+
+  while (true) {
+    {
+      std::unique_lock<std::mutex> guard(lock);
+      pushed.wait(guard, [this]() { return stopping || !queue.empty(); });
+      if (queue.empty()) {
+        break;
+      }
+      batch.swap(queue);
+    }
+
+    // Files are written without holding the lock, onSlice() keeps queueing meanwhile.
+    uint64_t start = nowMicros();
+    bool written = writeBatch(batch);
+    long long writeTime = (long long)(nowMicros() - start);
+
+    size_t bytes = 0;
+    for (auto& slice : batch) {
+      bytes += slice.payload->size();
+    }
+
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      queuedBytes -= bytes;
+      statsBatches++;
+      statsWriteTime += writeTime;
+      statsMaxWriteTime = std::max(statsMaxWriteTime, writeTime);
+      if (written) {
+        statsSlices += batch.size();
+        statsBytes += bytes;
+      } else {
+        statsDropped += batch.size();
+        failed = true;
+      }
+    }
+
+    if (!written) {
+      printf("[Record] Failed to write %s, recording stopped\n", path.c_str());
+    }
+    batch.clear();
+  }
+}
+
+bool SliceRecorder::writeBatch(const std::deque<EncodedSlice>& batch) {
+  std::vector<RecordingIndexEntry> entries;
+  entries.reserve(batch.size());
+
+  for (auto& slice : batch) {
+    const std::vector<uint8_t>& payload = *slice.payload;
+    if (fwrite(payload.data(), 1, payload.size(), pData) != payload.size()) {
+      return false;
+    }
+
+    RecordingIndexEntry entry;
+    entry.offset = dataOffset;
+    entry.captureTimeUs = slice.captureTimeUs;
+    entry.length = (uint32_t)payload.size();
+    entry.frameIndex = slice.frameIndex;
+    entry.sliceIndex = slice.sliceIndex;
+    entry.flags = (slice.keyFrame ? RECORDING_KEY_FRAME : 0) | (slice.lastInFrame ? RECORDING_LAST_IN_FRAME : 0);
+    entries.push_back(entry);
+    dataOffset += payload.size();
+  }
+
+  // Data first, an index read while recording never points past the data file.
+  return fflush(pData) == 0 &&
+         fwrite(entries.data(), sizeof(RecordingIndexEntry), entries.size(), pIndex) == entries.size() &&
+         fflush(pIndex) == 0;
+}
+
+size_t SliceRecorder::getQueuedBytes() {
+  std::lock_guard<std::mutex> guard(lock);
+  return queuedBytes;
+}
+
+long long SliceRecorder::getDropped() {
+  std::lock_guard<std::mutex> guard(lock);
+  return statsDropped;
+}
+
+void SliceRecorder::debugSession() {
+  std::lock_guard<std::mutex> guard(lock);
+
+  printf("\n\n---------------------------------------------\n");
+  printf("Recorder stats (%s):\n", path.c_str());
+  printf("  Written: %lld slices (%lld KB)\n", statsSlices, statsBytes / 1024);
+  printf("  Batches: %lld (avg %lldus, max %lldus)\n", statsBatches,
+         statsBatches == 0 ? 0 : statsWriteTime / statsBatches, statsMaxWriteTime);
+  printf("  Queued: %zd KB (peak %zd KB, limit %zd KB)\n", queuedBytes / 1024, statsPeakQueued / 1024,
+         maxQueuedBytes / 1024);
+  printf("  Dropped: %lld\n", statsDropped);
+  printf("  Skipped until IDR: %lld\n", statsSkipped);
+  printf("---------------------------------------------\n");
+
+  statsSlices = 0;
+  statsBytes = 0;
+  statsDropped = 0;
+  statsSkipped = 0;
+  statsBatches = 0;
+  statsWriteTime = 0;
+  statsMaxWriteTime = 0;
+  statsPeakQueued = queuedBytes;
+}
+
+static bool is_frame_start(const RecordingIndexEntry& entry) {
+  return (entry.flags & RECORDING_KEY_FRAME) && entry.sliceIndex == 0;
+}
+
+bool RecordingReplay::initialize(const std::string& path, bool loop) {
+  this->loop = loop;
+
+  FILE* pIndex = fopen((path + ".idx").c_str(), "rb");
+  if (!pIndex) {
+    printf("[Replay] Failed to open the index of %s\n", path.c_str());
+    return false;
+  }
+
+  RecordingIndexHeader header;
+  bool valid = fread(&header, sizeof(header), 1, pIndex) == 1 &&
+               header.magic == RECORDING_INDEX_MAGIC && header.version == RECORDING_INDEX_VERSION;
+  RecordingIndexEntry entry;
+  while (valid && fread(&entry, sizeof(entry), 1, pIndex) == 1) {
+    entries.push_back(entry);
+  }
+  fclose(pIndex);
+  if (!valid) {
+    printf("[Replay] %s.idx is no recording index of this version\n", path.c_str());
+    return false;
+  }
+
+  pData = fopen(path.c_str(), "rb");
+  if (!pData) {
+    printf("[Replay] Failed to open %s\n", path.c_str());
+    return false;
+  }
+
+  // A recording cut off while writing keeps everything that is complete.
+  seek_file(pData, 0, SEEK_END);
+  uint64_t dataBytes = tell_file(pData);
+  while (!entries.empty() && entries.back().offset + entries.back().length > dataBytes) {
+    entries.pop_back();
+  }
+
+  next = 0;
+  while (next < entries.size() && !is_frame_start(entries[next])) {
+    next++;
+  }
+  if (next == entries.size()) {
+    printf("[Replay] %s has no IDR to start at\n", path.c_str());
+    return false;
+  }
+
+  frameIndex = 0;
+  startUs = 0;
+  printf("[Replay] Playing %s (%zd slices, %.1fs)\n", path.c_str(), entries.size(), getDuration() / 1000000.0);
+  return true;
+}
+
+void RecordingReplay::cleanup() {
+  if (pData) {
+    fclose(pData);
+    pData = nullptr;
+  }
+  entries.clear();
+}
+
+uint64_t RecordingReplay::getDuration() const {
+  return entries.empty() ? 0 : entries.back().captureTimeUs - entries.front().captureTimeUs;
+}
+
+bool RecordingReplay::seek(uint64_t offsetUs) {
+  if (entries.empty()) {
+    return false;
+  }
+
+  uint64_t target = entries.front().captureTimeUs + offsetUs;
+  size_t found = entries.size();
+  for (size_t i = 0; i < entries.size() && entries[i].captureTimeUs <= target; i++) {
+    if (is_frame_start(entries[i])) {
+      found = i;
+    }
+  }
+  if (found == entries.size()) {
+    return false;
+  }
+
+  // The pacing starts over at the new position.
+  next = found;
+  startUs = 0;
+  return true;
+}
+
+bool RecordingReplay::captureFrame(SliceSink* sink) {
+  if (!pData) {
+    return false;
+  }
+
+  if (next >= entries.size()) {
+    if (!loop || !seek(0)) {
+      return false;
+    }
+  }
+
+  // Frames are due when they were captured, relative to the first one played.
+  const RecordingIndexEntry& first = entries[next];
+  if (startUs == 0) {
+    startUs = nowMicros();
+    startCaptureUs = first.captureTimeUs;
+  }
+  uint64_t due = startUs + (first.captureTimeUs > startCaptureUs ? first.captureTimeUs - startCaptureUs : 0);
+  uint64_t now = nowMicros();
+  if (due > now) {
+    std::this_thread::sleep_for(std::chrono::microseconds(due - now));
+  }
+
+  uint64_t captureTime = nowMicros();
+  uint32_t recordedFrame = first.frameIndex;
+  while (next < entries.size() && entries[next].frameIndex == recordedFrame) {
+    const RecordingIndexEntry& entry = entries[next++];
+
+    auto payload = std::make_shared<std::vector<uint8_t>>(entry.length);
+    if (seek_file(pData, entry.offset, SEEK_SET) != 0 ||
+        fread(payload->data(), 1, entry.length, pData) != entry.length) {
+      printf("[Replay] Failed to read slice at %llu\n", (unsigned long long)entry.offset);
+      return false;
+    }
+
+    EncodedSlice slice;
+    slice.streamId = streamId;
+    slice.frameIndex = frameIndex;
+    slice.sliceIndex = entry.sliceIndex;
+    slice.lastInFrame = (entry.flags & RECORDING_LAST_IN_FRAME) != 0;
+    slice.keyFrame = (entry.flags & RECORDING_KEY_FRAME) != 0;
+    slice.captureTimeUs = captureTime;
+    slice.payload = payload;
+
+    if (sink) {
+      sink->onSlice(slice);
+    }
+
+    if (slice.lastInFrame) {
+      break;
+    }
+  }
+
+  frameIndex++;
+  return true;
+}
+
+/// Collects replayed slices for verifyRecording().
+class ReplayCollector : public SliceSink {
+  public:
+    std::vector<EncodedSlice> slices;
+
+    void onSlice(const EncodedSlice& slice) override { slices.push_back(slice); }
+};
+
+static const uint32_t CHECK_FRAMES = 20;
+static const uint32_t CHECK_SLICES = 4;
+static const uint32_t CHECK_GOP = 10;
+static const uint64_t CHECK_FRAME_US = 16667;
+
+static EncodedSlice make_check_slice(uint32_t frame, uint32_t sliceIndex, size_t bytes) {
+  EncodedSlice slice;
+  slice.frameIndex = frame;
+  slice.sliceIndex = sliceIndex;
+  slice.lastInFrame = sliceIndex == CHECK_SLICES - 1;
+  slice.keyFrame = frame % CHECK_GOP == 0;
+  slice.captureTimeUs = 1000000 + frame * CHECK_FRAME_US;
+
+  auto payload = std::make_shared<std::vector<uint8_t>>(bytes, (uint8_t)(0x80 | (frame & 0x7f)));
+  (*payload)[0] = 0;
+  (*payload)[1] = 0;
+  (*payload)[2] = 0;
+  (*payload)[3] = 1;
+  (*payload)[4] = slice.keyFrame ? 0x65 : 0x41;
+  (*payload)[5] = (uint8_t)sliceIndex;
+  slice.payload = payload;
+  return slice;
+}
+
+bool verifyRecording(const std::string& directory) {
+  bool ok = true;
+  std::string path = directory + "/brocky-record-check.h264";
+
+  // Record from the middle of a GOP, the file has to start at the next IDR.
+  std::vector<EncodedSlice> recorded;
+  {
+    SliceRecorder recorder;
+    if (!recorder.initialize(path)) {
+      printf("[Record] Recording checks FAILED\n");
+      return false;
+    }
+    for (uint32_t frame = 3; frame < CHECK_FRAMES; frame++) {
+      for (uint32_t s = 0; s < CHECK_SLICES; s++) {
+        EncodedSlice slice = make_check_slice(frame, s, 1000 + frame * 10 + s);
+        recorder.onSlice(slice);
+        if (frame >= CHECK_GOP) {
+          recorded.push_back(slice);
+        }
+      }
+    }
+    recorder.cleanup();
+    if (recorder.getDropped() != 0) {
+      printf("[Record] Slices dropped without backpressure\n");
+      ok = false;
+    }
+  }
+
+  // Everything comes back in order, byte for byte.
+  {
+    RecordingReplay replay;
+    ReplayCollector collector;
+    if (!replay.initialize(path, false)) {
+      printf("[Record] Recording checks FAILED\n");
+      return false;
+    }
+    while (replay.captureFrame(&collector)) {}
+
+    bool same = collector.slices.size() == recorded.size();
+    for (size_t i = 0; same && i < recorded.size(); i++) {
+      same = *collector.slices[i].payload == *recorded[i].payload &&
+             collector.slices[i].keyFrame == recorded[i].keyFrame &&
+             collector.slices[i].lastInFrame == recorded[i].lastInFrame &&
+             collector.slices[i].frameIndex == i / CHECK_SLICES;
+    }
+    if (!same) {
+      printf("[Record] Replay differs from what was recorded (%zd of %zd slices)\n",
+             collector.slices.size(), recorded.size());
+      ok = false;
+    }
+
+    // The data file alone is the plain stream.
+    FILE* pFile = fopen(path.c_str(), "rb");
+    size_t firstBytes = 0;
+    uint8_t head[5] = { 0 };
+    if (pFile) {
+      firstBytes = fread(head, 1, sizeof(head), pFile);
+      fclose(pFile);
+    }
+    if (firstBytes != sizeof(head) || head[3] != 1 || head[4] != 0x65) {
+      printf("[Record] Data file does not start with an IDR slice\n");
+      ok = false;
+    }
+
+    // Seeking into the middle of a GOP starts at its IDR.
+    collector.slices.clear();
+    if (!replay.seek(5 * CHECK_FRAME_US) || !replay.captureFrame(&collector) ||
+        collector.slices.empty() || *collector.slices[0].payload != *recorded[0].payload) {
+      printf("[Record] Seek does not land on the IDR\n");
+      ok = false;
+    }
+  }
+
+  // Room for only a few slices: whatever is dropped, the file resumes at an IDR.
+  {
+    SliceRecorder recorder;
+    long long dropped = 0;
+    if (recorder.initialize(path, 3 * 1200)) {
+      for (uint32_t frame = 0; frame < CHECK_FRAMES * 5; frame++) {
+        for (uint32_t s = 0; s < CHECK_SLICES; s++) {
+          recorder.onSlice(make_check_slice(frame, s, 1000));
+        }
+      }
+      recorder.cleanup();
+      dropped = recorder.getDropped();
+    }
+
+    RecordingReplay replay;
+    ReplayCollector collector;
+    if (replay.initialize(path, false)) {
+      while (replay.captureFrame(&collector)) {}
+    }
+
+    bool resumed = !collector.slices.empty();
+    uint8_t lastFrame = 0;
+    for (size_t i = 0; resumed && i < collector.slices.size(); i++) {
+      const EncodedSlice& slice = collector.slices[i];
+      uint8_t recordedFrame = (*slice.payload)[6] & 0x7f;
+      bool startsFrame = slice.sliceIndex == 0;
+      bool continues = i > 0 && recordedFrame == lastFrame && (*slice.payload)[5] == (*collector.slices[i - 1].payload)[5] + 1;
+      bool nextFrame = i > 0 && startsFrame && recordedFrame == ((lastFrame + 1) & 0x7f);
+      resumed = continues || nextFrame || (startsFrame && slice.keyFrame);
+      lastFrame = recordedFrame;
+    }
+    if (!resumed) {
+      printf("[Record] Recording does not resume at an IDR after dropping\n");
+      ok = false;
+    }
+    printf("[Record] Small queue kept %zd slices and dropped %lld\n", collector.slices.size(), dropped);
+  }
+
+  remove(path.c_str());
+  remove((path + ".idx").c_str());
+  printf("[Record] Recording checks %s\n", ok ? "passed" : "FAILED");
+  return ok;
+}
@@ -0,0 +1,143 @@
+#ifndef _RECORDING_H_
+#define _RECORDING_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "encoded_slice.h"
+
+#define RECORDING_INDEX_MAGIC 0x494b5242
+#define RECORDING_INDEX_VERSION 1
+/// Encoded bytes waiting for the writer, slices beyond that are dropped until the next IDR.
+#define RECORDER_MAX_QUEUED_BYTES (64 * 1024 * 1024)
+/// Buffer of the data file, the writer flushes it once per batch.
+#define RECORDER_WRITE_BUFFER (1024 * 1024)
+
+/// Flags of a RecordingIndexEntry.
+#define RECORDING_KEY_FRAME 0x1
+#define RECORDING_LAST_IN_FRAME 0x2
+
+/// Start of the `.idx` file next to a recording.
+struct RecordingIndexHeader {
+  uint32_t magic;
+  uint32_t version;
+};
+
+/// One slice of the recording, the `.idx` file is the header followed by one entry per
+/// slice in the order of the data file. Little endian, like every host we run on.
+struct RecordingIndexEntry {
+  /// Position of the slice in the data file.
+  uint64_t offset;
+  /// Capture time of the frame (steady clock of the recording host, microseconds).
+  uint64_t captureTimeUs;
+  uint32_t length;
+  uint32_t frameIndex;
+  uint32_t sliceIndex;
+  uint32_t flags;
+};
+
+/// Writes the slices of a stream to disk without a second encode.
+///
+/// The data file is the plain Annex-B stream, any player takes it. The `.idx` file next
+/// to it has an entry per slice with frame, IDR flag and capture time, so a replay can
+/// seek to any IDR and keep the original pacing.
+///
+/// onSlice() only queues the shared payload (no copy), a writer thread does all file I/O.
+/// If the disk cannot keep up the queue is capped, slices are dropped and recording
+/// resumes at the next IDR so the file stays decodable.
+class SliceRecorder : public SliceSink {
+  private:
+    std::string path;
+    FILE* pData = nullptr;
+    FILE* pIndex = nullptr;
+    uint64_t dataOffset = 0;
+    size_t maxQueuedBytes = RECORDER_MAX_QUEUED_BYTES;
+    /// Slices for the writer, everything below is guarded by `lock`.
+    std::deque<EncodedSlice> queue;
+    std::mutex lock;
+    std::condition_variable pushed;
+    size_t queuedBytes = 0;
+    /// Set at the start and after a drop, nothing is queued before the next IDR.
+    bool waitingForKeyFrame = true;
+    bool stopping = false;
+    bool failed = false;
+    std::thread writerThread;
+    /// Debug stats, guarded by `lock` as well.
+    long long statsSlices = 0;
+    long long statsBytes = 0;
+    long long statsDropped = 0;
+    long long statsSkipped = 0;
+    long long statsBatches = 0;
+    long long statsWriteTime = 0;
+    long long statsMaxWriteTime = 0;
+    size_t statsPeakQueued = 0;
+
+  public:
+    ~SliceRecorder() { this->cleanup(); }
+
+    /// Creates `path` and `path.idx` and starts the writer thread.
+    bool initialize(const std::string& path, size_t maxQueuedBytes = RECORDER_MAX_QUEUED_BYTES);
+    /// Writes what is still queued and closes the files.
+    void cleanup();
+
+    /// Queues the slice for the writer, never waits for the disk.
+    void onSlice(const EncodedSlice& slice) override;
+
+    /// Backpressure counters.
+    size_t getQueuedBytes();
+    long long getDropped();
+    void debugSession();
+
+  private:
+    void writeLoop();
+    bool writeBatch(const std::deque<EncodedSlice>& batch);
+};
+
+/// Plays a recording of SliceRecorder back as a frame source.
+///
+/// Like SyntheticCapturer, captureFrame() waits for the frame slot (the original capture
+/// times of the recording) and pushes the slices of one frame. Slices are re-stamped
+/// with the current time and frame counters keep counting when the recording loops.
+class RecordingReplay {
+  private:
+    FILE* pData = nullptr;
+    std::vector<RecordingIndexEntry> entries;
+    /// Stream id the slices are published with.
+    uint32_t streamId = 0;
+    bool loop = true;
+    /// Entry the next frame starts at.
+    size_t next = 0;
+    uint32_t frameIndex = 0;
+    /// Steady clock time the recorded time `startCaptureUs` is played at.
+    uint64_t startUs = 0;
+    uint64_t startCaptureUs = 0;
+
+  public:
+    ~RecordingReplay() { this->cleanup(); }
+
+    bool initialize(const std::string& path, bool loop = true);
+    void setStreamId(uint32_t id) { streamId = id; }
+    void cleanup();
+
+    /// Continues at the last IDR captured at or before `offsetUs` into the recording.
+    bool seek(uint64_t offsetUs);
+    /// Length of the recording.
+    uint64_t getDuration() const;
+    size_t getSliceCount() const { return entries.size(); }
+
+    /// Waits for the next frame slot and pushes its slices to `sink` one by one.
+    /// Returns false at the end of a recording that does not loop.
+    bool captureFrame(SliceSink* sink);
+};
+
+/// Records synthetic slices, replays them and checks slices, IDR seeking and the drop
+/// back to the next IDR when the writer falls behind.
+bool verifyRecording(const std::string& directory);
+
+#endif
@@ -0,0 +1,197 @@
+#include <cstdio>
+
+#include "relay.h"
+
+/// nal_unit_type of a sequence parameter set.
+#define NAL_UNIT_SPS 7
+
+void RelayIngest::initialize(SliceSink* sink, uint32_t streamId) {
+  pSink = sink;
+  this->streamId = streamId;
+  carry.clear();
+  started = false;
+  lastNalSlice = false;
+  frameEnded = false;
+  frameIndex = 0;
+  nextSliceIndex = 0;
+  keyFrame = false;
+}
+
+void RelayIngest::onStreamData(const uint8_t* data, size_t len) {
+  receivedUs = nowMicros();
+  statsBytes += len;
+
+  // Finish a start code that was cut off at the end of the last chunk.
+  std::vector<uint8_t> joined;
+  if (!carry.empty()) {
+    joined.swap(carry);
+    joined.insert(joined.end(), data, data + len);
+    data = joined.data();
+    len = joined.size();
+  }
+
+  size_t pieceStart = 0;
+  size_t end = len;
+  for (size_t i = 0; i + 2 < len; i++) {
+    if (data[i + 2] > 1) {
+      // Fast skip, none of the three bytes can be the start of a start code.
+      i += 2;
+      continue;
+    }
+    if (data[i] != 0 || data[i + 1] != 0 || data[i + 2] != 1) {
+      continue;
+    }
+
+    size_t startCode = i > pieceStart && data[i - 1] == 0 ? i - 1 : i;
+    // The nal header and the first slice header byte tell where the unit belongs.
+    if (i + 4 >= len) {
+      end = startCode;
+      break;
+    }
+
+    publish(data + pieceStart, startCode - pieceStart);
+    beginNalUnit(data + i + 3);
+    pieceStart = startCode;
+    i += 2;
+  }
+
+  // A NAL unit never ends with a zero byte, trailing zeros belong to the next start code.
+  if (end == len) {
+    while (end > pieceStart && len - end < 3 && data[end - 1] == 0) {
+      end--;
+    }
+  }
+
+  publish(data + pieceStart, end - pieceStart);
+  carry.assign(data + end, data + len);
+}
+
+void RelayIngest::beginNalUnit(const uint8_t* nal) {
+  int type = nal[0] & 0x1f;
+  bool slice = type == NAL_UNIT_SLICE || type == NAL_UNIT_IDR;
+
+  // The delimiter belongs to the frame it ends, whatever follows opens the next one.
+  if (type == NAL_UNIT_AUD) {
+    frameEnded = started;
+    lastNalSlice = false;
+    return;
+  }
+
+  // Parameter sets and SEI after a slice open the next frame, so does a slice with
+  // first_mb_in_slice 0 (a single set bit) that follows another slice.
+  bool frameStart = lastNalSlice || !started;
+  if (slice) {
+    frameStart = frameStart && (nal[1] & 0x80) != 0;
+  }
+  frameStart = frameStart || frameEnded;
+  frameEnded = false;
+
+  if (frameStart) {
+    if (started) {
+      frameIndex++;
+    }
+    started = true;
+    nextSliceIndex = 0;
+    // Our encoders repeat the parameter sets in front of every IDR.
+    keyFrame = type == NAL_UNIT_SPS || type == NAL_UNIT_IDR;
+
+    statsFrames++;
+    if (keyFrame) {
+      statsKeyFrames++;
+    }
+  }
+
+  lastNalSlice = slice;
+}
+
+void RelayIngest::publish(const uint8_t* data, size_t len) {
+  if (len == 0) {
+    return;
+  }
+
+  if (!started) {
+    statsDroppedBytes += len;
+    return;
+  }
+
+  EncodedSlice slice;
+  slice.streamId = streamId;
+  slice.frameIndex = frameIndex;
+  slice.sliceIndex = nextSliceIndex++;
+  slice.lastInFrame = frameEnded;
+  slice.keyFrame = keyFrame;
+  slice.captureTimeUs = receivedUs;
+  slice.payload = std::make_shared<std::vector<uint8_t>>(data, data + len);
+  statsPieces++;
+
+  if (pSink) {
+    pSink->onSlice(slice);
+  }
+}
+
+void RelayIngest::debugSession() {
+  printf("  Received: %lld KB in %lld pieces\n", statsBytes / 1024, statsPieces);
+  printf("  Frames: %lld (key frames: %lld)\n", statsFrames, statsKeyFrames);
+  printf("  Dropped before first frame: %lld bytes\n", statsDroppedBytes);
+
+  statsBytes = 0;
+  statsPieces = 0;
+  statsFrames = 0;
+  statsKeyFrames = 0;
+}
+
+bool Relay::initialize(const RelayConfig& config) {
+  this->config = config;
+
+  if (!router.addStream(0, config.streamName)) {
+    return false;
+  }
+  ingest.initialize(&router, 0);
+
+  server.setRouter(&router);
+  if (!server.initialize(config.listenPort)) {
+    return false;
+  }
+
+  upstream.setServer(config.upstreamHost, config.upstreamPort);
+  upstream.setStreamName(config.streamName);
+  upstream.setDataSink(&ingest);
+  if (!upstream.initialize()) {
+    return false;
+  }
+
+  printf(
+    "Relay is ready with (upstream: %s:%s; stream: %s; port: %u)\n",
+    config.upstreamHost.c_str(), config.upstreamPort.c_str(), config.streamName.c_str(), config.listenPort
+  );
+  return true;
+}
+
+void Relay::tick() {
+  // Everything received upstream is handed to the downstream connections right here.
+  upstream.tick();
+  server.tick();
+}
+
+void Relay::cleanup() {
+  server.cleanup();
+  upstream.cleanup();
+}
+
+void Relay::debugSession() {
+  quiche_stats stats = {};
+  upstream.getStats(&stats);
+  double rttMs = stats.rtt / 1000000.0;
+  double forwardMs = server.getAverageSendLatency() / 1000.0;
+
+  printf("\n\n---------------------------------------------\n");
+  printf("Relay stats (%s:%s -> :%u):\n", config.upstreamHost.c_str(), config.upstreamPort.c_str(), config.listenPort);
+  printf("  Upstream rtt: %.2fms (lost packets: %zu)\n", rttMs, (size_t)stats.lost);
+  printf("  Forwarding time: %.2fms\n", forwardMs);
+  printf("  Hop latency: %.2fms (half the rtt plus forwarding)\n", rttMs / 2 + forwardMs);
+  ingest.debugSession();
+  printf("  Downstream clients: %zd\n", router.subscriberCount(0));
+  printf("---------------------------------------------\n");
+
+  server.debugSession();
+}
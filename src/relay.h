@@ -0,0 +1,99 @@
+#ifndef _RELAY_H_
+#define _RELAY_H_
+
+#include <string>
+#include <vector>
+
+#include "encoded_slice.h"
+#include "quic_client.h"
+#include "quic_server.h"
+#include "stream_router.h"
+
+/// Turns the byte stream received from an upstream server back into slices that can
+/// be published at a StreamRouter, without waiting for NAL units to complete.
+///
+/// Every received chunk is forwarded right away, cut at the start codes it contains.
+/// The pieces carry the frame structure the router and the GOP cache need: a piece
+/// starting a frame has `sliceIndex` 0 and a frame starting with parameter sets is a
+/// key frame. The server ends every frame with an access unit delimiter, the piece
+/// carrying it has `lastInFrame` set.
+class RelayIngest : public StreamDataSink {
+  private:
+    SliceSink* pSink = nullptr;
+    uint32_t streamId = 0;
+
+    /// Trailing bytes that might be the beginning of a start code.
+    std::vector<uint8_t> carry;
+    /// Set once the first frame started, everything before is dropped.
+    bool started = false;
+    /// Whether the last NAL unit was a slice (and not a parameter set or SEI).
+    bool lastNalSlice = false;
+    /// The last NAL unit was an access unit delimiter, the next one opens a frame.
+    bool frameEnded = false;
+    uint32_t frameIndex = 0;
+    uint32_t nextSliceIndex = 0;
+    bool keyFrame = false;
+    /// Arrival time of the chunk being forwarded.
+    uint64_t receivedUs = 0;
+
+    /// Debug stats.
+    long long statsBytes = 0;
+    long long statsPieces = 0;
+    long long statsFrames = 0;
+    long long statsKeyFrames = 0;
+    long long statsDroppedBytes = 0;
+
+  public:
+    void initialize(SliceSink* sink, uint32_t streamId);
+
+    void onStreamData(const uint8_t* data, size_t len) override;
+
+    void debugSession();
+
+  private:
+    /// Updates the frame state for a NAL unit starting at `nal` (right after its start code).
+    void beginNalUnit(const uint8_t* nal);
+    void publish(const uint8_t* data, size_t len);
+};
+
+/// Where a relay pulls its stream from and where it serves it.
+struct RelayConfig {
+  std::string upstreamHost = "127.0.0.1";
+  std::string upstreamPort = "1337";
+  /// Stream requested upstream, served under the same name.
+  std::string streamName = "stream";
+  /// UDP port downstream clients connect to.
+  uint16_t listenPort = 1338;
+};
+
+/// Edge node for cascaded fan-out: connects to a brocky server (or another relay) as a
+/// client and serves the stream to its own clients.
+///
+/// Slices are neither decoded nor re-encoded, every received byte is copied once into
+/// a shared payload that all downstream connections and the GOP cache reference.
+/// Relays can be chained, each hop only adds its forwarding time and one network hop.
+class Relay {
+  private:
+    RelayConfig config;
+    QUICClient upstream;
+    RelayIngest ingest;
+    StreamRouter router;
+    QUICServer server;
+
+  public:
+    bool initialize(const RelayConfig& config);
+    /// Pulls from upstream, forwards to all downstream clients and serves their requests.
+    void tick();
+    /// Sleeps until upstream data arrived or `maxMs` passed.
+    void wait(int maxMs) { upstream.wait(maxMs); }
+    void cleanup();
+
+    bool isUpstreamClosed() const { return upstream.isClosed(); }
+
+    /// Prints the latency of this hop: upstream round trip plus the time slices spend here.
+    void debugSession();
+
+    ~Relay() { this->cleanup(); }
+};
+
+#endif
@@ -0,0 +1,341 @@
+#include <cstdio>
+#include <cstring>
+#include <random>
+
+#include "encoded_slice.h"
+#include "retry_token.h"
+
+/// Minimal SHA-256 (FIPS 180-4), only used to build HMACs over a few dozen bytes.
+struct Sha256 {
+  uint32_t state[8];
+  uint8_t block[64];
+  size_t blockLen;
+  uint64_t totalLen;
+};
+
+static const uint32_t SHA256_K[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static inline uint32_t rotr(uint32_t x, int n) {
+  return (x >> n) | (x << (32 - n));
+}
+
+static void sha256_compress(Sha256& ctx, const uint8_t* block) {
+  uint32_t w[64];
+  for (int i = 0; i < 16; i++) {
+    w[i] = (uint32_t)block[i * 4] << 24 | (uint32_t)block[i * 4 + 1] << 16 |
+           (uint32_t)block[i * 4 + 2] << 8 | (uint32_t)block[i * 4 + 3];
+  }
+  for (int i = 16; i < 64; i++) {
+    uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+    uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+    w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+  }
+
+  uint32_t a = ctx.state[0], b = ctx.state[1], c = ctx.state[2], d = ctx.state[3];
+  uint32_t e = ctx.state[4], f = ctx.state[5], g = ctx.state[6], h = ctx.state[7];
+  for (int i = 0; i < 64; i++) {
+    uint32_t t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + SHA256_K[i] + w[i];
+    uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+    h = g;
+    g = f;
+    f = e;
+    e = d + t1;
+    d = c;
+    c = b;
+    b = a;
+    a = t1 + t2;
+  }
+
+  ctx.state[0] += a;
+  ctx.state[1] += b;
+  ctx.state[2] += c;
+  ctx.state[3] += d;
+  ctx.state[4] += e;
+  ctx.state[5] += f;
+  ctx.state[6] += g;
+  ctx.state[7] += h;
+}
+
+static void sha256_init(Sha256& ctx) {
+  static const uint32_t initial[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+  };
+  memcpy(ctx.state, initial, sizeof(initial));
+  ctx.blockLen = 0;
+  ctx.totalLen = 0;
+}
+
+static void sha256_update(Sha256& ctx, const uint8_t* data, size_t len) {
+  ctx.totalLen += len;
+  while (len > 0) {
+    size_t take = 64 - ctx.blockLen < len ? 64 - ctx.blockLen : len;
+    memcpy(ctx.block + ctx.blockLen, data, take);
+    ctx.blockLen += take;
+    data += take;
+    len -= take;
+
+    if (ctx.blockLen == 64) {
+      sha256_compress(ctx, ctx.block);
+      ctx.blockLen = 0;
+    }
+  }
+}
+
+static void sha256_final(Sha256& ctx, uint8_t* digest) {
+  uint64_t bits = ctx.totalLen * 8;
+  uint8_t padding = 0x80;
+  sha256_update(ctx, &padding, 1);
+
+  padding = 0;
+  while (ctx.blockLen != 56) {
+    sha256_update(ctx, &padding, 1);
+  }
+
+  uint8_t length[8];
+  for (int i = 0; i < 8; i++) {
+    length[i] = (uint8_t)(bits >> (56 - i * 8));
+  }
+  sha256_update(ctx, length, 8);
+
+  for (int i = 0; i < 8; i++) {
+    digest[i * 4] = (uint8_t)(ctx.state[i] >> 24);
+    digest[i * 4 + 1] = (uint8_t)(ctx.state[i] >> 16);
+    digest[i * 4 + 2] = (uint8_t)(ctx.state[i] >> 8);
+    digest[i * 4 + 3] = (uint8_t)ctx.state[i];
+  }
+}
+
+/// HMAC-SHA256 (RFC 2104) over the concatenation of two messages.
+static void hmac_sha256(const uint8_t* key, size_t keyLen,
+                        const uint8_t* first, size_t firstLen,
+                        const uint8_t* second, size_t secondLen,
+                        uint8_t* mac) {
+  uint8_t block[64] = {};
+  if (keyLen > 64) {
+    Sha256 ctx;
+    sha256_init(ctx);
+    sha256_update(ctx, key, keyLen);
+    sha256_final(ctx, block);
+  } else {
+    memcpy(block, key, keyLen);
+  }
+
+  uint8_t pad[64];
+  for (int i = 0; i < 64; i++) {
+    pad[i] = block[i] ^ 0x36;
+  }
+  uint8_t inner[32];
+  Sha256 ctx;
+  sha256_init(ctx);
+  sha256_update(ctx, pad, 64);
+  sha256_update(ctx, first, firstLen);
+  sha256_update(ctx, second, secondLen);
+  sha256_final(ctx, inner);
+
+  for (int i = 0; i < 64; i++) {
+    pad[i] = block[i] ^ 0x5c;
+  }
+  sha256_init(ctx);
+  sha256_update(ctx, pad, 64);
+  sha256_update(ctx, inner, sizeof(inner));
+  sha256_final(ctx, mac);
+}
+
+/// Compares without leaking the position of the first difference through timing.
+static bool equal_constant_time(const uint8_t* a, const uint8_t* b, size_t len) {
+  uint8_t diff = 0;
+  for (size_t i = 0; i < len; i++) {
+    diff |= a[i] ^ b[i];
+  }
+  return diff == 0;
+}
+
+bool RetryTokens::initialize(uint64_t lifetimeUs, uint64_t rotationUs) {
+  if (lifetimeUs == 0 || rotationUs <= lifetimeUs) {
+    printf("Retry token rotation (%lluus) has to be longer than the token lifetime (%lluus)\n",
+           (unsigned long long)rotationUs, (unsigned long long)lifetimeUs);
+    return false;
+  }
+
+  this->lifetimeUs = lifetimeUs;
+  this->rotationUs = rotationUs;
+  hasPrevious = false;
+  current.id = 0;
+  rotateKey(nowMicros());
+  return true;
+}
+
+void RetryTokens::rotateKey(uint64_t nowUs) {
+  if (current.createdUs != 0) {
+    previous = current;
+    hasPrevious = true;
+  }
+
+  std::random_device random;
+  for (size_t i = 0; i < sizeof(current.secret); i += 4) {
+    uint32_t value = random();
+    memcpy(current.secret + i, &value, 4);
+  }
+  current.id++;
+  current.createdUs = nowUs;
+}
+
+const RetryTokens::Key* RetryTokens::findKey(uint8_t id) const {
+  if (id == current.id) {
+    return &current;
+  }
+  if (hasPrevious && id == previous.id) {
+    return &previous;
+  }
+  return nullptr;
+}
+
+void RetryTokens::seal(const Key& key, const uint8_t* token, size_t len, const uint8_t* addr, size_t addrLen,
+                       uint8_t* mac) const {
+  uint8_t digest[32];
+  hmac_sha256(key.secret, sizeof(key.secret), token, len, addr, addrLen, digest);
+  memcpy(mac, digest, RETRY_TOKEN_MAC_LEN);
+}
+
+size_t RetryTokens::mint(const uint8_t* odcid, size_t odcidLen, const uint8_t* addr, size_t addrLen, uint8_t* token) {
+  if (odcidLen > RETRY_TOKEN_MAX_CID_LEN) {
+    return 0;
+  }
+
+  uint64_t now = nowMicros();
+  if (now - current.createdUs >= rotationUs) {
+    rotateKey(now);
+  }
+
+  // key id | expiry (big endian) | cid length | cid | mac
+  uint64_t expiry = now + lifetimeUs;
+  size_t len = 0;
+  token[len++] = current.id;
+  for (int i = 0; i < 8; i++) {
+    token[len++] = (uint8_t)(expiry >> (56 - i * 8));
+  }
+  token[len++] = (uint8_t)odcidLen;
+  memcpy(token + len, odcid, odcidLen);
+  len += odcidLen;
+
+  seal(current, token, len, addr, addrLen, token + len);
+  statsMinted++;
+  return len + RETRY_TOKEN_MAC_LEN;
+}
+
+bool RetryTokens::validate(const uint8_t* token, size_t tokenLen, const uint8_t* addr, size_t addrLen,
+                           uint8_t* odcid, size_t* odcidLen) {
+  // Cheap checks first, a flood of garbage never gets to the hmac.
+  if (tokenLen < 1 + 8 + 1 + RETRY_TOKEN_MAC_LEN) {
+    statsRejected++;
+    return false;
+  }
+  size_t cidLen = token[9];
+  size_t sealedLen = 1 + 8 + 1 + cidLen;
+  const Key* key = findKey(token[0]);
+  if (cidLen > RETRY_TOKEN_MAX_CID_LEN || tokenLen != sealedLen + RETRY_TOKEN_MAC_LEN || !key) {
+    statsRejected++;
+    return false;
+  }
+
+  uint64_t expiry = 0;
+  for (int i = 0; i < 8; i++) {
+    expiry = (expiry << 8) | token[1 + i];
+  }
+  if (nowMicros() > expiry) {
+    statsExpired++;
+    return false;
+  }
+
+  uint8_t mac[RETRY_TOKEN_MAC_LEN];
+  seal(*key, token, sealedLen, addr, addrLen, mac);
+  if (!equal_constant_time(mac, token + sealedLen, RETRY_TOKEN_MAC_LEN)) {
+    statsRejected++;
+    return false;
+  }
+
+  memcpy(odcid, token + 10, cidLen);
+  *odcidLen = cidLen;
+  statsValidated++;
+  return true;
+}
+
+bool benchmarkRetryTokens(uint32_t iterations) {
+  // RFC 4231 test cases 1 and 2.
+  static const uint8_t key1[20] = {
+    0x0b, 0x0b, 0x0b, 0x0b, 0x0b, 0x0b, 0x0b, 0x0b, 0x0b, 0x0b,
+    0x0b, 0x0b, 0x0b, 0x0b, 0x0b, 0x0b, 0x0b, 0x0b, 0x0b, 0x0b
+  };
+  static const uint8_t expected1[32] = {
+    0xb0, 0x34, 0x4c, 0x61, 0xd8, 0xdb, 0x38, 0x53, 0x5c, 0xa8, 0xaf, 0xce, 0xaf, 0x0b, 0xf1, 0x2b,
+    0x88, 0x1d, 0xc2, 0x00, 0xc9, 0x83, 0x3d, 0xa7, 0x26, 0xe9, 0x37, 0x6c, 0x2e, 0x32, 0xcf, 0xf7
+  };
+  static const uint8_t expected2[32] = {
+    0x5b, 0xdc, 0xc1, 0x46, 0xbf, 0x60, 0x75, 0x4e, 0x6a, 0x04, 0x24, 0x26, 0x08, 0x95, 0x75, 0xc7,
+    0x5a, 0x00, 0x3f, 0x08, 0x9d, 0x27, 0x39, 0x83, 0x9d, 0xec, 0x58, 0xb9, 0x64, 0xec, 0x38, 0x43
+  };
+  uint8_t mac[32];
+  hmac_sha256(key1, sizeof(key1), (const uint8_t*)"Hi ", 3, (const uint8_t*)"There", 5, mac);
+  bool hmacOk = memcmp(mac, expected1, sizeof(mac)) == 0;
+  hmac_sha256((const uint8_t*)"Jefe", 4, (const uint8_t*)"what do ya want ", 16,
+              (const uint8_t*)"for nothing?", 12, mac);
+  hmacOk = hmacOk && memcmp(mac, expected2, sizeof(mac)) == 0;
+
+  RetryTokens tokens;
+  if (!tokens.initialize()) {
+    return false;
+  }
+
+  uint8_t odcid[16];
+  uint8_t addr[6] = { 192, 168, 178, 21, 0x9c, 0x40 };
+  for (size_t i = 0; i < sizeof(odcid); i++) {
+    odcid[i] = (uint8_t)(i * 37 + 11);
+  }
+
+  uint8_t token[RETRY_TOKEN_MAX_LEN];
+  size_t tokenLen = 0;
+  uint64_t start = nowMicros();
+  for (uint32_t i = 0; i < iterations; i++) {
+    odcid[0] = (uint8_t)i;
+    tokenLen = tokens.mint(odcid, sizeof(odcid), addr, sizeof(addr), token);
+  }
+  uint64_t minted = nowMicros();
+
+  uint8_t parsed[RETRY_TOKEN_MAX_CID_LEN];
+  size_t parsedLen = 0;
+  bool roundTrip = true;
+  for (uint32_t i = 0; i < iterations; i++) {
+    roundTrip = tokens.validate(token, tokenLen, addr, sizeof(addr), parsed, &parsedLen) && roundTrip;
+  }
+  uint64_t validated = nowMicros();
+  roundTrip = roundTrip && parsedLen == sizeof(odcid) && memcmp(parsed, odcid, parsedLen) == 0;
+
+  // A token must not work from another address or once it was tampered with.
+  addr[3]++;
+  bool otherAddress = tokens.validate(token, tokenLen, addr, sizeof(addr), parsed, &parsedLen);
+  addr[3]--;
+  token[tokenLen - 1] ^= 1;
+  bool tampered = tokens.validate(token, tokenLen, addr, sizeof(addr), parsed, &parsedLen);
+
+  double mintUs = (double)(minted - start) / iterations;
+  double validateUs = (double)(validated - minted) / iterations;
+  bool tokensOk = roundTrip && !otherAddress && !tampered;
+
+  printf("\n\n---------------------------------------------\n");
+  printf("Retry token stats (%u iterations, %zd byte tokens):\n", iterations, tokenLen);
+  printf("  HMAC-SHA256 test vectors: %s\n", hmacOk ? "ok" : "FAILED");
+  printf("  Round trip / address binding / tampering: %s\n", tokensOk ? "ok" : "FAILED");
+  printf("  Minted: %.0f tokens/s (%.2fus)\n", mintUs > 0 ? 1000000.0 / mintUs : 0.0, mintUs);
+  printf("  Validated: %.0f tokens/s (%.2fus)\n", validateUs > 0 ? 1000000.0 / validateUs : 0.0, validateUs);
+  printf("---------------------------------------------\n");
+  return hmacOk && tokensOk;
+}
@@ -0,0 +1,72 @@
+#ifndef _RETRY_TOKEN_H_
+#define _RETRY_TOKEN_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+/// How long a retry token is accepted after it was minted.
+#define RETRY_TOKEN_LIFETIME_US (10ull * 1000000)
+/// How often the token key is replaced, must be longer than the token lifetime.
+#define RETRY_KEY_ROTATION_US (300ull * 1000000)
+
+/// Bytes of the truncated HMAC-SHA256 that seals a token.
+#define RETRY_TOKEN_MAC_LEN 16
+/// Largest connection id a token carries (QUICHE_MAX_CONN_ID_LEN).
+#define RETRY_TOKEN_MAX_CID_LEN 20
+/// Key id, expiry, cid length, cid and mac.
+#define RETRY_TOKEN_MAX_LEN (1 + 8 + 1 + RETRY_TOKEN_MAX_CID_LEN + RETRY_TOKEN_MAC_LEN)
+
+/// Mints and checks stateless retry tokens.
+///
+/// A token carries the original destination connection id of the client and an expiry.
+/// Both are sealed with HMAC-SHA256 over the token and the client address, so a token
+/// only works from the address it was sent to and cannot be forged or extended. The
+/// key is replaced regularly, tokens of the previous key stay valid until they expire.
+class RetryTokens {
+  private:
+    struct Key {
+      uint8_t id = 0;
+      uint8_t secret[32] = {};
+      uint64_t createdUs = 0;
+    };
+
+    Key current;
+    Key previous;
+    bool hasPrevious = false;
+    uint64_t lifetimeUs = RETRY_TOKEN_LIFETIME_US;
+    uint64_t rotationUs = RETRY_KEY_ROTATION_US;
+
+    /// Debug stats.
+    long long statsMinted = 0;
+    long long statsValidated = 0;
+    long long statsRejected = 0;
+    long long statsExpired = 0;
+
+  public:
+    bool initialize(uint64_t lifetimeUs = RETRY_TOKEN_LIFETIME_US, uint64_t rotationUs = RETRY_KEY_ROTATION_US);
+
+    /// Writes a token for `odcid` to `token` (at least RETRY_TOKEN_MAX_LEN bytes),
+    /// `addr` are the bytes identifying the client address. Returns the token length.
+    size_t mint(const uint8_t* odcid, size_t odcidLen, const uint8_t* addr, size_t addrLen, uint8_t* token);
+    /// Checks a token received from `addr` and extracts the original destination
+    /// connection id (`odcid` holds at least RETRY_TOKEN_MAX_CID_LEN bytes).
+    bool validate(const uint8_t* token, size_t tokenLen, const uint8_t* addr, size_t addrLen,
+                  uint8_t* odcid, size_t* odcidLen);
+
+    long long getMinted() const { return statsMinted; }
+    long long getValidated() const { return statsValidated; }
+    long long getRejected() const { return statsRejected; }
+    long long getExpired() const { return statsExpired; }
+
+  private:
+    void rotateKey(uint64_t nowUs);
+    const Key* findKey(uint8_t id) const;
+    void seal(const Key& key, const uint8_t* token, size_t len, const uint8_t* addr, size_t addrLen,
+              uint8_t* mac) const;
+};
+
+/// Checks HMAC-SHA256 against the RFC 4231 test vectors and prints how many tokens per
+/// second can be minted and validated. Returns false if a check failed.
+bool benchmarkRetryTokens(uint32_t iterations);
+
+#endif
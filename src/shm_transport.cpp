@@ -0,0 +1,328 @@
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+
+#include "shm_transport.h"
+
+/// Rings live in /dev/shm, named after the stream.
+static std::string ring_path(const std::string& name) {
+  return "/brocky-" + name;
+}
+
+static size_t ring_bytes(size_t dataBytes, uint32_t slotCount) {
+  return sizeof(ShmRingHeader) + sizeof(ShmSlot) * slotCount + dataBytes;
+}
+
+/// Shared (not process private) futex, readers can live in other processes.
+static void futex_wake(std::atomic<uint32_t>* word) {
+  syscall(SYS_futex, (uint32_t*)word, FUTEX_WAKE, INT32_MAX, nullptr, nullptr, 0);
+}
+
+static void futex_wait(std::atomic<uint32_t>* word, uint32_t value, uint32_t timeoutMs) {
+  struct timespec timeout;
+  timeout.tv_sec = timeoutMs / 1000;
+  timeout.tv_nsec = (long)(timeoutMs % 1000) * 1000000;
+  syscall(SYS_futex, (uint32_t*)word, FUTEX_WAIT, value, &timeout, nullptr, 0);
+}
+
+bool ShmPublisher::initialize(const std::string& name, size_t dataBytes, uint32_t slotCount) {
+  if (slotCount == 0 || (slotCount & (slotCount - 1)) != 0) {
+    printf("[SHM] Slot count %u is not a power of two\n", slotCount);
+    return false;
+  }
+
+  // A ring left behind by a crashed server is replaced, its readers keep their old mapping.
+  path = ring_path(name);
+  shm_unlink(path.c_str());
+  fd = shm_open(path.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (fd < 0) {
+    perror("[SHM] Failed to create ring");
+    return false;
+  }
+
+  mappedBytes = ring_bytes(dataBytes, slotCount);
+  if (ftruncate(fd, mappedBytes) != 0) {
+    perror("[SHM] Failed to size ring");
+    return false;
+  }
+
+  pMemory = (uint8_t*)mmap(nullptr, mappedBytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (pMemory == MAP_FAILED) {
+    pMemory = nullptr;
+    perror("[SHM] Failed to map ring");
+    return false;
+  }
+
+  // Fresh shared memory is zeroed, that is a valid state for all atomics.
+  pHeader = (ShmRingHeader*)pMemory;
+  pSlots = (ShmSlot*)(pMemory + sizeof(ShmRingHeader));
+  pData = pMemory + sizeof(ShmRingHeader) + sizeof(ShmSlot) * slotCount;
+  if (!pHeader->published.is_lock_free() || !pHeader->futex.is_lock_free()) {
+    printf("[SHM] Atomics are not lock free, they cannot be shared between processes\n");
+    return false;
+  }
+
+  pHeader->version = SHM_RING_VERSION;
+  pHeader->dataBytes = dataBytes;
+  pHeader->slotCount = slotCount;
+  pHeader->writerPid = (uint32_t)getpid();
+  // Readers check the magic last, the rest of the header is complete by then.
+  std::atomic_thread_fence(std::memory_order_release);
+  pHeader->magic = SHM_RING_MAGIC;
+
+  printf("[SHM] Publishing %s (%zd MB, %u slots)\n", path.c_str(), dataBytes / (1024 * 1024), slotCount);
+  return true;
+}
+
+void ShmPublisher::cleanup() {
+  if (pMemory) {
+    munmap(pMemory, mappedBytes);
+    pMemory = nullptr;
+    pHeader = nullptr;
+  }
+
+  if (fd >= 0) {
+    close(fd);
+    shm_unlink(path.c_str());
+    fd = -1;
+  }
+}
+
+void ShmPublisher::onSlice(const EncodedSlice& slice) {
+  if (!pHeader) {
+    return;
+  }
+
+  // A slice has to fit twice, otherwise a reader could never copy it out in one piece.
+  size_t length = slice.payload->size();
+  uint64_t dataBytes = pHeader->dataBytes;
+  if (length > dataBytes / 2) {
+    statsTooLarge++;
+    return;
+  }
+
+  // Payloads are never split, one that does not fit before the end starts at the beginning.
+  uint64_t offset = pHeader->reserved.load(std::memory_order_relaxed);
+  if (offset % dataBytes + length > dataBytes) {
+    offset += dataBytes - offset % dataBytes;
+  }
+
+  // Readers copying what gets overwritten now see the new end after their copy.
+  pHeader->reserved.store(offset + length, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  memcpy(pData + offset % dataBytes, slice.payload->data(), length);
+
+  uint64_t sequence = pHeader->published.load(std::memory_order_relaxed) + 1;
+  ShmSlot& slot = pSlots[sequence & (pHeader->slotCount - 1)];
+  slot.sequence.store(0, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  slot.offset = offset;
+  slot.length = (uint32_t)length;
+  slot.streamId = slice.streamId;
+  slot.frameIndex = slice.frameIndex;
+  slot.sliceIndex = slice.sliceIndex;
+  slot.lastInFrame = slice.lastInFrame;
+  slot.keyFrame = slice.keyFrame;
+  slot.captureTimeUs = slice.captureTimeUs;
+  slot.sequence.store(sequence, std::memory_order_release);
+  pHeader->published.store(sequence, std::memory_order_release);
+
+  // Only pay for the syscall if somebody sleeps. The futex is bumped before the waiters
+  // are checked and a reader counts itself before it checks the futex, both sequentially
+  // consistent so one of both sees the other (like PipelineRing).
+  pHeader->futex.fetch_add(1);
+  if (pHeader->waiters.load() > 0) {
+    futex_wake(&pHeader->futex);
+    statsWakeups++;
+  }
+
+  statsSlices++;
+  statsBytes += length;
+}
+
+void ShmPublisher::debugSession() {
+  printf("\n\n---------------------------------------------\n");
+  printf("Shared memory stats (%s):\n", path.c_str());
+  printf("  Slices: %lld (%lld KB)\n", statsSlices, statsBytes / 1024);
+  printf("  Reader wakeups: %lld\n", statsWakeups);
+  printf("  Too large: %lld\n", statsTooLarge);
+  printf("---------------------------------------------\n");
+
+  statsSlices = 0;
+  statsBytes = 0;
+  statsTooLarge = 0;
+  statsWakeups = 0;
+}
+
+bool ShmSubscriber::initialize(const std::string& name) {
+  std::string path = ring_path(name);
+  fd = shm_open(path.c_str(), O_RDWR, 0);
+  if (fd < 0) {
+    perror("[SHM] Failed to open ring");
+    return false;
+  }
+
+  struct stat info;
+  if (fstat(fd, &info) != 0 || (size_t)info.st_size < sizeof(ShmRingHeader)) {
+    printf("[SHM] %s is no ring\n", path.c_str());
+    return false;
+  }
+
+  // Readers write the waiter count, so the mapping is writable as well.
+  mappedBytes = (size_t)info.st_size;
+  pMemory = (uint8_t*)mmap(nullptr, mappedBytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (pMemory == MAP_FAILED) {
+    pMemory = nullptr;
+    perror("[SHM] Failed to map ring");
+    return false;
+  }
+
+  pHeader = (ShmRingHeader*)pMemory;
+  if (pHeader->magic != SHM_RING_MAGIC || pHeader->version != SHM_RING_VERSION ||
+      ring_bytes(pHeader->dataBytes, pHeader->slotCount) != mappedBytes) {
+    printf("[SHM] %s is no ring of this version\n", path.c_str());
+    pHeader = nullptr;
+    return false;
+  }
+  std::atomic_thread_fence(std::memory_order_acquire);
+
+  pSlots = (ShmSlot*)(pMemory + sizeof(ShmRingHeader));
+  pData = pMemory + sizeof(ShmRingHeader) + sizeof(ShmSlot) * pHeader->slotCount;
+  next = 0;
+  synced = false;
+
+  printf("[SHM] Reading %s (written by pid %u)\n", path.c_str(), pHeader->writerPid);
+  return true;
+}
+
+void ShmSubscriber::cleanup() {
+  if (pMemory) {
+    munmap(pMemory, mappedBytes);
+    pMemory = nullptr;
+    pHeader = nullptr;
+  }
+
+  if (fd >= 0) {
+    close(fd);
+    fd = -1;
+  }
+}
+
+bool ShmSubscriber::readSlot(uint64_t sequence, EncodedSlice& slice) {
+  const ShmSlot& slot = pSlots[sequence & (pHeader->slotCount - 1)];
+  if (slot.sequence.load(std::memory_order_acquire) != sequence) {
+    return false;
+  }
+
+  uint64_t offset = slot.offset;
+  uint32_t length = slot.length;
+  slice.streamId = slot.streamId;
+  slice.frameIndex = slot.frameIndex;
+  slice.sliceIndex = slot.sliceIndex;
+  slice.lastInFrame = slot.lastInFrame != 0;
+  slice.keyFrame = slot.keyFrame != 0;
+  slice.captureTimeUs = slot.captureTimeUs;
+  // Torn reads of a slot being rewritten must not point outside of the ring.
+  if (length > pHeader->dataBytes / 2 || offset % pHeader->dataBytes + length > pHeader->dataBytes) {
+    return false;
+  }
+
+  auto payload = std::make_shared<std::vector<uint8_t>>(pData + offset % pHeader->dataBytes,
+                                                         pData + offset % pHeader->dataBytes + length);
+
+  // Slot and data are only valid if the writer did not come around while we copied.
+  std::atomic_thread_fence(std::memory_order_acquire);
+  if (slot.sequence.load(std::memory_order_relaxed) != sequence ||
+      pHeader->reserved.load(std::memory_order_relaxed) - offset > pHeader->dataBytes) {
+    return false;
+  }
+
+  slice.payload = payload;
+  return true;
+}
+
+uint64_t ShmSubscriber::findKeyFrame(uint64_t published) {
+  uint64_t oldest = published > pHeader->slotCount ? published - pHeader->slotCount + 1 : 1;
+  for (uint64_t sequence = published; sequence >= oldest && sequence > 0; sequence--) {
+    const ShmSlot& slot = pSlots[sequence & (pHeader->slotCount - 1)];
+    if (slot.sequence.load(std::memory_order_acquire) == sequence && slot.keyFrame && slot.sliceIndex == 0 &&
+        pHeader->reserved.load(std::memory_order_relaxed) - slot.offset <= pHeader->dataBytes) {
+      return sequence;
+    }
+  }
+  return 0;
+}
+
+size_t ShmSubscriber::read(SliceSink* sink, uint32_t timeoutMs) {
+  if (!pHeader) {
+    return 0;
+  }
+
+  uint32_t futexValue = pHeader->futex.load();
+  uint64_t published = pHeader->published.load(std::memory_order_acquire);
+
+  // Nothing new, sleep until the writer publishes something, see ShmPublisher::onSlice().
+  if (next != 0 && next > published && timeoutMs > 0) {
+    pHeader->waiters.fetch_add(1);
+    if (pHeader->futex.load() == futexValue) {
+      futex_wait(&pHeader->futex, futexValue, timeoutMs);
+    }
+    pHeader->waiters.fetch_sub(1);
+    statsWaits++;
+    published = pHeader->published.load(std::memory_order_acquire);
+  }
+
+  // Start (or restart after an overrun) at the newest IDR, otherwise at whatever comes next.
+  if (next == 0 || (next <= published && published - next >= pHeader->slotCount)) {
+    if (next != 0) {
+      statsOverruns++;
+    }
+    uint64_t keyFrame = findKeyFrame(published);
+    next = keyFrame != 0 ? keyFrame : published + 1;
+    synced = false;
+  }
+
+  size_t handed = 0;
+  EncodedSlice slice;
+  for (; next <= published; next++) {
+    if (!readSlot(next, slice)) {
+      // Overrun while reading, start over at the newest IDR.
+      statsOverruns++;
+      next = 0;
+      break;
+    }
+
+    if (!synced && !(slice.keyFrame && slice.sliceIndex == 0)) {
+      continue;
+    }
+    synced = true;
+
+    sink->onSlice(slice);
+    handed++;
+  }
+
+  statsSlices += handed;
+  return handed;
+}
+
+void ShmSubscriber::debugSession() {
+  printf("\n\n---------------------------------------------\n");
+  printf("Shared memory reader stats:\n");
+  printf("  Slices: %lld\n", statsSlices);
+  printf("  Overruns: %lld\n", statsOverruns);
+  printf("  Waits: %lld\n", statsWaits);
+  printf("---------------------------------------------\n");
+
+  statsSlices = 0;
+  statsOverruns = 0;
+  statsWaits = 0;
+}
@@ -0,0 +1,121 @@
+#ifndef _SHM_TRANSPORT_H_
+#define _SHM_TRANSPORT_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+#include <string>
+
+#include "encoded_slice.h"
+
+#define SHM_RING_MAGIC 0x594b5242
+#define SHM_RING_VERSION 1
+/// Bytes of slice data a ring holds, readers that fall further behind lose slices.
+#define SHM_RING_DATA_BYTES (32 * 1024 * 1024)
+/// Slices a ring indexes, a power of two.
+#define SHM_RING_SLOTS 4096
+
+/// Index entry of a slice in the ring.
+struct ShmSlot {
+  /// Sequence number of the slice in this slot, 0 while the slot is rewritten.
+  std::atomic<uint64_t> sequence;
+  /// Position of the payload in the data ring, counted since the ring was created.
+  uint64_t offset;
+  uint32_t length;
+  uint32_t streamId;
+  uint32_t frameIndex;
+  uint32_t sliceIndex;
+  uint32_t lastInFrame;
+  uint32_t keyFrame;
+  uint64_t captureTimeUs;
+};
+
+/// Start of the shared memory, followed by the slots and the data ring.
+struct ShmRingHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t dataBytes;
+  uint32_t slotCount;
+  uint32_t writerPid;
+  /// Sequence number of the newest complete slice.
+  std::atomic<uint64_t> published;
+  /// End of the data written or being written, readers check their copy against it.
+  std::atomic<uint64_t> reserved;
+  /// Bumped with every slice, readers sleep on it.
+  std::atomic<uint32_t> futex;
+  /// Readers sleeping on `futex`, nobody is woken up while it is 0.
+  std::atomic<uint32_t> waiters;
+};
+
+/// Publishes the slices of a stream into a shared memory ring (`/dev/shm/brocky-<name>`)
+/// for consumers on the same host, no encryption, no sockets and no copy per consumer.
+///
+/// It subscribes at the router like a QUIC client. The writer never waits for readers:
+/// every reader follows on its own and skips ahead to the next IDR if it was overrun.
+class ShmPublisher : public SliceSink {
+  private:
+    std::string path;
+    int fd = -1;
+    uint8_t* pMemory = nullptr;
+    size_t mappedBytes = 0;
+    ShmRingHeader* pHeader = nullptr;
+    ShmSlot* pSlots = nullptr;
+    uint8_t* pData = nullptr;
+    /// Debug stats.
+    long long statsSlices = 0;
+    long long statsBytes = 0;
+    long long statsTooLarge = 0;
+    long long statsWakeups = 0;
+
+  public:
+    ~ShmPublisher() { this->cleanup(); }
+
+    bool initialize(const std::string& name, size_t dataBytes = SHM_RING_DATA_BYTES, uint32_t slotCount = SHM_RING_SLOTS);
+    void cleanup();
+
+    /// Copies the slice into the ring and wakes up waiting readers.
+    void onSlice(const EncodedSlice& slice) override;
+
+    void debugSession();
+};
+
+/// Reads a ring of a ShmPublisher, possibly from another process.
+class ShmSubscriber {
+  private:
+    int fd = -1;
+    uint8_t* pMemory = nullptr;
+    size_t mappedBytes = 0;
+    ShmRingHeader* pHeader = nullptr;
+    ShmSlot* pSlots = nullptr;
+    uint8_t* pData = nullptr;
+    /// Sequence number of the next slice to hand out, 0 before the first read.
+    uint64_t next = 0;
+    /// Set once an IDR start was handed out, cleared when the writer overran us.
+    bool synced = false;
+    /// Debug stats.
+    long long statsSlices = 0;
+    long long statsOverruns = 0;
+    long long statsWaits = 0;
+
+  public:
+    ~ShmSubscriber() { this->cleanup(); }
+
+    bool initialize(const std::string& name);
+    void cleanup();
+
+    /// Hands every new slice to `sink`, waiting up to `timeoutMs` for one. Starts at the
+    /// newest IDR still in the ring. Returns the amount of slices handed out.
+    size_t read(SliceSink* sink, uint32_t timeoutMs);
+
+    long long getSlices() const { return statsSlices; }
+    long long getOverruns() const { return statsOverruns; }
+    void debugSession();
+
+  private:
+    /// Copies slice `sequence` out of the ring, false if the writer overwrote it meanwhile.
+    bool readSlot(uint64_t sequence, EncodedSlice& slice);
+    /// Sequence number of the newest IDR start still in the ring, 0 if there is none.
+    uint64_t findKeyFrame(uint64_t published);
+};
+
+#endif
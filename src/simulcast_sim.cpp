@@ -0,0 +1,165 @@
+#include <cstdio>
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "layer_selector.h"
+#include "simulcast_sim.h"
+#include "stream_router.h"
+#include "synthetic_capture.h"
+
+/// Frames per second of all layers.
+static const uint32_t SIM_FPS = 100;
+static const uint32_t SIM_FRAMES = 700;
+/// How often the clients measure their throughput.
+static const uint32_t SIM_MEASURE_FRAMES = 10;
+/// Frames the flaky client only gets SIM_FLAKY_KBPS in.
+static const uint32_t SIM_FLAKY_START = 250;
+static const uint32_t SIM_FLAKY_END = 400;
+static const double SIM_FLAKY_KBPS = 1500.0;
+
+/// Client behind a link of a given capacity, checks everything it receives.
+class SimulatedClient : public SliceSink {
+  public:
+    std::string name;
+    /// Link capacity at a given frame.
+    std::function<double(uint32_t)> capacityKbps;
+    LayerSelector selector;
+
+    uint32_t currentStream = 0;
+    bool receiving = false;
+    bool midFrame = false;
+    uint32_t frame = 0;
+    uint32_t violations = 0;
+    uint32_t switches = 0;
+    /// Frame of every switch and the stream switched to.
+    std::vector<std::pair<uint32_t, uint32_t>> switchedAt;
+    std::map<uint32_t, size_t> bytesPerStream;
+
+    void onSlice(const EncodedSlice& slice) override {
+      bool idrStart = slice.keyFrame && slice.sliceIndex == 0;
+
+      if (!receiving || slice.streamId != currentStream) {
+        // Decoding can only start or continue on another layer at an IDR.
+        if (!idrStart) {
+          printf("[Sim] %s: stream %u starts with slice %u of a %s frame\n",
+                 name.c_str(), slice.streamId, slice.sliceIndex, slice.keyFrame ? "key" : "delta");
+          violations++;
+        }
+        if (receiving && midFrame) {
+          printf("[Sim] %s: left stream %u in the middle of a frame\n", name.c_str(), currentStream);
+          violations++;
+        }
+        if (receiving) {
+          printf("[Sim] %s: switched from stream %u to %u at frame %u\n", name.c_str(), currentStream, slice.streamId, frame);
+          switches++;
+          switchedAt.push_back(std::make_pair(frame, slice.streamId));
+        }
+        currentStream = slice.streamId;
+        receiving = true;
+      }
+
+      midFrame = !slice.lastInFrame;
+      bytesPerStream[slice.streamId] += slice.payload->size();
+    }
+};
+
+bool runSimulcastSimulation() {
+  struct LayerSpec {
+    uint32_t slicesPerFrame;
+    size_t sliceSize;
+  };
+  // Full, half and quarter resolution.
+  LayerSpec specs[] = { { 8, 1100 }, { 4, 900 }, { 2, 600 } };
+
+  StreamRouter router;
+  std::vector<SyntheticCapturer> capturers(3);
+  for (uint32_t i = 0; i < 3; i++) {
+    uint32_t bitrateKbps = (uint32_t)(specs[i].slicesPerFrame * specs[i].sliceSize * 8 * SIM_FPS / 1000);
+    bool added = i == 0 ? router.addStream(i, "sim", bitrateKbps) : router.addLayer(i, 0, bitrateKbps);
+    if (!added || !capturers[i].initialize(SIM_FPS, specs[i].slicesPerFrame, specs[i].sliceSize, 0)) {
+      return false;
+    }
+    capturers[i].setStreamId(i);
+  }
+
+  std::vector<SimulatedClient> clients(3);
+  clients[0].name = "desktop";
+  clients[0].capacityKbps = [](uint32_t) { return 50000.0; };
+  clients[1].name = "pi-wifi";
+  clients[1].capacityKbps = [](uint32_t) { return 4000.0; };
+  clients[2].name = "flaky";
+  clients[2].capacityKbps = [](uint32_t frame) {
+    return frame >= SIM_FLAKY_START && frame < SIM_FLAKY_END ? SIM_FLAKY_KBPS : 50000.0;
+  };
+
+  for (auto& client : clients) {
+    client.selector.initialize(router.getLayers(0), 1000000);
+    router.subscribe(client.selector.getLayer(0).streamId, &client);
+  }
+
+  for (uint32_t frame = 0; frame < SIM_FRAMES; frame++) {
+    uint64_t simTimeUs = (uint64_t)frame * 1000000 / SIM_FPS;
+
+    if (frame % SIM_MEASURE_FRAMES == 0) {
+      for (auto& client : clients) {
+        size_t before = client.selector.getCurrent();
+        size_t layer = client.selector.update(client.capacityKbps(frame), simTimeUs);
+        if (layer != before) {
+          router.switchLayer(&client, client.selector.getLayer(layer).streamId);
+        }
+      }
+    }
+
+    for (auto& client : clients) {
+      client.frame = frame;
+    }
+    for (auto& capturer : capturers) {
+      capturer.captureFrame(&router);
+    }
+  }
+
+  uint32_t violations = 0;
+  printf("\n\n---------------------------------------------\n");
+  printf("Simulcast simulation (%u frames at %u fps):\n", SIM_FRAMES, SIM_FPS);
+  for (auto& layer : router.getLayers(0)) {
+    printf("  Layer %u: %u kbit/s\n", layer.streamId, layer.bitrateKbps);
+  }
+  for (auto& client : clients) {
+    printf("  %s: final stream %u, %u switches, %u violations\n",
+           client.name.c_str(), client.currentStream, client.switches, client.violations);
+    for (auto& bytes : client.bytesPerStream) {
+      printf("    Stream %u: %zd KB\n", bytes.first, bytes.second / 1024);
+    }
+    violations += client.violations;
+  }
+  printf("  Layer switches (router): %llu\n", (unsigned long long)router.getLayerSwitches());
+
+  // Every client has to end up where its bandwidth allows, the flaky one has to drop to the
+  // lowest layer while its link is slow and come back afterwards.
+  bool settled = true;
+  if (clients[0].currentStream != 0) {
+    printf("  desktop did not end on stream 0\n");
+    settled = false;
+  }
+  if (clients[1].currentStream != 1) {
+    printf("  pi-wifi did not settle on stream 1\n");
+    settled = false;
+  }
+  bool dropped = false;
+  for (auto& switched : clients[2].switchedAt) {
+    dropped = dropped || (switched.second == 2 && switched.first >= SIM_FLAKY_START && switched.first < SIM_FLAKY_END);
+  }
+  if (!dropped || clients[2].currentStream != 0) {
+    printf("  flaky did not drop to stream 2 within frames %u-%u and return to stream 0\n", SIM_FLAKY_START, SIM_FLAKY_END);
+    settled = false;
+  }
+  printf("  Outcome: %s\n", violations == 0 && settled ? "passed" : "FAILED");
+  printf("---------------------------------------------\n");
+
+  for (auto& client : clients) {
+    router.unsubscribe(&client);
+  }
+  return violations == 0 && settled;
+}
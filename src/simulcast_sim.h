@@ -0,0 +1,13 @@
+#ifndef _SIMULCAST_SIM_H_
+#define _SIMULCAST_SIM_H_
+
+/// Runs three synthetic simulcast layers through a StreamRouter to clients with
+/// simulated bandwidth (constant fast, constant slow and one that drops and recovers).
+///
+/// Every client picks its layer with a LayerSelector. The run checks that clients only
+/// ever change layers at an IDR and never lose the rest of a frame when doing so, and
+/// that they end up on the expected layer: desktop on 0, pi-wifi on 1 and flaky back on
+/// 0 after dropping to 2 while its link was slow. Returns false if a check failed.
+bool runSimulcastSimulation();
+
+#endif
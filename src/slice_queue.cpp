@@ -0,0 +1,43 @@
+#include <chrono>
+
+#include "slice_queue.h"
+
+void SliceQueue::onSlice(const EncodedSlice& slice) {
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    slices.push_back(slice);
+    metricDepth.set((int64_t)slices.size());
+  }
+  metricQueued.add();
+  pushed.notify_one();
+}
+
+size_t SliceQueue::drain(SliceSink* sink, uint32_t timeoutMs) {
+  std::deque<EncodedSlice> ready;
+
+  {
+    std::unique_lock<std::mutex> guard(lock);
+    pushed.wait_for(guard, std::chrono::milliseconds(timeoutMs), [this]() { return !slices.empty(); });
+    ready.swap(slices);
+    metricDepth.set(0);
+  }
+
+  // The sink is called without holding the lock so the encoder never waits on the network.
+  for (auto& slice : ready) {
+    if (sink) {
+      sink->onSlice(slice);
+    }
+  }
+
+  return ready.size();
+}
+
+size_t SliceQueue::size() {
+  std::lock_guard<std::mutex> guard(lock);
+  return slices.size();
+}
+
+void SliceQueue::registerMetrics(MetricsRegistry& registry, const std::string& labels) {
+  registry.addCounter("brocky_slices_queued_total", "Slices the encoder handed over for sending.", labels, &metricQueued);
+  registry.addGauge("brocky_slice_queue_depth", "Slices waiting for the sending thread.", labels, &metricDepth);
+}
@@ -0,0 +1,34 @@
+#ifndef _SLICE_QUEUE_H_
+#define _SLICE_QUEUE_H_
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
+#include "encoded_slice.h"
+#include "metrics.h"
+
+/// Hands slices from an encoder thread over to the thread that sends them out.
+class SliceQueue : public SliceSink {
+  private:
+    std::deque<EncodedSlice> slices;
+    std::mutex lock;
+    std::condition_variable pushed;
+    MetricCounter metricQueued;
+    MetricGauge metricDepth;
+
+  public:
+    /// Queues a slice, may be called from any thread.
+    void onSlice(const EncodedSlice& slice) override;
+
+    /// Waits up to `timeoutMs` for slices and passes everything queued to `sink`.
+    /// Returns the amount of slices passed on.
+    size_t drain(SliceSink* sink, uint32_t timeoutMs);
+
+    size_t size();
+
+    /// Adds the queue depth to `registry`, `labels` tell the queues apart.
+    void registerMetrics(MetricsRegistry& registry, const std::string& labels);
+};
+
+#endif
@@ -0,0 +1,297 @@
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+
+#include "stream_router.h"
+
+bool StreamRouter::addStream(uint32_t id, const std::string& name, uint32_t bitrateKbps) {
+  uint32_t existing = 0;
+  if (streams.count(id) || findStream(name, &existing)) {
+    printf("[Router] Stream %u (%s) is already registered\n", id, name.c_str());
+    return false;
+  }
+
+  if (streams.empty()) {
+    defaultStream = id;
+  }
+
+  Stream stream;
+  stream.name = name;
+  stream.group = id;
+  stream.bitrateKbps = bitrateKbps;
+  streams[id] = stream;
+
+  printf("[Router] Registered stream %u as %s\n", id, name.c_str());
+  return true;
+}
+
+bool StreamRouter::addLayer(uint32_t id, uint32_t baseId, uint32_t bitrateKbps) {
+  auto base = streams.find(baseId);
+  if (base == streams.end() || base->second.group != baseId) {
+    printf("[Router] Layer %u needs a base stream, %u is none\n", id, baseId);
+    return false;
+  }
+
+  std::string name = base->second.name + "." + std::to_string(getLayers(baseId).size());
+  if (!addStream(id, name, bitrateKbps)) {
+    return false;
+  }
+
+  streams[id].group = baseId;
+  return true;
+}
+
+void StreamRouter::removeStream(uint32_t id) {
+  streams.erase(id);
+  subscriptions.erase(
+    std::remove_if(subscriptions.begin(), subscriptions.end(),
+                   [id](const Subscription& s) { return s.stream == id; }),
+    subscriptions.end()
+  );
+}
+
+bool StreamRouter::isBaseStream(uint32_t id) const {
+  auto stream = streams.find(id);
+  return stream != streams.end() && stream->second.group == id;
+}
+
+std::vector<StreamLayer> StreamRouter::getLayers(uint32_t id) const {
+  std::vector<StreamLayer> layers;
+  auto stream = streams.find(id);
+  if (stream == streams.end()) {
+    return layers;
+  }
+
+  for (auto iter = streams.begin(); iter != streams.end(); iter++) {
+    if (iter->second.group == stream->second.group) {
+      StreamLayer layer;
+      layer.streamId = iter->first;
+      layer.bitrateKbps = iter->second.bitrateKbps;
+      layers.push_back(layer);
+    }
+  }
+  return layers;
+}
+
+bool StreamRouter::subscribe(uint32_t id, SliceSink* subscriber) {
+  auto stream = streams.find(id);
+  if (stream == streams.end()) {
+    return false;
+  }
+
+  // A subscriber only ever listens to a single stream.
+  unsubscribe(subscriber);
+
+  Subscription subscription;
+  subscription.sink = subscriber;
+  subscription.stream = id;
+  subscription.pendingStream = id;
+  subscription.synced = false;
+  subscription.midFrame = false;
+
+  // Burst out the current GOP, the live slices continue right where it ends.
+  const GopCache& cache = stream->second.cache;
+  if (cache.replay(subscriber)) {
+    subscription.synced = true;
+    subscription.midFrame = !cache.isFrameComplete();
+    printf("[Router] Replayed %zd cached slices (%zd KB) to new subscriber of stream %u\n",
+           cache.getSliceCount(), cache.getBytes() / 1024, id);
+  }
+
+  subscriptions.push_back(subscription);
+  return true;
+}
+
+void StreamRouter::unsubscribe(SliceSink* subscriber) {
+  subscriptions.erase(
+    std::remove_if(subscriptions.begin(), subscriptions.end(),
+                   [subscriber](const Subscription& s) { return s.sink == subscriber; }),
+    subscriptions.end()
+  );
+}
+
+bool StreamRouter::switchLayer(SliceSink* subscriber, uint32_t id) {
+  auto target = streams.find(id);
+  if (target == streams.end()) {
+    return false;
+  }
+
+  for (auto& subscription : subscriptions) {
+    if (subscription.sink != subscriber) {
+      continue;
+    }
+
+    if (streams.count(subscription.stream) == 0 || streams[subscription.stream].group != target->second.group) {
+      printf("[Router] Stream %u is no layer of stream %u\n", id, subscription.stream);
+      return false;
+    }
+
+    subscription.pendingStream = id;
+    if (!subscription.midFrame) {
+      switchFromCache(subscription);
+    }
+    return true;
+  }
+
+  return false;
+}
+
+bool StreamRouter::getSubscribedStream(SliceSink* subscriber, uint32_t* id) const {
+  for (auto& subscription : subscriptions) {
+    if (subscription.sink == subscriber) {
+      *id = subscription.stream;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+void StreamRouter::switchFromCache(Subscription& subscription) {
+  if (subscription.pendingStream == subscription.stream) {
+    return;
+  }
+
+  // Only the IDR frame that is currently being sent, anything older would jump back in time.
+  const GopCache& cache = streams[subscription.pendingStream].cache;
+  if (!cache.isValid() || cache.getFrameCount() != 1) {
+    return;
+  }
+
+  cache.replay(subscription.sink);
+  subscription.stream = subscription.pendingStream;
+  subscription.synced = true;
+  subscription.midFrame = !cache.isFrameComplete();
+  statsLayerSwitches++;
+}
+
+bool StreamRouter::findStream(const std::string& name, uint32_t* id) const {
+  for (auto iter = streams.begin(); iter != streams.end(); iter++) {
+    if (iter->second.name == name) {
+      *id = iter->first;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+bool StreamRouter::resolveRequest(const char* request, size_t len, uint32_t* id) const {
+  return resolveName(request, len, "GET /raw/", ".h264", id);
+}
+
+CursorChannel* StreamRouter::resolveCursorRequest(const char* request, size_t len) const {
+  uint32_t id = 0;
+  if (!resolveName(request, len, "GET /cursor/", ".cursor", &id)) {
+    return nullptr;
+  }
+
+  // Layers show the same screen, the cursor lives at the base stream.
+  auto stream = streams.find(id);
+  auto base = streams.find(stream->second.group);
+  return base == streams.end() ? nullptr : base->second.cursor;
+}
+
+InputSink* StreamRouter::resolveInputRequest(const char* request, size_t len) const {
+  uint32_t id = 0;
+  if (!resolveName(request, len, "GET /input/", ".input", &id)) {
+    return nullptr;
+  }
+
+  auto stream = streams.find(id);
+  auto base = streams.find(stream->second.group);
+  return base == streams.end() ? nullptr : base->second.input;
+}
+
+bool StreamRouter::setInput(uint32_t id, InputSink* input) {
+  if (!isBaseStream(id)) {
+    return false;
+  }
+
+  streams[id].input = input;
+  return true;
+}
+
+bool StreamRouter::setCursor(uint32_t id, CursorChannel* cursor) {
+  if (!isBaseStream(id)) {
+    return false;
+  }
+
+  streams[id].cursor = cursor;
+  return true;
+}
+
+bool StreamRouter::resolveName(const char* request, size_t len, const char* prefix, const char* suffix, uint32_t* id) const {
+  size_t prefixLen = strlen(prefix);
+  size_t suffixLen = strlen(suffix);
+
+  if (len < prefixLen || memcmp(request, prefix, prefixLen) != 0) {
+    return false;
+  }
+
+  // Name runs up to the extension.
+  const char* begin = request + prefixLen;
+  const char* end = request + len;
+  const char* extension = std::search(begin, end, suffix, suffix + suffixLen);
+  if (extension == end) {
+    return false;
+  }
+
+  std::string name(begin, extension);
+  if (findStream(name, id)) {
+    return true;
+  }
+
+  // Old clients simply ask for `stream`.
+  if (name == "stream" && streams.count(defaultStream)) {
+    *id = defaultStream;
+    return true;
+  }
+
+  return false;
+}
+
+size_t StreamRouter::subscriberCount(uint32_t id) const {
+  return std::count_if(subscriptions.begin(), subscriptions.end(),
+                       [id](const Subscription& s) { return s.stream == id; });
+}
+
+void StreamRouter::onSlice(const EncodedSlice& slice) {
+  auto stream = streams.find(slice.streamId);
+  if (stream == streams.end()) {
+    return;
+  }
+
+  stream->second.cache.push(slice);
+  bool idrStart = slice.keyFrame && slice.sliceIndex == 0;
+
+  for (auto& subscription : subscriptions) {
+    // Layer switches happen at an IDR of the new layer while the old one is between frames.
+    bool switching = subscription.pendingStream != subscription.stream;
+    if (switching && slice.streamId == subscription.pendingStream && idrStart && !subscription.midFrame) {
+      subscription.stream = subscription.pendingStream;
+      subscription.synced = true;
+      statsLayerSwitches++;
+    }
+
+    if (slice.streamId != subscription.stream) {
+      continue;
+    }
+
+    // Nothing before an IDR can be decoded by a new subscriber.
+    if (!subscription.synced) {
+      if (!idrStart) {
+        continue;
+      }
+      subscription.synced = true;
+    }
+
+    subscription.sink->onSlice(slice);
+    subscription.midFrame = !slice.lastInFrame;
+
+    // The IDR of the new layer may have started while this frame was still going.
+    if (!subscription.midFrame) {
+      switchFromCache(subscription);
+    }
+  }
+}
@@ -0,0 +1,108 @@
+#ifndef _STREAM_ROUTER_H_
+#define _STREAM_ROUTER_H_
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "cursor_protocol.h"
+#include "encoded_slice.h"
+#include "gop_cache.h"
+#include "input_protocol.h"
+#include "layer_selector.h"
+
+/// Connects capture sources to the clients that subscribed to them.
+///
+/// Every source publishes its slices under its own stream id, subscribers only get
+/// the slices of the stream they asked for. The router does not know anything about
+/// the transport, so it works the same for QUIC clients or anything else.
+///
+/// Every stream keeps its current GOP, a new subscriber gets it replayed first and
+/// can decode immediately instead of waiting for the next IDR.
+///
+/// Streams can be grouped into simulcast layers (same content, different resolution or
+/// bitrate). A subscriber is moved between the layers of its group at IDR boundaries.
+class StreamRouter : public SliceSink {
+  private:
+    struct Subscription {
+      SliceSink* sink;
+      /// Stream currently delivered.
+      uint32_t stream;
+      /// Layer to switch to, same as `stream` while no switch is pending.
+      uint32_t pendingStream;
+      /// Set once the subscriber has seen the start of an IDR frame.
+      bool synced;
+      /// Set while a frame of `stream` is only partially delivered.
+      bool midFrame;
+    };
+
+    struct Stream {
+      std::string name;
+      /// Base stream of the simulcast group, its own id if it is the base.
+      uint32_t group;
+      uint32_t bitrateKbps;
+      GopCache cache;
+      /// Cursor of the capture source, shared by all layers of the group.
+      CursorChannel* cursor = nullptr;
+      /// Where the input of clients watching the group goes.
+      InputSink* input = nullptr;
+    };
+
+    std::map<uint32_t, Stream> streams;
+    std::vector<Subscription> subscriptions;
+    /// Stream served for the generic `stream` name.
+    uint32_t defaultStream = 0;
+    /// Debug stats.
+    uint64_t statsLayerSwitches = 0;
+
+  public:
+    /// Registers a stream. The first registered stream is the default one.
+    bool addStream(uint32_t id, const std::string& name, uint32_t bitrateKbps = 0);
+    /// Registers `id` as another layer of the base stream `baseId`. It can be requested
+    /// directly as `<base name>.<n>`.
+    bool addLayer(uint32_t id, uint32_t baseId, uint32_t bitrateKbps);
+    void removeStream(uint32_t id);
+
+    /// Whether `id` is a stream on its own or the base of a simulcast group.
+    bool isBaseStream(uint32_t id) const;
+    /// All layers of the group `id` belongs to, just `id` itself without simulcast.
+    std::vector<StreamLayer> getLayers(uint32_t id) const;
+
+    /// Starts delivering slices of stream `id` to `subscriber`. The cached GOP is handed
+    /// to it right away, without one it starts with the next IDR frame.
+    bool subscribe(uint32_t id, SliceSink* subscriber);
+    /// Removes `subscriber` from whatever stream it is subscribed to.
+    void unsubscribe(SliceSink* subscriber);
+    /// Moves `subscriber` to another layer of its group. The switch happens at the first
+    /// IDR of that layer that does not cut a frame of the current one.
+    bool switchLayer(SliceSink* subscriber, uint32_t id);
+    /// Stream that is currently delivered to `subscriber`.
+    bool getSubscribedStream(SliceSink* subscriber, uint32_t* id) const;
+
+    /// Resolves a request like `GET /raw/<name>.h264` to a stream id.
+    bool resolveRequest(const char* request, size_t len, uint32_t* id) const;
+    /// Resolves a request like `GET /cursor/<name>.cursor` to the cursor of that stream.
+    CursorChannel* resolveCursorRequest(const char* request, size_t len) const;
+    /// Resolves a request like `GET /input/<name>.input` to the input sink of that stream.
+    InputSink* resolveInputRequest(const char* request, size_t len) const;
+    bool findStream(const std::string& name, uint32_t* id) const;
+
+    /// Sets the cursor published next to the base stream `id`, the router does not own it.
+    bool setCursor(uint32_t id, CursorChannel* cursor);
+    /// Sets where client input for the base stream `id` goes, the router does not own it.
+    bool setInput(uint32_t id, InputSink* input);
+
+    size_t subscriberCount(uint32_t id) const;
+    uint64_t getLayerSwitches() const { return statsLayerSwitches; }
+
+    /// Publishes a slice to all subscribers of `slice.streamId`.
+    void onSlice(const EncodedSlice& slice) override;
+
+  private:
+    /// Stream id of the name between `prefix` and `suffix` of a request.
+    bool resolveName(const char* request, size_t len, const char* prefix, const char* suffix, uint32_t* id) const;
+    /// Finishes a pending switch from the cache if the new layer's IDR frame already started.
+    void switchFromCache(Subscription& subscription);
+};
+
+#endif
@@ -0,0 +1,84 @@
+#include <cstdio>
+#include <thread>
+
+#include "synthetic_capture.h"
+
+bool SyntheticCapturer::initialize(uint32_t fps, uint32_t slicesPerFrame, size_t sliceSize, uint32_t encodeTimeMs) {
+  if (fps == 0 || slicesPerFrame == 0 || sliceSize < 2) {
+    printf("Invalid synthetic capture settings\n");
+    return false;
+  }
+
+  this->fps = fps;
+  this->slicesPerFrame = slicesPerFrame;
+  this->sliceSize = sliceSize;
+  this->encodeTimeMs = encodeTimeMs;
+  frameIndex = 0;
+  nextFrameTime = std::chrono::steady_clock::now();
+
+  printf("Synthetic capture is ready with (fps: %u; slices: %u; slice size: %zu)\n", fps, slicesPerFrame, sliceSize);
+  return true;
+}
+
+void SyntheticCapturer::cleanup() {
+  frameIndex = 0;
+}
+
+SlicePayload SyntheticCapturer::createSlice(bool keyFrame, uint32_t sliceIndex) {
+  static const uint8_t startCode[] = { 0x00, 0x00, 0x00, 0x01 };
+  // Minimal fake parameter sets, only the nal header matters for the transport.
+  static const uint8_t sps[] = { 0x00, 0x00, 0x00, 0x01, 0x67, 0x42, 0xc0, 0x1f };
+  static const uint8_t pps[] = { 0x00, 0x00, 0x00, 0x01, 0x68, 0xce, 0x3c, 0x80 };
+
+  auto slice = std::make_shared<std::vector<uint8_t>>();
+  slice->reserve(sizeof(sps) + sizeof(pps) + sizeof(startCode) + sliceSize);
+
+  // Like NVENC with repeatSPSPPS the parameter sets travel in front of the first IDR slice.
+  if (keyFrame && sliceIndex == 0) {
+    slice->insert(slice->end(), sps, sps + sizeof(sps));
+    slice->insert(slice->end(), pps, pps + sizeof(pps));
+  }
+
+  slice->insert(slice->end(), startCode, startCode + sizeof(startCode));
+  slice->push_back(keyFrame ? 0x65 : 0x41);
+
+  // first_mb_in_slice (ue) is only zero on the first slice, that is where a frame starts.
+  slice->push_back(sliceIndex == 0 ? 0x80 : 0x40);
+
+  // Filler that can never form a start code.
+  uint8_t filler = 0x80 | (frameIndex & 0x7f);
+  slice->insert(slice->end(), sliceSize - 2, filler);
+
+  return slice;
+}
+
+bool SyntheticCapturer::captureFrame(SliceSink* sink) {
+  // Pace frames like a display would.
+  std::this_thread::sleep_until(nextFrameTime);
+  nextFrameTime += std::chrono::microseconds(1000000 / fps);
+
+  bool keyFrame = frameIndex % gopLength == 0;
+  auto captureTime = nowMicros();
+  auto sliceTime = std::chrono::microseconds(encodeTimeMs * 1000 / slicesPerFrame);
+
+  for (uint32_t i = 0; i < slicesPerFrame; i++) {
+    // Simulate the encoder finishing one slice after another.
+    std::this_thread::sleep_for(sliceTime);
+
+    EncodedSlice slice;
+    slice.streamId = streamId;
+    slice.frameIndex = frameIndex;
+    slice.sliceIndex = i;
+    slice.lastInFrame = i == slicesPerFrame - 1;
+    slice.keyFrame = keyFrame;
+    slice.captureTimeUs = captureTime;
+    slice.payload = createSlice(keyFrame, i);
+
+    if (sink) {
+      sink->onSlice(slice);
+    }
+  }
+
+  frameIndex++;
+  return true;
+}
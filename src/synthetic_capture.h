@@ -0,0 +1,41 @@
+#ifndef _SYNTHETIC_CAPTURE_H_
+#define _SYNTHETIC_CAPTURE_H_
+
+#include <chrono>
+
+#include "encoded_slice.h"
+
+/// Frame source that does not capture anything but emits fake H.264 slices on the
+/// same schedule a real encoder would. Used to exercise the transport on machines
+/// without a GPU or a desktop.
+class SyntheticCapturer {
+  private:
+    /// Frames per second.
+    uint32_t fps = 60;
+    /// Amount of slices every frame is split into.
+    uint32_t slicesPerFrame = 8;
+    /// Payload size of a single slice (without start code).
+    size_t sliceSize = 1500 - 28;
+    /// Simulated encode time of a whole frame, spread evenly over all slices.
+    uint32_t encodeTimeMs = 8;
+    /// Every n-th frame is an IDR frame.
+    uint32_t gopLength = 5;
+    /// Stream id the slices are published with.
+    uint32_t streamId = 0;
+
+    uint32_t frameIndex = 0;
+    std::chrono::steady_clock::time_point nextFrameTime;
+
+  public:
+    bool initialize(uint32_t fps, uint32_t slicesPerFrame, size_t sliceSize, uint32_t encodeTimeMs);
+    void setStreamId(uint32_t id) { streamId = id; }
+    void cleanup();
+
+    /// Waits for the next frame slot and pushes its slices to `sink` one by one.
+    bool captureFrame(SliceSink* sink);
+
+  private:
+    SlicePayload createSlice(bool keyFrame, uint32_t sliceIndex);
+};
+
+#endif
@@ -0,0 +1,445 @@
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "quic_client.h"
+#include "quic_server.h"
+#include "shm_transport.h"
+#include "slice_queue.h"
+#include "stream_router.h"
+#include "synthetic_capture.h"
+#include "transport_bench.h"
+
+static const uint32_t BENCH_SLICES_PER_FRAME = 8;
+/// Frames between two IDRs, a reader that was overrun picks up again at the next one.
+static const uint32_t BENCH_GOP_FRAMES = 60;
+/// Paced slices for the latency, one every BENCH_PACE_US.
+static const uint32_t BENCH_LATENCY_SLICES = 2000;
+static const uint32_t BENCH_LATENCY_SLICE_BYTES = 4 * 1024;
+static const uint64_t BENCH_PACE_US = 500;
+/// Slices sent back to back for the throughput.
+static const uint32_t BENCH_THROUGHPUT_SLICES = 4000;
+static const uint32_t BENCH_THROUGHPUT_SLICE_BYTES = 16 * 1024;
+static const uint64_t BENCH_TIMEOUT_US = 20000000;
+static const uint16_t BENCH_QUIC_PORT = 14337;
+/// Start code, nal header and the slice index every bench slice begins with.
+static const size_t BENCH_HEADER_BYTES = 9;
+/// Backlog the QUIC run waits for before queueing the next slice, well below
+/// CLIENT_BACKLOG_MAX_BYTES so the server never drops slices to catch up.
+static const size_t BENCH_MAX_BACKLOG_BYTES = CLIENT_BACKLOG_MAX_BYTES / 4;
+/// Synthetic stream, 10s of 60 fps frames with 8 slices each.
+static const uint32_t SYNTHETIC_FRAMES = 600;
+static const uint32_t SYNTHETIC_FPS = 60;
+static const uint32_t SYNTHETIC_SLICES = 8;
+static const uint32_t SYNTHETIC_SLICE_BYTES = 4 * 1024;
+static const uint32_t SYNTHETIC_ENCODE_MS = 8;
+
+static size_t bench_slice_bytes(uint32_t index) {
+  return index < BENCH_LATENCY_SLICES ? BENCH_LATENCY_SLICE_BYTES : BENCH_THROUGHPUT_SLICE_BYTES;
+}
+
+/// Index of the slice starting at `data`, 7 bits per byte behind the nal header.
+static uint32_t read_bench_index(const uint8_t* data) {
+  return (uint32_t)(data[5] & 0x7f) << 21 | (uint32_t)(data[6] & 0x7f) << 14 |
+         (uint32_t)(data[7] & 0x7f) << 7 | (uint32_t)(data[8] & 0x7f);
+}
+
+/// Slice `index` of the run, a non-IDR or IDR NAL unit of filler bytes.
+static EncodedSlice make_bench_slice(uint32_t index, size_t bytes) {
+  EncodedSlice slice;
+  slice.frameIndex = index / BENCH_SLICES_PER_FRAME;
+  slice.sliceIndex = index % BENCH_SLICES_PER_FRAME;
+  slice.lastInFrame = slice.sliceIndex == BENCH_SLICES_PER_FRAME - 1;
+  slice.keyFrame = slice.frameIndex % BENCH_GOP_FRAMES == 0;
+
+  // No zero bytes after the start code, neither the index nor the filler look like one.
+  auto payload = std::make_shared<std::vector<uint8_t>>(bytes, 0xAA);
+  (*payload)[0] = 0;
+  (*payload)[1] = 0;
+  (*payload)[2] = 0;
+  (*payload)[3] = 1;
+  (*payload)[4] = slice.keyFrame ? 0x65 : 0x41;
+  (*payload)[5] = 0x80 | ((index >> 21) & 0x7f);
+  (*payload)[6] = 0x80 | ((index >> 14) & 0x7f);
+  (*payload)[7] = 0x80 | ((index >> 7) & 0x7f);
+  (*payload)[8] = 0x80 | (index & 0x7f);
+  slice.payload = payload;
+  return slice;
+}
+
+/// Arrival of every slice, filled by the receiving thread and evaluated once it stopped.
+/// Slices carry their index, one that was dropped on the way does not shift the others.
+class BenchReceiver : public SliceSink, public StreamDataSink {
+  public:
+    std::vector<uint64_t> arrivalUs;
+    /// Set once the last slice of the run arrived, nothing can follow it.
+    std::atomic<bool> finished{ false };
+    /// Beginning of the QUIC slice being received, its index tells how long it is.
+    uint8_t header[BENCH_HEADER_BYTES];
+    size_t headerBytes = 0;
+    uint32_t current = 0;
+    /// Bytes of the current slice (and its delimiter) still to come.
+    size_t remaining = 0;
+
+    explicit BenchReceiver(uint32_t slices) : arrivalUs(slices) {}
+
+    void arrived(uint32_t index, uint64_t now) {
+      if (index < arrivalUs.size()) {
+        arrivalUs[index] = now;
+        if (index + 1 == arrivalUs.size()) {
+          finished = true;
+        }
+      }
+    }
+
+    // Shared memory hands out slices.
+    void onSlice(const EncodedSlice& slice) override {
+      if (slice.payload->size() >= BENCH_HEADER_BYTES) {
+        arrived(read_bench_index(slice.payload->data()), nowMicros());
+      }
+    }
+
+    // QUIC hands out bytes, a slice arrived once the stream got past its end.
+    void onStreamData(const uint8_t* data, size_t len) override {
+      uint64_t now = nowMicros();
+      size_t offset = 0;
+      while (offset < len) {
+        if (headerBytes < BENCH_HEADER_BYTES) {
+          size_t take = std::min(BENCH_HEADER_BYTES - headerBytes, len - offset);
+          memcpy(header + headerBytes, data + offset, take);
+          headerBytes += take;
+          offset += take;
+          if (headerBytes < BENCH_HEADER_BYTES) {
+            return;
+          }
+
+          // The server closes every frame with a delimiter.
+          current = read_bench_index(header);
+          remaining = bench_slice_bytes(current) - BENCH_HEADER_BYTES;
+          if (current % BENCH_SLICES_PER_FRAME == BENCH_SLICES_PER_FRAME - 1) {
+            remaining += sizeof(ACCESS_UNIT_DELIMITER);
+          }
+        }
+
+        size_t take = std::min(remaining, len - offset);
+        remaining -= take;
+        offset += take;
+        if (remaining == 0) {
+          arrived(current, now);
+          headerBytes = 0;
+        }
+      }
+    }
+};
+
+/// Sends all slices into `sink`, `pump` keeps the transport going while waiting.
+template <typename Pump>
+static void run_bench(BenchReceiver& receiver, SliceSink* sink, const std::vector<EncodedSlice>& slices,
+                      std::vector<uint64_t>& sendUs, Pump pump) {
+  // Paced, the receiver has to wake up for every slice.
+  uint32_t index = 0;
+  for (; index < BENCH_LATENCY_SLICES; index++) {
+    EncodedSlice slice = slices[index];
+    slice.captureTimeUs = nowMicros();
+    sendUs[index] = slice.captureTimeUs;
+    sink->onSlice(slice);
+    while (nowMicros() - slice.captureTimeUs < BENCH_PACE_US) {
+      pump();
+    }
+  }
+
+  // Back to back.
+  for (; index < slices.size(); index++) {
+    EncodedSlice slice = slices[index];
+    slice.captureTimeUs = nowMicros();
+    sendUs[index] = slice.captureTimeUs;
+    sink->onSlice(slice);
+    pump();
+  }
+
+  uint64_t start = nowMicros();
+  while (!receiver.finished && nowMicros() - start < BENCH_TIMEOUT_US) {
+    pump();
+  }
+}
+
+static void print_bench(const char* name, const BenchReceiver& receiver, const std::vector<uint64_t>& sendUs) {
+  std::vector<uint64_t> latencies;
+  for (uint32_t i = 0; i < BENCH_LATENCY_SLICES; i++) {
+    if (receiver.arrivalUs[i] != 0) {
+      latencies.push_back(receiver.arrivalUs[i] - sendUs[i]);
+    }
+  }
+  std::sort(latencies.begin(), latencies.end());
+
+  uint64_t bytes = 0;
+  uint64_t lastArrival = 0;
+  uint32_t delivered = 0;
+  for (uint32_t i = BENCH_LATENCY_SLICES; i < sendUs.size(); i++) {
+    if (receiver.arrivalUs[i] != 0) {
+      bytes += BENCH_THROUGHPUT_SLICE_BYTES;
+      lastArrival = std::max(lastArrival, receiver.arrivalUs[i]);
+      delivered++;
+    }
+  }
+  uint64_t duration = lastArrival > sendUs[BENCH_LATENCY_SLICES] ? lastArrival - sendUs[BENCH_LATENCY_SLICES] : 1;
+
+  printf("  %s:\n", name);
+  if (latencies.empty()) {
+    printf("    Latency: nothing arrived\n");
+  } else {
+    printf("    Latency: p50 %lluus, p99 %lluus, max %lluus (%zd/%u slices)\n",
+           (unsigned long long)latencies[latencies.size() / 2],
+           (unsigned long long)latencies[latencies.size() * 99 / 100],
+           (unsigned long long)latencies.back(), latencies.size(), BENCH_LATENCY_SLICES);
+  }
+  printf("    Throughput: %.0f MB/s (%u/%u slices)\n", (double)bytes / (double)duration,
+         delivered, BENCH_THROUGHPUT_SLICES);
+}
+
+void benchmarkLocalTransports() {
+  std::vector<EncodedSlice> slices;
+  for (uint32_t i = 0; i < BENCH_LATENCY_SLICES + BENCH_THROUGHPUT_SLICES; i++) {
+    slices.push_back(make_bench_slice(i, bench_slice_bytes(i)));
+  }
+
+  printf("\n\n---------------------------------------------\n");
+  printf("Local transports (%u paced slices of %u KB, %u back to back slices of %u KB):\n",
+         BENCH_LATENCY_SLICES, BENCH_LATENCY_SLICE_BYTES / 1024, BENCH_THROUGHPUT_SLICES,
+         BENCH_THROUGHPUT_SLICE_BYTES / 1024);
+
+  // Shared memory, the reader sleeps on the futex like a consumer process would.
+  {
+    ShmPublisher publisher;
+    ShmSubscriber subscriber;
+    BenchReceiver receiver((uint32_t)slices.size());
+    std::vector<uint64_t> sendUs(slices.size());
+    if (publisher.initialize("bench") && subscriber.initialize("bench")) {
+      std::atomic<bool> done{ false };
+      std::thread reader([&]() {
+        while (!done) {
+          subscriber.read(&receiver, 10);
+        }
+      });
+
+      run_bench(receiver, &publisher, slices, sendUs, []() {});
+      done = true;
+      reader.join();
+      print_bench("Shared memory", receiver, sendUs);
+      printf("    Overruns: %lld\n", subscriber.getOverruns());
+    }
+  }
+
+  // QUIC over loopback, the client runs on its own thread like on another host.
+  {
+    StreamRouter router;
+    router.addStream(0, "bench");
+    QUICServer server;
+    server.setRouter(&router);
+    BenchReceiver receiver((uint32_t)slices.size());
+    std::vector<uint64_t> sendUs(slices.size());
+
+    if (server.initialize(BENCH_QUIC_PORT)) {
+      std::atomic<bool> done{ false };
+      std::thread clientThread([&]() {
+        QUICClient client;
+        client.setServer("127.0.0.1", std::to_string(BENCH_QUIC_PORT));
+        client.setStreamName("bench");
+        client.setDataSink(&receiver);
+        if (!client.initialize()) {
+          return;
+        }
+        while (!done && !client.isClosed()) {
+          client.wait(1);
+          client.tick();
+        }
+      });
+
+      uint64_t start = nowMicros();
+      while (router.subscriberCount(0) == 0 && nowMicros() - start < BENCH_TIMEOUT_US) {
+        server.tick();
+      }
+
+      if (router.subscriberCount(0) > 0) {
+        // Back to back slices only go out as fast as the backlog drains, the server would
+        // drop them otherwise.
+        run_bench(receiver, &router, slices, sendUs, [&]() {
+          uint64_t pumpStart = nowMicros();
+          do {
+            server.tick();
+          } while (server.getBacklogBytes() > BENCH_MAX_BACKLOG_BYTES && nowMicros() - pumpStart < BENCH_TIMEOUT_US);
+        });
+      }
+      done = true;
+      clientThread.join();
+      print_bench("QUIC loopback", receiver, sendUs);
+    } else {
+      printf("  QUIC loopback: server did not start\n");
+    }
+  }
+  printf("---------------------------------------------\n");
+}
+
+/// Records when the server got every synthetic slice and passes it on to the router.
+class SyntheticSends : public SliceSink {
+  public:
+    SliceSink* pNext;
+    std::vector<uint64_t> captureUs;
+    std::vector<uint64_t> sendUs;
+
+    SyntheticSends(SliceSink* next, uint32_t slices) : pNext(next), captureUs(slices), sendUs(slices) {}
+
+    void onSlice(const EncodedSlice& slice) override {
+      uint32_t index = slice.frameIndex * SYNTHETIC_SLICES + slice.sliceIndex;
+      if (index < sendUs.size()) {
+        captureUs[index] = slice.captureTimeUs;
+        sendUs[index] = nowMicros();
+      }
+      pNext->onSlice(slice);
+    }
+};
+
+/// Arrival of every synthetic slice as a NAL unit at the client. The stream only has frame
+/// starts (first_mb_in_slice 0) and the low bits of the frame index in the filler, frames
+/// are counted from the first one.
+class SyntheticArrivals : public NalSink {
+  public:
+    std::vector<uint64_t> arrivalUs;
+    std::atomic<uint32_t> received{ 0 };
+    long long misplaced = 0;
+    int64_t frame = -1;
+    uint32_t sliceIndex = 0;
+
+    explicit SyntheticArrivals(uint32_t slices) : arrivalUs(slices) {}
+
+    void onNalUnit(const uint8_t* data, size_t len) override {
+      uint64_t now = nowMicros();
+      int type = nalUnitType(data, len);
+      if (type != NAL_UNIT_SLICE && type != NAL_UNIT_IDR) {
+        return;
+      }
+
+      // Skip the start code and the nal header, first_mb_in_slice and the filler follow.
+      size_t header = 0;
+      while (header < len && data[header] == 0) {
+        header++;
+      }
+      if (header + 3 >= len) {
+        return;
+      }
+      if ((data[header + 2] & 0x80) != 0) {
+        frame++;
+        sliceIndex = 0;
+      } else {
+        sliceIndex++;
+      }
+      if (frame < 0 || (data[header + 3] & 0x7f) != (frame & 0x7f) || sliceIndex >= SYNTHETIC_SLICES) {
+        misplaced++;
+        return;
+      }
+
+      uint64_t index = (uint64_t)frame * SYNTHETIC_SLICES + sliceIndex;
+      if (index < arrivalUs.size()) {
+        arrivalUs[index] = now;
+        received++;
+      }
+    }
+};
+
+void benchmarkSyntheticStream() {
+  uint32_t slices = SYNTHETIC_FRAMES * SYNTHETIC_SLICES;
+  StreamRouter router;
+  router.addStream(0, "synthetic");
+  QUICServer server;
+  server.setRouter(&router);
+  SyntheticSends sends(&router, slices);
+  SyntheticArrivals arrivals(slices);
+
+  printf("\n\n---------------------------------------------\n");
+  printf("Synthetic stream over QUIC loopback (%u frames at %u fps, %u slices of %u KB, %ums encode):\n",
+         SYNTHETIC_FRAMES, SYNTHETIC_FPS, SYNTHETIC_SLICES, SYNTHETIC_SLICE_BYTES / 1024, SYNTHETIC_ENCODE_MS);
+
+  if (!server.initialize(BENCH_QUIC_PORT)) {
+    printf("  Server did not start\n");
+    printf("---------------------------------------------\n");
+    return;
+  }
+
+  // The client runs on its own thread like on another host.
+  std::atomic<bool> done{ false };
+  std::thread clientThread([&]() {
+    QUICClient client;
+    client.setServer("127.0.0.1", std::to_string(BENCH_QUIC_PORT));
+    client.setStreamName("synthetic");
+    client.setNalSink(&arrivals);
+    if (!client.initialize()) {
+      return;
+    }
+    while (!done && !client.isClosed()) {
+      client.wait(1);
+      client.tick();
+    }
+  });
+
+  uint64_t start = nowMicros();
+  while (router.subscriberCount(0) == 0 && nowMicros() - start < BENCH_TIMEOUT_US) {
+    server.tick();
+  }
+
+  if (router.subscriberCount(0) > 0) {
+    // Frames are paced on their own thread like a capturer, the server picks them up here.
+    SyntheticCapturer capturer;
+    SliceQueue queue;
+    std::atomic<bool> captured{ false };
+    std::thread captureThread([&]() {
+      if (capturer.initialize(SYNTHETIC_FPS, SYNTHETIC_SLICES, SYNTHETIC_SLICE_BYTES, SYNTHETIC_ENCODE_MS)) {
+        for (uint32_t i = 0; i < SYNTHETIC_FRAMES; i++) {
+          capturer.captureFrame(&queue);
+        }
+      }
+      captured = true;
+    });
+
+    while (!captured || queue.size() > 0) {
+      queue.drain(&sends, 1);
+      server.tick();
+    }
+    captureThread.join();
+
+    start = nowMicros();
+    while (arrivals.received.load() < slices && nowMicros() - start < BENCH_TIMEOUT_US) {
+      server.tick();
+    }
+  }
+  done = true;
+  clientThread.join();
+
+  // Only the slices that made it, the latencies are read after the client thread stopped.
+  for (uint32_t s = 0; s < SYNTHETIC_SLICES; s++) {
+    uint64_t captureToSend = 0;
+    uint64_t sendToArrival = 0;
+    uint64_t maxSendToArrival = 0;
+    uint32_t arrived = 0;
+    for (uint32_t f = 0; f < SYNTHETIC_FRAMES; f++) {
+      uint32_t i = f * SYNTHETIC_SLICES + s;
+      if (sends.sendUs[i] == 0 || arrivals.arrivalUs[i] == 0) {
+        continue;
+      }
+      captureToSend += sends.sendUs[i] - sends.captureUs[i];
+      sendToArrival += arrivals.arrivalUs[i] - sends.sendUs[i];
+      maxSendToArrival = std::max(maxSendToArrival, arrivals.arrivalUs[i] - sends.sendUs[i]);
+      arrived++;
+    }
+
+    uint32_t divisor = arrived == 0 ? 1 : arrived;
+    printf("  Slice %u: capture to send %lluus, send to arrival avg %lluus, max %lluus (%u/%u)\n", s,
+           (unsigned long long)(captureToSend / divisor), (unsigned long long)(sendToArrival / divisor),
+           (unsigned long long)maxSendToArrival, arrived, SYNTHETIC_FRAMES);
+  }
+  printf("  Slices out of place: %lld\n", arrivals.misplaced);
+  printf("---------------------------------------------\n");
+}
@@ -0,0 +1,14 @@
+#ifndef _TRANSPORT_BENCH_H_
+#define _TRANSPORT_BENCH_H_
+
+/// Sends the same synthetic slices through the shared memory ring and through QUIC over
+/// loopback (server and client in this process, `certs/` has to be around) and prints
+/// latency (paced slices) and throughput (slices as fast as possible) of both.
+void benchmarkLocalTransports();
+
+/// Streams the synthetic capture source through QUICServer to a client over loopback
+/// (`certs/` has to be around) and prints per slice of a frame how long it took from
+/// capture to send and from send to arrival as a NAL unit at the client.
+void benchmarkSyntheticStream();
+
+#endif
@@ -4,22 +4,31 @@
 #include "windows_capture.h"
 
 void WindowsCapturer::cleanup() {
+  stop();
+
   // Clean encoder
   if (pEncoder) {
-    pEncoder->DestroyEncoder();
+    // Collect whatever is still in flight so all input surfaces get unmapped.
+    while (ring.inFlight() > 0) {
+      ring.drain(nullptr, 0);
+    }
+    pEncoder->DestroySlicedEncoder();
     delete pEncoder;
     pEncoder = nullptr;
   }
 
   // Clean capturing
+  SAFE_RELEASE(pLastFrame);
+  hasLastFrame = false;
   SAFE_RELEASE(pDDA);
   SAFE_RELEASE(pDevice);
   SAFE_RELEASE(pContext);
   SAFE_RELEASE(pResource);
 }
 
-bool WindowsCapturer::initialize() {
+bool WindowsCapturer::initialize(const CaptureConfig& config) {
   HRESULT hr = S_OK;
+  this->config = config;
 
   // Temporary interfaces.
   IDXGIAdapter *pAdapter = nullptr;
@@ -29,6 +38,7 @@ bool WindowsCapturer::initialize() {
 
   /// Release all temporary refs before exit
   #define CLEAN_EXIT() \
+    SAFE_RELEASE(pLastFrame);\
     SAFE_RELEASE(pDDA);\
     SAFE_RELEASE(pDevice);\
     SAFE_RELEASE(pContext);\
@@ -86,10 +96,10 @@ bool WindowsCapturer::initialize() {
     CLEAN_EXIT();
   }
 
-  // Get output device (for now always the main monitor 0)
-  hr = pAdapter->EnumOutputs(0, &pOutput);
+  // Get requested output device (monitor).
+  hr = pAdapter->EnumOutputs(config.outputIndex, &pOutput);
   if (FAILED(hr)) {
-    printf("Failed to get output device 0 from dxgi adapter\n");
+    printf("Failed to get output device %d from dxgi adapter\n", config.outputIndex);
     CLEAN_EXIT();
   }
 
@@ -105,6 +115,10 @@ bool WindowsCapturer::initialize() {
 
   // Finally create output duplication
   hr = pOut1->DuplicateOutput(pDXGIDevice, &pDDA);
+  if (FAILED(hr)) {
+    printf("Failed to duplicate output %d (error code: %X)\n", config.outputIndex, hr);
+    CLEAN_EXIT();
+  }
 
   // Get capture device meta data (size,..)
   DXGI_OUTDUPL_DESC outDesc;
@@ -112,13 +126,60 @@ bool WindowsCapturer::initialize() {
   pDDA->GetDesc(&outDesc);
   height = outDesc.ModeDesc.Height;
   width = outDesc.ModeDesc.Width;
-  printf("Capture device is ready with (w: %d; h: %d)\n", width, height);
 
-  // Initialize Nvidia encoder.
-  this->pEncoder = new NvEncoderD3D11(
+  // Clamp the requested region to the output, the encoder wants even dimensions.
+  const RECT& region = config.region;
+  bool fullOutput = region.right <= region.left || region.bottom <= region.top;
+  cropBox.left = fullOutput ? 0 : min((UINT)max(region.left, 0L), (UINT)width);
+  cropBox.top = fullOutput ? 0 : min((UINT)max(region.top, 0L), (UINT)height);
+  cropBox.right = fullOutput ? width : min((UINT)max(region.right, 0L), (UINT)width);
+  cropBox.bottom = fullOutput ? height : min((UINT)max(region.bottom, 0L), (UINT)height);
+  cropBox.right -= (cropBox.right - cropBox.left) % 2;
+  cropBox.bottom -= (cropBox.bottom - cropBox.top) % 2;
+  cropBox.front = 0;
+  cropBox.back = 1;
+
+  // Where the captured region sits on the virtual desktop, input is injected relative to it.
+  DXGI_OUTPUT_DESC outputDesc;
+  ZeroMemory(&outputDesc, sizeof(outputDesc));
+  pOutput->GetDesc(&outputDesc);
+  desktopRect.left = outputDesc.DesktopCoordinates.left + (LONG)cropBox.left;
+  desktopRect.top = outputDesc.DesktopCoordinates.top + (LONG)cropBox.top;
+  desktopRect.right = outputDesc.DesktopCoordinates.left + (LONG)cropBox.right;
+  desktopRect.bottom = outputDesc.DesktopCoordinates.top + (LONG)cropBox.bottom;
+
+  UINT encodeWidth = cropBox.right - cropBox.left;
+  UINT encodeHeight = cropBox.bottom - cropBox.top;
+  if (encodeWidth == 0 || encodeHeight == 0) {
+    printf("Capture region is outside of output %d\n", config.outputIndex);
+    CLEAN_EXIT();
+  }
+
+  // Same format as the DDA surfaces, only the captured region is kept.
+  D3D11_TEXTURE2D_DESC lastFrameDesc;
+  ZeroMemory(&lastFrameDesc, sizeof(lastFrameDesc));
+  lastFrameDesc.Width = encodeWidth;
+  lastFrameDesc.Height = encodeHeight;
+  lastFrameDesc.MipLevels = 1;
+  lastFrameDesc.ArraySize = 1;
+  lastFrameDesc.Format = DXGI_FORMAT_B8G8R8A8_UNORM;
+  lastFrameDesc.SampleDesc.Count = 1;
+  lastFrameDesc.Usage = D3D11_USAGE_DEFAULT;
+  hr = pDevice->CreateTexture2D(&lastFrameDesc, nullptr, &pLastFrame);
+  if (FAILED(hr)) {
+    printf("Failed to create the last frame texture (error code: %X)\n", hr);
+    CLEAN_EXIT();
+  }
+  hasLastFrame = false;
+
+  printf("Capture device %d is ready with (w: %d; h: %d; region: %d,%d %dx%d; stream: %u)\n",
+    config.outputIndex, width, height, cropBox.left, cropBox.top, encodeWidth, encodeHeight, config.streamId);
+
+  // Initialize Nvidia encoder, only the captured region gets encoded.
+  this->pEncoder = new NvEncoderSlicedD3D11(
     pDevice,
-    width,
-    height,
+    encodeWidth,
+    encodeHeight,
     NV_ENC_BUFFER_FORMAT_ARGB
   );
 
@@ -133,10 +194,10 @@ bool WindowsCapturer::initialize() {
 
   // Basic init parameters.
   encInitParams.encodeConfig = &encConfig;  
-  encInitParams.encodeWidth = width;
-  encInitParams.encodeHeight = height;
-  encInitParams.maxEncodeWidth = width;
-  encInitParams.maxEncodeHeight = height;
+  encInitParams.encodeWidth = encodeWidth;
+  encInitParams.encodeHeight = encodeHeight;
+  encInitParams.maxEncodeWidth = encodeWidth;
+  encInitParams.maxEncodeHeight = encodeHeight;
   encConfig.gopLength = 5;
 
   // Picture encode parameters.
@@ -159,7 +220,12 @@ bool WindowsCapturer::initialize() {
     encConfig.encodeCodecConfig.h264Config.repeatSPSPPS = 1;
     encInitParams.frameRateNum = 60;
     encInitParams.reportSliceOffsets = 1;
-    encInitParams.enableEncodeAsync = 0;
+    encInitParams.enableSubFrameWrite = 1;
+    // Frame n+1 is captured while frame n is still encoding.
+    encInitParams.enableEncodeAsync = 1;
+
+    // Damage drives a per macroblock qp delta map.
+    encConfig.rcParams.qpMapMode = NV_ENC_QP_MAP_DELTA;
 
     // Create encoder.
     pEncoder->CreateEncoder(&encInitParams);
@@ -168,6 +234,16 @@ bool WindowsCapturer::initialize() {
     CLEAN_EXIT();
   }
   
+  DamageRect captureRegion = { (int32_t)cropBox.left, (int32_t)cropBox.top, (int32_t)cropBox.right, (int32_t)cropBox.bottom };
+  damageTracker.initialize(captureRegion, 2, config.keepAliveInterval);
+  picParams.qpDeltaMapSize = damageTracker.getMacroblockCount();
+
+  // One ring slot per encoder input surface.
+  if (!ring.initialize(pEncoder->GetSlotCount(), this)) {
+    CLEAN_EXIT();
+  }
+  slotQpMaps.assign(pEncoder->GetSlotCount(), std::vector<int8_t>(damageTracker.getMacroblockCount(), 0));
+
   // Release everything not needed anymore.
   SAFE_RELEASE(pAdapter);
   SAFE_RELEASE(pDXGIDevice);
@@ -176,7 +252,36 @@ bool WindowsCapturer::initialize() {
   return true;
 }
 
-std::vector<std::vector<uint8_t>>* WindowsCapturer::captureFrame() {
+bool WindowsCapturer::start() {
+  if (!pDDA || running) {
+    return false;
+  }
+
+  running = true;
+  captureThread = std::thread([this]() {
+    while (running) {
+      captureFrame();
+    }
+  });
+  return true;
+}
+
+void WindowsCapturer::stop() {
+  running = false;
+  if (captureThread.joinable()) {
+    captureThread.join();
+  }
+  ring.stop();
+}
+
+void WindowsCapturer::releaseFrame() {
+  if (pResource) {
+    pDDA->ReleaseFrame();
+    SAFE_RELEASE(pResource);
+  }
+}
+
+bool WindowsCapturer::captureFrame() {
   // Start measuring execution time.
   auto startTime = std::chrono::high_resolution_clock::now();
 
@@ -186,33 +291,43 @@ std::vector<std::vector<uint8_t>>* WindowsCapturer::captureFrame() {
 
   // Create new raw frame info object.
   ZeroMemory(&frameInfo, sizeof(frameInfo));
-  int acquired = 0;
-
-  // Release all resources from previous frame to allow dxgi to optimize.
-  if (pResource) {
-    pDDA ->ReleaseFrame();
-    pResource->Release();
-    pResource = nullptr;
-  }
 
   // Take next frame
-  hr = pDDA->AcquireNextFrame(INFINITE, &frameInfo, &pResource);
-  if (FAILED(hr) && hr != DXGI_ERROR_WAIT_TIMEOUT) {
+  hr = pDDA->AcquireNextFrame(config.acquireTimeout, &frameInfo, &pResource);
+  if (hr == DXGI_ERROR_WAIT_TIMEOUT) {
+    return encodeStatic();
+  }
+  if (FAILED(hr)) {
     printf("Failed to capture next frame.. (error code: %X)\n", hr);
-    return nullptr;
+    return false;
   }
   auto captureTimeEnd = std::chrono::high_resolution_clock::now();
 
-  // No updates neeeded.
-  if (frameInfo.AccumulatedFrames == 0 || frameInfo.LastPresentTime.QuadPart == 0) {
+  // Pointer moves and shape changes go out on the cursor channel, they cost a few bytes
+  // instead of a frame. The image did not change, for the tracker it is a static frame.
+  readPointer(frameInfo);
+  if (frameInfo.LastPresentTime.QuadPart == 0) {
+    releaseFrame();
+    statsPointerOnly++;
+    metricPointerOnly.add();
+    return encodeStatic();
+  }
+
+  // Only look at the frame if something within our region changed.
+  if (!readDamage(frameInfo)) {
+    damage.clear();
+    damage.full = true;
+  }
+
+  EncodeDecision decision = damageTracker.evaluate(damage);
+  if (decision == EncodeDecision::Skip) {
+    releaseFrame();
     statsSkipped++;
-    return nullptr;
+    metricSkipped.add();
+    return false;
   }
-  
-  // can this happen??
-  if (!pResource) {
-    printf("Unexpected error, output resource is still empty\n");
-    return nullptr;
+  if (decision == EncodeDecision::KeepAlive) {
+    statsKeepAlive++;
   }
 
   // Query for D3DTexture resource.
@@ -222,12 +337,27 @@ std::vector<std::vector<uint8_t>>* WindowsCapturer::captureFrame() {
   );
   if (FAILED(hr)) {
     printf("Failed to get d3d texture from dxgi resource\n");
-    return nullptr;
+    damageTracker.dropFrame();
+    releaseFrame();
+    return false;
+  }
+
+  // Keep the region even if this frame is dropped, static frames are encoded from it.
+  pContext->CopySubresourceRegion(pLastFrame, 0, 0, 0, 0, pFrameTexture, 0, &cropBox);
+  hasLastFrame = true;
+
+  // All input surfaces still encoding, drop the frame rather than stalling DDA.
+  int slot = ring.acquireSlot();
+  if (slot < 0) {
+    SAFE_RELEASE(pFrameTexture);
+    releaseFrame();
+    damageTracker.dropFrame();
+    metricRingFull.add();
+    return false;
   }
 
-  // Request new frame from encoder and copy over captured content.
-  const NvEncInputFrame* pEncoderInputFrame = pEncoder->GetNextInputFrame();
-  ID3D11Texture2D* pEncoderInputTexture = (ID3D11Texture2D *)pEncoderInputFrame->inputPtr;
+  // Copy captured content into the input surface of our slot.
+  ID3D11Texture2D* pEncoderInputTexture = (ID3D11Texture2D *)pEncoder->GetSlotInputFrame(slot)->inputPtr;
   pContext->CopySubresourceRegion(
     pEncoderInputTexture,
     D3D11CalcSubresource(0, 0, 1),
@@ -236,48 +366,231 @@ std::vector<std::vector<uint8_t>>* WindowsCapturer::captureFrame() {
     0,
     pFrameTexture,
     0,
-    NULL
+    &cropBox
   );
   SAFE_RELEASE(pFrameTexture);
-  pEncoderInputTexture->AddRef(); // ???
 
-  // Start encoding.
-  try {
-    pEncoder->EncodeFrame(localEncodedBuffer, &picParams);
-  } catch (...) {
-    printf("Failed to encode frame with nvenc\n");
-  }
+  // The copies are queued, DDA can have its surface back already.
+  releaseFrame();
 
-  SAFE_RELEASE(pEncoderInputTexture);
+  // Start encoding, the slices are collected by drainEncoded().
+  if (!submitFrame(slot)) {
+    return false;
+  }
 
   // Add some stats measurement
   auto endTime = std::chrono::high_resolution_clock::now();
   auto time = endTime - startTime;
+  metricFrames.add();
+  metricCaptureTime.observe((captureTimeEnd - startTime) / std::chrono::microseconds(1));
   statsFrame++;
   statsExecutionTime += time / std::chrono::milliseconds(1);
   statsCaptureTime += (captureTimeEnd - startTime) / std::chrono::milliseconds(1);
 
-  DWORD total = 0;
-  for (std::vector<uint8_t> &packet : localEncodedBuffer) {
-    total += packet.size();
+  return true;
+}
+
+bool WindowsCapturer::encodeStatic() {
+  // Nothing changed, but the tracker still wants refine frames after the last change and
+  // keep alive frames while the output stays static.
+  damage.clear();
+  EncodeDecision decision = damageTracker.evaluate(damage);
+  if (decision == EncodeDecision::Skip || !hasLastFrame) {
+    statsSkipped++;
+    metricSkipped.add();
+    return false;
+  }
+  if (decision == EncodeDecision::KeepAlive) {
+    statsKeepAlive++;
+  }
+
+  int slot = ring.acquireSlot();
+  if (slot < 0) {
+    damageTracker.dropFrame();
+    metricRingFull.add();
+    return false;
   }
-  statsTotal += total;
-  statsPackets += localEncodedBuffer.size();
-  
-  return &localEncodedBuffer;
+
+  // Encoder surfaces may be padded, only the captured size is copied.
+  D3D11_BOX lastFrameBox = { 0, 0, 0, cropBox.right - cropBox.left, cropBox.bottom - cropBox.top, 1 };
+  ID3D11Texture2D* pEncoderInputTexture = (ID3D11Texture2D *)pEncoder->GetSlotInputFrame(slot)->inputPtr;
+  pContext->CopySubresourceRegion(pEncoderInputTexture, 0, 0, 0, 0, pLastFrame, 0, &lastFrameBox);
+
+  if (!submitFrame(slot)) {
+    return false;
+  }
+  metricFrames.add();
+  statsFrame++;
+  return true;
 }
 
-void WindowsCapturer::debugLastFrame() {
-  DWORD total = 0;
-  for (std::vector<uint8_t> &packet : localEncodedBuffer) {
-    total += packet.size();
+bool WindowsCapturer::submitFrame(int slot) {
+  // The map has to stay alive until the slot is encoded.
+  slotQpMaps[slot] = damageTracker.getQpDeltaMap();
+
+  EncodeJob job;
+  job.streamId = config.streamId;
+  job.frameIndex = frameIndex++;
+  job.captureTimeUs = nowMicros();
+  if (!ring.submit(slot, job)) {
+    damageTracker.dropFrame();
+    return false;
   }
-  DWORD average = total == 0 ? 0 : total / localEncodedBuffer.size();
+  return true;
+}
+
+bool WindowsCapturer::submitEncode(int slot, const EncodeJob& job) {
+  NV_ENC_PIC_PARAMS slotParams = picParams;
+  slotParams.qpDeltaMap = slotQpMaps[slot].data();
+
+  try {
+    pEncoder->SubmitSlot(slot, &slotParams);
+  } catch (...) {
+    printf("Failed to submit frame %u to nvenc\n", job.frameIndex);
+    return false;
+  }
+
+  return true;
+}
+
+size_t WindowsCapturer::collectEncode(int slot, const EncodeJob& job, SliceSink* sink) {
+  try {
+    lastFrameBytes = pEncoder->CollectSlot(slot, job.streamId, job.frameIndex, job.captureTimeUs, sink);
+    lastFrameSlices = pEncoder->GetLastSliceCount();
+  } catch (...) {
+    printf("Failed to encode frame with nvenc\n");
+    lastFrameBytes = 0;
+    lastFrameSlices = 0;
+  }
+
+  metricEncodedBytes.add(lastFrameBytes);
+  metricEncodedSlices.add(lastFrameSlices);
+  metricEncodeTime.observe(nowMicros() - job.captureTimeUs);
+  statsTotal += lastFrameBytes;
+  statsPackets += lastFrameSlices;
+  statsEncoded++;
+  statsEncodeTime += (nowMicros() - job.captureTimeUs) / 1000;
+
+  return lastFrameBytes;
+}
+
+bool WindowsCapturer::drainEncoded(SliceSink* sink, uint32_t timeoutMs) {
+  return ring.drain(sink, timeoutMs);
+}
+
+void WindowsCapturer::readPointer(const DXGI_OUTDUPL_FRAME_INFO& frameInfo) {
+  if (!config.cursor) {
+    return;
+  }
+
+  // A shape buffer size is only reported when the shape changed.
+  if (frameInfo.PointerShapeBufferSize > 0) {
+    if (pointerShapeBuffer.size() < frameInfo.PointerShapeBufferSize) {
+      pointerShapeBuffer.resize(frameInfo.PointerShapeBufferSize);
+    }
+
+    UINT required = 0;
+    DXGI_OUTDUPL_POINTER_SHAPE_INFO shapeInfo;
+    HRESULT hr = pDDA->GetFramePointerShape(
+      frameInfo.PointerShapeBufferSize,
+      pointerShapeBuffer.data(),
+      &required,
+      &shapeInfo
+    );
+    if (FAILED(hr)) {
+      printf("Failed to get pointer shape (error code: %X)\n", hr);
+    } else {
+      CursorShape shape;
+      shape.type = (CursorShapeType)shapeInfo.Type;
+      shape.width = shapeInfo.Width;
+      shape.height = shapeInfo.Height;
+      shape.pitch = shapeInfo.Pitch;
+      shape.hotX = shapeInfo.HotSpot.x;
+      shape.hotY = shapeInfo.HotSpot.y;
+      shape.pixels.assign(pointerShapeBuffer.begin(), pointerShapeBuffer.begin() + (size_t)shapeInfo.Pitch * shapeInfo.Height);
+      config.cursor->publishShape(shape);
+      pointerHotSpot = shapeInfo.HotSpot;
+    }
+  }
+
+  // Zero means the position did not change since the last frame.
+  if (frameInfo.LastMouseUpdateTime.QuadPart != 0) {
+    CursorPosition position;
+    position.x = frameInfo.PointerPosition.Position.x + pointerHotSpot.x - (LONG)cropBox.left;
+    position.y = frameInfo.PointerPosition.Position.y + pointerHotSpot.y - (LONG)cropBox.top;
+    position.visible = frameInfo.PointerPosition.Visible != FALSE;
+    position.timeUs = nowMicros();
+    config.cursor->publishPosition(position);
+  }
+}
+
+bool WindowsCapturer::readDamage(const DXGI_OUTDUPL_FRAME_INFO& frameInfo) {
+  damage.clear();
+
+  // Only the pointer changed.
+  if (frameInfo.AccumulatedFrames == 0 || frameInfo.LastPresentTime.QuadPart == 0) {
+    return true;
+  }
+
+  if (frameInfo.TotalMetadataBufferSize == 0) {
+    return false;
+  }
+
+  if (metadataBuffer.size() < frameInfo.TotalMetadataBufferSize) {
+    metadataBuffer.resize(frameInfo.TotalMetadataBufferSize);
+  }
+
+  // Move rects come first, dirty rects use the rest of the buffer.
+  UINT moveSize = 0;
+  HRESULT hr = pDDA->GetFrameMoveRects(
+    frameInfo.TotalMetadataBufferSize,
+    (DXGI_OUTDUPL_MOVE_RECT*)metadataBuffer.data(),
+    &moveSize
+  );
+  if (FAILED(hr)) {
+    printf("Failed to get move rects (error code: %X)\n", hr);
+    return false;
+  }
+
+  UINT dirtySize = 0;
+  hr = pDDA->GetFrameDirtyRects(
+    frameInfo.TotalMetadataBufferSize - moveSize,
+    (RECT*)(metadataBuffer.data() + moveSize),
+    &dirtySize
+  );
+  if (FAILED(hr)) {
+    printf("Failed to get dirty rects (error code: %X)\n", hr);
+    return false;
+  }
+
+  DXGI_OUTDUPL_MOVE_RECT* pMoves = (DXGI_OUTDUPL_MOVE_RECT*)metadataBuffer.data();
+  for (UINT i = 0; i < moveSize / sizeof(DXGI_OUTDUPL_MOVE_RECT); i++) {
+    MoveRect move;
+    move.sourceX = pMoves[i].SourcePoint.x;
+    move.sourceY = pMoves[i].SourcePoint.y;
+    move.destination = {
+      pMoves[i].DestinationRect.left, pMoves[i].DestinationRect.top,
+      pMoves[i].DestinationRect.right, pMoves[i].DestinationRect.bottom
+    };
+    damage.moves.push_back(move);
+  }
+
+  RECT* pDirty = (RECT*)(metadataBuffer.data() + moveSize);
+  for (UINT i = 0; i < dirtySize / sizeof(RECT); i++) {
+    damage.dirty.push_back({ pDirty[i].left, pDirty[i].top, pDirty[i].right, pDirty[i].bottom });
+  }
+
+  return true;
+}
+
+void WindowsCapturer::debugLastFrame() {
+  DWORD total = (DWORD)lastFrameBytes;
+  DWORD average = lastFrameSlices == 0 ? 0 : total / lastFrameSlices;
 
   printf("\n\n---------------------------------------------\n");
   printf("Encoded buffer informations:\n");
   printf("  Total: %d\n", total);
-  printf("  Packets: %d\n", localEncodedBuffer.size());
+  printf("  Packets: %zd\n", lastFrameSlices);
   printf("  Avg: %d\n", average);
   printf("---------------------------------------------\n");
 }
@@ -293,15 +606,35 @@ void WindowsCapturer::debugSession() {
   printf("  Total (per Packet): %d KB\n", statsTotal / statsPackets / 1024);
   printf("  Total Packets: %d (Avg: %f)\n", statsPackets, (float)statsPackets / (float)statsFrame);
   printf("  Skipped Frames: %d\n", statsSkipped);
+  printf("  Keep Alive Frames: %d\n", statsKeepAlive);
+  printf("  Pointer only updates: %d\n", statsPointerOnly);
+  printf("  Dropped Frames (encoder busy): %lld\n", (long long)ring.getDropped());
   printf("  Execution time: %llds (Avg: %lldms)\n", statsExecutionTime / 1000, statsExecutionTime / (long long)statsFrame);
   printf("  Capture time: %llds (Avg: %lldms)\n", statsCaptureTime / 1000, statsCaptureTime / (long long)statsFrame);
   printf("  Diff time: %llds (Avg: %lldms)\n", captureDiff / 1000, captureDiff / (long long)statsFrame);
+  printf("  Encode time: %llds (Avg: %lldms)\n", statsEncodeTime / 1000, statsEncoded == 0 ? 0 : statsEncodeTime / statsEncoded);
   printf("---------------------------------------------\n");
 
   statsFrame = 0;
   statsSkipped = 0;
+  statsKeepAlive = 0;
+  statsPointerOnly = 0;
   statsExecutionTime = 0;
   statsTotal = 0;
   statsPackets = 0;
   statsCaptureTime = 0;
-}
\ No newline at end of file
+  statsEncodeTime = 0;
+  statsEncoded = 0;
+}
+
+void WindowsCapturer::registerMetrics(MetricsRegistry& registry, const std::string& name) {
+  std::string labels = "stream=\"" + name + "\"";
+  registry.addCounter("brocky_capture_frames_total", "Frames captured.", labels, &metricFrames);
+  registry.addCounter("brocky_capture_skipped_total", "Acquires without a frame to encode (timeout or no damage).", labels, &metricSkipped);
+  registry.addCounter("brocky_capture_pointer_only_total", "Acquires that only updated the pointer.", labels, &metricPointerOnly);
+  registry.addCounter("brocky_capture_ring_full_total", "Frames dropped because every encoder surface was busy.", labels, &metricRingFull);
+  registry.addHistogram("brocky_capture_seconds", "Time to acquire a frame.", labels, &metricCaptureTime);
+  registry.addHistogram("brocky_encode_seconds", "Time from submitting a frame until its slices were read back.", labels + ",layer=\"0\"", &metricEncodeTime);
+  registry.addCounter("brocky_encoded_bytes_total", "Bytes the encoder produced.", labels, &metricEncodedBytes);
+  registry.addCounter("brocky_encoded_slices_total", "Slices the encoder produced.", labels, &metricEncodedSlices);
+}
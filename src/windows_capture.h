@@ -1,15 +1,46 @@
 #ifndef _WINDOWS_CAPTURE_H_
 #define _WINDOWS_CAPTURE_H_
 
+#include <atomic>
+#include <thread>
+
 // DXGI and D3D API
 #include <dxgi1_2.h>
 #include <d3d11_2.h>
 
 // Nvidia encoder api
-#include "NvEncoder/NvEncoderD3D11.h"
+#include "nvenc_sliced_encoder.h"
+
+#include "cursor_protocol.h"
+#include "encode_ring.h"
+#include "frame_damage.h"
+#include "metrics.h"
+
+/// Describes what a WindowsCapturer duplicates and under which stream it is published.
+struct CaptureConfig {
+  /// Index of the DXGI output (monitor) to duplicate.
+  UINT outputIndex = 0;
+  /// Part of the output to capture, an empty rect captures the whole output.
+  RECT region = { 0, 0, 0, 0 };
+  /// Stream id the slices are published with.
+  uint32_t streamId = 0;
+  /// How long to wait for a new frame before checking whether capturing should stop.
+  UINT acquireTimeout = 100;
+  /// Static frames between two keep alive frames (0 sends nothing while static).
+  uint32_t keepAliveInterval = 0;
+  /// Receives pointer position and shape, the cursor is not part of the encoded image.
+  CursorChannel* cursor = nullptr;
+};
 
-class WindowsCapturer {
+/// Captures a DXGI output and encodes it with NVENC.
+///
+/// Capturing runs on its own thread: every frame is copied into a free encoder input
+/// surface, handed back to DDA and submitted to the encoder right away. The encoded
+/// slices are picked up through drainEncoded() while the next frame is captured.
+class WindowsCapturer : public EncodeBackend {
   private:
+    /// What to capture.
+    CaptureConfig config;
     /// The DDA object
     IDXGIOutputDuplication* pDDA = nullptr;
     /// The D3D11 device used by the DDA session
@@ -18,38 +49,113 @@ class WindowsCapturer {
     ID3D11DeviceContext* pContext = nullptr;
     /// The resource used to acquire a new captured frame from DDA
     IDXGIResource *pResource = nullptr;
+    /// Copy of the last captured region. DDA delivers nothing while the output is static,
+    /// refine and keep alive frames are encoded from this copy.
+    ID3D11Texture2D* pLastFrame = nullptr;
+    bool hasLastFrame = false;
     /// Output width obtained from DXGI_OUTDUPL_DESC
     DWORD width = 0;
     /// Output height obtained from DXGI_OUTDUPL_DESC
     DWORD height = 0;
+    /// Captured part of the output, this is also the size that gets encoded.
+    D3D11_BOX cropBox = { 0 };
+    /// Captured region in virtual desktop coordinates.
+    RECT desktopRect = { 0, 0, 0, 0 };
+    /// Raw move/dirty rect metadata as returned by DDA.
+    std::vector<BYTE> metadataBuffer;
+    /// Pointer shape as returned by DDA.
+    std::vector<BYTE> pointerShapeBuffer;
+    /// Hotspot of the current shape, DDA reports the position of the shape's corner.
+    POINT pointerHotSpot = { 0, 0 };
+    /// Damage of the last acquired frame.
+    FrameDamage damage;
+    /// Decides whether and how a frame gets encoded based on its damage.
+    DamageTracker damageTracker;
+    /// Input surfaces shared between the capture thread and drainEncoded().
+    EncodeRing ring;
+    /// QP delta map of every slot, has to stay alive until the slot is encoded.
+    std::vector<std::vector<int8_t>> slotQpMaps;
+    /// Thread running captureFrame().
+    std::thread captureThread;
+    std::atomic<bool> running{ false };
+    uint32_t frameIndex = 0;
     /// Debug stats.
     DWORD statsFrame = 0;
     DWORD statsSkipped = 0;
+    DWORD statsKeepAlive = 0;
+    DWORD statsPointerOnly = 0;
     long long statsExecutionTime = 0;
     long long statsCaptureTime = 0;
     long long statsPackets = 0;
     long long statsTotal = 0;
+    long long statsEncodeTime = 0;
+    long long statsEncoded = 0;
+    /// Live metrics.
+    MetricCounter metricFrames;
+    MetricCounter metricSkipped;
+    MetricCounter metricPointerOnly;
+    MetricCounter metricRingFull;
+    MetricCounter metricEncodedBytes;
+    MetricCounter metricEncodedSlices;
+    MetricHistogram metricCaptureTime;
+    MetricHistogram metricEncodeTime;
+    /// Size of the last encoded frame.
+    size_t lastFrameBytes = 0;
+    size_t lastFrameSlices = 0;
 
-    /// NVENCODE API wrapper. Defined in NvEncoderD3D11.h. This class is imported from NVIDIA Video SDK
-    NvEncoderD3D11 *pEncoder = nullptr;
+    /// NVENCODE API wrapper with slice readback. Based on NvEncoderD3D11 from the NVIDIA Video SDK
+    NvEncoderSlicedD3D11 *pEncoder = nullptr;
     /// NVENCODEAPI session intialization parameters
     NV_ENC_INITIALIZE_PARAMS encInitParams = { 0 };
     /// NVENCODEAPI video encoding configuration parameters
     NV_ENC_CONFIG encConfig = { 0 };
     /// NVENCODEAPI paramters for encoding command.
     NV_ENC_PIC_PARAMS picParams = { 0 };
-    /// Encoded video bitstream packet in CPU memory
-    std::vector<std::vector<uint8_t>> localEncodedBuffer;
 
   public:
     ~WindowsCapturer() { this->cleanup(); }
 
-    bool initialize();
+    bool initialize(const CaptureConfig& config);
     void cleanup();
-    
-    std::vector<std::vector<uint8_t>>* captureFrame();
+
+    /// Starts the capture thread.
+    bool start();
+    void stop();
+
+    /// Hands the slices of the oldest submitted frame to `sink`, waiting up to
+    /// `timeoutMs` for one. Returns false if no frame was ready.
+    bool drainEncoded(SliceSink* sink, uint32_t timeoutMs);
+
+    // EncodeBackend
+    bool submitEncode(int slot, const EncodeJob& job) override;
+    size_t collectEncode(int slot, const EncodeJob& job, SliceSink* sink) override;
+
+  private:
+    /// Captures the next frame and submits it to the encoder, runs on the capture thread.
+    /// Returns false if no frame was submitted.
+    bool captureFrame();
+    /// Asks the damage tracker about a frame without changes (DDA timeout, pointer only)
+    /// and re-encodes the last frame for refine and keep alive frames.
+    bool encodeStatic();
+    /// Submits the frame copied into `slot` with the current QP delta map.
+    bool submitFrame(int slot);
+    /// Gives the acquired frame back to DDA.
+    void releaseFrame();
+    /// Reads move and dirty rects of the acquired frame into `damage`.
+    bool readDamage(const DXGI_OUTDUPL_FRAME_INFO& frameInfo);
+    /// Publishes pointer position and shape updates of the acquired frame to the cursor channel.
+    void readPointer(const DXGI_OUTDUPL_FRAME_INFO& frameInfo);
+
+  public:
+    /// Move/dirty rects of the last acquired frame.
+    const FrameDamage& getLastDamage() const { return damage; }
+    /// Captured region in virtual desktop coordinates, what stream pixel 0,0 maps to.
+    const RECT& getDesktopRect() const { return desktopRect; }
+
     void debugLastFrame();
     void debugSession();
+    /// Adds capture and encoding of the stream `name` to `registry`.
+    void registerMetrics(MetricsRegistry& registry, const std::string& name);
 };
 
 // Macro to release and null a dxgi resource.
@@ -0,0 +1,122 @@
+#include <cstdio>
+
+#include "windows_input.h"
+
+/// Scan code of an evdev key code, the extended flag is in the high byte. Codes up to
+/// KEY_F12 are the set 1 scan codes already.
+static WORD scan_code(uint32_t code) {
+  if (code > 0 && code <= 88) {
+    return (WORD)code;
+  }
+
+  switch (code) {
+    case 96: return 0xE01C;  // KEY_KPENTER
+    case 97: return 0xE01D;  // KEY_RIGHTCTRL
+    case 98: return 0xE035;  // KEY_KPSLASH
+    case 99: return 0xE037;  // KEY_SYSRQ
+    case 100: return 0xE038; // KEY_RIGHTALT
+    case 102: return 0xE047; // KEY_HOME
+    case 103: return 0xE048; // KEY_UP
+    case 104: return 0xE049; // KEY_PAGEUP
+    case 105: return 0xE04B; // KEY_LEFT
+    case 106: return 0xE04D; // KEY_RIGHT
+    case 107: return 0xE04F; // KEY_END
+    case 108: return 0xE050; // KEY_DOWN
+    case 109: return 0xE051; // KEY_PAGEDOWN
+    case 110: return 0xE052; // KEY_INSERT
+    case 111: return 0xE053; // KEY_DELETE
+    case 125: return 0xE05B; // KEY_LEFTMETA
+    case 126: return 0xE05C; // KEY_RIGHTMETA
+    case 127: return 0xE05D; // KEY_COMPOSE
+  }
+  return 0;
+}
+
+void WindowsInputInjector::onInputEvent(const InputEvent& event) {
+  INPUT input;
+  ZeroMemory(&input, sizeof(input));
+
+  switch (event.type) {
+    case InputEventType::MouseMove: {
+      // Absolute coordinates are normalized to 0..65535 over the whole virtual desktop.
+      LONG x = min(max(region.left + event.x, region.left), region.right - 1);
+      LONG y = min(max(region.top + event.y, region.top), region.bottom - 1);
+      LONG desktopX = GetSystemMetrics(SM_XVIRTUALSCREEN);
+      LONG desktopY = GetSystemMetrics(SM_YVIRTUALSCREEN);
+      LONG desktopWidth = max(GetSystemMetrics(SM_CXVIRTUALSCREEN), 2);
+      LONG desktopHeight = max(GetSystemMetrics(SM_CYVIRTUALSCREEN), 2);
+
+      input.type = INPUT_MOUSE;
+      input.mi.dx = (x - desktopX) * 65535 / (desktopWidth - 1);
+      input.mi.dy = (y - desktopY) * 65535 / (desktopHeight - 1);
+      input.mi.dwFlags = MOUSEEVENTF_MOVE | MOUSEEVENTF_ABSOLUTE | MOUSEEVENTF_VIRTUALDESK;
+      break;
+    }
+
+    case InputEventType::MouseButton:
+      input.type = INPUT_MOUSE;
+      switch (event.code) {
+        case 0: input.mi.dwFlags = event.pressed ? MOUSEEVENTF_LEFTDOWN : MOUSEEVENTF_LEFTUP; break;
+        case 1: input.mi.dwFlags = event.pressed ? MOUSEEVENTF_RIGHTDOWN : MOUSEEVENTF_RIGHTUP; break;
+        case 2: input.mi.dwFlags = event.pressed ? MOUSEEVENTF_MIDDLEDOWN : MOUSEEVENTF_MIDDLEUP; break;
+        case 3:
+        case 4:
+          input.mi.dwFlags = event.pressed ? MOUSEEVENTF_XDOWN : MOUSEEVENTF_XUP;
+          input.mi.mouseData = event.code == 3 ? XBUTTON1 : XBUTTON2;
+          break;
+        default:
+          return;
+      }
+      break;
+
+    case InputEventType::MouseWheel:
+      // Both directions at once need two inputs.
+      input.type = INPUT_MOUSE;
+      if (event.x != 0) {
+        input.mi.dwFlags = MOUSEEVENTF_HWHEEL;
+        input.mi.mouseData = (DWORD)event.x;
+        SendInput(1, &input, sizeof(INPUT));
+      }
+      if (event.y == 0) {
+        statsInjected++;
+        return;
+      }
+      input.mi.dwFlags = MOUSEEVENTF_WHEEL;
+      input.mi.mouseData = (DWORD)event.y;
+      break;
+
+    case InputEventType::Key: {
+      WORD scan = scan_code(event.code);
+      if (scan == 0) {
+        statsUnknownKeys++;
+        return;
+      }
+
+      input.type = INPUT_KEYBOARD;
+      input.ki.wScan = scan & 0xFF;
+      input.ki.dwFlags = KEYEVENTF_SCANCODE | (scan > 0xFF ? KEYEVENTF_EXTENDEDKEY : 0) |
+                         (event.pressed ? 0 : KEYEVENTF_KEYUP);
+      break;
+    }
+
+    default:
+      return;
+  }
+
+  if (SendInput(1, &input, sizeof(INPUT)) != 1) {
+    printf("[Input] Failed to inject event (error code: %lu)\n", GetLastError());
+    return;
+  }
+  statsInjected++;
+}
+
+void WindowsInputInjector::debugSession() {
+  printf("\n\n---------------------------------------------\n");
+  printf("Input injection stats:\n");
+  printf("  Injected events: %lld\n", statsInjected);
+  printf("  Unknown keys: %lld\n", statsUnknownKeys);
+  printf("---------------------------------------------\n");
+
+  statsInjected = 0;
+  statsUnknownKeys = 0;
+}
@@ -0,0 +1,32 @@
+#ifndef _WINDOWS_INPUT_H_
+#define _WINDOWS_INPUT_H_
+
+#include <windows.h>
+
+#include "input_protocol.h"
+
+/// Injects client input into the desktop with SendInput.
+///
+/// Mouse positions are pixels of the stream and get mapped onto the captured region of
+/// the virtual desktop. Keys are Linux evdev codes, they are sent as scan codes so they
+/// follow the keyboard layout of the server.
+///
+/// Clients are not authenticated, every QUIC peer that reaches the server can inject
+/// input. The server only creates injectors when started with `--input`.
+class WindowsInputInjector : public InputSink {
+  private:
+    /// Captured region in virtual desktop coordinates.
+    RECT region = { 0, 0, 0, 0 };
+    /// Debug stats.
+    long long statsInjected = 0;
+    long long statsUnknownKeys = 0;
+
+  public:
+    void initialize(const RECT& desktopRegion) { region = desktopRegion; }
+
+    void onInputEvent(const InputEvent& event) override;
+
+    void debugSession();
+};
+
+#endif
@@ -0,0 +1,281 @@
+#include <cstdio>
+#include <chrono>
+
+#include "x11_capture.h"
+
+bool X11Capturer::initialize(const X11CaptureConfig& config) {
+  this->config = config;
+
+  pDisplay = XOpenDisplay(config.display);
+  if (!pDisplay) {
+    printf("Failed to open X display %s\n", config.display ? config.display : "(default)");
+    return false;
+  }
+
+  if (!XShmQueryExtension(pDisplay)) {
+    printf("X server does not support MIT-SHM\n");
+    return false;
+  }
+
+  int screen = config.screen < 0 ? DefaultScreen(pDisplay) : config.screen;
+  if (screen >= ScreenCount(pDisplay)) {
+    printf("X screen %d does not exist\n", screen);
+    return false;
+  }
+  root = RootWindow(pDisplay, screen);
+  int screenWidth = DisplayWidth(pDisplay, screen);
+  int screenHeight = DisplayHeight(pDisplay, screen);
+
+  // Clamp the requested region to the screen, the encoder needs even dimensions.
+  left = config.left;
+  top = config.top;
+  width = config.width;
+  height = config.height;
+  if (width <= 0 || height <= 0) {
+    left = 0;
+    top = 0;
+    width = screenWidth;
+    height = screenHeight;
+  }
+  if (left < 0 || top < 0 || left + width > screenWidth || top + height > screenHeight) {
+    printf("Capture region (%d, %d, %d, %d) is outside of the screen\n", left, top, width, height);
+    return false;
+  }
+  width &= ~1;
+  height &= ~1;
+
+  pImage = XShmCreateImage(
+    pDisplay, DefaultVisual(pDisplay, screen), DefaultDepth(pDisplay, screen),
+    ZPixmap, nullptr, &shmInfo, width, height
+  );
+  if (!pImage) {
+    printf("Failed to create shared memory image\n");
+    return false;
+  }
+  if (pImage->bits_per_pixel != 32) {
+    printf("Unsupported X visual with %d bits per pixel\n", pImage->bits_per_pixel);
+    return false;
+  }
+
+  shmInfo.shmid = shmget(IPC_PRIVATE, pImage->bytes_per_line * pImage->height, IPC_CREAT | 0600);
+  if (shmInfo.shmid < 0) {
+    printf("Failed to allocate shared memory\n");
+    return false;
+  }
+  shmInfo.shmaddr = pImage->data = (char*)shmat(shmInfo.shmid, nullptr, 0);
+  shmInfo.readOnly = False;
+  if (shmInfo.shmaddr == (char*)-1 || !XShmAttach(pDisplay, &shmInfo)) {
+    printf("Failed to attach shared memory\n");
+    // The segment is not marked for removal yet, it would outlive the process otherwise.
+    shmctl(shmInfo.shmid, IPC_RMID, nullptr);
+    return false;
+  }
+  XSync(pDisplay, False);
+  shmAttached = true;
+  // Segment goes away as soon as both sides detached.
+  shmctl(shmInfo.shmid, IPC_RMID, nullptr);
+
+  // Base stream, optionally scaled.
+  int encodeWidth = width;
+  int encodeHeight = height;
+  if (config.scaleWidth > 0 && config.scaleHeight > 0) {
+    encodeWidth = config.scaleWidth;
+    encodeHeight = config.scaleHeight;
+  }
+  if (!initializeLayer(config.streamId, encodeWidth, encodeHeight, config.bitrateKbps)) {
+    return false;
+  }
+
+  for (auto& layer : config.layers) {
+    int layerWidth = layer.width;
+    int layerHeight = layer.height;
+    if (layerWidth <= 0 || layerHeight <= 0) {
+      layerWidth = layers.back()->width / 2;
+      layerHeight = layers.back()->height / 2;
+    }
+    if (!initializeLayer(layer.streamId, layerWidth, layerHeight, layer.bitrateKbps)) {
+      return false;
+    }
+  }
+
+  printf(
+    "X11 capturer is ready with (screen: %d; region: %d, %d, %d, %d; layers: %zd; kernels: %s)\n",
+    screen, left, top, width, height, layers.size(), getColorKernelName()
+  );
+  return true;
+}
+
+bool X11Capturer::initializeLayer(uint32_t streamId, int encodeWidth, int encodeHeight, uint32_t bitrateKbps) {
+  std::unique_ptr<EncodeLayer> layer(new EncodeLayer());
+  layer->streamId = streamId;
+  layer->width = encodeWidth & ~1;
+  layer->height = encodeHeight & ~1;
+
+  if (layer->width != width || layer->height != height) {
+    if (!layer->scaler.initialize(width, height, layer->width, layer->height)) {
+      printf("Invalid scale size %dx%d\n", encodeWidth, encodeHeight);
+      return false;
+    }
+    layer->scaled.resize(layer->width * layer->height * 4);
+  }
+
+  // I420 layout in one allocation.
+  int lumaSize = layer->width * layer->height;
+  layer->picture.resize(lumaSize * 3 / 2);
+  layer->planes[0] = layer->picture.data();
+  layer->planes[1] = layer->planes[0] + lumaSize;
+  layer->planes[2] = layer->planes[1] + lumaSize / 4;
+  layer->strides[0] = layer->width;
+  layer->strides[1] = layer->width / 2;
+  layer->strides[2] = layer->width / 2;
+
+  if (!layer->encoder.initialize(layer->width, layer->height, config.fps, bitrateKbps, config.threads, &queue)) {
+    return false;
+  }
+
+  layers.push_back(std::move(layer));
+  return true;
+}
+
+void X11Capturer::cleanup() {
+  stop();
+  layers.clear();
+
+  if (shmAttached) {
+    XShmDetach(pDisplay, &shmInfo);
+    shmAttached = false;
+  }
+  if (shmInfo.shmaddr && shmInfo.shmaddr != (char*)-1) {
+    shmdt(shmInfo.shmaddr);
+  }
+  shmInfo.shmaddr = nullptr;
+  if (pImage) {
+    // The data belongs to the shared memory segment.
+    pImage->data = nullptr;
+    XDestroyImage(pImage);
+    pImage = nullptr;
+  }
+  if (pDisplay) {
+    XCloseDisplay(pDisplay);
+    pDisplay = nullptr;
+  }
+}
+
+bool X11Capturer::start() {
+  if (!pImage || running) {
+    return false;
+  }
+
+  running = true;
+  captureThread = std::thread([this]() {
+    auto frameTime = std::chrono::microseconds(1000000 / config.fps);
+    auto nextFrame = std::chrono::steady_clock::now();
+
+    while (running) {
+      captureFrame();
+
+      // X11 has no notion of new frames, grab at a fixed rate.
+      nextFrame += frameTime;
+      auto now = std::chrono::steady_clock::now();
+      if (nextFrame < now) {
+        nextFrame = now;
+      }
+      std::this_thread::sleep_until(nextFrame);
+    }
+  });
+  return true;
+}
+
+void X11Capturer::stop() {
+  running = false;
+  if (captureThread.joinable()) {
+    captureThread.join();
+  }
+}
+
+bool X11Capturer::captureFrame() {
+  uint64_t startTime = nowMicros();
+  if (!XShmGetImage(pDisplay, root, pImage, left, top, AllPlanes)) {
+    printf("Failed to grab X11 image\n");
+    return false;
+  }
+  uint64_t captureTime = nowMicros();
+
+  // Layers are encoded one after another, the lower ones are cheap next to the base stream.
+  uint32_t index = frameIndex++;
+  for (auto& layer : layers) {
+    uint64_t layerStart = nowMicros();
+
+    const uint8_t* bgra = (const uint8_t*)pImage->data;
+    int bgraStride = pImage->bytes_per_line;
+    if (!layer->scaled.empty()) {
+      layer->scaler.scale(bgra, bgraStride, layer->scaled.data(), layer->width * 4);
+      bgra = layer->scaled.data();
+      bgraStride = layer->width * 4;
+    }
+    uint64_t scaleTime = nowMicros();
+
+    convertBgraToI420(
+      bgra, bgraStride, layer->width, layer->height,
+      layer->planes[0], layer->strides[0], layer->planes[1], layer->strides[1], layer->planes[2], layer->strides[2]
+    );
+    uint64_t convertTime = nowMicros();
+
+    layer->encoder.encode(layer->planes, layer->strides, layer->streamId, index, startTime);
+    uint64_t encodeTime = nowMicros();
+
+    layer->metricConvertTime.observe(convertTime - layerStart);
+    layer->metricEncodeTime.observe(encodeTime - convertTime);
+    statsScaleTime += scaleTime - layerStart;
+    statsConvertTime += convertTime - scaleTime;
+    statsEncodeTime += encodeTime - convertTime;
+    statsConvertedPixels += (long long)layer->width * layer->height;
+  }
+
+  metricFrames.add();
+  metricCaptureTime.observe(captureTime - startTime);
+  statsFrame++;
+  statsCaptureTime += captureTime - startTime;
+  statsEncoded++;
+  return true;
+}
+
+bool X11Capturer::drainEncoded(SliceSink* sink, uint32_t timeoutMs) {
+  return queue.drain(sink, timeoutMs) > 0;
+}
+
+void X11Capturer::debugSession() {
+  // Taken and reset in one go, the capture thread keeps counting meanwhile.
+  uint32_t frameCount = statsFrame.exchange(0);
+  long long captureTime = statsCaptureTime.exchange(0);
+  long long scaleTime = statsScaleTime.exchange(0);
+  long long convertTime = statsConvertTime.exchange(0);
+  long long convertedPixels = statsConvertedPixels.exchange(0);
+  long long encodeTime = statsEncodeTime.exchange(0);
+  long long encoded = statsEncoded.exchange(0);
+  long long frames = frameCount == 0 ? 1 : frameCount;
+
+  printf("\n\n---------------------------------------------\n");
+  printf("Session stats:\n");
+  printf("  Frames: %u\n", frameCount);
+  printf("  Capture time: %lldms (Avg: %lldus)\n", captureTime / 1000, captureTime / frames);
+  printf("  Scale time: %lldms (Avg: %lldus)\n", scaleTime / 1000, scaleTime / frames);
+  printf("  Convert time: %lldms (Avg: %lldus)\n", convertTime / 1000, convertTime / frames);
+  printf("  Convert rate: %.0f MP/s\n", convertTime == 0 ? 0.0 : (double)convertedPixels / convertTime);
+  printf("  Encode time: %lldms (Avg: %lldus)\n", encodeTime / 1000, encoded == 0 ? 0 : encodeTime / encoded);
+  printf("---------------------------------------------\n");
+}
+
+void X11Capturer::registerMetrics(MetricsRegistry& registry, const std::string& name) {
+  std::string labels = "stream=\"" + name + "\"";
+  registry.addCounter("brocky_capture_frames_total", "Frames captured.", labels, &metricFrames);
+  registry.addHistogram("brocky_capture_seconds", "Time to grab a frame.", labels, &metricCaptureTime);
+
+  for (size_t i = 0; i < layers.size(); i++) {
+    std::string layerLabels = labels + ",layer=\"" + std::to_string(i) + "\"";
+    registry.addHistogram("brocky_convert_seconds", "Time to scale and color convert a frame.", layerLabels, &layers[i]->metricConvertTime);
+    registry.addHistogram("brocky_encode_seconds", "Time to encode a frame.", layerLabels, &layers[i]->metricEncodeTime);
+  }
+
+  queue.registerMetrics(registry, labels);
+}
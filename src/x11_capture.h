@@ -0,0 +1,140 @@
+#ifndef _X11_CAPTURE_H_
+#define _X11_CAPTURE_H_
+
+#include <stdint.h>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+
+// X11 with the MIT shared memory extension
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <X11/extensions/XShm.h>
+
+#include "color_convert.h"
+#include "metrics.h"
+#include "slice_queue.h"
+#include "x264_encoder.h"
+
+/// Additional simulcast layer encoded from the same capture.
+struct X11EncodeLayer {
+  /// Stream id the slices of the layer are published with.
+  uint32_t streamId = 0;
+  /// Encoded size, zero halves the size of the previous layer.
+  int width = 0;
+  int height = 0;
+  uint32_t bitrateKbps = 0;
+};
+
+/// Describes what a X11Capturer grabs and under which stream it is published.
+struct X11CaptureConfig {
+  /// X display to connect to, null uses $DISPLAY.
+  const char* display = nullptr;
+  /// X screen to capture, -1 captures the default screen.
+  int screen = -1;
+  /// Part of the screen to capture, a zero width or height captures the whole screen.
+  int left = 0;
+  int top = 0;
+  int width = 0;
+  int height = 0;
+  /// Size the region is scaled to before encoding, zero keeps the captured size.
+  int scaleWidth = 0;
+  int scaleHeight = 0;
+  /// Stream id the slices are published with.
+  uint32_t streamId = 0;
+  /// Frames captured per second.
+  uint32_t fps = 60;
+  /// Target bitrate of the encoder.
+  uint32_t bitrateKbps = 10000;
+  /// Slice threads used by x264.
+  uint32_t threads = 4;
+  /// Lower resolution/bitrate versions encoded next to the base stream (simulcast).
+  std::vector<X11EncodeLayer> layers;
+};
+
+/// Captures an X11 screen through MIT-SHM and encodes it with x264.
+///
+/// Linux counterpart of WindowsCapturer: capturing, color conversion and encoding run
+/// on a capture thread, slices are queued as x264 emits them and picked up through
+/// drainEncoded().
+class X11Capturer {
+  private:
+    /// What to capture.
+    X11CaptureConfig config;
+    Display* pDisplay = nullptr;
+    Window root = 0;
+    /// Shared memory image XShmGetImage() writes into.
+    XImage* pImage = nullptr;
+    XShmSegmentInfo shmInfo = {};
+    bool shmAttached = false;
+    /// Captured part of the screen, this is also the size that gets encoded.
+    int left = 0;
+    int top = 0;
+    int width = 0;
+    int height = 0;
+    /// Everything needed to encode one version of the captured image.
+    struct EncodeLayer {
+      uint32_t streamId = 0;
+      /// Size of the encoded picture.
+      int width = 0;
+      int height = 0;
+      /// Scales the captured image to the encoded size, only used if they differ.
+      BgraScaler scaler;
+      std::vector<uint8_t> scaled;
+      /// I420 planes of the converted frame.
+      std::vector<uint8_t> picture;
+      uint8_t* planes[3] = { nullptr, nullptr, nullptr };
+      int strides[3] = { 0, 0, 0 };
+      /// Software encoder, slices go straight into `queue`.
+      X264Encoder encoder;
+      MetricHistogram metricConvertTime;
+      MetricHistogram metricEncodeTime;
+    };
+    /// Base stream first, then the simulcast layers.
+    std::vector<std::unique_ptr<EncodeLayer>> layers;
+    SliceQueue queue;
+    /// Thread running captureFrame().
+    std::thread captureThread;
+    std::atomic<bool> running{ false };
+    uint32_t frameIndex = 0;
+    /// Debug stats, written by the capture thread and reset by debugSession().
+    std::atomic<uint32_t> statsFrame{ 0 };
+    std::atomic<long long> statsCaptureTime{ 0 };
+    std::atomic<long long> statsScaleTime{ 0 };
+    std::atomic<long long> statsConvertTime{ 0 };
+    std::atomic<long long> statsConvertedPixels{ 0 };
+    std::atomic<long long> statsEncodeTime{ 0 };
+    std::atomic<long long> statsEncoded{ 0 };
+    /// Live metrics.
+    MetricCounter metricFrames;
+    MetricHistogram metricCaptureTime;
+
+  public:
+    ~X11Capturer() { this->cleanup(); }
+
+    bool initialize(const X11CaptureConfig& config);
+    void cleanup();
+
+    /// Starts the capture thread.
+    bool start();
+    void stop();
+
+    /// Hands all encoded slices to `sink`, waiting up to `timeoutMs` for one.
+    /// Returns false if no slice was ready.
+    bool drainEncoded(SliceSink* sink, uint32_t timeoutMs);
+
+  private:
+    bool initializeLayer(uint32_t streamId, int encodeWidth, int encodeHeight, uint32_t bitrateKbps);
+    /// Grabs, converts and encodes the next frame, runs on the capture thread.
+    bool captureFrame();
+
+  public:
+    void debugSession();
+    /// Adds capture, conversion, encoding and queueing of the stream `name` to `registry`.
+    void registerMetrics(MetricsRegistry& registry, const std::string& name);
+};
+
+#endif
@@ -0,0 +1,152 @@
+#include <cstdio>
+
+#include "x264_encoder.h"
+
+bool X264Encoder::initialize(int width, int height, uint32_t fps, uint32_t bitrateKbps, uint32_t threads, SliceSink* sink) {
+  if (x264_param_default_preset(&param, "ultrafast", "zerolatency") < 0) {
+    printf("Failed to load x264 preset\n");
+    return false;
+  }
+
+  param.i_csp = X264_CSP_I420;
+  param.i_width = width;
+  param.i_height = height;
+  param.i_fps_num = fps;
+  param.i_fps_den = 1;
+  param.i_keyint_max = 5;
+  param.b_repeat_headers = 1;
+  param.b_annexb = 1;
+
+  // Slice threads keep the latency at a single frame, the size limit matches the NVENC path.
+  param.i_threads = threads;
+  param.b_sliced_threads = 1;
+  param.i_slice_max_size = 1500 - 28;
+
+  // Constant bitrate with a single frame vbv buffer.
+  param.rc.i_rc_method = X264_RC_ABR;
+  param.rc.i_bitrate = bitrateKbps;
+  param.rc.i_vbv_max_bitrate = bitrateKbps;
+  param.rc.i_vbv_buffer_size = bitrateKbps / fps;
+
+  // Receive every nal unit the moment it is written.
+  param.nalu_process = &X264Encoder::onNal;
+
+  if (x264_param_apply_profile(&param, "high") < 0) {
+    printf("Failed to apply x264 profile\n");
+    return false;
+  }
+
+  pEncoder = x264_encoder_open(&param);
+  if (!pEncoder) {
+    printf("Failed to open x264 encoder\n");
+    return false;
+  }
+
+  pSink = sink;
+  mbCount = ((width + 15) / 16) * ((height + 15) / 16);
+  printf("x264 encoder is ready with (w: %d; h: %d; fps: %u; bitrate: %u kbit/s; threads: %u)\n", width, height, fps, bitrateKbps, threads);
+  return true;
+}
+
+void X264Encoder::cleanup() {
+  if (pEncoder) {
+    x264_encoder_close(pEncoder);
+    pEncoder = nullptr;
+  }
+}
+
+size_t X264Encoder::encode(uint8_t* planes[3], int strides[3], uint32_t streamId, uint32_t frameIndex, uint64_t captureTimeUs) {
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    this->streamId = streamId;
+    this->frameIndex = frameIndex;
+    this->captureTimeUs = captureTimeUs;
+    pending.clear();
+    prefix.clear();
+    nextMb = 0;
+    sliceIndex = 0;
+    frameBytes = 0;
+  }
+
+  x264_picture_t picture;
+  x264_picture_init(&picture);
+  picture.img.i_csp = X264_CSP_I420;
+  picture.img.i_plane = 3;
+  for (int i = 0; i < 3; i++) {
+    picture.img.plane[i] = planes[i];
+    picture.img.i_stride[i] = strides[i];
+  }
+  picture.i_pts = frameIndex;
+  picture.opaque = this;
+
+  // With nalu_process set all output arrives through onNal(), the returned nals are invalid.
+  x264_nal_t* nals = nullptr;
+  int nalCount = 0;
+  x264_picture_t output;
+  if (x264_encoder_encode(pEncoder, &nals, &nalCount, &picture, &output) < 0) {
+    printf("Failed to encode frame %u with x264\n", frameIndex);
+    return 0;
+  }
+
+  std::lock_guard<std::mutex> guard(lock);
+  if (!pending.empty()) {
+    printf("x264 left %zd slices of frame %u behind\n", pending.size(), frameIndex);
+  }
+  return frameBytes;
+}
+
+void X264Encoder::onNal(x264_t* h, x264_nal_t* nal, void* opaque) {
+  ((X264Encoder*)opaque)->handleNal(h, nal);
+}
+
+void X264Encoder::handleNal(x264_t* h, x264_nal_t* nal) {
+  // Size required by x264_nal_encode, afterwards nal points into our buffer.
+  auto data = std::make_shared<std::vector<uint8_t>>(nal->i_payload * 3 / 2 + 5 + 64);
+  x264_nal_encode(h, data->data(), nal);
+  data->resize(nal->i_payload);
+
+  std::lock_guard<std::mutex> guard(lock);
+
+  if (nal->i_type != NAL_SLICE && nal->i_type != NAL_SLICE_IDR) {
+    prefix.insert(prefix.end(), data->begin(), data->end());
+    return;
+  }
+
+  PendingSlice slice;
+  slice.data = data;
+  slice.lastMb = nal->i_last_mb;
+  slice.keyFrame = nal->i_type == NAL_SLICE_IDR;
+  pending[nal->i_first_mb] = slice;
+  emitReadySlices();
+}
+
+void X264Encoder::emitReadySlices() {
+  for (auto next = pending.find(nextMb); next != pending.end(); next = pending.find(nextMb)) {
+    std::shared_ptr<std::vector<uint8_t>> payload = next->second.data;
+
+    // Like NVENC the parameter sets travel in front of the first slice.
+    if (!prefix.empty()) {
+      auto merged = std::make_shared<std::vector<uint8_t>>(prefix);
+      merged->insert(merged->end(), payload->begin(), payload->end());
+      payload = merged;
+      prefix.clear();
+    }
+
+    EncodedSlice slice;
+    slice.streamId = streamId;
+    slice.frameIndex = frameIndex;
+    slice.sliceIndex = sliceIndex++;
+    slice.lastInFrame = (uint32_t)next->second.lastMb + 1 >= mbCount;
+    slice.keyFrame = next->second.keyFrame;
+    slice.captureTimeUs = captureTimeUs;
+    slice.payload = payload;
+    frameBytes += payload->size();
+
+    nextMb = next->second.lastMb + 1;
+    pending.erase(next);
+
+    if (pSink) {
+      pSink->onSlice(slice);
+    }
+  }
+}
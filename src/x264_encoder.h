@@ -0,0 +1,63 @@
+#ifndef _X264_ENCODER_H_
+#define _X264_ENCODER_H_
+
+#include <stdint.h>
+#include <map>
+#include <mutex>
+#include <vector>
+
+extern "C" {
+#include <x264.h>
+}
+
+#include "encoded_slice.h"
+
+/// Low latency software H.264 encoder based on x264 (zerolatency tune, sliced threads).
+///
+/// Slices are produced with the same size limit as the NVENC path and handed to the
+/// sink through x264's nalu_process callback while the rest of the frame is still
+/// being encoded by the other slice threads.
+class X264Encoder {
+  private:
+    struct PendingSlice {
+      std::shared_ptr<std::vector<uint8_t>> data;
+      int lastMb;
+      bool keyFrame;
+    };
+
+    x264_t* pEncoder = nullptr;
+    x264_param_t param;
+    SliceSink* pSink = nullptr;
+    uint32_t mbCount = 0;
+
+    /// Frame currently being encoded.
+    uint32_t streamId = 0;
+    uint32_t frameIndex = 0;
+    uint64_t captureTimeUs = 0;
+
+    /// Slice threads finish in any order, slices are put back in macroblock order.
+    std::mutex lock;
+    std::map<int, PendingSlice> pending;
+    /// Parameter sets and SEI, sent together with the first slice.
+    std::vector<uint8_t> prefix;
+    int nextMb = 0;
+    uint32_t sliceIndex = 0;
+    size_t frameBytes = 0;
+
+  public:
+    ~X264Encoder() { this->cleanup(); }
+
+    bool initialize(int width, int height, uint32_t fps, uint32_t bitrateKbps, uint32_t threads, SliceSink* sink);
+    void cleanup();
+
+    /// Encodes an I420 picture, blocks until the frame is done. Returns the amount of bytes.
+    size_t encode(uint8_t* planes[3], int strides[3], uint32_t streamId, uint32_t frameIndex, uint64_t captureTimeUs);
+
+  private:
+    static void onNal(x264_t* h, x264_nal_t* nal, void* opaque);
+    void handleNal(x264_t* h, x264_nal_t* nal);
+    /// Passes on all slices that are next in macroblock order. Requires `lock`.
+    void emitReadySlices();
+};
+
+#endif